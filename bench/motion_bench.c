@@ -0,0 +1,284 @@
+/**
+ * @file motion_bench.c
+ *
+ * @brief Times motion_analyze() at 1080p and 4K on pools of 1 to N threads
+ *        and checks that every pool size gives the same scores. Each pool
+ *        size runs in a process of its own, as the pool can only be started
+ *        once.
+ *
+ *        Usage: motion_bench [threads [frames]]. threads defaults to the
+ *        number of online CPUs and frames to 200. Prints ms/frame, the
+ *        speed-up over one thread and a hash of the score and every block
+ *        score, and fails if the hashes differ.
+ * @author Aramayis Orkusyan
+ * @date December 9, 2019
+ * @copyright GNU General Public License v3.0
+ */
+
+#include "motion.h"
+#include "pool.h"
+#include "util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define BENCH_DEFAULT_FRAMES 200
+#define BENCH_WARMUP_FRAMES  5
+
+// What a run in a child process reports back through a pipe.
+typedef struct bench_result
+{
+    double   ms_per_frame;
+    uint64_t hash;
+    uint32_t score;
+} bench_result_t;
+
+/*******************************************************************************
+ *
+ * Function:    bench_random()
+ *
+ * Description: Steps a xorshift generator, so that every run gets the same
+ *              frames.
+ *
+ * Returns:     The next pseudo-random number.
+ *
+ ******************************************************************************/
+static uint32_t bench_random(uint32_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+/*******************************************************************************
+ *
+ * Function:    bench_frames()
+ *
+ * Description: Makes a textured reference frame and a current frame that is
+ *              a little brighter, with sensor noise and a square that moved.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void bench_frames(uint8_t *ref, uint8_t *cur, uint32_t width, uint32_t height)
+{
+    uint32_t state = 2463534242u;
+
+    for (uint32_t y = 0; y < height; ++y)
+    {
+        for (uint32_t x = 0; x < width; ++x)
+        {
+            uint32_t texture = ((x / 7) * 37 + (y / 5) * 91 + (x * y) / 113) & 0x7f;
+            uint32_t noise   = bench_random(&state) & 7;
+            uint32_t pixel   = 40 + texture + noise;
+
+            ref[(size_t)y * width + x] = (uint8_t)pixel;
+            cur[(size_t)y * width + x] = (uint8_t)((pixel * 21) / 20 + (bench_random(&state) & 3));
+        }
+    }
+
+    // A bright square moved 6 pixels right and 3 down.
+    for (uint32_t y = height / 3; y < height / 2; ++y)
+    {
+        for (uint32_t x = width / 3; x < width / 2; ++x)
+        {
+            ref[(size_t)y * width + x]             = 230;
+            cur[(size_t)(y + 3) * width + (x + 6)] = 235;
+        }
+    }
+}
+
+/*******************************************************************************
+ *
+ * Function:    bench_hash()
+ *
+ * Description: FNV-1a hash of the frame score and every block score.
+ *
+ * Returns:     The hash.
+ *
+ ******************************************************************************/
+static uint64_t bench_hash(const motion_result_t *result)
+{
+    uint64_t       hash   = 14695981039346656037ull;
+    const uint8_t *bytes  = (const uint8_t *)result->block_scores;
+    size_t         length = (size_t)result->blocks_x * result->blocks_y * sizeof(uint16_t);
+
+    for (size_t n = 0; n < sizeof(result->score); ++n)
+    {
+        hash = (hash ^ ((result->score >> (8 * n)) & 0xff)) * 1099511628211ull;
+    }
+    for (size_t n = 0; n < length; ++n)
+    {
+        hash = (hash ^ bytes[n]) * 1099511628211ull;
+    }
+
+    return hash;
+}
+
+/*******************************************************************************
+ *
+ * Function:    bench_run()
+ *
+ * Description: Starts a pool of the given size and times motion_analyze() on
+ *              the frames. Runs in a child process.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+static int bench_run(const uint8_t *ref, const uint8_t *cur, uint32_t width, uint32_t height,
+                     uint32_t threads, uint32_t frames, bench_result_t *out)
+{
+    motion_result_t result;
+
+    if ((pool_init(threads) == -1) || (pool_size() != threads) ||
+        (motion_init(width, height) == -1))
+    {
+        return -1;
+    }
+
+    for (uint32_t frame = 0; frame < BENCH_WARMUP_FRAMES; ++frame)
+    {
+        motion_analyze(ref, width, cur, width, &result);
+    }
+
+    uint64_t start_ns = monotonic_time_ns();
+
+    for (uint32_t frame = 0; frame < frames; ++frame)
+    {
+        if (motion_analyze(ref, width, cur, width, &result) == -1)
+        {
+            return -1;
+        }
+    }
+
+    out->ms_per_frame = (double)(monotonic_time_ns() - start_ns) / 1e6 / frames;
+    out->hash         = bench_hash(&result);
+    out->score        = result.score;
+    return 0;
+}
+
+/*******************************************************************************
+ *
+ * Function:    bench_fork()
+ *
+ * Description: Runs bench_run() in a child process, which gets a pool of its
+ *              own.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+static int bench_fork(const uint8_t *ref, const uint8_t *cur, uint32_t width, uint32_t height,
+                      uint32_t threads, uint32_t frames, bench_result_t *out)
+{
+    int   fds[2];
+    int   status;
+    pid_t pid;
+
+    if (pipe(fds) == -1)
+    {
+        return -1;
+    }
+
+    pid = fork();
+    if (pid == -1)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    if (pid == 0)
+    {
+        bench_result_t result;
+        int            ok;
+
+        close(fds[0]);
+        ok = (bench_run(ref, cur, width, height, threads, frames, &result) == 0) &&
+             (write(fds[1], &result, sizeof(result)) == (ssize_t)sizeof(result));
+        _exit(ok ? 0 : 1);
+    }
+
+    close(fds[1]);
+    ssize_t length = read(fds[0], out, sizeof(*out));
+    close(fds[0]);
+
+    if ((waitpid(pid, &status, 0) == -1) || !WIFEXITED(status) ||
+        (WEXITSTATUS(status) != 0) || (length != (ssize_t)sizeof(*out)))
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    static const uint32_t sizes[][2] = { { 1920, 1080 }, { 3840, 2160 } };
+
+    long     cpus    = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t threads = (argc > 1) ? (uint32_t)strtoul(argv[1], NULL, 10) : (uint32_t)cpus;
+    uint32_t frames  = (argc > 2) ? (uint32_t)strtoul(argv[2], NULL, 10) : BENCH_DEFAULT_FRAMES;
+    int      failed  = 0;
+
+    if ((threads == 0) || (threads > POOL_MAX_THREADS) || (frames == 0))
+    {
+        fprintf(stderr, "usage: %s [threads 1-%d [frames]]\n", argv[0], POOL_MAX_THREADS);
+        return 1;
+    }
+
+    printf("motion_analyze, %u frames per run, %ld online CPUs\n", frames, cpus);
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+    {
+        uint32_t       width  = sizes[s][0];
+        uint32_t       height = sizes[s][1];
+        uint8_t       *ref    = malloc((size_t)width * height);
+        uint8_t       *cur    = malloc((size_t)width * height);
+        bench_result_t first  = { 0 };
+
+        if ((ref == NULL) || (cur == NULL))
+        {
+            return 1;
+        }
+        bench_frames(ref, cur, width, height);
+
+        for (uint32_t n = 1; n <= threads; ++n)
+        {
+            bench_result_t result;
+
+            if (bench_fork(ref, cur, width, height, n, frames, &result) == -1)
+            {
+                fprintf(stderr, "%ux%u: run with %u threads failed\n", width, height, n);
+                failed = 1;
+                if (n == 1)
+                {
+                    break; // nothing to compare to
+                }
+                continue;
+            }
+            if (n == 1)
+            {
+                first = result;
+            }
+
+            printf("%4ux%-4u %2u threads %8.3f ms/frame %6.2fx  score %u  hash %016llx%s\n",
+                   width, height, n, result.ms_per_frame,
+                   first.ms_per_frame / result.ms_per_frame, result.score,
+                   (unsigned long long)result.hash,
+                   (result.hash != first.hash) ? "  DIFFERS" : "");
+            if (result.hash != first.hash)
+            {
+                failed = 1;
+            }
+        }
+
+        free(ref);
+        free(cur);
+    }
+
+    return failed;
+}
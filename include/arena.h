@@ -0,0 +1,68 @@
+/**
+ * @file arena.h
+ *
+ * @brief This module provides a block of memory carved into equal slots that
+ *        start on page boundaries, for capture buffers that are owned by the
+ *        application rather than the driver. The block is backed by huge
+ *        pages when the system has them reserved, and asks for transparent
+ *        huge pages otherwise, so that the buffers cost few TLB entries. It
+ *        is populated up front so no frame ever takes a page fault.
+ *
+ *        An arena is reference counted, so buffers can keep it alive after
+ *        the stream that created it has been reconfigured.
+ * @author Aramayis Orkusyan
+ * @date December 9, 2019
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef SITE_MON_GSM_ARENA_H
+#define SITE_MON_GSM_ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ARENA_SLOT_ALIGN 4096 // slots start on a page, and so on a cache line
+
+typedef struct arena arena_t;
+
+/**
+ * Create an arena. It starts with one reference.
+ *
+ * @param slot_size Size of each slot in bytes, rounded up to ARENA_SLOT_ALIGN.
+ * @param slots Number of slots.
+ * @return The arena, or NULL on failure.
+ */
+arena_t *arena_create(size_t slot_size, uint32_t slots);
+
+/**
+ * Get the memory of a slot.
+ *
+ * @param arena The arena.
+ * @param slot The slot number, less than the number of slots.
+ * @return The start of the slot.
+ */
+void *arena_slot(const arena_t *arena, uint32_t slot);
+
+/**
+ * Get the size of the slots.
+ *
+ * @param arena The arena.
+ * @return The size of each slot in bytes, after rounding.
+ */
+size_t arena_slot_size(const arena_t *arena);
+
+/**
+ * Take a reference to an arena.
+ *
+ * @param arena The arena.
+ */
+void arena_ref(arena_t *arena);
+
+/**
+ * Drop a reference to an arena, freeing it with the last one.
+ *
+ * @param arena The arena, NULL is ignored.
+ */
+void arena_unref(arena_t *arena);
+
+#endif // SITE_MON_GSM_ARENA_H
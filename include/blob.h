@@ -0,0 +1,75 @@
+/**
+ * @file blob.h
+ *
+ * @brief This module groups the blocks that changed between two frames into
+ *        connected objects, so that motion can be filtered by object size.
+ *        Insects and raindrops near the lens, for example, show up as objects
+ *        that are too large or too small to be worth an alert.
+ * @author Aramayis Orkusyan
+ * @date December 9, 2019
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef SITE_MON_GSM_BLOB_H
+#define SITE_MON_GSM_BLOB_H
+
+#include <stdint.h>
+#include "motion.h"
+
+#define BLOB_MAX_BLOBS 16 // largest blobs reported per frame
+#define BLOB_MAX_ZONES 8
+
+// All coordinates and areas are in blocks of MOTION_BLOCK_SIZE pixels.
+typedef struct blob
+{
+    uint32_t area;     // number of changed blocks
+    float    cx;       // centroid, measured to the block centers
+    float    cy;
+    uint16_t x0, y0;   // bounding box, inclusive
+    uint16_t x1, y1;
+} blob_t;
+
+// A rectangle of the picture, inclusive.
+typedef struct blob_zone
+{
+    uint16_t x0, y0;
+    uint16_t x1, y1;
+} blob_zone_t;
+
+typedef struct blob_config
+{
+    // Blocks whose motion_result_t.block_scores entry is at or above this are
+    // considered changed.
+    uint16_t block_threshold;
+    // Blobs with an area outside [min_area, max_area] do not qualify.
+    uint32_t min_area;
+    uint32_t max_area;
+    // Blobs whose centroid lies outside every zone do not qualify either.
+    // Without zones the whole picture counts.
+    uint32_t    zone_count;
+    blob_zone_t zones[BLOB_MAX_ZONES];
+} blob_config_t;
+
+typedef struct blob_result
+{
+    uint32_t count;              // number of blobs found
+    uint32_t qualifying;         // number of blobs within the size limits
+    uint32_t stored;             // number of entries in blobs
+    blob_t   blobs[BLOB_MAX_BLOBS]; // largest blobs first
+    uint64_t elapsed_ns;         // time taken by blob_analyze()
+} blob_result_t;
+
+/**
+ * Labels the connected components of changed blocks.
+ *
+ * @param motion The scores of a frame pair from motion_analyze().
+ * @param config Which blocks count as changed and which blobs qualify.
+ * @param result Filled in with the blobs found.
+ * @return On success, returns the number of qualifying blobs. Otherwise,
+ *         returns -1.
+ * @note Blocks touching at a corner belong to the same blob.
+ */
+int blob_analyze(const motion_result_t *motion, const blob_config_t *config,
+                 blob_result_t *result);
+
+#endif // SITE_MON_GSM_BLOB_H
@@ -10,34 +10,262 @@
 #ifndef SITE_MON_GMS_CAMERA_H
 #define SITE_MON_GMS_CAMERA_H
 
+#include <stddef.h>
 #include <stdint.h>
+#include "motion.h"
+
+#define CAMERA_STILL_QUALITY 80 // JPEG quality of evidence stills, 1 to 100
+
+typedef enum camera_still_mode
+{
+    // Stills are captured from the detection stream at detection resolution.
+    CAMERA_STILL_SAME_STREAM,
+    // The detection node is switched to the still resolution with
+    // VIDIOC_S_FMT for the duration of a burst of stills.
+    CAMERA_STILL_SWITCH_FORMAT,
+    // Stills are captured from a second capture node configured at the still
+    // resolution, leaving the detection stream untouched.
+    CAMERA_STILL_SECOND_NODE
+} camera_still_mode_t;
+
+typedef struct camera_still_latency
+{
+    uint64_t last_ns;  // most recent sample
+    uint64_t min_ns;   // fastest sample
+    uint64_t max_ns;   // slowest sample
+    uint64_t total_ns; // sum of all samples, divide by count for the mean
+    uint32_t count;    // number of samples
+} camera_still_latency_t;
+
+typedef struct camera_still_stats
+{
+    camera_still_mode_t    mode;
+    // From camera_begin_stills() until the first still is captured.
+    camera_still_latency_t enter;
+    // From camera_end_stills() until the detection resolution is producing
+    // frames again. Only measured in CAMERA_STILL_SWITCH_FORMAT mode.
+    camera_still_latency_t leave;
+} camera_still_stats_t;
+
+typedef enum camera_memory
+{
+    // Buffers allocated by the driver and mapped with mmap.
+    CAMERA_MEMORY_MMAP,
+    // Slots of an aligned, hugepage-backed arena owned by the application,
+    // passed to the driver with V4L2_MEMORY_USERPTR.
+    CAMERA_MEMORY_USERPTR,
+    // Buffers allocated from a DMA heap and imported with
+    // V4L2_MEMORY_DMABUF, which devices without scatter-gather need.
+    CAMERA_MEMORY_DMABUF
+} camera_memory_t;
+
+typedef struct camera_dedup_config
+{
+    // Summed motion score, in 1/256 grey levels, that the scene must change
+    // by since the last still stored in full for a still to be stored in
+    // full again. Stills below it are stored as a reference. 0 disables.
+    uint32_t threshold;
+    // A still is stored in full at least every this many stills.
+    uint32_t keyframe_interval;
+} camera_dedup_config_t;
+
+// A detection frame held with camera_hold_frame().
+typedef struct camera_frame
+{
+    const uint8_t *luma;         // luma plane inside the capture buffer
+    size_t         stride;       // bytes between the start of two rows
+    uint32_t       width;
+    uint32_t       height;
+    uint64_t       timestamp_ns; // capture time, CLOCK_MONOTONIC
+    uint32_t       sequence;     // sequence number assigned by the driver
+    void          *handle;       // the buffer, for camera_release_frame()
+} camera_frame_t;
 
 /**
  * Initialize the camera to capture grey-scale images.
  *
  * @param device The device file of the camera e.g. /dev/video0.
+ * @param width Requested width of the detection stream in pixels.
+ * @param height Requested height of the detection stream in pixels.
+ * @return On success, returns 0. Otherwise, returns -1.
+ * @note The pixel format is negotiated with the camera. GREY, NV12 and YUYV
+ *       are supported, as is MJPEG when built with SITEMON_WITH_MJPEG.
+ */
+int camera_init(const char *device, uint32_t width, uint32_t height);
+
+/**
+ * Configure the camera to capture evidence stills at a higher resolution than
+ * the one used for motion detection.
+ *
+ * @param device The device file of a second capture node for stills, or NULL
+ *               to switch the detection node's format with VIDIOC_S_FMT.
+ * @param width Requested width of stills in pixels.
+ * @param height Requested height of stills in pixels.
+ * @return On success, returns 0. Otherwise, returns -1 and stills keep being
+ *         captured from the detection stream.
+ * @note Must be called after camera_init().
+ */
+int camera_init_stills(const char *device, uint32_t width, uint32_t height);
+
+/**
+ * Switch to still resolution before capturing a burst of frames with
+ * camera_capture_frame().
+ *
+ * @return On success, returns 0. Otherwise, returns -1.
+ * @note In CAMERA_STILL_SWITCH_FORMAT mode camera_detect_motion() fails until
+ *       camera_end_stills() is called.
+ */
+int camera_begin_stills(void);
+
+/**
+ * Switch back to detection resolution after a burst of stills.
+ *
  * @return On success, returns 0. Otherwise, returns -1.
  */
-int camera_init(const char *device);
+int camera_end_stills(void);
 
 /**
- * Captures a fram and saves it to disk as a grey-scale pgm file.
+ * Get the resolution switch latencies measured so far, so that the best
+ * still mode can be picked for a given camera model.
+ *
+ * @param stats Filled in with the current still mode and latencies.
+ */
+void camera_get_still_stats(camera_still_stats_t *stats);
+
+/**
+ * Captures a fram and saves it to disk as a grey-scale JPEG file.
  *
  * @param out_dir Absolute path to the directory where the image will be save.
  * @return On success, returns 0. Otherwise, returns -1.
- * @note The image will be saved as <out_dir>/<time_stamp>.pgm
+ * @note The image will be saved as <out_dir>/<seconds>.<milliseconds>.jpg,
+ *       named after its capture time on the wall clock, unless the segment
+ *       store has been opened with store_open(), in which case it is
+ *       appended to the store and out_dir is ignored.
  */
 int camera_capture_frame(const char *out_dir);
 
 /**
  * Detects if there is motion.
- * 
+ *
  * @param avg_pixel_diff The threshold to use when determining if motion occured.
- * @return If motion is detected, returns 1. Otherwise, returns 0.
- * @note Currently, the camera moduule captures 10 frames and computes the
- *       the average of the difference in pixel values between the 5th and 10th
- *       frames.
+ *                       It is compared to the integer part of result->score.
+ * @param result If not NULL, receives the scores of the analyzed frame pair.
+ *               Global changes in brightness and contrast, such as clouds,
+ *               auto-exposure steps or lights switching on, are compensated
+ *               for in the score.
+ * @return If motion is detected, returns 1. Otherwise, returns 0. Returns -1
+ *         on error.
+ * @note The detection stream is kept running between calls. Each call
+ *       compares the newest frame with the frame analyzed by the previous
+ *       call, so the caller decides how far apart compared frames are.
+ */
+int camera_detect_motion(uint8_t avg_pixel_diff, motion_result_t *result);
+
+/**
+ * Waits for the next frame of the detection stream and discards it.
+ *
+ * @return On success, returns 0. Otherwise, returns -1.
+ */
+int camera_skip_frame(void);
+
+/**
+ * Sets the frame rate of the detection stream with VIDIOC_S_PARM.
+ *
+ * @param fps The requested number of frames per second.
+ * @return On success, returns the frame rate granted by the camera.
+ *         Otherwise, returns -1.
+ */
+int camera_set_frame_rate(uint32_t fps);
+
+/**
+ * Publish every analyzed detection frame, with its motion scores, to a
+ * shared-memory ring that other processes can follow, see frame_ring.h.
+ *
+ * @param name Name of the shared-memory object, e.g. FRAME_RING_NAME.
+ * @param slots Number of frames kept in the ring.
+ * @return On success, returns 0. Otherwise, returns -1.
+ * @note Must be called after camera_init(). Publishing copies each frame
+ *       once and never waits for the readers.
+ */
+int camera_publish_frames(const char *name, uint32_t slots);
+
+/**
+ * Store near-duplicate stills, e.g. of a person standing still, as a
+ * reference to the previous still instead of in full. Whether a still is a
+ * near-duplicate is decided from the detector's scores of the frames since
+ * the previous still, so no pass is made over the still itself.
+ *
+ * @param config The thresholds. It is copied.
+ * @note Only a still after which camera_detect_motion() kept scoring frames
+ *       without a gap can be repeated. In CAMERA_STILL_SWITCH_FORMAT mode
+ *       every still is stored in full.
+ */
+void camera_set_dedup(const camera_dedup_config_t *config);
+
+/**
+ * Find motion vectors in the frames camera_detect_motion() detects motion
+ * in, see motion_estimate(). The vectors and flow are returned with the
+ * frame's scores.
+ *
+ * @param config Which blocks to search and how far. It is copied.
+ */
+void camera_set_motion_search(const motion_search_config_t *config);
+
+/**
+ * Choose what the capture buffers are made of. The driver writes frames
+ * straight into them, so frames are never copied on the way in.
+ *
+ * @param memory The kind of buffers to capture into.
+ * @note Must be called before camera_init(). A driver that doesn't support
+ *       the choice gets the next one down, down to CAMERA_MEMORY_MMAP.
+ */
+void camera_set_memory(camera_memory_t memory);
+
+/**
+ * Hold the newest analyzed detection frame in place, e.g. to send it with an
+ * alert. Its buffer isn't handed back to the driver until it is released, so
+ * fewer buffers are left for capturing while it is held.
+ *
+ * @param frame Receives the frame.
+ * @return On success, returns 0. Otherwise, returns -1, also if no frame has
+ *         been analyzed since the stream started.
+ * @note Must be called from the thread that calls camera_detect_motion().
+ *       The frame may be used and released from any thread.
+ */
+int camera_hold_frame(camera_frame_t *frame);
+
+/**
+ * Release a frame held with camera_hold_frame().
+ *
+ * @param frame The frame. It must not be used afterwards.
+ */
+void camera_release_frame(camera_frame_t *frame);
+
+/**
+ * Look at the newest analyzed detection frame in place, e.g. to save it.
+ *
+ * @param stride Receives the number of bytes between the start of two rows.
+ * @param width Receives the width of the frame.
+ * @param height Receives the height of the frame.
+ * @return The frame's luma plane, or NULL if no frame has been analyzed since
+ *         the stream started. Valid until the next camera_detect_motion().
+ * @note Must be called from the thread that calls camera_detect_motion().
+ */
+const uint8_t *camera_reference(size_t *stride, uint32_t *width, uint32_t *height);
+
+/**
+ * Compare the first detection frame to a saved frame instead of skipping it,
+ * so that detection continues right away after a restart.
+ *
+ * @param luma The saved luma plane. Must stay valid until the first call to
+ *             camera_detect_motion() has returned.
+ * @param stride Number of bytes between the start of two rows in luma.
+ * @param width Width of the saved frame.
+ * @param height Height of the saved frame.
+ * @return On success, returns 0. Otherwise, returns -1, also if the saved
+ *         frame's size differs from the detection frame size.
+ * @note Must be called after camera_init().
  */
-int camera_detect_motion(uint8_t avg_pixel_diff);
+int camera_warm_start(const uint8_t *luma, size_t stride, uint32_t width, uint32_t height);
 
 #endif
@@ -0,0 +1,53 @@
+/**
+ * @file checkpoint.h
+ *
+ * @brief This module saves the detector's state to a file now and then, so
+ *        that after a restart or reboot detection continues where it left
+ *        off instead of starting cold: the first frame is compared to the
+ *        last analyzed frame, an event that was open stays the same event
+ *        and the scheduler stays at its idle level.
+ *
+ *        The file is a fixed header followed by the luma plane of the last
+ *        analyzed frame. It is written under a temporary name and renamed, so
+ *        it is always either the old or the new checkpoint, and it is mapped
+ *        rather than read when loading, so the plane is used where it lies.
+ * @author Aramayis Orkusyan
+ * @date December 9, 2019
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef SITE_MON_GSM_CHECKPOINT_H
+#define SITE_MON_GSM_CHECKPOINT_H
+
+#include <stdint.h>
+
+#define CHECKPOINT_MAGIC   0x50434b53u // "SKCP"
+#define CHECKPOINT_VERSION 2
+
+/**
+ * Save the detector's state.
+ *
+ * @param path The checkpoint file.
+ * @param threshold The motion threshold in use, saved so that event state
+ *                  isn't restored under another threshold.
+ * @return On success, returns 0. Otherwise, returns -1, also if no frame has
+ *         been analyzed yet.
+ * @note Must be called from the thread that calls camera_detect_motion().
+ */
+int checkpoint_save(const char *path, uint32_t threshold);
+
+/**
+ * Restore the detector's state. The saved frame is only used if it has the
+ * size of the detection frames, and the event state only if it was saved
+ * with the same threshold and event settings.
+ *
+ * @param path The checkpoint file.
+ * @param threshold The motion threshold in use.
+ * @return 0 if the saved frame will be the first reference, -1 if detection
+ *         starts cold.
+ * @note Must be called after camera_init(), scheduler_init() and event_init().
+ *       The file stays mapped until the next checkpoint_save().
+ */
+int checkpoint_load(const char *path, uint32_t threshold);
+
+#endif // SITE_MON_GSM_CHECKPOINT_H
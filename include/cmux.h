@@ -0,0 +1,59 @@
+/**
+ * @file cmux.h
+ *
+ * @brief This module runs the basic option of the 3GPP 27.010 (GSM 07.10)
+ *        multiplexer protocol over a serial port, so that several AT
+ *        command streams share one link without waiting for each other.
+ *
+ *        Every virtual channel (DLCI) is bridged to a pseudo-terminal, which
+ *        is used like a serial port of its own: a background thread frames
+ *        what is written to it and hands the payload of received frames to
+ *        it. Flow control requested by the modem with MSC, FCon and FCoff
+ *        is honoured per channel.
+ * @author Aramayis Orkusyan
+ * @date December 9, 2019
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef SITE_MON_GSM_CMUX_H
+#define SITE_MON_GSM_CMUX_H
+
+#include <stdint.h>
+
+#define CMUX_MAX_CHANNELS      4   // DLCIs 1 to CMUX_MAX_CHANNELS
+#define CMUX_MAX_FRAME_SIZE    1500
+#define CMUX_DEFAULT_FRAME_SIZE 31 // N1 of the basic option
+
+typedef struct cmux cmux_t;
+
+/**
+ * Start multiplexing on a serial port whose modem has just accepted
+ * AT+CMUX=0. Opens the control channel and channels 1 to channels.
+ * Each serial port gets a multiplexer of its own.
+ *
+ * @param fd The serial port. It is used by the multiplexer from now on.
+ * @param channels Number of virtual channels, at most CMUX_MAX_CHANNELS.
+ * @param frame_size Largest payload of a frame, the N1 given to AT+CMUX.
+ * @return On success, returns the multiplexer. Otherwise, returns NULL.
+ */
+cmux_t *cmux_start(int fd, uint32_t channels, uint32_t frame_size);
+
+/**
+ * Get the pseudo-terminal of a virtual channel.
+ *
+ * @param mux The multiplexer.
+ * @param channel The channel, 1 to the number of channels started.
+ * @return The path of the terminal to open, or NULL if there is no such
+ *         channel.
+ */
+const char *cmux_channel_path(const cmux_t *mux, uint32_t channel);
+
+/**
+ * Close the multiplexer down and remove the pseudo-terminals. The modem
+ * returns to AT commands on the serial port.
+ *
+ * @param mux The multiplexer, which is freed. NULL is ignored.
+ */
+void cmux_stop(cmux_t *mux);
+
+#endif // SITE_MON_GSM_CMUX_H
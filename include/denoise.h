@@ -0,0 +1,71 @@
+/**
+ * @file denoise.h
+ *
+ * @brief This module suppresses sensor noise in low light with a recursive
+ *        temporal filter, so that noise alone doesn't push frames over the
+ *        motion threshold at night. Each frame is blended in place with the
+ *        filtered frame before it, pixels that changed a lot much less than
+ *        pixels that barely did, so moving objects don't leave trails. The
+ *        filter switches itself on and off from an estimate of the noise
+ *        level that is gathered in the same pass.
+ * @author Aramayis Orkusyan
+ * @date December 9, 2019
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef SITE_MON_GSM_DENOISE_H
+#define SITE_MON_GSM_DENOISE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DENOISE_WEIGHT_ONE 128 // weights are in 1/128ths
+
+typedef struct denoise_config
+{
+    // Noise level, in 1/256 grey levels, at or above which the filter
+    // switches on, and below which it switches off again. The level is the
+    // median absolute difference to the previous frame, which filtering
+    // itself lowers, so off_level must be well below on_level.
+    uint32_t on_level;
+    uint32_t off_level;
+    // Weight of the new frame, in 1/DENOISE_WEIGHT_ONE, for a pixel that
+    // didn't change. The weight grows with the difference to the previous
+    // frame, reaching DENOISE_WEIGHT_ONE at motion_difference grey levels.
+    uint32_t still_weight;
+    uint32_t motion_difference;
+} denoise_config_t;
+
+/**
+ * Initialize the filter. Until it is called, denoise_frame() does nothing.
+ *
+ * @param config When and how hard to filter. It is copied.
+ * @return On success, returns 0. Otherwise, returns -1.
+ */
+int denoise_init(const denoise_config_t *config);
+
+/**
+ * Estimates the noise in a frame and filters it in place if the noise level
+ * calls for it.
+ *
+ * @param cur The frame to filter.
+ * @param cur_stride Number of bytes between the start of two rows in cur.
+ * @param prev The previous frame, as returned by this function.
+ * @param prev_stride Number of bytes between the start of two rows in prev.
+ * @param width Width of the frames in pixels.
+ * @param height Height of the frames in pixels.
+ * @return If the frame was filtered, returns 1. If it wasn't, returns 0.
+ *         Returns -1 on error.
+ */
+int denoise_frame(uint8_t *cur, size_t cur_stride,
+                  const uint8_t *prev, size_t prev_stride,
+                  uint32_t width, uint32_t height);
+
+/**
+ * Get the current noise level estimate.
+ *
+ * @return The noise level in 1/256 grey levels.
+ */
+uint32_t denoise_level(void);
+
+#endif // SITE_MON_GSM_DENOISE_H
@@ -0,0 +1,76 @@
+/**
+ * @file dispatch.h
+ *
+ * @brief This module spreads outgoing SMS over several modems so that one
+ *        flaky SIM or a carrier outage doesn't silence a site. Every modem
+ *        has a queue and a worker thread of its own. A message goes to the
+ *        healthy modem with the least work ahead of it, weighing its queue
+ *        depth by how long its recent sends took. Idle modems are checked
+ *        with AT every so often; one that stops answering is taken out, its
+ *        queue moves to the others, and it rejoins once it answers again. A
+ *        message that fails is tried again on another modem.
+ * @author Aramayis Orkusyan
+ * @date December 9, 2019
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef SITE_MON_GSM_DISPATCH_H
+#define SITE_MON_GSM_DISPATCH_H
+
+#include <stdint.h>
+#include "gsm.h"
+
+#define DISPATCH_MAX_MODEMS 4
+
+typedef struct dispatch_config
+{
+    // Seconds between two liveness checks of an idle modem.
+    uint32_t liveness_seconds;
+    // Failed liveness checks or sends in a row after which a modem is taken
+    // out until it answers again.
+    uint32_t max_failures;
+    // Modems a message is tried on before it is given up.
+    uint32_t max_attempts;
+    // Keep the radio of a modem off (AT+CFUN=0) while nothing uses it.
+    int      power_save;
+} dispatch_config_t;
+
+/**
+ * Start dispatching over a set of modems, all of which are taken to be
+ * healthy.
+ *
+ * @param modems The modems, from gsm_open().
+ * @param count Number of modems, 1 to DISPATCH_MAX_MODEMS.
+ * @param config The dispatch policy. It is copied.
+ * @return On success, returns 0. Otherwise, returns -1.
+ * @note Must only be called once.
+ */
+int dispatch_init(gsm_t *const *modems, uint32_t count, const dispatch_config_t *config);
+
+/**
+ * Send a message over the best healthy modem, trying others if it fails.
+ * Blocks until the message has been sent or given up.
+ *
+ * @param destination The address to send the message to (e.g. a phone number)
+ * @param message The null-terminated string to be sent to destination, at
+ *                most GSM_TX_BUF_SIZE - 2 characters.
+ * @return On success, returns 0. Otherwise, returns -1.
+ */
+int dispatch_send(const char *destination, const char *message);
+
+/**
+ * Pick the best healthy modem for work other than SMS, e.g. an upload, and
+ * keep its radio on until dispatch_release().
+ *
+ * @return The modem, or NULL if none is healthy.
+ */
+gsm_t *dispatch_acquire(void);
+
+/**
+ * Hand back a modem from dispatch_acquire().
+ *
+ * @param modem The modem. NULL is ignored.
+ */
+void dispatch_release(gsm_t *modem);
+
+#endif // SITE_MON_GSM_DISPATCH_H
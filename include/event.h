@@ -0,0 +1,150 @@
+/**
+ * @file event.h
+ *
+ * @brief This module turns per-frame motion decisions into motion events. An
+ *        event opens once enough recent frames show motion and closes after a
+ *        quiet period, so that a single noisy frame pair never raises an
+ *        alert and an ongoing event raises exactly one.
+ * @author Aramayis Orkusyan
+ * @date December 9, 2019
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef SITE_MON_GSM_EVENT_H
+#define SITE_MON_GSM_EVENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define EVENT_MAX_WINDOW 64 // largest supported sliding window in frames
+
+typedef enum event_transition
+{
+    EVENT_IDLE,    // no event is open and none was opened
+    EVENT_OPENED,  // an event was opened by this frame
+    EVENT_ONGOING, // an event is open
+    EVENT_CLOSED   // the open event was closed by this frame
+} event_transition_t;
+
+typedef struct event_config
+{
+    // An event opens when open_count of the last window frames are active.
+    uint32_t window;
+    uint32_t open_count;
+    // An open event closes once no frame has been active for this long.
+    uint32_t quiet_ms;
+} event_config_t;
+
+typedef struct event
+{
+    uint32_t id;         // increments with every event opened
+    uint64_t start_ns;   // capture time of the first active frame
+    uint64_t end_ns;     // capture time of the last active frame
+    uint32_t peak_score; // highest score of an active frame
+    uint32_t frames;     // number of active frames
+    // Summed flow of the active frames, see motion_result_t.flow_x, i.e. how
+    // far in pixels and which way the moving object has travelled.
+    float    travel_x;
+    float    travel_y;
+} event_t;
+
+// How the travel of an event is told, see event_describe_travel().
+typedef struct event_travel_config
+{
+    float approach_x; // which way someone coming towards the gate moves in
+    float approach_y; // the picture, x right and y down
+    float min_pixels; // shorter travel has no direction
+} event_travel_config_t;
+
+// Everything the state machine remembers between frames, for saving it across
+// restarts, see event_save_state().
+typedef struct event_state
+{
+    event_config_t config;
+    uint64_t       history;
+    uint32_t       active_count;
+    uint32_t       open;
+    uint64_t       frame_number;
+    uint64_t       timestamps[EVENT_MAX_WINDOW];
+    uint32_t       scores[EVENT_MAX_WINDOW];
+    float          flows_x[EVENT_MAX_WINDOW];
+    float          flows_y[EVENT_MAX_WINDOW];
+    event_t        current;
+} event_state_t;
+
+/**
+ * Initialize the event state machine.
+ *
+ * @param config The hysteresis settings. It is copied.
+ * @return On success, returns 0. Otherwise, returns -1.
+ */
+int event_init(const event_config_t *config);
+
+/**
+ * Feeds the decision for one analyzed frame into the state machine.
+ *
+ * @param active Non-zero if the frame showed motion.
+ * @param score The frame's motion score, used to track the peak.
+ * @param flow_x The frame's flow, see motion_result_t.flow_x, added up into
+ *               the travel of the event.
+ * @param flow_y The frame's flow, see motion_result_t.flow_y.
+ * @param timestamp_ns The capture time of the frame in nanoseconds.
+ * @param event If not NULL and an event is open or was just closed, receives
+ *              that event.
+ * @return What happened to the event state as a result of this frame.
+ */
+event_transition_t event_update(int active, uint32_t score, float flow_x, float flow_y,
+                                uint64_t timestamp_ns, event_t *event);
+
+/**
+ * Describe which way and how fast the moving object of an event went, e.g.
+ * "approaching, down-left at 40 px/s". Speeds are in detection frame pixels.
+ *
+ * @param event The event.
+ * @param config Which way is approaching and the least travel to describe.
+ * @param text Receives the description, empty if the object travelled too
+ *             little to tell.
+ * @param size The size of text.
+ */
+void event_describe_travel(const event_t *event, const event_travel_config_t *config,
+                           char *text, size_t size);
+
+/**
+ * Wait for an open event to travel far enough to tell its direction. An event
+ * opens after a few frames, too few for the object to have moved much, so an
+ * alert sent right away could rarely say which way it went.
+ *
+ * @param opened The event as it was when it opened, only its id is used.
+ * @param min_pixels The travel to wait for.
+ * @param max_frames Stop waiting once the event has this many active frames.
+ * @param timeout_ms Stop waiting after this long.
+ * @param event Receives the latest state of the event, unless another event
+ *              has been opened since. May be the same as opened.
+ * @return If the event has travelled min_pixels, returns 0. Otherwise, e.g.
+ *         if it closed or the frames or time ran out first, returns -1.
+ * @note Safe to call from another thread than the one calling event_update().
+ */
+int event_wait_travel(const event_t *opened, float min_pixels, uint32_t max_frames,
+                      uint32_t timeout_ms, event_t *event);
+
+/**
+ * Copy the state of the state machine, e.g. to save it to a file.
+ *
+ * @param state Receives the state.
+ */
+void event_save_state(event_state_t *state);
+
+/**
+ * Continue from a saved state, so that an event that was open when the state
+ * was saved is not reported as a new one.
+ *
+ * @param state A state from event_save_state().
+ * @param shift_ns Added to every timestamp in state, to move them to the
+ *                 current clock if the state was saved before a reboot.
+ * @return On success, returns 0. Otherwise, returns -1, also if state was
+ *         saved with different settings than those of event_init().
+ * @note Must be called after event_init().
+ */
+int event_restore_state(const event_state_t *state, int64_t shift_ns);
+
+#endif // SITE_MON_GSM_EVENT_H
@@ -0,0 +1,150 @@
+/**
+ * @file frame_ring.h
+ *
+ * @brief This module publishes the analyzed detection frames to other
+ *        processes through a POSIX shared-memory ring of fixed-size slots,
+ *        so that tools such as a live preview or an archiver never have to
+ *        open the camera or read stills back from disk.
+ *
+ *        There is one writer, the daemon, and any number of readers. Every
+ *        slot is guarded by a sequence count that is odd while the slot is
+ *        being written. Readers map the ring read-only and check the count
+ *        before and after looking at a slot, so they never block the writer;
+ *        a reader that falls behind skips to the newest frame instead.
+ *
+ *        The reader half of this module is also built as the static library
+ *        sitemon_frames for use by those tools.
+ * @author Aramayis Orkusyan
+ * @date December 9, 2019
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef SITE_MON_GSM_FRAME_RING_H
+#define SITE_MON_GSM_FRAME_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FRAME_RING_NAME    "/sitemon-frames" // default shared-memory object
+#define FRAME_RING_MAGIC   0x53464d52u       // "SFMR"
+#define FRAME_RING_VERSION 1
+
+// Describes one published frame. Stored at the start of every slot.
+typedef struct frame_ring_meta
+{
+    uint64_t index;        // publish count of this frame, starting at 0
+    uint64_t timestamp_ns; // capture time, CLOCK_MONOTONIC
+    uint32_t sequence;     // sequence number assigned by the driver
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;       // bytes between the start of two rows
+    uint32_t score;        // motion score against the previous frame, 1/256 grey
+    uint32_t raw_score;    // uncompensated score, 1/256 grey
+    float    gain;         // lighting change compensated for
+    float    offset;
+    uint32_t motion;       // non-zero if the daemon decided there was motion
+    uint32_t reserved;
+} frame_ring_meta_t;
+
+typedef struct frame_ring frame_ring_t;
+typedef struct frame_reader frame_reader_t;
+
+// A frame being looked at in place by a reader.
+typedef struct frame_view
+{
+    frame_ring_meta_t meta;   // copied out of the slot
+    const uint8_t    *pixels; // luma plane inside the shared memory
+    uint64_t          slot_sequence;
+} frame_view_t;
+
+/**
+ * Create the shared-memory ring and map it for writing.
+ *
+ * @param name Name of the shared-memory object, e.g. FRAME_RING_NAME.
+ * @param width Width of the frames in pixels.
+ * @param height Height of the frames in pixels.
+ * @param slots Number of frames kept in the ring.
+ * @return The ring, or NULL on failure.
+ * @note An existing object with the same name is replaced, readers still
+ *       attached to it must attach again.
+ */
+frame_ring_t *frame_ring_create(const char *name, uint32_t width, uint32_t height,
+                                uint32_t slots);
+
+/**
+ * Copy a frame into the next slot of the ring. Never waits for readers.
+ *
+ * @param ring The ring.
+ * @param luma The luma plane of the frame.
+ * @param stride Bytes between the start of two rows in luma.
+ * @param meta The frame's metadata. The index and size fields are set by
+ *             the ring.
+ */
+void frame_ring_publish(frame_ring_t *ring, const uint8_t *luma, size_t stride,
+                        const frame_ring_meta_t *meta);
+
+/**
+ * Unmap and remove the ring.
+ *
+ * @param ring The ring, NULL is ignored.
+ */
+void frame_ring_destroy(frame_ring_t *ring);
+
+/**
+ * Attach to a ring read-only. The reader starts at the newest frame.
+ *
+ * @param name Name of the shared-memory object.
+ * @return The reader, or NULL if the ring does not exist or is incompatible.
+ */
+frame_reader_t *frame_reader_attach(const char *name);
+
+/**
+ * Start looking at the next unread frame in place, without copying it.
+ *
+ * @param reader The reader.
+ * @param view Receives the frame's metadata and a pointer to its pixels.
+ * @return 1 if a frame is available, 0 if the reader is up to date.
+ * @note The pixels may be overwritten at any time. Call frame_reader_end()
+ *       after using them and discard the result if it returns 0.
+ */
+int frame_reader_begin(frame_reader_t *reader, frame_view_t *view);
+
+/**
+ * Check that the frame of frame_reader_begin() wasn't overwritten while it
+ * was in use.
+ *
+ * @param reader The reader.
+ * @param view The view filled in by frame_reader_begin().
+ * @return 1 if the frame was intact, 0 if it was overwritten.
+ */
+int frame_reader_end(frame_reader_t *reader, const frame_view_t *view);
+
+/**
+ * Copy the next unread frame out of the ring.
+ *
+ * @param reader The reader.
+ * @param meta Receives the frame's metadata.
+ * @param pixels Receives the luma plane, meta->stride bytes per row.
+ * @param size Size of pixels in bytes.
+ * @return 1 if a frame was copied, 0 if the reader is up to date, -1 if
+ *         pixels is too small.
+ */
+int frame_reader_read(frame_reader_t *reader, frame_ring_meta_t *meta,
+                      uint8_t *pixels, size_t size);
+
+/**
+ * Get the number of frames the reader missed because the writer lapped it.
+ *
+ * @param reader The reader.
+ * @return The number of frames skipped so far.
+ */
+uint64_t frame_reader_skipped(const frame_reader_t *reader);
+
+/**
+ * Detach from the ring.
+ *
+ * @param reader The reader, NULL is ignored.
+ */
+void frame_reader_detach(frame_reader_t *reader);
+
+#endif // SITE_MON_GSM_FRAME_RING_H
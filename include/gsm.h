@@ -1,7 +1,9 @@
 /**
  * @file gsm.h
  *
- * @brief This module provides a high-level API for accessing and using the GSM modem.
+ * @brief This module provides a high-level API for accessing and using GSM
+ *        modems. Each modem is driven through a handle of its own, so one
+ *        process can use several.
  * @author Aramayis Orkusyan
  * @date December 8, 2019
  * @copyright GNU General Public License v3.0
@@ -12,9 +14,14 @@
 
 #define GSM_TX_BUF_SIZE 256
 #define GSM_RX_BUF_SIZE 256
+#define GSM_NAME_SIZE   16 // longest modem name, including the terminator
 
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 
+typedef struct gsm gsm_t;
+
 typedef enum gsm_functionality_mode
 {
     // The RF part of the module is powered off and the USIM card is not accessible,
@@ -30,46 +37,187 @@ typedef enum gsm_functionality_mode
     GSM_FUNCTIONALITY_MODE_ERROR
 } gsm_functionality_mode_t;
 
+// Network registration states reported by AT+CREG.
+typedef enum gsm_registration
+{
+    GSM_REGISTRATION_NONE      = 0, // not registered and not searching
+    GSM_REGISTRATION_HOME      = 1,
+    GSM_REGISTRATION_SEARCHING = 2,
+    GSM_REGISTRATION_DENIED    = 3,
+    GSM_REGISTRATION_UNKNOWN   = 4,
+    GSM_REGISTRATION_ROAMING   = 5
+} gsm_registration_t;
+
+#define GSM_RSSI_UNKNOWN 0 // rssi_dbm when the signal strength isn't known
+
+// The latest modem status known, see gsm_get_status(). The times are
+// CLOCK_MONOTONIC nanoseconds of when each value was last reported, 0 if it
+// never was.
+typedef struct gsm_status
+{
+    int32_t                  rssi_dbm;     // e.g. -71, or GSM_RSSI_UNKNOWN
+    uint32_t                 ber;          // bit error rate class, 99 if unknown
+    gsm_registration_t       registration;
+    gsm_functionality_mode_t mode;
+    uint64_t                 signal_ns;
+    uint64_t                 registration_ns;
+    uint64_t                 mode_ns;
+} gsm_status_t;
+
+// Values of the AT+HTTPACTION method parameter.
+typedef enum gsm_http_method
+{
+    GSM_HTTP_GET  = 0,
+    GSM_HTTP_POST = 1
+} gsm_http_method_t;
+
+// How gsm_open() sets up the serial link. The default, all zero, is a plain
+// 115200 baud link without flow control. Steps the modem doesn't support are
+// skipped. With multiplexing, SMS and functionality mode commands, status
+// polls and HTTP transfers each get a virtual channel and no longer wait for
+// each other.
+typedef struct gsm_link_config
+{
+    uint32_t baud;         // rate to move the link to with AT+IPR, 0 keeps 115200
+    int      flow_control; // turn on RTS/CTS flow control with AT+IFC
+    int      multiplex;    // run the 27.010 multiplexer, see cmux.h
+    uint32_t frame_size;   // largest multiplexer frame payload, 0 for the default
+} gsm_link_config_t;
+
 /**
- * Initialize the GSM modem to allow for SMS messaging.
+ * Open a GSM modem and initialize it to allow for SMS messaging.
  *
  * @param device The serial port to which the GSM modem is connected. 
- * @return On success, returns 0. Otherwise, returns -1.
+ * @param name Short name of the modem, used in logs and metric labels, e.g.
+ *             "modem0". Longer names are cut to GSM_NAME_SIZE - 1.
+ * @param link How to set up the serial link, or NULL for the default. It is
+ *             copied.
+ * @return On success, returns the modem. Otherwise, returns NULL.
+ * @note Modems stay open for the life of the program, as their metrics do.
  */
-int gsm_init(const char *device);
+gsm_t *gsm_open(const char *device, const char *name, const gsm_link_config_t *link);
+
+/**
+ * Get the name a modem was opened with.
+ *
+ * @param modem The modem.
+ * @return The name.
+ */
+const char *gsm_name(const gsm_t *modem);
+
+/**
+ * Check whether a modem still answers, with a plain AT command.
+ *
+ * @param modem The modem.
+ * @return If the modem answered OK, returns 1. Otherwise, returns 0.
+ */
+int gsm_check_liveness(gsm_t *modem);
 
 /**
  * Print the connected GSM modems product identification information.
  *
+ * @param modem The modem.
  * @param stream The output stream to print to.
  */
-void gsm_print_identification(FILE *stream);
+void gsm_print_identification(gsm_t *modem, FILE *stream);
 
 /**
  * Send a message to a destination address over the GSM network.
  *
+ * @param modem The modem to send with.
  * @param destination The address to send the message to (e.g. a phone number)
  * @param message The null-terminated string to be sent to destination.
  * @return On success, returns 0. Otherwise, returns -1.
  */
-int gsm_send_message(const char *destination, const char *message);
+int gsm_send_message(gsm_t *modem, const char *destination, const char *message);
 
 /**
  * Sets the functionality mode of the modem.
  *
+ * @param modem The modem.
  * @param mode The mode to set the modem to.
  * @return On success, returns 0. Otherwise, returns -1.
  * @note This function can be used to set the modem to low power mode.
  */
-int gsm_set_functionality_mode(gsm_functionality_mode_t mode);
+int gsm_set_functionality_mode(gsm_t *modem, gsm_functionality_mode_t mode);
 
 /**
  * Returns the functionality mode of the modem.
  *
+ * @param modem The modem.
  * @return On success, returns the mode of the modem. Otherwise, returns
  *         @ref GSM_FUNCTIONALITY_MODE_ERROR.
  */
-gsm_functionality_mode_t gsm_get_functionality_mode(void);
+gsm_functionality_mode_t gsm_get_functionality_mode(gsm_t *modem);
+
+/**
+ * Opens the GPRS bearer and the modem's HTTP service (AT+SAPBR, AT+HTTPINIT),
+ * as found on SIM800 and SIM7000 series modems.
+ *
+ * @param modem The modem.
+ * @param apn The access point name of the mobile operator.
+ * @return On success, returns 0. Otherwise, returns -1.
+ * @note The modem must be in GSM_FULL_FUNCTIONALITY_MODE.
+ */
+int gsm_data_open(gsm_t *modem, const char *apn);
+
+/**
+ * Performs one HTTP request over the data channel.
+ *
+ * @param modem The modem, with its data channel open.
+ * @param method GSM_HTTP_GET or GSM_HTTP_POST.
+ * @param url The URL to request, at most about 200 characters.
+ * @param body The body of a POST request, sent as application/octet-stream.
+ * @param length The length of body in bytes.
+ * @param response If not NULL, receives the start of the response body as
+ *                 a null-terminated string.
+ * @param response_size The size of response.
+ * @return The HTTP status returned by the server, e.g. 200, or a modem
+ *         specific status such as 601 for network errors. Returns -1 if the
+ *         request could not be made.
+ */
+int gsm_http_request(gsm_t *modem, gsm_http_method_t method, const char *url,
+                     const uint8_t *body, size_t length, char *response,
+                     size_t response_size);
+
+/**
+ * Closes the modem's HTTP service and the GPRS bearer.
+ *
+ * @param modem The modem.
+ * @return On success, returns 0. Otherwise, returns -1.
+ */
+int gsm_data_close(gsm_t *modem);
+
+/**
+ * Keep the status cache fresh in the background: registration changes are
+ * picked up from +CREG URCs as they arrive, and while the radio is on the
+ * signal quality and registration are also polled every poll_seconds.
+ * Each modem has a status cache and a monitor of its own.
+ *
+ * @param modem The modem.
+ * @param poll_seconds Time between two polls while the radio is on.
+ * @return On success, returns 0. Otherwise, returns -1.
+ * @note The cache is also updated from the responses to every other command.
+ */
+int gsm_start_status_monitor(gsm_t *modem, uint32_t poll_seconds);
+
+/**
+ * Get the latest modem status without waiting for the modem or any lock.
+ *
+ * @param modem The modem.
+ * @param status Receives the status.
+ * @return If any status has been reported since gsm_open(), returns 0.
+ *         Otherwise, returns -1.
+ */
+int gsm_get_status(gsm_t *modem, gsm_status_t *status);
+
+/**
+ * Get a short name for a registration state, e.g. "roaming".
+ *
+ * @param registration The registration state.
+ * @return The name.
+ */
+const char *gsm_registration_string(gsm_registration_t registration);
 
 #endif
 
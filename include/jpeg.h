@@ -0,0 +1,52 @@
+/**
+ * @file jpeg.h
+ *
+ * @brief This module compresses 8-bit luma frames as grey-scale baseline
+ *        JPEG without any external library. Blocks are transformed with the
+ *        integer AAN DCT, eight lanes at a time with SSE2 or NEON where
+ *        available, and entropy coded with the standard Huffman tables
+ *        straight into a buffer supplied by the caller. The quantization and
+ *        Huffman code tables of a quality level are built once, on first
+ *        use.
+ * @author Aramayis Orkusyan
+ * @date December 9, 2019
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef SITE_MON_GSM_JPEG_H
+#define SITE_MON_GSM_JPEG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define JPEG_MAX_DIMENSION 65535 // largest width or height a JPEG can have
+
+/**
+ * Get the largest size the JPEG of a frame can have, whatever its content
+ * and quality, so that an output buffer can be allocated once up front.
+ *
+ * @param width Width of the frame in pixels.
+ * @param height Height of the frame in pixels.
+ * @return The size in bytes.
+ */
+size_t jpeg_max_size(uint32_t width, uint32_t height);
+
+/**
+ * Compress a luma frame.
+ *
+ * @param luma The luma plane of the frame.
+ * @param stride Bytes between the start of two rows in luma.
+ * @param width Width of the frame in pixels.
+ * @param height Height of the frame in pixels.
+ * @param quality JPEG quality, 1 to 100, as used by libjpeg.
+ * @param out Receives the JPEG.
+ * @param size Size of out in bytes.
+ * @return On success, returns the length of the JPEG. Otherwise, returns -1,
+ *         also if out is too small.
+ * @note Safe to call from several threads at once.
+ */
+ssize_t jpeg_encode(const uint8_t *luma, size_t stride, uint32_t width, uint32_t height,
+                    int quality, uint8_t *out, size_t size);
+
+#endif // SITE_MON_GSM_JPEG_H
@@ -0,0 +1,104 @@
+/**
+ * @file log.h
+ *
+ * @brief This module provides logging that is cheap enough to leave on in
+ *        production builds. A log call copies the raw arguments and a pointer
+ *        to its call site into the calling thread's ring buffer; formatting
+ *        and writing happen later on a background thread, which writes to a
+ *        file that is rotated once it grows too large.
+ *
+ *        Each call site is a static log_site_t whose argument types are
+ *        parsed from the format string on first use, so a log call costs a
+ *        clock read and a few stores. Messages below the current level are
+ *        rejected before any argument is evaluated.
+ * @author Aramayis Orkusyan
+ * @date December 9, 2019
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef SITE_MON_GSM_LOG_H
+#define SITE_MON_GSM_LOG_H
+
+#include <stdint.h>
+
+#define LOG_MAX_ARGS     8   // arguments beyond this are not recorded
+#define LOG_MAX_THREADS  8   // threads beyond this have their messages dropped
+#define LOG_RING_RECORDS 256 // messages buffered per thread, a power of two
+
+typedef enum log_level
+{
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG
+} log_level_t;
+
+typedef struct log_config
+{
+    // File to log to, or NULL for stdout. Once it reaches max_bytes it is
+    // renamed to path.1, path.1 to path.2 and so on up to path.max_files.
+    const char  *path;
+    uint32_t     max_bytes;
+    uint32_t     max_files;
+    log_level_t  level;
+} log_config_t;
+
+// A log statement. Created by the LOG_* macros, one per call site.
+typedef struct log_site
+{
+    const char *format;
+    const char *file;
+    uint32_t    line;
+    log_level_t level;
+    uint32_t    parsed; // set once types and nargs have been filled in
+    uint32_t    nargs;
+    uint8_t     types[LOG_MAX_ARGS];
+} log_site_t;
+
+// The most verbose level that is logged. Use log_set_level() to change it.
+extern log_level_t log_threshold;
+
+/**
+ * Start the background thread that writes log messages.
+ *
+ * @param config Where to log and the initial level. It is copied.
+ * @return On success, returns 0. Otherwise, returns -1.
+ * @note Messages logged before this are buffered, up to LOG_RING_RECORDS
+ *       per thread.
+ */
+int log_init(const log_config_t *config);
+
+/**
+ * Change which messages are logged. Takes effect immediately in all threads.
+ *
+ * @param level The most verbose level to log.
+ */
+void log_set_level(log_level_t level);
+
+/**
+ * Record a message. Use the LOG_* macros instead of calling this directly.
+ *
+ * @param site The call site of the message.
+ * @param format The same format string as site->format, for type checking.
+ */
+void log_write(log_site_t *site, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/**
+ * Write every buffered message before returning.
+ */
+void log_flush(void);
+
+#define LOG_AT(lvl, fmt, ...) do { \
+        if ((int)(lvl) <= (int)__atomic_load_n(&log_threshold, __ATOMIC_RELAXED)) { \
+            static log_site_t log_site_ = { fmt, __FILE__, __LINE__, lvl, 0, 0, { 0 } }; \
+            log_write(&log_site_, fmt, ##__VA_ARGS__); \
+        } \
+    } while (0)
+
+#define LOG_ERROR(fmt, ...) LOG_AT(LOG_LEVEL_ERROR, fmt, ##__VA_ARGS__)
+#define LOG_WARN(fmt, ...)  LOG_AT(LOG_LEVEL_WARN, fmt, ##__VA_ARGS__)
+#define LOG_INFO(fmt, ...)  LOG_AT(LOG_LEVEL_INFO, fmt, ##__VA_ARGS__)
+#define LOG_DEBUG(fmt, ...) LOG_AT(LOG_LEVEL_DEBUG, fmt, ##__VA_ARGS__)
+
+#endif // SITE_MON_GSM_LOG_H
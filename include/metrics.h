@@ -0,0 +1,105 @@
+/**
+ * @file metrics.h
+ *
+ * @brief This module provides counters, gauges and latency histograms for the
+ *        pipeline stages, and exports them in the Prometheus text format to a
+ *        file and over a Unix domain socket.
+ *
+ *        Updates are lock-free. Every thread writes to its own cache-aligned
+ *        shard with relaxed atomics and the exporter sums the shards, so the
+ *        cost on the hot path is a handful of uncontended adds.
+ * @author Aramayis Orkusyan
+ * @date December 9, 2019
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef SITE_MON_GSM_METRICS_H
+#define SITE_MON_GSM_METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define METRICS_MAX_METRICS 64 // number of metrics that can be registered
+#define METRICS_MAX_THREADS 8  // threads beyond this share shards
+
+typedef struct metric metric_t;
+
+typedef struct metrics_export_config
+{
+    // Prometheus text file rewritten every interval_seconds, or NULL. It is
+    // replaced atomically so that a collector never reads a partial file.
+    const char *text_file;
+    unsigned    interval_seconds;
+    // Unix domain socket that answers every connection with the current
+    // metrics, or NULL.
+    const char *socket_path;
+} metrics_export_config_t;
+
+/**
+ * Register a monotonically increasing counter.
+ *
+ * @param name The Prometheus metric name, e.g. sitemon_bytes_written_total.
+ * @param labels Label set including the braces, e.g. {command="CMGS"}, or NULL.
+ * @param help One line description of the metric.
+ * @return A handle to the counter, or NULL if too many metrics are registered.
+ * @note All strings must outlive the program, string literals are expected.
+ *       Metrics that share a name must be registered with the same type.
+ */
+metric_t *metrics_counter(const char *name, const char *labels, const char *help);
+
+/**
+ * Register a gauge, i.e. a value that can go up and down.
+ *
+ * @see metrics_counter() for the parameters.
+ */
+metric_t *metrics_gauge(const char *name, const char *labels, const char *help);
+
+/**
+ * Register a histogram of durations in nanoseconds. Values are counted in
+ * log-linear buckets, four per power of two, so relative error is bounded
+ * at about 20% from nanoseconds to minutes. They are exported in seconds.
+ *
+ * @see metrics_counter() for the parameters.
+ */
+metric_t *metrics_histogram(const char *name, const char *labels, const char *help);
+
+/**
+ * Add to a counter.
+ *
+ * @param metric The counter, NULL is ignored.
+ * @param n The amount to add.
+ */
+void metrics_add(metric_t *metric, uint64_t n);
+
+/**
+ * Set the value of a gauge.
+ *
+ * @param metric The gauge, NULL is ignored.
+ * @param value The new value.
+ */
+void metrics_set(metric_t *metric, int64_t value);
+
+/**
+ * Record a value in a histogram.
+ *
+ * @param metric The histogram, NULL is ignored.
+ * @param ns The observed duration in nanoseconds.
+ */
+void metrics_observe(metric_t *metric, uint64_t ns);
+
+/**
+ * Write every registered metric in the Prometheus text exposition format.
+ *
+ * @param stream The output stream to print to.
+ */
+void metrics_print(FILE *stream);
+
+/**
+ * Start the background thread that exports the metrics.
+ *
+ * @param config Where and how often to export. It is copied.
+ * @return On success, returns 0. Otherwise, returns -1.
+ */
+int metrics_start_exporter(const metrics_export_config_t *config);
+
+#endif // SITE_MON_GSM_METRICS_H
@@ -0,0 +1,122 @@
+/**
+ * @file motion.h
+ *
+ * @brief This module scores the difference between two luma frames in a way
+ *        that is insensitive to global lighting changes. Each frame's mean and
+ *        contrast are normalized before differencing, and the statistics
+ *        needed for that are gathered in the same pass that scores the frame.
+ *        The blocks that changed can then be tracked back to the reference
+ *        frame by block matching, which tells where the motion is headed.
+ * @author Aramayis Orkusyan
+ * @date December 9, 2019
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef SITE_MON_GSM_MOTION_H
+#define SITE_MON_GSM_MOTION_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MOTION_BLOCK_SIZE        16 // frames are scored in square blocks of pixels
+#define MOTION_MAX_SEARCH_RANGE  16 // largest displacement motion_estimate() finds
+
+// Where the content of one block of the current frame came from in the
+// reference frame. Only blocks whose content moved are reported.
+typedef struct motion_vector
+{
+    uint16_t bx, by;    // the block, in blocks of MOTION_BLOCK_SIZE pixels
+    int8_t   dx, dy;    // displacement in pixels from the reference frame
+    uint16_t sad;       // sum of absolute differences at the displacement
+    uint16_t still_sad; // sum of absolute differences without displacement
+} motion_vector_t;
+
+typedef struct motion_search_config
+{
+    // Blocks whose motion_result_t.block_scores entry is at or above this are
+    // searched, the same threshold as blob_config_t.block_threshold.
+    uint16_t block_threshold;
+    // Most blocks searched per frame. If more blocks changed, an evenly
+    // spread subset of them is searched. 0 disables the search.
+    uint32_t max_blocks;
+    // Largest displacement searched in each direction, in pixels, at most
+    // MOTION_MAX_SEARCH_RANGE.
+    uint32_t range;
+} motion_search_config_t;
+
+typedef struct motion_result
+{
+    // Average over all blocks of the RMS difference left after the reference
+    // frame has been matched to the current frame's mean and contrast, with
+    // 8 fractional bits (i.e. in 1/256ths of a grey level).
+    uint32_t        score;
+    // Average absolute difference without any compensation, in the same units.
+    uint32_t        raw_score;
+    // Lighting change that was compensated for: current = gain * ref + offset.
+    float           gain;
+    float           offset;
+    // Per-block compensated RMS differences, in the same units as score,
+    // stored row by row. Valid until the next call to motion_analyze().
+    uint32_t        blocks_x;
+    uint32_t        blocks_y;
+    const uint16_t *block_scores;
+    // Blocks found to have moved by motion_estimate(), and the displacement
+    // in pixels most of their content moved by. 0 until motion_estimate() is
+    // called, and valid until the next call to motion_analyze().
+    uint32_t               vector_count;
+    const motion_vector_t *vectors;
+    float                  flow_x;
+    float                  flow_y;
+    uint32_t               flow_blocks; // vectors that agree with the flow
+    // Capture time (CLOCK_MONOTONIC, in nanoseconds) and sequence number of
+    // the current frame. Not set by motion_analyze(), but by the camera
+    // module that feeds it.
+    uint64_t        timestamp_ns;
+    uint32_t        sequence;
+} motion_result_t;
+
+/**
+ * Initialize the module for frames of a given size.
+ *
+ * @param width Width of the frames in pixels.
+ * @param height Height of the frames in pixels.
+ * @return On success, returns 0. Otherwise, returns -1.
+ * @note May be called again to change the frame size.
+ */
+int motion_init(uint32_t width, uint32_t height);
+
+/**
+ * Scores the difference between two luma frames.
+ *
+ * @param ref The reference (older) frame.
+ * @param ref_stride Number of bytes between the start of two rows in ref.
+ * @param cur The current frame.
+ * @param cur_stride Number of bytes between the start of two rows in cur.
+ * @param result Filled in with the scores.
+ * @return On success, returns 0. Otherwise, returns -1.
+ */
+int motion_analyze(const uint8_t *ref, size_t ref_stride,
+                   const uint8_t *cur, size_t cur_stride,
+                   motion_result_t *result);
+
+/**
+ * Finds how the changed blocks of a frame pair scored by motion_analyze()
+ * moved, and the displacement shared by most of them.
+ *
+ * @param ref The reference (older) frame given to motion_analyze().
+ * @param ref_stride Number of bytes between the start of two rows in ref.
+ * @param cur The current frame given to motion_analyze().
+ * @param cur_stride Number of bytes between the start of two rows in cur.
+ * @param config Which blocks to search and how far.
+ * @param result The result of motion_analyze() for the pair. Its vectors and
+ *               flow are filled in.
+ * @return On success, returns the number of vectors found. Otherwise,
+ *         returns -1.
+ * @note Blocks at the right and bottom edges that are not full size are not
+ *       searched.
+ */
+int motion_estimate(const uint8_t *ref, size_t ref_stride,
+                    const uint8_t *cur, size_t cur_stride,
+                    const motion_search_config_t *config, motion_result_t *result);
+
+#endif // SITE_MON_GSM_MOTION_H
@@ -0,0 +1,50 @@
+/**
+ * @file pixfmt.h
+ *
+ * @brief This module provides routines for extracting the luma (grey-scale)
+ *        plane from the pixel formats commonly produced by V4L2 cameras.
+ * @author Aramayis Orkusyan
+ * @date December 9, 2019
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef SITE_MON_GSM_PIXFMT_H
+#define SITE_MON_GSM_PIXFMT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Extracts the luma plane of a packed YUYV (YUV 4:2:2) image.
+ *
+ * @param dst Destination luma plane.
+ * @param dst_stride Number of bytes between the start of two rows in dst.
+ * @param src Source YUYV image.
+ * @param src_stride Number of bytes between the start of two rows in src
+ *                   (the bytesperline reported by the driver).
+ * @param width Width of the image in pixels.
+ * @param height Height of the image in pixels.
+ */
+void pixfmt_yuyv_to_luma(uint8_t *dst, size_t dst_stride,
+                         const uint8_t *src, size_t src_stride,
+                         uint32_t width, uint32_t height);
+
+/**
+ * Decodes the luma plane of a motion-JPEG frame. Chroma is neither
+ * transformed nor upsampled.
+ *
+ * @param dst Destination luma plane.
+ * @param dst_stride Number of bytes between the start of two rows in dst.
+ * @param src Compressed JPEG frame.
+ * @param nbytes Number of bytes in src (the bytesused reported by the driver).
+ * @param width Expected width of the decoded image in pixels.
+ * @param height Expected height of the decoded image in pixels.
+ * @return On success, returns 0. Otherwise, returns -1.
+ * @note Only available when built with SITEMON_WITH_MJPEG, otherwise it
+ *       always fails.
+ */
+int pixfmt_mjpeg_to_luma(uint8_t *dst, size_t dst_stride,
+                         const uint8_t *src, size_t nbytes,
+                         uint32_t width, uint32_t height);
+
+#endif // SITE_MON_GSM_PIXFMT_H
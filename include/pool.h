@@ -0,0 +1,58 @@
+/**
+ * @file pool.h
+ *
+ * @brief This module splits per-frame work across a fixed pool of worker
+ *        threads that are created once, each pinned to a core and woken
+ *        through a futex for every job, so no thread is created or destroyed
+ *        per frame.
+ *
+ *        A job is divided into stripes. Stripe s always goes to thread
+ *        s % pool_size(), and the calling thread takes its share too, so the
+ *        partition of the work never depends on timing. Callers that reduce
+ *        per-stripe results in stripe order therefore get the same result
+ *        with any number of threads.
+ * @author Aramayis Orkusyan
+ * @date December 9, 2019
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef SITE_MON_GSM_POOL_H
+#define SITE_MON_GSM_POOL_H
+
+#include <stdint.h>
+
+#define POOL_MAX_THREADS 16
+
+// Does the part of a job that is stripe number stripe.
+typedef void (*pool_task_t)(void *arg, uint32_t stripe);
+
+/**
+ * Start the worker threads.
+ *
+ * @param threads Threads to run jobs on, including the caller of pool_run(),
+ *                or 0 for one per online CPU. At most POOL_MAX_THREADS.
+ * @return On success, returns 0. Otherwise, returns -1 and jobs run on the
+ *         calling thread only.
+ * @note Must be called once, before the first pool_run(). Without it every
+ *       job runs on the calling thread.
+ */
+int pool_init(uint32_t threads);
+
+/**
+ * Get the number of threads jobs are split across.
+ *
+ * @return The number of threads, at least 1.
+ */
+uint32_t pool_size(void);
+
+/**
+ * Run a job and wait until every stripe is done.
+ *
+ * @param task Called once for every stripe.
+ * @param arg Passed to task.
+ * @param stripes The number of stripes.
+ * @note Jobs must be started from one thread at a time.
+ */
+void pool_run(pool_task_t task, void *arg, uint32_t stripes);
+
+#endif // SITE_MON_GSM_POOL_H
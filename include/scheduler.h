@@ -0,0 +1,117 @@
+/**
+ * @file scheduler.h
+ *
+ * @brief This module paces motion detection according to scene activity. The
+ *        camera frame rate is lowered and frames are skipped during long quiet
+ *        periods, and full rate is restored as soon as the motion score rises.
+ * @author Aramayis Orkusyan
+ * @date December 9, 2019
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef SITE_MON_GSM_SCHEDULER_H
+#define SITE_MON_GSM_SCHEDULER_H
+
+#include <stdint.h>
+#include "motion.h"
+
+#define SCHEDULER_MAX_LEVELS 8
+
+typedef struct scheduler_config
+{
+    // Camera frame rate while the scene is active.
+    uint32_t full_fps;
+    // Lowest camera frame rate requested during quiet periods.
+    uint32_t min_fps;
+    // Number of idle levels below full rate (at most SCHEDULER_MAX_LEVELS - 1).
+    // Every level halves the frame rate, down to min_fps, and then doubles the
+    // number of frames skipped between two analyzed frames.
+    uint32_t idle_levels;
+    // Seconds without a rising score before dropping to the next idle level.
+    uint32_t quiet_seconds;
+    // Score, in the units of camera_detect_motion(), at or above which the
+    // scheduler returns to full rate immediately. This should be well below
+    // the motion threshold so that it ramps up before motion is confirmed.
+    uint32_t wake_score;
+} scheduler_config_t;
+
+typedef struct scheduler_stats
+{
+    uint32_t level;                // current idle level, 0 is full rate
+    uint32_t fps;                  // frame rate granted by the camera
+    uint32_t skip;                 // frames skipped between analyzed frames
+    uint64_t frames_analyzed;      // since scheduler_init()
+    uint64_t frames_skipped;       // since scheduler_init()
+    double   frames_analyzed_per_hour;
+    double   cpu_percent;          // process CPU use since the previous call
+    // Detection latency added by idling, i.e. how much later a wake-up was
+    // seen at most than it would have been at full rate, measured from the
+    // capture times of the frame that saw it and the one analyzed before.
+    uint64_t added_latency_last_ns;
+    uint64_t added_latency_max_ns;
+    uint64_t added_latency_total_ns;
+    uint32_t wakeups;
+} scheduler_stats_t;
+
+// What the scheduler needs to continue at the same idle level after a
+// restart, see scheduler_save_state().
+typedef struct scheduler_state
+{
+    uint32_t level;     // idle level
+    uint32_t reserved;
+    uint64_t active_ns; // last time the scene looked active, CLOCK_MONOTONIC
+} scheduler_state_t;
+
+/**
+ * Initialize the scheduler and set the camera to full rate.
+ *
+ * @param config The scheduling policy. It is copied.
+ * @return On success, returns 0. Otherwise, returns -1.
+ * @note Must be called after camera_init().
+ */
+int scheduler_init(const scheduler_config_t *config);
+
+/**
+ * Skips as many frames as the current idle level calls for and then runs
+ * camera_detect_motion() on the next one.
+ *
+ * @param avg_pixel_diff The threshold to use when determining if motion occured.
+ * @param result If not NULL, receives the scores of the analyzed frame pair.
+ * @return The result of camera_detect_motion().
+ */
+int scheduler_detect_motion(uint8_t avg_pixel_diff, motion_result_t *result);
+
+/**
+ * Get the scheduler's current state and cost.
+ *
+ * @param stats Filled in with the current statistics.
+ */
+void scheduler_get_stats(scheduler_stats_t *stats);
+
+/**
+ * Log the scheduler's current state and cost at LOG_LEVEL_INFO.
+ *
+ * @note The state, frame counts and added latency are also exported as
+ *       metrics, see metrics.h.
+ */
+void scheduler_log_stats(void);
+
+/**
+ * Copy the scheduler's idle level and when the scene was last active.
+ *
+ * @param state Receives the state.
+ */
+void scheduler_save_state(scheduler_state_t *state);
+
+/**
+ * Continue at a saved idle level.
+ *
+ * @param state A state from scheduler_save_state().
+ * @param shift_ns Added to the saved time, to move it to the current clock if
+ *                 the state was saved before a reboot.
+ * @note Must be called after scheduler_init(). Levels beyond the configured
+ *       idle levels are clamped.
+ */
+void scheduler_restore_state(const scheduler_state_t *state, int64_t shift_ns);
+
+#endif // SITE_MON_GSM_SCHEDULER_H
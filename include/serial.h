@@ -43,6 +43,26 @@ ssize_t serial_write(int fd, uint8_t *buffer, size_t nbytes);
  */
 ssize_t serial_read(int fd, uint8_t *buffer, size_t nbytes);
 
+/**
+ * Change the baud rate of an open serial port, after the data already
+ * written has been transmitted.
+ *
+ * @param fd File descriptor specifying the serial port.
+ * @param baud The baud rate in bits per second, e.g. 921600.
+ * @return On success, returns 0. Otherwise, returns -1, also if the rate is
+ *         not one termios knows.
+ */
+int serial_set_baud(int fd, uint32_t baud);
+
+/**
+ * Turn RTS/CTS hardware flow control on or off.
+ *
+ * @param fd File descriptor specifying the serial port.
+ * @param on Non-zero to turn flow control on.
+ * @return On success, returns 0. Otherwise, returns -1.
+ */
+int serial_set_flow_control(int fd, int on);
+
 /**
  * Flush all data received but not read and all data written but not yet transmitted.
  *
@@ -0,0 +1,93 @@
+/**
+ * @file settings.h
+ *
+ * @brief This module holds the settings that can be tuned without a rebuild,
+ *        read from a plain "key = value" file that is watched with inotify
+ *        and applied as soon as it is saved, without restarting streaming or
+ *        the modems.
+ *
+ *        The settings in force are an immutable snapshot behind an atomic
+ *        pointer. A reload parses the file into a new snapshot, swaps the
+ *        pointer and frees the old one once every reader that may still see
+ *        it is done, RCU style. Readers never take a lock: they only bump one
+ *        of two counters, so the per-frame path is never held up by a reload.
+ * @author Aramayis Orkusyan
+ * @date December 9, 2019
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef SITE_MON_GSM_SETTINGS_H
+#define SITE_MON_GSM_SETTINGS_H
+
+#include <stdint.h>
+#include "blob.h"
+
+#define SETTINGS_MAX_RECIPIENTS   4
+#define SETTINGS_MAX_MODEMS       4
+#define SETTINGS_RECIPIENT_SIZE   32
+#define SETTINGS_MESSAGE_SIZE     64
+#define SETTINGS_PATH_SIZE        64
+
+typedef struct settings
+{
+    // Detection, applied from the next frame on.
+    uint32_t      threshold;       // average pixel difference for motion
+    blob_config_t blob_filter;     // changed blocks, blob sizes and zones
+    uint32_t      stills;          // stills taken per event
+
+    // Alerts, applied from the next event on.
+    uint32_t      recipient_count;
+    char          recipients[SETTINGS_MAX_RECIPIENTS][SETTINGS_RECIPIENT_SIZE];
+    char          message[SETTINGS_MESSAGE_SIZE];
+    uint32_t      alert_interval_seconds; // least time between two alerts
+    uint32_t      max_alerts_per_hour;    // 0 for no limit
+
+    // Devices, only read at start. Changing them takes a restart.
+    char          video_device[SETTINGS_PATH_SIZE];
+    uint32_t      modem_count;
+    char          modems[SETTINGS_MAX_MODEMS][SETTINGS_PATH_SIZE];
+} settings_t;
+
+/**
+ * Put the defaults in force and apply the settings file over them if it
+ * exists. Keys missing from the file keep their defaults. Keys that can be
+ * given several times (recipient, zone, modem) replace the defaults as a
+ * whole. A '#' starts a comment at the start of a line, or as a word of its
+ * own after a value.
+ *
+ * @param defaults The settings used where the file has none. They are copied.
+ * @param path The settings file. It is copied.
+ * @return On success, returns 0. If the file exists but can't be used,
+ *         returns -1 and the defaults stay in force.
+ */
+int settings_init(const settings_t *defaults, const char *path);
+
+/**
+ * Start watching the settings file. Whenever it is written, the file is
+ * read again over the defaults and, if valid, replaces the settings in force.
+ * An invalid file is logged and ignored.
+ *
+ * @return On success, returns 0. Otherwise, returns -1.
+ * @note Must be called after settings_init().
+ */
+int settings_watch(void);
+
+/**
+ * Get the settings in force, which stay valid until settings_release().
+ * Never blocks.
+ *
+ * @return The settings.
+ * @note Keep the settings only as long as needed, e.g. for one frame; a
+ *       reload waits for them to be released before freeing the old ones.
+ *       Calls may nest within a thread.
+ */
+const settings_t *settings_acquire(void);
+
+/**
+ * Hand back the settings from settings_acquire().
+ *
+ * @param settings The settings.
+ */
+void settings_release(const settings_t *settings);
+
+#endif // SITE_MON_GSM_SETTINGS_H
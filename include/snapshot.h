@@ -0,0 +1,44 @@
+/**
+ * @file snapshot.h
+ *
+ * @brief This module turns a luma frame into a small image for sending over
+ *        the modem. The frame is downscaled with a box filter and compressed
+ *        as a grey-scale JPEG, see jpeg.h.
+ * @author Aramayis Orkusyan
+ * @date December 9, 2019
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef SITE_MON_GSM_SNAPSHOT_H
+#define SITE_MON_GSM_SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define SNAPSHOT_QUALITY 60 // JPEG quality, 1 to 100
+
+/**
+ * Downscale and compress a frame.
+ *
+ * @param luma The luma plane of the frame.
+ * @param stride Bytes between the start of two rows in luma.
+ * @param width Width of the frame in pixels.
+ * @param height Height of the frame in pixels.
+ * @param scale Both sides are divided by this, 1 keeps the full size.
+ * @param out Receives the encoded image.
+ * @param size Size of out in bytes.
+ * @return On success, returns the length of the encoded image. Otherwise,
+ *         returns -1, also if out is too small.
+ */
+ssize_t snapshot_encode(const uint8_t *luma, size_t stride, uint32_t width, uint32_t height,
+                        uint32_t scale, uint8_t *out, size_t size);
+
+/**
+ * Get the file extension of the images made by snapshot_encode().
+ *
+ * @return "jpg".
+ */
+const char *snapshot_extension(void);
+
+#endif // SITE_MON_GSM_SNAPSHOT_H
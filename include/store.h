@@ -0,0 +1,115 @@
+/**
+ * @file store.h
+ *
+ * @brief This module keeps evidence stills in a fixed-size pool of
+ *        preallocated segment files that are reused oldest first, so the
+ *        storage never fills up and the filesystem sees no new files, no
+ *        fragmentation and no metadata churn once the pool exists.
+ *
+ *        Frames are appended to the current segment. A memory-mapped index
+ *        file keeps one small entry per frame, in time order, with the
+ *        segment and offset it was written to. Finding the frames of a time
+ *        range is a binary search over the index and never scans a
+ *        directory.
+ * @author Aramayis Orkusyan
+ * @date December 9, 2019
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef SITE_MON_GSM_STORE_H
+#define SITE_MON_GSM_STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+typedef struct store_config
+{
+    const char *dir;           // directory holding the segments and index
+    uint32_t    segments;      // number of segment files in the pool
+    uint32_t    segment_bytes; // size each segment is preallocated to
+    uint32_t    max_frames;    // capacity of the index
+} store_config_t;
+
+#define STORE_ENTRY_REPEAT 0x1 // the frame repeats the data of an earlier one
+
+typedef struct store_entry
+{
+    uint64_t timestamp_ns; // CLOCK_REALTIME, never decreasing within the store
+    uint64_t stored_ns;    // timestamp of the frame the data was stored with
+    uint32_t segment;      // segment file the frame is in
+    uint32_t offset;       // offset of the frame data in the segment
+    uint32_t length;       // length of the frame data in bytes
+    uint32_t flags;        // STORE_ENTRY_*
+} store_entry_t;
+
+/**
+ * Open the store, creating and preallocating the segments and the index if
+ * they don't exist yet. An existing store is continued where it left off.
+ *
+ * @param config The layout of the store. It is copied.
+ * @return On success, returns 0. Otherwise, returns -1.
+ * @note If the layout differs from that of an existing store, the existing
+ *       index is discarded and the segments are reused from the start.
+ */
+int store_open(const store_config_t *config);
+
+/**
+ * Check whether the store has been opened.
+ *
+ * @return 1 if store_open() succeeded, 0 otherwise.
+ */
+int store_is_open(void);
+
+/**
+ * Append a frame, reusing the oldest segment once the pool is full.
+ *
+ * @param timestamp_ns Capture time of the frame, CLOCK_REALTIME.
+ * @param iov The pieces of the frame data, written back to back.
+ * @param iovcnt The number of pieces.
+ * @return On success, returns the number of bytes stored. Otherwise,
+ *         returns -1.
+ */
+ssize_t store_append(uint64_t timestamp_ns, const struct iovec *iov, int iovcnt);
+
+/**
+ * Append a frame that is a near-duplicate of the last one appended. Only an
+ * index entry referring to the last frame's data is added, nothing is
+ * written to the segments.
+ *
+ * @param timestamp_ns Capture time of the frame, CLOCK_REALTIME.
+ * @return On success, returns 0. Otherwise, returns -1, also if the store
+ *         holds no frame to repeat.
+ */
+int store_append_repeat(uint64_t timestamp_ns);
+
+/**
+ * Find the frames captured in a time range.
+ *
+ * @param from_ns Start of the range, inclusive, CLOCK_REALTIME.
+ * @param to_ns End of the range, exclusive.
+ * @param entries Receives up to max_entries index entries, oldest first.
+ * @param max_entries Size of entries.
+ * @return The number of frames in the range, which may exceed max_entries.
+ *         Returns -1 if the store is not open.
+ */
+int store_find(uint64_t from_ns, uint64_t to_ns, store_entry_t *entries,
+               uint32_t max_entries);
+
+/**
+ * Read a frame found with store_find().
+ *
+ * @param entry The frame's index entry.
+ * @param buffer Receives the frame data.
+ * @param size Size of buffer, at least entry->length.
+ * @return On success, returns the number of bytes read. Otherwise, returns
+ *         -1, also if the frame's segment has been reused since.
+ */
+ssize_t store_read(const store_entry_t *entry, void *buffer, size_t size);
+
+/**
+ * Flush and close the store.
+ */
+void store_close(void);
+
+#endif // SITE_MON_GSM_STORE_H
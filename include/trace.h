@@ -0,0 +1,93 @@
+/**
+ * @file trace.h
+ *
+ * @brief This module records begin/end events into per-thread ring buffers
+ *        and writes them out in the Chrome trace event format, which can be
+ *        opened in chrome://tracing or Perfetto to see where the time between
+ *        motion and alert went.
+ *
+ *        Recording is lock-free: each thread owns its ring and only publishes
+ *        its head with a release store. The newest events are kept and the
+ *        oldest ones overwritten.
+ *
+ *        Tracing is compiled in only when SITEMON_WITH_TRACE is defined (the
+ *        SITEMON_WITH_TRACE CMake option). Otherwise every macro expands to
+ *        nothing and the module adds no code at all.
+ * @author Aramayis Orkusyan
+ * @date December 9, 2019
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef SITE_MON_GSM_TRACE_H
+#define SITE_MON_GSM_TRACE_H
+
+#define TRACE_MAX_THREADS 8    // threads beyond this are not traced
+#define TRACE_RING_EVENTS 4096 // events kept per thread, a power of two
+
+#ifdef SITEMON_WITH_TRACE
+
+/**
+ * Install the dump handlers. The trace is written to path when the process
+ * receives SIGUSR2, and when it exits or is stopped with SIGINT or SIGTERM.
+ *
+ * @param path The file to write the trace to.
+ * @return On success, returns 0. Otherwise, returns -1.
+ * @note Must be called before any other thread is created, so that every
+ *       thread inherits the blocked signal mask.
+ */
+int trace_init(const char *path);
+
+/**
+ * Name the calling thread in the trace.
+ *
+ * @param name The thread name. Must outlive the program, e.g. a literal.
+ */
+void trace_thread_name(const char *name);
+
+/**
+ * Record an event for the calling thread.
+ *
+ * @param name The event name. Must outlive the program, e.g. a literal.
+ * @param phase 'B' to begin a span, 'E' to end one, 'i' for an instant.
+ */
+void trace_event(const char *name, char phase);
+
+/**
+ * Write every buffered event to a file.
+ *
+ * @param path The file to write the trace to.
+ * @return On success, returns 0. Otherwise, returns -1.
+ */
+int trace_dump(const char *path);
+
+// Ends the span of a TRACE_SCOPE() when the enclosing block is left.
+static inline void trace_scope_end(const char **name)
+{
+    trace_event(*name, 'E');
+}
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b)  TRACE_CONCAT_(a, b)
+
+#define TRACE_INIT(path)        trace_init(path)
+#define TRACE_THREAD_NAME(name) trace_thread_name(name)
+#define TRACE_BEGIN(name)       trace_event(name, 'B')
+#define TRACE_END(name)         trace_event(name, 'E')
+#define TRACE_INSTANT(name)     trace_event(name, 'i')
+// Spans from here to the end of the enclosing block, including early returns.
+#define TRACE_SCOPE(name) \
+    const char *TRACE_CONCAT(trace_scope_, __LINE__) \
+        __attribute__((cleanup(trace_scope_end))) = (trace_event(name, 'B'), name)
+
+#else
+
+#define TRACE_INIT(path)        ((void)0)
+#define TRACE_THREAD_NAME(name) ((void)0)
+#define TRACE_BEGIN(name)       ((void)0)
+#define TRACE_END(name)         ((void)0)
+#define TRACE_INSTANT(name)     ((void)0)
+#define TRACE_SCOPE(name)       ((void)0)
+
+#endif // SITEMON_WITH_TRACE
+
+#endif // SITE_MON_GSM_TRACE_H
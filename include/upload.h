@@ -0,0 +1,66 @@
+/**
+ * @file upload.h
+ *
+ * @brief This module uploads event snapshots to an HTTP server over the
+ *        modem's data channel, in chunks that can be resumed after a dropped
+ *        connection.
+ *
+ *        Every upload has an id. The server keeps the bytes it has received
+ *        for each id and answers every request with how many it has, as a
+ *        decimal number in the response body:
+ *
+ *            GET  url?id=ID                          -> committed offset
+ *            POST url?id=ID&offset=N&total=T  <data> -> committed offset
+ *
+ *        A chunk is only sent from the offset the server reports, so a chunk
+ *        that was lost or only partly stored is sent again and nothing is
+ *        sent twice once it has been committed. Chunks are sized from the
+ *        measured throughput so that each one takes about target_chunk_ms,
+ *        large enough that the per-request overhead of the modem stays small
+ *        and small enough that a failure costs little.
+ * @author Aramayis Orkusyan
+ * @date December 9, 2019
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef SITE_MON_GSM_UPLOAD_H
+#define SITE_MON_GSM_UPLOAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "gsm.h"
+
+typedef struct upload_config
+{
+    const char *url;             // e.g. "http://example.com/upload"
+    const char *apn;             // access point name of the mobile operator
+    uint32_t    min_chunk;       // bytes, also the size of the first chunk
+    uint32_t    max_chunk;       // bytes, at most what AT+HTTPDATA accepts
+    uint32_t    target_chunk_ms; // how long a chunk should take to send
+    uint32_t    max_attempts;    // failed requests in a row before giving up
+} upload_config_t;
+
+/**
+ * Set where and how snapshots are uploaded.
+ *
+ * @param config The upload settings. It is copied, the strings are not.
+ * @return On success, returns 0. Otherwise, returns -1.
+ */
+int upload_init(const upload_config_t *config);
+
+/**
+ * Upload a snapshot, continuing from whatever the server already has of it.
+ *
+ * @param modem The modem to upload with.
+ * @param id Identifies the upload on the server, letters, digits, '-' and
+ *           '_' only.
+ * @param data The snapshot.
+ * @param length The length of data in bytes.
+ * @return On success, returns 0. Otherwise, returns -1. A failed upload can
+ *         be continued by calling this again with the same id and data.
+ * @note The modem must be in GSM_FULL_FUNCTIONALITY_MODE. The data channel
+ *       is opened and closed by this call.
+ */
+int upload_snapshot(gsm_t *modem, const char *id, const uint8_t *data, size_t length);
+
+#endif // SITE_MON_GSM_UPLOAD_H
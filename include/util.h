@@ -8,6 +8,7 @@
 #ifndef SITE_MON_GSM_UTIL_H
 #define SITE_MON_GSM_UTIL_H
 
+#include <stdint.h>
 #include <unistd.h>
 
 /**
@@ -34,4 +35,11 @@
  */
 int has_alphanumeric(const char *str);
 
+/**
+ * Reads the monotonic clock.
+ *
+ * @return The value of CLOCK_MONOTONIC in nanoseconds.
+ */
+uint64_t monotonic_time_ns(void);
+
 #endif
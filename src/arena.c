@@ -0,0 +1,143 @@
+#include "arena.h"
+#include "log.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#define ARENA_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+#define ARENA_ROUND_UP(n, a) (((n) + (a) - 1) / (a) * (a))
+
+struct arena
+{
+    uint8_t *base;
+    size_t   size;      // bytes mapped
+    size_t   slot_size;
+    uint32_t slots;
+    uint32_t refs;
+};
+
+/*******************************************************************************
+ *
+ * Function:    arena_create()
+ *
+ * Description: Maps the memory of an arena, preferring reserved huge pages,
+ *              then transparent huge pages, then normal pages.
+ *
+ * Returns:     The arena, or NULL on failure.
+ *
+ ******************************************************************************/
+arena_t *arena_create(size_t slot_size, uint32_t slots)
+{
+    arena_t *arena;
+
+    if ((slot_size == 0) || (slots == 0) || ((arena = calloc(1, sizeof(*arena))) == NULL))
+    {
+        return NULL;
+    }
+
+    arena->slot_size = ARENA_ROUND_UP(slot_size, ARENA_SLOT_ALIGN);
+    arena->slots     = slots;
+    arena->refs      = 1;
+    arena->size      = ARENA_ROUND_UP(arena->slot_size * slots, ARENA_HUGE_PAGE_SIZE);
+    arena->base      = mmap(NULL, arena->size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+
+    if (arena->base != MAP_FAILED)
+    {
+        LOG_INFO("arena of %u x %zu bytes on huge pages", slots, arena->slot_size);
+        return arena;
+    }
+
+    // No huge pages reserved, over-allocate to be able to align to one.
+    size_t   mapped = arena->size + ARENA_HUGE_PAGE_SIZE;
+    uint8_t *raw    = mmap(NULL, mapped, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (raw == MAP_FAILED)
+    {
+        LOG_ERROR("failed to map an arena of %zu bytes", arena->size);
+        free(arena);
+        return NULL;
+    }
+
+    arena->base = (uint8_t *)ARENA_ROUND_UP((uintptr_t)raw, ARENA_HUGE_PAGE_SIZE);
+    if (arena->base > raw)
+    {
+        munmap(raw, (size_t)(arena->base - raw));
+    }
+    munmap(arena->base + arena->size, (size_t)(raw + mapped - (arena->base + arena->size)));
+
+    madvise(arena->base, arena->size, MADV_HUGEPAGE);
+
+    // Fault every page in now rather than during the first frames.
+    for (size_t offset = 0; offset < arena->size; offset += ARENA_SLOT_ALIGN)
+    {
+        arena->base[offset] = 0;
+    }
+
+    LOG_INFO("arena of %u x %zu bytes on transparent huge pages", slots, arena->slot_size);
+    return arena;
+}
+
+/*******************************************************************************
+ *
+ * Function:    arena_slot()
+ *
+ * Description: Gets the memory of a slot.
+ *
+ * Returns:     The start of the slot.
+ *
+ ******************************************************************************/
+void *arena_slot(const arena_t *arena, uint32_t slot)
+{
+    return arena->base + (size_t)slot * arena->slot_size;
+}
+
+/*******************************************************************************
+ *
+ * Function:    arena_slot_size()
+ *
+ * Description: Gets the size of the slots.
+ *
+ * Returns:     The size of each slot in bytes.
+ *
+ ******************************************************************************/
+size_t arena_slot_size(const arena_t *arena)
+{
+    return arena->slot_size;
+}
+
+/*******************************************************************************
+ *
+ * Function:    arena_ref()
+ *
+ * Description: Takes a reference to an arena.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+void arena_ref(arena_t *arena)
+{
+    __atomic_add_fetch(&arena->refs, 1, __ATOMIC_RELAXED);
+}
+
+/*******************************************************************************
+ *
+ * Function:    arena_unref()
+ *
+ * Description: Drops a reference to an arena and unmaps it with the last.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+void arena_unref(arena_t *arena)
+{
+    if ((arena == NULL) || (__atomic_sub_fetch(&arena->refs, 1, __ATOMIC_ACQ_REL) != 0))
+    {
+        return;
+    }
+
+    munmap(arena->base, arena->size);
+    free(arena);
+}
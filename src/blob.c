@@ -0,0 +1,270 @@
+#include "blob.h"
+#include "log.h"
+#include "util.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A horizontal run of changed blocks. Runs are the nodes of the union-find
+// forest, so its size depends on the number of runs rather than blocks.
+typedef struct blob_run
+{
+    uint16_t y;
+    uint16_t x0;
+    uint16_t x1;     // inclusive
+    uint32_t parent;
+} blob_run_t;
+
+// Global module variables
+static blob_run_t *runs;
+static blob_t     *labels;   // per-root statistics, indexed like runs
+static uint32_t    capacity; // number of runs the buffers can hold
+
+/*******************************************************************************
+ *
+ * Function:    blob_find()
+ *
+ * Description: Finds the root of a run's tree, halving the path on the way.
+ *
+ * Returns:     The index of the root run.
+ *
+ ******************************************************************************/
+static uint32_t blob_find(uint32_t run)
+{
+    while (runs[run].parent != run)
+    {
+        runs[run].parent = runs[runs[run].parent].parent;
+        run = runs[run].parent;
+    }
+    return run;
+}
+
+/*******************************************************************************
+ *
+ * Function:    blob_union()
+ *
+ * Description: Merges the trees of two runs. The lower index becomes the
+ *              root so that labels are stable in raster order.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void blob_union(uint32_t a, uint32_t b)
+{
+    a = blob_find(a);
+    b = blob_find(b);
+
+    if (a < b)
+    {
+        runs[b].parent = a;
+    }
+    else if (b < a)
+    {
+        runs[a].parent = b;
+    }
+}
+
+/*******************************************************************************
+ *
+ * Function:    blob_compare_area()
+ *
+ * Description: qsort() comparator ordering blobs by decreasing area.
+ *
+ * Returns:     Negative, zero or positive as required by qsort().
+ *
+ ******************************************************************************/
+static int blob_compare_area(const void *lhs, const void *rhs)
+{
+    const blob_t *a = (const blob_t *)lhs;
+    const blob_t *b = (const blob_t *)rhs;
+    return (a->area < b->area) - (a->area > b->area);
+}
+
+/*******************************************************************************
+ *
+ * Function:    blob_in_zone()
+ *
+ * Description: Checks whether the centroid of a blob lies in one of the
+ *              zones.
+ *
+ * Returns:     1 if it does or there are no zones, 0 otherwise.
+ *
+ ******************************************************************************/
+static int blob_in_zone(const blob_config_t *config, const blob_t *blob)
+{
+    if (config->zone_count == 0)
+    {
+        return 1;
+    }
+
+    for (uint32_t n = 0; (n < config->zone_count) && (n < BLOB_MAX_ZONES); ++n)
+    {
+        const blob_zone_t *zone = &config->zones[n];
+
+        // Centroids are measured to block centers, so a zone covers its
+        // blocks from their left and top edges to their right and bottom.
+        if ((blob->cx >= zone->x0) && (blob->cx <= zone->x1 + 1u) &&
+            (blob->cy >= zone->y0) && (blob->cy <= zone->y1 + 1u))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*******************************************************************************
+ *
+ * Function:    blob_analyze()
+ *
+ * Description: Labels the connected components of changed blocks. Each row
+ *              of the block mask is run-length encoded and every run is
+ *              joined with the runs of the previous row that it touches,
+ *              including diagonally. A final pass over the runs accumulates
+ *              area, centroid and bounding box per component.
+ *
+ * Returns:     On success, returns the number of qualifying blobs.
+ *              Otherwise, returns -1.
+ *
+ ******************************************************************************/
+int blob_analyze(const motion_result_t *motion, const blob_config_t *config,
+                 blob_result_t *result)
+{
+    if ((motion == NULL) || (config == NULL) || (result == NULL) ||
+        (motion->block_scores == NULL))
+    {
+        return -1;
+    }
+
+    uint64_t start_ns = monotonic_time_ns();
+    uint32_t width    = motion->blocks_x;
+    uint32_t height   = motion->blocks_y;
+
+    memset(result, 0, sizeof(*result));
+
+    // A row of n blocks holds at most (n + 1) / 2 runs.
+    uint32_t needed = height * ((width + 1) / 2);
+
+    if (needed > capacity)
+    {
+        blob_run_t *new_runs   = realloc(runs, needed * sizeof(*runs));
+        blob_t     *new_labels = (new_runs != NULL) ? realloc(labels, needed * sizeof(*labels)) : NULL;
+
+        if (new_runs != NULL)
+        {
+            runs = new_runs;
+        }
+        if (new_labels == NULL)
+        {
+            LOG_ERROR("failed to allocate run buffers");
+            return -1;
+        }
+        labels   = new_labels;
+        capacity = needed;
+    }
+
+    uint32_t nruns     = 0;
+    uint32_t prev_row  = 0; // first run of the previous row
+    uint32_t prev_end  = 0; // one past the last run of the previous row
+
+    for (uint32_t y = 0; y < height; ++y)
+    {
+        const uint16_t *scores    = motion->block_scores + (size_t)y * width;
+        uint32_t        row_start = nruns;
+        uint32_t        overlap   = prev_row;
+
+        for (uint32_t x = 0; x < width; )
+        {
+            if (scores[x] < config->block_threshold)
+            {
+                ++x;
+                continue;
+            }
+
+            uint32_t x0 = x;
+            while ((x < width) && (scores[x] >= config->block_threshold))
+            {
+                ++x;
+            }
+
+            blob_run_t *run = &runs[nruns];
+            run->y      = (uint16_t)y;
+            run->x0     = (uint16_t)x0;
+            run->x1     = (uint16_t)(x - 1);
+            run->parent = nruns;
+
+            // Runs of both rows are sorted, so the scan of the previous row
+            // resumes where the last run left off. Touching means overlapping
+            // once the run is widened by one block on each side.
+            while ((overlap < prev_end) && (runs[overlap].x1 + 1 < run->x0))
+            {
+                ++overlap;
+            }
+            for (uint32_t other = overlap;
+                 (other < prev_end) && (runs[other].x0 <= run->x1 + 1);
+                 ++other)
+            {
+                blob_union(nruns, other);
+            }
+
+            ++nruns;
+        }
+
+        prev_row = row_start;
+        prev_end = nruns;
+    }
+
+    // Accumulate statistics into the label slot of each root.
+    for (uint32_t run = 0; run < nruns; ++run)
+    {
+        uint32_t root = blob_find(run);
+        uint32_t len  = runs[run].x1 - runs[run].x0 + 1u;
+        blob_t  *blob = &labels[root];
+
+        if (root == run)
+        {
+            blob->area = 0;
+            blob->cx   = 0.0f;
+            blob->cy   = 0.0f;
+            blob->x0   = runs[run].x0;
+            blob->x1   = runs[run].x1;
+            blob->y0   = runs[run].y;
+            blob->y1   = runs[run].y;
+            ++result->count;
+        }
+
+        blob->area += len;
+        // Sums of block centers for now, divided by the area below.
+        blob->cx   += (float)len * ((float)(runs[run].x0 + runs[run].x1) * 0.5f + 0.5f);
+        blob->cy   += (float)len * ((float)runs[run].y + 0.5f);
+        if (runs[run].x0 < blob->x0) blob->x0 = runs[run].x0;
+        if (runs[run].x1 > blob->x1) blob->x1 = runs[run].x1;
+        if (runs[run].y  > blob->y1) blob->y1 = runs[run].y;
+    }
+
+    // Compact the roots into the front of the label array.
+    uint32_t nblobs = 0;
+    for (uint32_t run = 0; run < nruns; ++run)
+    {
+        if (runs[run].parent == run)
+        {
+            blob_t blob = labels[run];
+            blob.cx /= (float)blob.area;
+            blob.cy /= (float)blob.area;
+            labels[nblobs++] = blob;
+
+            if ((blob.area >= config->min_area) && (blob.area <= config->max_area) &&
+                blob_in_zone(config, &blob))
+            {
+                ++result->qualifying;
+            }
+        }
+    }
+
+    qsort(labels, nblobs, sizeof(*labels), blob_compare_area);
+
+    result->stored = (nblobs < BLOB_MAX_BLOBS) ? nblobs : BLOB_MAX_BLOBS;
+    memcpy(result->blobs, labels, result->stored * sizeof(*labels));
+    result->elapsed_ns = monotonic_time_ns() - start_ns;
+
+    return (int)result->qualifying;
+}
@@ -1,267 +1,2001 @@
 #include "camera.h"
-#include "debug.h"
+#include "arena.h"
+#include "pixfmt.h"
+#include "motion.h"
+#include "frame_ring.h"
+#include "store.h"
+#include "jpeg.h"
+#include "denoise.h"
+#include "metrics.h"
+#include "trace.h"
+#include "log.h"
 #include "util.h"
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <linux/videodev2.h>
+#include <linux/dma-buf.h>
+
+#if defined(__has_include)
+    #if __has_include(<linux/dma-heap.h>)
+        #include <linux/dma-heap.h>
+        #define CAMERA_HAVE_DMA_HEAP
+    #endif
+#endif
 
 #define CAMERA_NUM_BUFFERS 10      // number of buffers for capturing frames
-#define CAMERA_VIDEO_WIDTH_PX 800  // width of captured frames in pixels
-#define CAMERA_VIDEO_HEIGHT_PX 600 // height of captured frames in pixels
+#define CAMERA_LUMA_ALIGNMENT 64   // alignment of converted luma planes in bytes
+#define CAMERA_FILENAME_SIZE 256   // path of a still saved to a file
 
-// This datastructure is used to store the infomation about shared memory
-// spaces created with mmap. A shared memory buffer must be created that is
-// passed to the camera device to write to and then can be read by the user.
-typedef struct buffer 
+// This datastructure is used to store the infomation about a capture buffer
+// the camera device writes to and the user reads from. Its memory is either
+// mapped from the driver, a slot of an arena of ours or a DMABUF we import.
+//
+// A buffer is handed back to the driver only once nobody uses its frame: the
+// detector holds the frame it compares the next one to, and anyone may hold
+// a frame with camera_hold_frame(). A buffer outlives its stream if a frame
+// in it is still held when the stream is reconfigured.
+typedef struct buffer
 {
-    void *start;
-    size_t length;
+    void                 *start;
+    size_t                length;
+    size_t                bytesused;
+    uint64_t              timestamp_ns; // capture time of the frame on CLOCK_MONOTONIC
+    uint32_t              sequence;
+    uint32_t              index;        // index of the buffer in its stream
+    uint32_t              memory;       // V4L2_MEMORY_* the buffer was set up for
+    uint32_t              refs;         // users of the frame, see above
+    int                   queued;       // owned by the driver
+    int                   dmabuf_fd;
+    arena_t              *arena;        // kept alive by V4L2_MEMORY_USERPTR buffers
+    uint8_t              *luma_plane;   // for formats that aren't read in place
+    struct camera_stream *stream;       // NULL once the stream has let go of it
 } buffer_t;
 
+// A capture node together with its negotiated format and mapped buffers. The
+// detection stream always exists; a second one is only opened for stills
+// when they are taken from a separate capture node.
+typedef struct camera_stream
+{
+    int                        fd;
+    struct v4l2_capability     capability;
+    struct v4l2_format         format;
+    struct v4l2_requestbuffers bufrequest;
+    buffer_t                  *buffers[CAMERA_NUM_BUFFERS];
+    uint32_t                   memory;    // V4L2_MEMORY_* of the buffers
+    uint32_t                   bytesperline;
+    size_t                     luma_stride;
+    int                        streaming; // all free buffers are queued
+    int                        reference; // buffer held for the next diff
+} camera_stream_t;
+
+// Pixel formats we know how to read luma from, in order of preference. GREY
+// and NV12 are read in place, YUYV is deinterleaved and MJPEG is decoded.
+static const uint32_t camera_pixel_formats[] =
+{
+    V4L2_PIX_FMT_GREY,
+    V4L2_PIX_FMT_NV12,
+    V4L2_PIX_FMT_YUYV,
+#ifdef SITEMON_WITH_MJPEG
+    V4L2_PIX_FMT_MJPEG,
+#endif
+};
+
+#define CAMERA_NUM_PIXEL_FORMATS \
+    (sizeof(camera_pixel_formats) / sizeof(camera_pixel_formats[0]))
+
 // Global module variables
-static int                        fd;
-static struct v4l2_capability     capability;
-static struct v4l2_format         format;
-static struct v4l2_requestbuffers bufrequest;
-static buffer_t                   buffers[CAMERA_NUM_BUFFERS];
+static camera_stream_t       detect_stream;
+static camera_stream_t       still_stream;
+static camera_still_mode_t   still_mode = CAMERA_STILL_SAME_STREAM;
+static uint32_t              detect_width;
+static uint32_t              detect_height;
+static uint32_t              still_width;
+static uint32_t              still_height;
+static int                   stills_active;
+static int                   stills_first_pending;
+static uint64_t              stills_begin_ns;
+static camera_still_stats_t  still_stats;
+static metric_t             *dequeue_metric;
+static metric_t             *detection_metric;
+static metric_t             *search_metric;
+static metric_t             *bytes_written_metric;
+static frame_ring_t         *frame_ring;
+static const uint8_t        *reference_luma;   // luma of detect_stream.reference
+static size_t                reference_stride;
+static const uint8_t        *warm_luma;        // restored reference, see camera_warm_start()
+static size_t                warm_stride;
+static camera_memory_t       capture_memory = CAMERA_MEMORY_MMAP;
+// Guards the reference counts and queued flags of the buffers, which
+// camera_release_frame() changes from other threads.
+static pthread_mutex_t       buffer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static camera_dedup_config_t still_dedup;        // see camera_set_dedup()
+static motion_search_config_t motion_search;     // see camera_set_motion_search()
+static camera_stream_t      *still_last_stream;  // of the last still stored in full
+static uint32_t              still_last_width;
+static uint32_t              still_last_height;
+static char                  still_last_file[64];
+static uint64_t              still_drift;        // summed scores since that still
+static uint32_t              still_drift_frames; // frames scored since that still
+static uint32_t              still_repeats;      // repeats stored since that still
+static metric_t             *still_repeats_metric;
+static metric_t             *encode_metric;
+static uint8_t              *still_jpeg;         // stills are encoded into this
+static size_t                still_jpeg_size;
 
 /*******************************************************************************
  *
- * Function:    camera_init()
+ * Function:    camera_fourcc_to_string()
  *
- * Description: Initialize the camera to capture grey-scale images.
+ * Description: Converts a V4L2 four character code into a printable string.
+ *
+ * Returns:     Returns str.
+ *
+ ******************************************************************************/
+static char *camera_fourcc_to_string(uint32_t fourcc, char str[5])
+{
+    str[0] = (char)(fourcc & 0xFF);
+    str[1] = (char)((fourcc >> 8) & 0xFF);
+    str[2] = (char)((fourcc >> 16) & 0xFF);
+    str[3] = (char)((fourcc >> 24) & 0xFF);
+    str[4] = '\0';
+    return str;
+}
+
+/*******************************************************************************
+ *
+ * Function:    camera_record_latency()
+ *
+ * Description: Adds a resolution switch latency sample to a running summary.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void camera_record_latency(camera_still_latency_t *latency, uint64_t ns)
+{
+    if ((latency->count == 0) || (ns < latency->min_ns))
+    {
+        latency->min_ns = ns;
+    }
+    if (ns > latency->max_ns)
+    {
+        latency->max_ns = ns;
+    }
+    latency->last_ns   = ns;
+    latency->total_ns += ns;
+    latency->count    += 1;
+}
+
+/*******************************************************************************
+ *
+ * Function:    camera_stream_open()
+ *
+ * Description: Opens a capture node and checks that it can stream frames.
  *
  * Returns:     On success, returns 0. Otherwise, returns -1.
  *
  ******************************************************************************/
-int camera_init(const char *device)
+static int camera_stream_open(camera_stream_t *stream, const char *device)
 {
     // Open descriptor to camera device.
-    if ((fd = open(device, O_RDWR)) == -1)
+    if ((stream->fd = open(device, O_RDWR)) == -1)
     {
-        DEBUG_LOG(stdout, "%s: Failed to open camera", __FILE__);
+        LOG_ERROR("Failed to open camera %s", device);
         return -1;
     }
 
     // Retrieve the devices capabilities.
-    if (ioctl(fd, VIDIOC_QUERYCAP, &capability) < 0)
+    if (ioctl(stream->fd, VIDIOC_QUERYCAP, &stream->capability) < 0)
     {
-        DEBUG_LOG(stdout, "%s: Failed VIDIOC_QUERYCAP\n", __FILE__);
+        LOG_ERROR("Failed VIDIOC_QUERYCAP");
+        close(stream->fd);
         return -1;
     }
-    
+
     // Check if camera device has single-planar video capture capability.
-    if (!(capability.capabilities & V4L2_CAP_VIDEO_CAPTURE))
+    if (!(stream->capability.capabilities & V4L2_CAP_VIDEO_CAPTURE))
     {
-        DEBUG_LOG(stdout,
-                  "%s: camera does not support single-planar video capture.\n"
-                  __FILE__);
+        LOG_ERROR("camera does not support single-planar video capture.");
+        close(stream->fd);
         return -1;
     }
 
     // Check if camera device has frame streaming capability.
-    if (!(capability.capabilities & V4L2_CAP_STREAMING))
+    if (!(stream->capability.capabilities & V4L2_CAP_STREAMING))
     {
-        DEBUG_LOG(stdout, "%s: camera does not support frame streaming.\n" __FILE__);
+        LOG_ERROR("camera does not support frame streaming.");
+        close(stream->fd);
         return -1;
     }
 
-    // Set video format.
-    format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    format.fmt.pix.pixelformat = V4L2_PIX_FMT_GREY;
-    format.fmt.pix.width = CAMERA_VIDEO_WIDTH_PX;
-    format.fmt.pix.height = CAMERA_VIDEO_HEIGHT_PX;
-    
-    if (ioctl(fd, VIDIOC_S_FMT, &format) < 0)
+    return 0;
+}
+
+/*******************************************************************************
+ *
+ * Function:    camera_negotiate_format()
+ *
+ * Description: Enumerates the pixel formats supported by the camera and
+ *              configures the most preferred one we can extract luma from.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+static int camera_negotiate_format(camera_stream_t *stream, uint32_t width, uint32_t height)
+{
+    struct v4l2_fmtdesc fmtdesc;
+    size_t              best = CAMERA_NUM_PIXEL_FORMATS;
+    char                fourcc[5];
+
+    memset(&fmtdesc, 0, sizeof(fmtdesc));
+    fmtdesc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    for (fmtdesc.index = 0; ioctl(stream->fd, VIDIOC_ENUM_FMT, &fmtdesc) == 0; ++fmtdesc.index)
     {
-        DEBUG_LOG(stdout, "%s: failed to set video format.\n" __FILE__);
-        return -1;
+        for (size_t pref = 0; pref < best; ++pref)
+        {
+            if (camera_pixel_formats[pref] == fmtdesc.pixelformat)
+            {
+                best = pref;
+                break;
+            }
+        }
     }
 
-    // Inform the device about future buffers.
-    bufrequest.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    bufrequest.memory = V4L2_MEMORY_MMAP;
-    bufrequest.count = CAMERA_NUM_BUFFERS;
-    
-    if (ioctl(fd, VIDIOC_REQBUFS, &bufrequest) < 0)
+    if (best == CAMERA_NUM_PIXEL_FORMATS)
     {
-        DEBUG_LOG(stdout, "%s: failed VIDIOC_REQBUFS.\n" __FILE__);
+        LOG_ERROR("camera supports none of GREY, NV12, YUYV%s",
+#ifdef SITEMON_WITH_MJPEG
+                  ", MJPG"
+#else
+                  " (MJPG support not compiled in)"
+#endif
+                  );
         return -1;
     }
 
-    for (uint32_t index = 0; index < bufrequest.count; ++index)
+    memset(&stream->format, 0, sizeof(stream->format));
+    stream->format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    stream->format.fmt.pix.pixelformat = camera_pixel_formats[best];
+    stream->format.fmt.pix.width = width;
+    stream->format.fmt.pix.height = height;
+    stream->format.fmt.pix.field = V4L2_FIELD_NONE;
+
+    // Ask for rows that start on a cache line so that SIMD loads stay
+    // aligned. Drivers that can't pad rows report the stride they use.
+    if (camera_pixel_formats[best] != V4L2_PIX_FMT_MJPEG)
     {
-        // Allocate buffers.
-        static struct v4l2_buffer buffer;
-        memset(&buffer, 0, sizeof(buffer));
-        buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buffer.memory = V4L2_MEMORY_MMAP;
-        buffer.index = index;
-    
-        if (ioctl(fd, VIDIOC_QUERYBUF, &buffer) < 0)
-        {
-            DEBUG_LOG(stdout, "%s: failed to allocate buffers.\n" __FILE__);
-            return -1;
-        }
+        uint32_t row = (camera_pixel_formats[best] == V4L2_PIX_FMT_YUYV) ? 2 * width : width;
 
-        buffers[index].length = buffer.length;
+        stream->format.fmt.pix.bytesperline = (row + CAMERA_LUMA_ALIGNMENT - 1)
+                                            & ~(uint32_t)(CAMERA_LUMA_ALIGNMENT - 1);
+    }
 
-        // Map the memory.
-        buffers[index].start = mmap (
-            NULL,
-            buffer.length,
-            PROT_READ | PROT_WRITE,
-            MAP_SHARED,
-            fd,
-            buffer.m.offset
-        );
+    if (ioctl(stream->fd, VIDIOC_S_FMT, &stream->format) < 0)
+    {
+        LOG_ERROR("failed to set video format %s.",
+                  camera_fourcc_to_string(camera_pixel_formats[best], fourcc));
+        return -1;
+    }
 
-        if(buffers[index].start == MAP_FAILED){
-            DEBUG_LOG(stdout, "%s: failed to map memory with mmap.\n" __FILE__);
-            return -1;
-        }
+    // The driver is free to substitute another format or frame size, so
+    // everything from here on must go by what it actually returned.
+    if (stream->format.fmt.pix.pixelformat != camera_pixel_formats[best])
+    {
+        LOG_ERROR("driver substituted pixel format %s.",
+                  camera_fourcc_to_string(stream->format.fmt.pix.pixelformat, fourcc));
+        return -1;
+    }
 
-        memset(buffers[index].start, 0, buffers[index].length);
+    stream->bytesperline = stream->format.fmt.pix.bytesperline;
+    if (stream->bytesperline == 0)
+    {
+        stream->bytesperline = (stream->format.fmt.pix.pixelformat == V4L2_PIX_FMT_YUYV)
+                             ? 2 * stream->format.fmt.pix.width
+                             : stream->format.fmt.pix.width;
     }
 
+    LOG_INFO("capturing %ux%u %s, %u bytes per line",
+             stream->format.fmt.pix.width, stream->format.fmt.pix.height,
+             camera_fourcc_to_string(stream->format.fmt.pix.pixelformat, fourcc),
+             stream->bytesperline);
+
     return 0;
 }
 
 /*******************************************************************************
  *
- * Function:    camera_capture_frame()
+ * Function:    camera_stream_filled()
  *
- * Description: Captures a fram and saves it to disk as a grey-scale pgm file.
+ * Description: Records what the driver reported about a buffer it filled.
+ *              Drivers that don't stamp frames with the monotonic clock get
+ *              the time of dequeuing instead.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void camera_stream_filled(camera_stream_t *stream, const struct v4l2_buffer *buffer)
+{
+    buffer_t *filled = stream->buffers[buffer->index];
+
+    filled->bytesused = buffer->bytesused;
+    filled->sequence  = buffer->sequence;
+
+    if ((buffer->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+    {
+        filled->timestamp_ns = (uint64_t)buffer->timestamp.tv_sec * 1000000000ull
+                             + (uint64_t)buffer->timestamp.tv_usec * 1000ull;
+    }
+    else
+    {
+        filled->timestamp_ns = monotonic_time_ns();
+    }
+}
+
+/*******************************************************************************
+ *
+ * Function:    camera_buffer_sync()
+ *
+ * Description: Brackets CPU access to a DMABUF buffer so that the caches
+ *              agree with what the device wrote. Access is read and write,
+ *              as frames read in place are denoised in place too. Other
+ *              buffers need nothing.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void camera_buffer_sync(buffer_t *buffer, uint64_t flags)
+{
+    if (buffer->memory == V4L2_MEMORY_DMABUF)
+    {
+        struct dma_buf_sync sync = { .flags = flags };
+        ioctl(buffer->dmabuf_fd, DMA_BUF_IOCTL_SYNC, &sync);
+    }
+}
+
+/*******************************************************************************
+ *
+ * Function:    camera_buffer_free()
+ *
+ * Description: Frees a buffer and gives back its memory.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void camera_buffer_free(buffer_t *buffer)
+{
+    if (buffer->memory == V4L2_MEMORY_USERPTR)
+    {
+        arena_unref(buffer->arena);
+    }
+    else if ((buffer->start != NULL) && (buffer->start != MAP_FAILED))
+    {
+        munmap(buffer->start, buffer->length);
+    }
+
+    if (buffer->dmabuf_fd != -1)
+    {
+        close(buffer->dmabuf_fd);
+    }
+
+    free(buffer->luma_plane);
+    free(buffer);
+}
+
+/*******************************************************************************
+ *
+ * Function:    camera_stream_queue()
+ *
+ * Description: Hands a buffer back to the driver to be filled.
+ *
+ * Notes:       The buffer must not be held, or buffer_mutex must be held.
  *
  * Returns:     On success, returns 0. Otherwise, returns -1.
- * 
+ *
  ******************************************************************************/
-int camera_capture_frame(const char *save_dir)
+static int camera_stream_queue(camera_stream_t *stream, uint32_t index)
 {
+    buffer_t          *queued = stream->buffers[index];
     struct v4l2_buffer buffer;
     memset(&buffer, 0, sizeof(buffer));
     buffer.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    buffer.memory = V4L2_MEMORY_MMAP;
-    buffer.index  = 0;
+    buffer.memory = queued->memory;
+    buffer.index  = index;
 
-    // Activate streaming
-    int type = buffer.type;
-    if (ioctl(fd, VIDIOC_STREAMON, &type) < 0)
+    if (queued->memory == V4L2_MEMORY_USERPTR)
     {
-        DEBUG_LOG(stdout, "%s: failed VIDIOC_STREAMON\n" __FILE__);
-        return -1;
+        buffer.m.userptr = (unsigned long)queued->start;
+        buffer.length    = (uint32_t)queued->length;
+    }
+    else if (queued->memory == V4L2_MEMORY_DMABUF)
+    {
+        buffer.m.fd   = queued->dmabuf_fd;
+        buffer.length = (uint32_t)queued->length;
+        camera_buffer_sync(queued, DMA_BUF_SYNC_END | DMA_BUF_SYNC_RW);
     }
 
-    // Put the buffer in the incoming queue.
-    if (ioctl(fd, VIDIOC_QBUF, &buffer) < 0)
+    if (ioctl(stream->fd, VIDIOC_QBUF, &buffer) < 0)
     {
-        DEBUG_LOG(stdout, "%s: failed VIDIOC_QBUF\n" __FILE__);
+        LOG_ERROR("failed VIDIOC_QBUF");
         return -1;
     }
-    
-    // The buffer's waiting in the outgoing queue.
-    if (ioctl(fd, VIDIOC_DQBUF, &buffer) < 0)
+
+    queued->queued = 1;
+    return 0;
+}
+
+/*******************************************************************************
+ *
+ * Function:    camera_buffer_put()
+ *
+ * Description: Drops one use of a buffer's frame. Once nobody uses it, the
+ *              buffer goes back to the driver, or is freed if its stream has
+ *              let go of it.
+ *
+ * Notes:       Must be called with buffer_mutex held.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void camera_buffer_put(buffer_t *buffer)
+{
+    if (--buffer->refs > 0)
     {
-        DEBUG_LOG(stdout, "%s: failed VIDIOC_DQBUF\n" __FILE__);
-        return -1;
+        return;
     }
 
-    // Deactivate streaming
-    if (ioctl(fd, VIDIOC_STREAMOFF, &type) < 0)
+    if (buffer->stream == NULL)
     {
-        DEBUG_LOG(stdout, "%s: failed VIDIOC_STREAMOFF\n" __FILE__);
-        return -1;
+        camera_buffer_free(buffer);
+    }
+    else if (buffer->stream->streaming && !buffer->queued)
+    {
+        camera_stream_queue(buffer->stream, buffer->index);
     }
+}
 
-    // Write captured frame to file.
-    int pgmfile;
-    char header[64];
-    char filename[64];
-    sprintf(header, "%s\n%u %u\n255\n", "P5", format.fmt.pix.width, format.fmt.pix.height);
-    sprintf(filename, "%s/%lu.pgm", save_dir, (unsigned long)time(NULL));
+/*******************************************************************************
+ *
+ * Function:    camera_stream_set_reference()
+ *
+ * Description: Holds a freshly dequeued buffer as the one the next frame is
+ *              compared to, and lets go of the previous one.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void camera_stream_set_reference(camera_stream_t *stream, int index,
+                                        const uint8_t *luma, size_t stride)
+{
+    pthread_mutex_lock(&buffer_mutex);
 
-    if ((pgmfile = open(filename, O_WRONLY | O_CREAT, 0660)) < 0)
+    if (stream->reference != -1)
     {
-        DEBUG_LOG(stdout, "%s: failed to open image file\n" __FILE__);
-        return -1;
+        camera_buffer_put(stream->buffers[stream->reference]);
     }
+    stream->buffers[index]->refs = 1;
+    stream->reference = index;
+    reference_luma    = luma;
+    reference_stride  = stride;
 
-    write(pgmfile, header, strlen(header));
-    write(pgmfile, buffers[buffer.index].start, buffers[buffer.index].length);
-    close(pgmfile);
-
-    return 0;
+    pthread_mutex_unlock(&buffer_mutex);
 }
 
 /*******************************************************************************
  *
- * Function:    camera_detect_motion()
+ * Function:    camera_stream_dequeue()
  *
- * Description: Detects if there is motion.
+ * Description: Waits for the driver to fill the oldest queued buffer.
+ *
+ * Returns:     On success, returns the index of the filled buffer.
+ *              Otherwise, returns -1.
  *
- * Returns:     If motion is detected, returns 1. Otherwise, returns 0.
- * 
  ******************************************************************************/
-int camera_detect_motion(uint8_t avg_pixel_diff)
+static int camera_stream_dequeue(camera_stream_t *stream)
 {
+    TRACE_SCOPE("VIDIOC_DQBUF");
+
     struct v4l2_buffer buffer;
     memset(&buffer, 0, sizeof(buffer));
-    buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    buffer.memory = V4L2_MEMORY_MMAP;
-    buffer.index = 0;
+    buffer.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buffer.memory = stream->memory;
 
-    // Activate streaming
-    int type = buffer.type;
-    if (ioctl(fd, VIDIOC_STREAMON, &type) < 0)
+    uint64_t start_ns = monotonic_time_ns();
+
+    if (ioctl(stream->fd, VIDIOC_DQBUF, &buffer) < 0)
     {
-        DEBUG_LOG(stdout, "%s: failed VIDIOC_STREAMON\n" __FILE__);
+        LOG_ERROR("failed VIDIOC_DQBUF");
         return -1;
     }
 
-    for (size_t index = 0; index < bufrequest.count; ++index)
+    metrics_observe(dequeue_metric, monotonic_time_ns() - start_ns);
+    stream->buffers[buffer.index]->queued = 0;
+    camera_buffer_sync(stream->buffers[buffer.index], DMA_BUF_SYNC_START | DMA_BUF_SYNC_RW);
+    camera_stream_filled(stream, &buffer);
+
+    return (int)buffer.index;
+}
+
+/*******************************************************************************
+ *
+ * Function:    camera_stream_dequeue_latest()
+ *
+ * Description: Waits for a filled buffer and then keeps dequeuing for as long
+ *              as more are already waiting, requeuing all but the newest. This
+ *              discards frames that went stale while nobody was reading.
+ *
+ * Returns:     On success, returns the index of the newest filled buffer.
+ *              Otherwise, returns -1.
+ *
+ ******************************************************************************/
+static int camera_stream_dequeue_latest(camera_stream_t *stream)
+{
+    int index = camera_stream_dequeue(stream);
+    struct pollfd pfd = { .fd = stream->fd, .events = POLLIN };
+
+    while ((index != -1) && (poll(&pfd, 1, 0) == 1) && (pfd.revents & POLLIN))
     {
-        buffer.index = index;
-        // Put the buffer in the incoming queue.
-        if (ioctl(fd, VIDIOC_QBUF, &buffer) < 0)
+        int newer = camera_stream_dequeue(stream);
+
+        if (newer == -1)
         {
-            DEBUG_LOG(stdout, "%s: failed VIDIOC_QBUF\n" __FILE__);
-            return -1;
+            break;
         }
-        
-        // The buffer's waiting in the outgoing queue.
-        if (ioctl(fd, VIDIOC_DQBUF, &buffer) < 0)
+
+        camera_stream_queue(stream, (uint32_t)index);
+        index = newer;
+    }
+
+    return index;
+}
+
+/*******************************************************************************
+ *
+ * Function:    camera_stream_start()
+ *
+ * Description: Queues every buffer nobody holds and activates streaming, so
+ *              that frames keep arriving between calls instead of being
+ *              captured on demand. Held buffers follow once released.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+static int camera_stream_start(camera_stream_t *stream)
+{
+    pthread_mutex_lock(&buffer_mutex);
+
+    for (uint32_t index = 0; index < stream->bufrequest.count; ++index)
+    {
+        buffer_t *buffer = stream->buffers[index];
+
+        if ((buffer->refs == 0) && !buffer->queued &&
+            (camera_stream_queue(stream, index) == -1))
         {
-            DEBUG_LOG(stdout, "%s: failed VIDIOC_DQBUF\n" __FILE__);
+            pthread_mutex_unlock(&buffer_mutex);
             return -1;
         }
     }
 
-    // Deactivate streaming
-    if (ioctl(fd, VIDIOC_STREAMOFF, &type) < 0)
+    int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (ioctl(stream->fd, VIDIOC_STREAMON, &type) < 0)
     {
-        DEBUG_LOG(stdout, "%s: failed VIDIOC_STREAMOFF\n" __FILE__);
+        LOG_ERROR("failed VIDIOC_STREAMON");
+        pthread_mutex_unlock(&buffer_mutex);
         return -1;
     }
 
-    uint8_t *first  = (uint8_t*)buffers[(CAMERA_NUM_BUFFERS - 1) / 2].start;
-    uint8_t *second = (uint8_t*)buffers[CAMERA_NUM_BUFFERS - 1].start;
-    int sum_diff = 0;
-    int diff = 0;
+    stream->streaming = 1;
+    stream->reference = -1;
+
+    pthread_mutex_unlock(&buffer_mutex);
+    return 0;
+}
+
+/*******************************************************************************
+ *
+ * Function:    camera_stream_stop()
+ *
+ * Description: Deactivates streaming, which also returns every buffer from
+ *              the driver, and lets go of the detector's reference frame.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+static int camera_stream_stop(camera_stream_t *stream)
+{
+    int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    int ret  = 0;
+
+    pthread_mutex_lock(&buffer_mutex);
+
+    stream->streaming = 0;
+    if (stream->reference != -1)
+    {
+        camera_buffer_put(stream->buffers[stream->reference]);
+        stream->reference = -1;
+    }
+
+    if (ioctl(stream->fd, VIDIOC_STREAMOFF, &type) < 0)
+    {
+        LOG_ERROR("failed VIDIOC_STREAMOFF");
+        ret = -1;
+    }
+
+    for (uint32_t index = 0; index < stream->bufrequest.count; ++index)
+    {
+        stream->buffers[index]->queued = 0;
+    }
+
+    pthread_mutex_unlock(&buffer_mutex);
+    return ret;
+}
+
+/*******************************************************************************
+ *
+ * Function:    camera_stream_release()
+ *
+ * Description: Frees the buffers of a stream so that its format can be
+ *              changed. Buffers whose frames are still held are left for
+ *              camera_release_frame() to free.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void camera_stream_release(camera_stream_t *stream)
+{
+    if (stream->streaming)
+    {
+        camera_stream_stop(stream);
+    }
+
+    pthread_mutex_lock(&buffer_mutex);
+
+    for (uint32_t index = 0; index < CAMERA_NUM_BUFFERS; ++index)
+    {
+        buffer_t *buffer = stream->buffers[index];
+
+        if (buffer == NULL)
+        {
+            continue;
+        }
+
+        stream->buffers[index] = NULL;
+        buffer->stream = NULL;
+        if (buffer->refs == 0)
+        {
+            camera_buffer_free(buffer);
+        }
+    }
+
+    pthread_mutex_unlock(&buffer_mutex);
+
+    // Requesting zero buffers releases the ones held by the driver. Mapped
+    // buffers that are still held are orphaned and stay valid until unmapped.
+    stream->bufrequest.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    stream->bufrequest.memory = stream->memory;
+    stream->bufrequest.count = 0;
+    ioctl(stream->fd, VIDIOC_REQBUFS, &stream->bufrequest);
+}
+
+/*******************************************************************************
+ *
+ * Function:    camera_request_buffers()
+ *
+ * Description: Tells the driver how many buffers of which memory type will be
+ *              used, falling back from DMABUF to USERPTR to MMAP for drivers
+ *              that don't support the chosen one.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+static int camera_request_buffers(camera_stream_t *stream, camera_memory_t memory)
+{
+    static const uint32_t memories[] =
+    {
+        [CAMERA_MEMORY_MMAP]    = V4L2_MEMORY_MMAP,
+        [CAMERA_MEMORY_USERPTR] = V4L2_MEMORY_USERPTR,
+        [CAMERA_MEMORY_DMABUF]  = V4L2_MEMORY_DMABUF,
+    };
+    static const char *const names[] = { "MMAP", "USERPTR", "DMABUF" };
+
+    for (int type = (int)memory; type >= (int)CAMERA_MEMORY_MMAP; --type)
+    {
+        stream->bufrequest.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        stream->bufrequest.memory = memories[type];
+        stream->bufrequest.count = CAMERA_NUM_BUFFERS;
+
+        if (ioctl(stream->fd, VIDIOC_REQBUFS, &stream->bufrequest) == 0)
+        {
+            if (type != (int)capture_memory)
+            {
+                LOG_WARN("camera can't capture into %s buffers, using %s",
+                         names[capture_memory], names[type]);
+            }
+            stream->memory = memories[type];
+            return 0;
+        }
+    }
+
+    LOG_ERROR("failed VIDIOC_REQBUFS.");
+    return -1;
+}
+
+/*******************************************************************************
+ *
+ * Function:    camera_open_dma_heap()
+ *
+ * Description: Opens the DMA heap that DMABUF buffers are allocated from,
+ *              preferring contiguous memory, which devices without an IOMMU
+ *              need.
+ *
+ * Returns:     The heap's file descriptor, or -1 if there is none.
+ *
+ ******************************************************************************/
+static int camera_open_dma_heap(void)
+{
+#ifdef CAMERA_HAVE_DMA_HEAP
+    static const char *const heaps[] = { "/dev/dma_heap/linux,cma", "/dev/dma_heap/system" };
 
-    for (size_t pixel = 0; pixel < buffers[0].length; ++pixel)
+    for (size_t n = 0; n < sizeof(heaps) / sizeof(heaps[0]); ++n)
     {
-        diff = *first - *second;
-        sum_diff += (diff > 0 ? diff : (-1 * diff));
-        ++first;
-        ++second;
+        int fd = open(heaps[n], O_RDWR | O_CLOEXEC);
+
+        if (fd != -1)
+        {
+            return fd;
+        }
     }
+#endif
+
+    return -1;
+}
 
-    return (sum_diff / (format.fmt.pix.width * format.fmt.pix.height)) > avg_pixel_diff;
+/*******************************************************************************
+ *
+ * Function:    camera_buffer_map()
+ *
+ * Description: Gives a buffer its memory: a mapping of the driver's buffer,
+ *              a slot of the arena or a DMABUF allocated from the DMA heap.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+static int camera_buffer_map(camera_stream_t *stream, buffer_t *buffer, arena_t *arena,
+                             int heap_fd)
+{
+    if (buffer->memory == V4L2_MEMORY_USERPTR)
+    {
+        arena_ref(arena);
+        buffer->arena  = arena;
+        buffer->start  = arena_slot(arena, buffer->index);
+        buffer->length = arena_slot_size(arena);
+        return 0;
+    }
+
+    if (buffer->memory == V4L2_MEMORY_DMABUF)
+    {
+#ifdef CAMERA_HAVE_DMA_HEAP
+        struct dma_heap_allocation_data allocation;
+
+        memset(&allocation, 0, sizeof(allocation));
+        allocation.len      = (stream->format.fmt.pix.sizeimage + ARENA_SLOT_ALIGN - 1)
+                            & ~(uint64_t)(ARENA_SLOT_ALIGN - 1);
+        allocation.fd_flags = O_RDWR | O_CLOEXEC;
+
+        if (ioctl(heap_fd, DMA_HEAP_IOCTL_ALLOC, &allocation) < 0)
+        {
+            LOG_ERROR("failed to allocate a DMABUF.");
+            return -1;
+        }
+
+        buffer->dmabuf_fd = (int)allocation.fd;
+        buffer->length    = (size_t)allocation.len;
+        buffer->start     = mmap(NULL, buffer->length, PROT_READ | PROT_WRITE, MAP_SHARED,
+                                 buffer->dmabuf_fd, 0);
+        if (buffer->start == MAP_FAILED)
+        {
+            LOG_ERROR("failed to map a DMABUF.");
+            return -1;
+        }
+        return 0;
+#else
+        (void)heap_fd;
+        return -1;
+#endif
+    }
+
+    // Allocate buffers.
+    struct v4l2_buffer query;
+    memset(&query, 0, sizeof(query));
+    query.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    query.memory = V4L2_MEMORY_MMAP;
+    query.index = buffer->index;
+
+    if (ioctl(stream->fd, VIDIOC_QUERYBUF, &query) < 0)
+    {
+        LOG_ERROR("failed to allocate buffers.");
+        return -1;
+    }
+
+    buffer->length = query.length;
+
+    // Map the memory.
+    buffer->start = mmap (
+        NULL,
+        query.length,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED,
+        stream->fd,
+        query.m.offset
+    );
+
+    if(buffer->start == MAP_FAILED){
+        LOG_ERROR("failed to map memory with mmap.");
+        return -1;
+    }
+
+    memset(buffer->start, 0, buffer->length);
+    return 0;
+}
+
+/*******************************************************************************
+ *
+ * Function:    camera_stream_configure()
+ *
+ * Description: Sets the format of a stream and sets up its capture buffers.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1 with no buffers
+ *              left allocated.
+ *
+ ******************************************************************************/
+static int camera_stream_configure(camera_stream_t *stream, uint32_t width, uint32_t height)
+{
+    camera_memory_t memory  = capture_memory;
+    arena_t        *arena   = NULL;
+    int             heap_fd = -1;
+    int             ret     = 0;
+
+    // Pick a video format we can read luma from.
+    if (camera_negotiate_format(stream, width, height) == -1)
+    {
+        return -1;
+    }
+
+    // Without a DMA heap there is nothing to import.
+    if ((memory == CAMERA_MEMORY_DMABUF) && ((heap_fd = camera_open_dma_heap()) == -1))
+    {
+        memory = CAMERA_MEMORY_USERPTR;
+    }
+
+    // Inform the device about future buffers.
+    if (camera_request_buffers(stream, memory) == -1)
+    {
+        ret = -1;
+    }
+
+    if (stream->bufrequest.count > CAMERA_NUM_BUFFERS)
+    {
+        stream->bufrequest.count = CAMERA_NUM_BUFFERS;
+    }
+
+    if ((ret == 0) && (stream->memory == V4L2_MEMORY_USERPTR) &&
+        ((arena = arena_create(stream->format.fmt.pix.sizeimage,
+                               stream->bufrequest.count)) == NULL))
+    {
+        LOG_ERROR("failed to allocate the capture arena.");
+        ret = -1;
+    }
+
+    for (uint32_t index = 0; (ret == 0) && (index < stream->bufrequest.count); ++index)
+    {
+        buffer_t *buffer = calloc(1, sizeof(*buffer));
+
+        if (buffer == NULL)
+        {
+            ret = -1;
+            break;
+        }
+
+        buffer->index     = index;
+        buffer->memory    = stream->memory;
+        buffer->dmabuf_fd = -1;
+        buffer->stream    = stream;
+        stream->buffers[index] = buffer;
+
+        if (camera_buffer_map(stream, buffer, arena, heap_fd) == -1)
+        {
+            ret = -1;
+            break;
+        }
+
+        // Formats that are not read in place need a plane to hold the luma.
+        if ((stream->format.fmt.pix.pixelformat == V4L2_PIX_FMT_YUYV) ||
+            (stream->format.fmt.pix.pixelformat == V4L2_PIX_FMT_MJPEG))
+        {
+            stream->luma_stride = (stream->format.fmt.pix.width + CAMERA_LUMA_ALIGNMENT - 1)
+                                & ~(size_t)(CAMERA_LUMA_ALIGNMENT - 1);
+
+            if (posix_memalign((void **)&buffer->luma_plane, CAMERA_LUMA_ALIGNMENT,
+                               stream->luma_stride * stream->format.fmt.pix.height) != 0)
+            {
+                LOG_ERROR("failed to allocate luma plane.");
+                ret = -1;
+            }
+        }
+    }
+
+    // From here on the buffers keep the arena alive.
+    arena_unref(arena);
+    if (heap_fd != -1)
+    {
+        close(heap_fd);
+    }
+
+    // Don't leave a buffer count that covers slots never filled in.
+    if (ret == -1)
+    {
+        camera_stream_release(stream);
+    }
+
+    return ret;
+}
+
+/*******************************************************************************
+ *
+ * Function:    camera_stream_grab()
+ *
+ * Description: Queues a buffer nobody holds on a streaming capture node and
+ *              waits for the driver to fill it.
+ *
+ * Returns:     On success, returns the index of the filled buffer.
+ *              Otherwise, returns -1.
+ *
+ ******************************************************************************/
+static int camera_stream_grab(camera_stream_t *stream)
+{
+    int index  = -1;
+    int queued = 0;
+
+    pthread_mutex_lock(&buffer_mutex);
+
+    for (uint32_t n = 0; (n < stream->bufrequest.count) && (index == -1); ++n)
+    {
+        if (stream->buffers[n]->refs == 0)
+        {
+            index = (int)n;
+        }
+    }
+
+    // Put the buffer in the incoming queue.
+    queued = (index != -1) && (camera_stream_queue(stream, (uint32_t)index) == 0);
+
+    pthread_mutex_unlock(&buffer_mutex);
+
+    if (!queued)
+    {
+        return -1;
+    }
+
+    // The buffer's waiting in the outgoing queue.
+    return camera_stream_dequeue(stream);
+}
+
+/*******************************************************************************
+ *
+ * Function:    camera_stream_set_streaming()
+ *
+ * Description: Activates or deactivates streaming on a capture node.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+static int camera_stream_set_streaming(camera_stream_t *stream, int on)
+{
+    int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    if (ioctl(stream->fd, on ? VIDIOC_STREAMON : VIDIOC_STREAMOFF, &type) < 0)
+    {
+        LOG_ERROR("failed %s",
+                  on ? "VIDIOC_STREAMON" : "VIDIOC_STREAMOFF");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*******************************************************************************
+ *
+ * Function:    camera_luma()
+ *
+ * Description: Locates the luma plane of a dequeued buffer. GREY and NV12
+ *              buffers are used in place; other formats are converted into
+ *              an aligned plane owned by the stream.
+ *
+ * Returns:     On success, returns a pointer to the first luma sample and
+ *              stores the row stride in stride. Otherwise, returns NULL.
+ *
+ ******************************************************************************/
+static uint8_t *camera_luma(camera_stream_t *stream, uint32_t index, size_t *stride)
+{
+    uint32_t width  = stream->format.fmt.pix.width;
+    uint32_t height = stream->format.fmt.pix.height;
+
+    switch (stream->format.fmt.pix.pixelformat)
+    {
+        case V4L2_PIX_FMT_GREY:
+        case V4L2_PIX_FMT_NV12:
+            *stride = stream->bytesperline;
+            return (uint8_t *)stream->buffers[index]->start;
+
+        case V4L2_PIX_FMT_YUYV:
+            pixfmt_yuyv_to_luma(stream->buffers[index]->luma_plane, stream->luma_stride,
+                                (const uint8_t *)stream->buffers[index]->start,
+                                stream->bytesperline, width, height);
+            *stride = stream->luma_stride;
+            return stream->buffers[index]->luma_plane;
+
+        case V4L2_PIX_FMT_MJPEG:
+            if (pixfmt_mjpeg_to_luma(stream->buffers[index]->luma_plane, stream->luma_stride,
+                                     (const uint8_t *)stream->buffers[index]->start,
+                                     stream->buffers[index]->bytesused, width, height) == -1)
+            {
+                LOG_ERROR("failed to decode MJPEG frame");
+                return NULL;
+            }
+            *stride = stream->luma_stride;
+            return stream->buffers[index]->luma_plane;
+
+        default:
+            return NULL;
+    }
+}
+
+/*******************************************************************************
+ *
+ * Function:    camera_realtime_ns()
+ *
+ * Description: Converts the capture time of a filled buffer to the wall
+ *              clock, which is what stored stills are indexed by.
+ *
+ * Returns:     The capture time on CLOCK_REALTIME in nanoseconds.
+ *
+ ******************************************************************************/
+static uint64_t camera_realtime_ns(camera_stream_t *stream, uint32_t index)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t realtime_ns = (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+    uint64_t age_ns      = monotonic_time_ns() - stream->buffers[index]->timestamp_ns;
+
+    return realtime_ns - age_ns;
+}
+
+/*******************************************************************************
+ *
+ * Function:    camera_still_filename()
+ *
+ * Description: Names the file of a still after its capture time, to the
+ *              millisecond, so stills taken within a second don't collide.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+static int camera_still_filename(camera_stream_t *stream, uint32_t index, const char *save_dir,
+                                 char *filename, size_t size)
+{
+    uint64_t realtime_ns = camera_realtime_ns(stream, index);
+    int      length      = snprintf(filename, size, "%s/%llu.%03u.jpg", save_dir,
+                                    (unsigned long long)(realtime_ns / 1000000000ull),
+                                    (unsigned)(realtime_ns / 1000000ull % 1000));
+
+    return ((length < 0) || ((size_t)length >= size)) ? -1 : 0;
+}
+
+/*******************************************************************************
+ *
+ * Function:    camera_still_repeats()
+ *
+ * Description: Decides whether a still can be stored as a repeat of the last
+ *              one stored in full. The detector's scores between consecutive
+ *              frames add up to a bound on how much the scene has changed
+ *              since then, so the still itself is never looked at.
+ *
+ * Returns:     1 if the still is a near-duplicate, 0 otherwise.
+ *
+ ******************************************************************************/
+static int camera_still_repeats(camera_stream_t *stream)
+{
+    return (still_dedup.threshold > 0) && (still_last_stream == stream) &&
+           (still_last_width == stream->format.fmt.pix.width) &&
+           (still_last_height == stream->format.fmt.pix.height) &&
+           (still_drift_frames > 0) && (still_drift < still_dedup.threshold) &&
+           (still_repeats + 1 < still_dedup.keyframe_interval);
+}
+
+/*******************************************************************************
+ *
+ * Function:    camera_still_stored()
+ *
+ * Description: Makes a still just stored in full the one later stills are
+ *              compared to.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void camera_still_stored(camera_stream_t *stream)
+{
+    still_last_stream  = stream;
+    still_last_width   = stream->format.fmt.pix.width;
+    still_last_height  = stream->format.fmt.pix.height;
+    still_drift        = 0;
+    still_drift_frames = 0;
+    still_repeats      = 0;
+}
+
+/*******************************************************************************
+ *
+ * Function:    camera_write_repeat()
+ *
+ * Description: Stores a near-duplicate still as a reference to the last one
+ *              stored in full: an index entry in the segment store, or a
+ *              symbolic link to the last file otherwise.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+static int camera_write_repeat(camera_stream_t *stream, uint32_t index, const char *save_dir)
+{
+    char filename[CAMERA_FILENAME_SIZE];
+
+    if (store_is_open())
+    {
+        if (store_append_repeat(camera_realtime_ns(stream, index)) == -1)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        if ((camera_still_filename(stream, index, save_dir, filename, sizeof(filename)) == -1) ||
+            (symlink(still_last_file, filename) == -1))
+        {
+            return -1;
+        }
+    }
+
+    still_repeats += 1;
+    metrics_add(still_repeats_metric, 1);
+    LOG_DEBUG("still repeats the last one, %llu/256 grey apart",
+              (unsigned long long)still_drift);
+
+    return 0;
+}
+
+/*******************************************************************************
+ *
+ * Function:    camera_encode_still()
+ *
+ * Description: Compresses the luma of a filled buffer as a grey-scale JPEG
+ *              into still_jpeg, which is allocated for the worst case of the
+ *              still size the first time and whenever that size grows.
+ *
+ * Returns:     On success, returns the length of the JPEG. Otherwise, returns
+ *              -1.
+ *
+ ******************************************************************************/
+static ssize_t camera_encode_still(camera_stream_t *stream, const uint8_t *luma, size_t stride)
+{
+    TRACE_SCOPE("encode JPEG");
+
+    uint32_t width  = stream->format.fmt.pix.width;
+    uint32_t height = stream->format.fmt.pix.height;
+    size_t   size   = jpeg_max_size(width, height);
+
+    if (size > still_jpeg_size)
+    {
+        uint8_t *jpeg = realloc(still_jpeg, size);
+
+        if (jpeg == NULL)
+        {
+            return -1;
+        }
+        still_jpeg      = jpeg;
+        still_jpeg_size = size;
+    }
+
+    uint64_t start_ns = monotonic_time_ns();
+    ssize_t  length   = jpeg_encode(luma, stride, width, height, CAMERA_STILL_QUALITY,
+                                    still_jpeg, still_jpeg_size);
+
+    metrics_observe(encode_metric, monotonic_time_ns() - start_ns);
+
+    return length;
+}
+
+/*******************************************************************************
+ *
+ * Function:    camera_write_still()
+ *
+ * Description: Saves the luma of a filled buffer as a grey-scale JPEG image,
+ *              to the segment store if it is open and to a file otherwise.
+ *              Frames in the store are indexed by their capture time on the
+ *              wall clock.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+static int camera_write_still(camera_stream_t *stream, uint32_t index, const char *save_dir)
+{
+    TRACE_SCOPE("write still");
+
+    const uint8_t *luma;
+    size_t         stride;
+    ssize_t        length;
+
+    // A near-duplicate is stored without touching its pixels.
+    if (camera_still_repeats(stream) && (camera_write_repeat(stream, index, save_dir) == 0))
+    {
+        return 0;
+    }
+
+    if ((luma = camera_luma(stream, index, &stride)) == NULL)
+    {
+        return -1;
+    }
+
+    still_last_stream = NULL;
+
+    if ((length = camera_encode_still(stream, luma, stride)) == -1)
+    {
+        LOG_ERROR("failed to encode still");
+        return -1;
+    }
+
+    if (store_is_open())
+    {
+        struct iovec iov = { .iov_base = still_jpeg, .iov_len = (size_t)length };
+
+        if (store_append(camera_realtime_ns(stream, index), &iov, 1) == -1)
+        {
+            return -1;
+        }
+        metrics_add(bytes_written_metric, (uint64_t)length);
+        camera_still_stored(stream);
+        return 0;
+    }
+
+    // Write captured frame to file.
+    int  jpegfile;
+    char filename[CAMERA_FILENAME_SIZE];
+
+    if (camera_still_filename(stream, index, save_dir, filename, sizeof(filename)) == -1)
+    {
+        LOG_ERROR("image file name too long");
+        return -1;
+    }
+
+    if ((jpegfile = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0660)) < 0)
+    {
+        LOG_ERROR("failed to open image file");
+        return -1;
+    }
+
+    ssize_t written = write(jpegfile, still_jpeg, (size_t)length);
+    close(jpegfile);
+
+    metrics_add(bytes_written_metric, (written > 0) ? (uint64_t)written : 0);
+    if (written != length)
+    {
+        LOG_ERROR("failed to write image file");
+        return -1;
+    }
+
+    // Repeats link to the file by its name within the directory.
+    strcpy(still_last_file, strrchr(filename, '/') + 1);
+    camera_still_stored(stream);
+
+    return 0;
+}
+
+/*******************************************************************************
+ *
+ * Function:    camera_init()
+ *
+ * Description: Initialize the camera to capture grey-scale images.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+int camera_init(const char *device, uint32_t width, uint32_t height)
+{
+    dequeue_metric = metrics_histogram("sitemon_frame_dequeue_seconds", NULL,
+        "Time spent waiting in VIDIOC_DQBUF for a frame.");
+    detection_metric = metrics_histogram("sitemon_detection_seconds", NULL,
+        "Time spent scoring one frame pair for motion.");
+    search_metric = metrics_histogram("sitemon_motion_search_seconds", NULL,
+        "Time spent finding motion vectors in one frame pair.");
+    bytes_written_metric = metrics_counter("sitemon_bytes_written_total", NULL,
+        "Bytes of evidence stills written to disk.");
+    still_repeats_metric = metrics_counter("sitemon_still_repeats_total", NULL,
+        "Evidence stills stored as a reference to the previous one.");
+    encode_metric = metrics_histogram("sitemon_still_encode_seconds", NULL,
+        "Time spent compressing one evidence still as JPEG.");
+
+    if (camera_stream_open(&detect_stream, device) == -1)
+    {
+        return -1;
+    }
+
+    if (camera_stream_configure(&detect_stream, width, height) == -1)
+    {
+        return -1;
+    }
+
+    if (motion_init(detect_stream.format.fmt.pix.width,
+                    detect_stream.format.fmt.pix.height) == -1)
+    {
+        return -1;
+    }
+
+    detect_width  = width;
+    detect_height = height;
+    detect_stream.reference = -1;
+    still_stream.reference  = -1;
+
+    return 0;
+}
+
+/*******************************************************************************
+ *
+ * Function:    camera_init_stills()
+ *
+ * Description: Configures how evidence stills are captured.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+int camera_init_stills(const char *device, uint32_t width, uint32_t height)
+{
+    still_width  = width;
+    still_height = height;
+    memset(&still_stats, 0, sizeof(still_stats));
+
+    if (device == NULL)
+    {
+        // Stills are taken by reconfiguring the detection node on demand.
+        still_mode = CAMERA_STILL_SWITCH_FORMAT;
+        return 0;
+    }
+
+    if ((camera_stream_open(&still_stream, device) == -1) ||
+        (camera_stream_configure(&still_stream, width, height) == -1))
+    {
+        still_mode = CAMERA_STILL_SAME_STREAM;
+        return -1;
+    }
+
+    still_mode = CAMERA_STILL_SECOND_NODE;
+    return 0;
+}
+
+/*******************************************************************************
+ *
+ * Function:    camera_restore_detection()
+ *
+ * Description: Reconfigures the detection node at the detection resolution
+ *              and starts it, whatever state a resolution switch left it in.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+static int camera_restore_detection(void)
+{
+    camera_stream_release(&detect_stream);
+    if ((camera_stream_configure(&detect_stream, detect_width, detect_height) == -1) ||
+        (camera_stream_start(&detect_stream) == -1))
+    {
+        LOG_ERROR("failed to restore detection at %ux%u", detect_width, detect_height);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*******************************************************************************
+ *
+ * Function:    camera_begin_stills()
+ *
+ * Description: Prepares the camera to capture a burst of evidence stills.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+int camera_begin_stills(void)
+{
+    TRACE_SCOPE("begin stills");
+
+    if (stills_active)
+    {
+        return 0;
+    }
+
+    stills_begin_ns = monotonic_time_ns();
+
+    switch (still_mode)
+    {
+        case CAMERA_STILL_SWITCH_FORMAT:
+            camera_stream_release(&detect_stream);
+            if (camera_stream_configure(&detect_stream, still_width, still_height) == -1)
+            {
+                // No stills this time, but detection must carry on.
+                LOG_ERROR("failed to switch to %ux%u for stills", still_width, still_height);
+                camera_restore_detection();
+                return -1;
+            }
+            // fall through
+        case CAMERA_STILL_SECOND_NODE:
+            stills_first_pending = 1;
+            break;
+
+        case CAMERA_STILL_SAME_STREAM:
+        default:
+            break;
+    }
+
+    stills_active = 1;
+    return 0;
+}
+
+/*******************************************************************************
+ *
+ * Function:    camera_end_stills()
+ *
+ * Description: Returns the camera to low-resolution motion detection.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+int camera_end_stills(void)
+{
+    TRACE_SCOPE("end stills");
+
+    if (!stills_active)
+    {
+        return 0;
+    }
+
+    stills_active = 0;
+
+    if (still_mode != CAMERA_STILL_SWITCH_FORMAT)
+    {
+        return 0;
+    }
+
+    // The switch back only counts as done once the detection resolution is
+    // producing frames again.
+    uint64_t start_ns = monotonic_time_ns();
+
+    // A node left half configured detects nothing, so a failed switch is
+    // tried once more from scratch.
+    if ((camera_restore_detection() == -1) && (camera_restore_detection() == -1))
+    {
+        return -1;
+    }
+
+    int index = camera_stream_dequeue(&detect_stream);
+
+    if ((index == -1) || (camera_stream_queue(&detect_stream, (uint32_t)index) == -1))
+    {
+        return -1;
+    }
+
+    camera_record_latency(&still_stats.leave, monotonic_time_ns() - start_ns);
+    LOG_DEBUG("switched back to %ux%u in %llu us",
+              detect_width, detect_height,
+              (unsigned long long)(still_stats.leave.last_ns / 1000));
+
+    return 0;
+}
+
+/*******************************************************************************
+ *
+ * Function:    camera_get_still_stats()
+ *
+ * Description: Returns the resolution switch latencies measured so far.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+void camera_get_still_stats(camera_still_stats_t *stats)
+{
+    *stats = still_stats;
+    stats->mode = still_mode;
+}
+
+/*******************************************************************************
+ *
+ * Function:    camera_capture_frame()
+ *
+ * Description: Captures a fram and saves it to disk as a grey-scale JPEG file.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+int camera_capture_frame(const char *save_dir)
+{
+    TRACE_SCOPE("capture still");
+
+    camera_stream_t *stream = ((still_mode == CAMERA_STILL_SECOND_NODE) && stills_active)
+                            ? &still_stream
+                            : &detect_stream;
+
+    int index;
+
+    if (stream->streaming)
+    {
+        // Take the newest frame of a running stream and hand it back after
+        // it has been written.
+        if ((index = camera_stream_dequeue_latest(stream)) == -1)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        // Activate streaming
+        if (camera_stream_set_streaming(stream, 1) == -1)
+        {
+            return -1;
+        }
+
+        index = camera_stream_grab(stream);
+
+        // Deactivate streaming
+        if ((camera_stream_set_streaming(stream, 0) == -1) || (index == -1))
+        {
+            return -1;
+        }
+    }
+
+    if (stills_active && stills_first_pending)
+    {
+        stills_first_pending = 0;
+        camera_record_latency(&still_stats.enter, monotonic_time_ns() - stills_begin_ns);
+        LOG_DEBUG("first %ux%u still after %llu us",
+                  stream->format.fmt.pix.width, stream->format.fmt.pix.height,
+                  (unsigned long long)(still_stats.enter.last_ns / 1000));
+    }
+
+    int ret = camera_write_still(stream, (uint32_t)index, save_dir);
+
+    if (stream->streaming)
+    {
+        camera_stream_queue(stream, (uint32_t)index);
+    }
+
+    return ret;
+}
+
+/*******************************************************************************
+ *
+ * Function:    camera_set_frame_rate()
+ *
+ * Description: Changes the frame rate of the detection stream.
+ *
+ * Returns:     On success, returns the frame rate granted by the driver.
+ *              Otherwise, returns -1.
+ *
+ ******************************************************************************/
+int camera_set_frame_rate(uint32_t fps)
+{
+    TRACE_SCOPE("set frame rate");
+
+    camera_stream_t    *stream = &detect_stream;
+    struct v4l2_streamparm parm;
+
+    memset(&parm, 0, sizeof(parm));
+    parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    if (ioctl(stream->fd, VIDIOC_G_PARM, &parm) < 0)
+    {
+        LOG_ERROR("failed VIDIOC_G_PARM");
+        return -1;
+    }
+
+    if (!(parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME))
+    {
+        LOG_ERROR("camera does not support setting the frame rate");
+        return -1;
+    }
+
+    parm.parm.capture.timeperframe.numerator   = 1;
+    parm.parm.capture.timeperframe.denominator = fps;
+
+    if (ioctl(stream->fd, VIDIOC_S_PARM, &parm) < 0)
+    {
+        // Some drivers refuse to change the frame interval while streaming.
+        if ((errno != EBUSY) || !stream->streaming)
+        {
+            LOG_ERROR("failed VIDIOC_S_PARM");
+            return -1;
+        }
+
+        camera_stream_stop(stream);
+        int failed = (ioctl(stream->fd, VIDIOC_S_PARM, &parm) < 0);
+
+        if ((camera_stream_start(stream) == -1) || failed)
+        {
+            LOG_ERROR("failed VIDIOC_S_PARM");
+            return -1;
+        }
+    }
+
+    if (parm.parm.capture.timeperframe.numerator == 0)
+    {
+        return -1;
+    }
+
+    return (int)(parm.parm.capture.timeperframe.denominator /
+                 parm.parm.capture.timeperframe.numerator);
+}
+
+/*******************************************************************************
+ *
+ * Function:    camera_skip_frame()
+ *
+ * Description: Waits for the next frame of the detection stream and hands it
+ *              straight back to the driver without looking at it.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+int camera_skip_frame(void)
+{
+    camera_stream_t *stream = &detect_stream;
+
+    if (stills_active && (still_mode == CAMERA_STILL_SWITCH_FORMAT))
+    {
+        return -1;
+    }
+
+    if (!stream->streaming && (camera_stream_start(stream) == -1))
+    {
+        return -1;
+    }
+
+    int index = camera_stream_dequeue(stream);
+
+    if (index == -1)
+    {
+        return -1;
+    }
+
+    return camera_stream_queue(stream, (uint32_t)index);
+}
+
+/*******************************************************************************
+ *
+ * Function:    camera_detect_motion()
+ *
+ * Description: Detects if there is motion between the newest frame and the
+ *              frame analyzed by the previous call. The newest frame is held
+ *              back from the driver to be the reference for the next call.
+ *              Scoring compensates for global lighting changes, see
+ *              motion_analyze(). Noisy frames are filtered first, see
+ *              denoise_frame(). Frames with motion are also searched for
+ *              motion vectors, see camera_set_motion_search().
+ *
+ * Returns:     If motion is detected, returns 1. Otherwise, returns 0.
+ *              Returns -1 on error.
+ *
+ ******************************************************************************/
+int camera_detect_motion(uint8_t avg_pixel_diff, motion_result_t *result)
+{
+    TRACE_SCOPE("detect motion");
+
+    camera_stream_t *stream = &detect_stream;
+    motion_result_t  motion;
+
+    memset(&motion, 0, sizeof(motion));
+    if (result != NULL)
+    {
+        *result = motion;
+    }
+
+    // The detection node is busy at still resolution.
+    if (stills_active && (still_mode == CAMERA_STILL_SWITCH_FORMAT))
+    {
+        return -1;
+    }
+
+    // A failed resolution switch may have left the node without buffers.
+    if (!stream->streaming && (camera_stream_start(stream) == -1) &&
+        (camera_restore_detection() == -1))
+    {
+        return -1;
+    }
+
+    int      index;
+    uint8_t *luma;
+    size_t   stride;
+
+    if ((index = camera_stream_dequeue_latest(stream)) == -1)
+    {
+        return -1;
+    }
+
+    if ((luma = camera_luma(stream, (uint32_t)index, &stride)) == NULL)
+    {
+        camera_stream_queue(stream, (uint32_t)index);
+        return -1;
+    }
+
+    motion.timestamp_ns = stream->buffers[index]->timestamp_ns;
+    motion.sequence     = stream->buffers[index]->sequence;
+
+    // Scores only bound the change since the last still if none is missing.
+    if (stream->reference == -1)
+    {
+        still_last_stream = NULL;
+    }
+
+    // The first frame after (re)starting the stream has nothing to compare to,
+    // unless a reference was restored from before a restart.
+    if ((stream->reference == -1) && (warm_luma != NULL))
+    {
+        reference_luma   = warm_luma;
+        reference_stride = warm_stride;
+    }
+    else if (stream->reference == -1)
+    {
+        camera_stream_set_reference(stream, index, luma, stride);
+        if (result != NULL)
+        {
+            *result = motion;
+        }
+        return 0;
+    }
+
+    // Filtering against the reference, itself filtered when it was analyzed,
+    // makes the filter recursive without keeping a frame of its own.
+    denoise_frame(luma, stride, reference_luma, reference_stride,
+                  stream->format.fmt.pix.width, stream->format.fmt.pix.height);
+
+    uint64_t start_ns = monotonic_time_ns();
+    int      ret      = motion_analyze(reference_luma, reference_stride, luma, stride, &motion);
+
+    metrics_observe(detection_metric, monotonic_time_ns() - start_ns);
+
+    int detected = (ret == 0) && ((motion.score >> 8) > avg_pixel_diff);
+
+    // Only frames with motion are worth tracking, and it has to be done
+    // before the reference moves on.
+    if (detected && (motion_search.max_blocks > 0))
+    {
+        TRACE_SCOPE("motion search");
+
+        start_ns = monotonic_time_ns();
+        motion_estimate(reference_luma, reference_stride, luma, stride, &motion_search, &motion);
+        metrics_observe(search_metric, monotonic_time_ns() - start_ns);
+    }
+
+    camera_stream_set_reference(stream, index, luma, stride);
+    warm_luma = NULL;
+
+    if (ret == -1)
+    {
+        still_last_stream = NULL;
+        return -1;
+    }
+
+    still_drift        += motion.score;
+    still_drift_frames += 1;
+
+    if (frame_ring != NULL)
+    {
+        frame_ring_meta_t meta;
+
+        memset(&meta, 0, sizeof(meta));
+        meta.timestamp_ns = motion.timestamp_ns;
+        meta.sequence     = motion.sequence;
+        meta.score        = motion.score;
+        meta.raw_score    = motion.raw_score;
+        meta.gain         = motion.gain;
+        meta.offset       = motion.offset;
+        meta.motion       = (uint32_t)detected;
+        frame_ring_publish(frame_ring, luma, stride, &meta);
+    }
+
+    if (result != NULL)
+    {
+        *result = motion;
+    }
+
+    return detected;
+}
+
+/*******************************************************************************
+ *
+ * Function:    camera_publish_frames()
+ *
+ * Description: Starts publishing analyzed detection frames to a shared-memory
+ *              ring for other processes.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+int camera_publish_frames(const char *name, uint32_t slots)
+{
+    frame_ring_destroy(frame_ring);
+    frame_ring = frame_ring_create(name, detect_stream.format.fmt.pix.width,
+                                   detect_stream.format.fmt.pix.height, slots);
+    if (frame_ring == NULL)
+    {
+        LOG_ERROR("failed to create frame ring %s", name);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*******************************************************************************
+ *
+ * Function:    camera_hold_frame()
+ *
+ * Description: Takes a reference to the newest analyzed detection frame, so
+ *              that its buffer isn't handed back to the driver until the
+ *              frame is released.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+int camera_hold_frame(camera_frame_t *frame)
+{
+    camera_stream_t *stream = &detect_stream;
+
+    pthread_mutex_lock(&buffer_mutex);
+
+    if (!stream->streaming || (stream->reference == -1))
+    {
+        pthread_mutex_unlock(&buffer_mutex);
+        return -1;
+    }
+
+    buffer_t *buffer = stream->buffers[stream->reference];
+
+    buffer->refs += 1;
+    frame->luma         = reference_luma;
+    frame->stride       = reference_stride;
+    frame->width        = stream->format.fmt.pix.width;
+    frame->height       = stream->format.fmt.pix.height;
+    frame->timestamp_ns = buffer->timestamp_ns;
+    frame->sequence     = buffer->sequence;
+    frame->handle       = buffer;
+
+    pthread_mutex_unlock(&buffer_mutex);
+    return 0;
+}
+
+/*******************************************************************************
+ *
+ * Function:    camera_release_frame()
+ *
+ * Description: Drops a reference taken by camera_hold_frame().
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+void camera_release_frame(camera_frame_t *frame)
+{
+    if (frame->handle == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&buffer_mutex);
+    camera_buffer_put((buffer_t *)frame->handle);
+    pthread_mutex_unlock(&buffer_mutex);
+
+    frame->handle = NULL;
+}
+
+/*******************************************************************************
+ *
+ * Function:    camera_set_dedup()
+ *
+ * Description: Sets when stills are stored as a repeat of the previous one.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+void camera_set_dedup(const camera_dedup_config_t *config)
+{
+    still_dedup = *config;
+}
+
+/*******************************************************************************
+ *
+ * Function:    camera_set_motion_search()
+ *
+ * Description: Sets which blocks of frames with motion are tracked back to
+ *              the reference frame.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+void camera_set_motion_search(const motion_search_config_t *config)
+{
+    motion_search = *config;
+}
+
+/*******************************************************************************
+ *
+ * Function:    camera_set_memory()
+ *
+ * Description: Chooses what the capture buffers are made of.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+void camera_set_memory(camera_memory_t memory)
+{
+    capture_memory = memory;
+}
+
+/*******************************************************************************
+ *
+ * Function:    camera_reference()
+ *
+ * Description: Gets the newest analyzed detection frame in place.
+ *
+ * Returns:     On success, returns a pointer to its luma plane and stores the
+ *              row stride in stride. Otherwise, returns NULL.
+ *
+ ******************************************************************************/
+const uint8_t *camera_reference(size_t *stride, uint32_t *width, uint32_t *height)
+{
+    if (!detect_stream.streaming || (detect_stream.reference == -1))
+    {
+        return NULL;
+    }
+
+    *stride = reference_stride;
+    *width  = detect_stream.format.fmt.pix.width;
+    *height = detect_stream.format.fmt.pix.height;
+    return reference_luma;
+}
+
+/*******************************************************************************
+ *
+ * Function:    camera_warm_start()
+ *
+ * Description: Sets the frame the first detection is compared to, if it has
+ *              the size of the detection frames.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+int camera_warm_start(const uint8_t *luma, size_t stride, uint32_t width, uint32_t height)
+{
+    if ((width != detect_stream.format.fmt.pix.width) ||
+        (height != detect_stream.format.fmt.pix.height) || (stride < width))
+    {
+        return -1;
+    }
+
+    warm_luma   = luma;
+    warm_stride = stride;
+    return 0;
 }
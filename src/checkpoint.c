@@ -0,0 +1,252 @@
+#include "checkpoint.h"
+#include "camera.h"
+#include "event.h"
+#include "scheduler.h"
+#include "trace.h"
+#include "util.h"
+#include "log.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024 // the Linux limit, not exposed without _XOPEN_SOURCE
+#endif
+
+#define CHECKPOINT_PATH_SIZE 256
+
+// The start of the file. The luma plane follows at header_size, packed with
+// width bytes per row.
+typedef struct checkpoint_header
+{
+    uint32_t          magic;
+    uint32_t          version;
+    uint32_t          header_size;
+    uint32_t          width;
+    uint32_t          height;
+    uint32_t          threshold;
+    int64_t           realtime_offset_ns; // CLOCK_REALTIME - CLOCK_MONOTONIC
+    uint64_t          saved_ns;           // CLOCK_MONOTONIC
+    event_state_t     event;
+    scheduler_state_t scheduler;
+} __attribute__((aligned(64))) checkpoint_header_t;
+
+// Global module variables
+static void  *loaded;      // mapping of the loaded checkpoint
+static size_t loaded_size;
+
+/*******************************************************************************
+ *
+ * Function:    checkpoint_realtime_offset()
+ *
+ * Description: Gets the difference between the wall clock and the monotonic
+ *              clock, which moves timestamps from one boot to another.
+ *
+ * Returns:     CLOCK_REALTIME - CLOCK_MONOTONIC in nanoseconds.
+ *
+ ******************************************************************************/
+static int64_t checkpoint_realtime_offset(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (int64_t)now.tv_sec * 1000000000ll + now.tv_nsec - (int64_t)monotonic_time_ns();
+}
+
+/*******************************************************************************
+ *
+ * Function:    checkpoint_write()
+ *
+ * Description: Writes the header and the rows of the plane with as few
+ *              system calls as IOV_MAX allows.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+static int checkpoint_write(int fd, const checkpoint_header_t *header,
+                            const uint8_t *luma, size_t stride)
+{
+    struct iovec iov[IOV_MAX];
+    uint32_t     row = 0;
+    int          iovcnt = 0;
+
+    iov[iovcnt].iov_base = (void *)header;
+    iov[iovcnt].iov_len  = sizeof(*header);
+    ++iovcnt;
+
+    while ((iovcnt > 0) || (row < header->height))
+    {
+        size_t expected = 0;
+
+        while ((iovcnt < IOV_MAX) && (row < header->height))
+        {
+            iov[iovcnt].iov_base = (void *)(luma + (size_t)row * stride);
+            iov[iovcnt].iov_len  = header->width;
+            ++iovcnt;
+            ++row;
+        }
+        for (int n = 0; n < iovcnt; ++n)
+        {
+            expected += iov[n].iov_len;
+        }
+
+        if (writev(fd, iov, iovcnt) != (ssize_t)expected)
+        {
+            return -1;
+        }
+        iovcnt = 0;
+    }
+
+    return 0;
+}
+
+/*******************************************************************************
+ *
+ * Function:    checkpoint_save()
+ *
+ * Description: Writes the state to a temporary file, syncs it and renames it
+ *              over the previous checkpoint.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+int checkpoint_save(const char *path, uint32_t threshold)
+{
+    TRACE_SCOPE("checkpoint save");
+
+    checkpoint_header_t header;
+    char                tmp_path[CHECKPOINT_PATH_SIZE + 8];
+    const uint8_t      *luma;
+    size_t              stride;
+    int                 fd;
+
+    memset(&header, 0, sizeof(header));
+    if ((luma = camera_reference(&stride, &header.width, &header.height)) == NULL)
+    {
+        return -1;
+    }
+
+    // The first detection is done with the loaded reference.
+    if (loaded != NULL)
+    {
+        munmap(loaded, loaded_size);
+        loaded = NULL;
+    }
+
+    header.magic              = CHECKPOINT_MAGIC;
+    header.version            = CHECKPOINT_VERSION;
+    header.header_size        = sizeof(header);
+    header.threshold          = threshold;
+    header.realtime_offset_ns = checkpoint_realtime_offset();
+    header.saved_ns           = monotonic_time_ns();
+    event_save_state(&header.event);
+    scheduler_save_state(&header.scheduler);
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    if ((fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+    {
+        LOG_ERROR("failed to open %s", tmp_path);
+        return -1;
+    }
+
+    // Synced before the rename, so that a crash never leaves an empty file
+    // behind under the real name.
+    if ((checkpoint_write(fd, &header, luma, stride) == -1) || (fdatasync(fd) == -1))
+    {
+        LOG_ERROR("failed to write %s", tmp_path);
+        close(fd);
+        unlink(tmp_path);
+        return -1;
+    }
+    close(fd);
+
+    return rename(tmp_path, path);
+}
+
+/*******************************************************************************
+ *
+ * Function:    checkpoint_load()
+ *
+ * Description: Maps a checkpoint and hands its parts to the modules they came
+ *              from. Timestamps are moved by the change of the offset between
+ *              the wall clock and the monotonic clock, which is zero after a
+ *              restart and the length of the downtime after a reboot.
+ *
+ * Returns:     0 if the saved frame will be the first reference, -1 otherwise.
+ *
+ ******************************************************************************/
+int checkpoint_load(const char *path, uint32_t threshold)
+{
+    struct stat st;
+    int         fd;
+
+    if (loaded != NULL)
+    {
+        munmap(loaded, loaded_size);
+        loaded = NULL;
+    }
+
+    if ((fd = open(path, O_RDONLY)) == -1)
+    {
+        LOG_INFO("no checkpoint in %s, starting cold", path);
+        return -1;
+    }
+
+    if ((fstat(fd, &st) == -1) || ((size_t)st.st_size < sizeof(checkpoint_header_t)))
+    {
+        LOG_WARN("checkpoint %s is truncated, starting cold", path);
+        close(fd);
+        return -1;
+    }
+
+    loaded_size = (size_t)st.st_size;
+    loaded      = mmap(NULL, loaded_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (loaded == MAP_FAILED)
+    {
+        loaded = NULL;
+        return -1;
+    }
+
+    const checkpoint_header_t *header = loaded;
+
+    if ((header->magic != CHECKPOINT_MAGIC) || (header->version != CHECKPOINT_VERSION) ||
+        (header->header_size != sizeof(*header)) ||
+        (loaded_size != header->header_size + (size_t)header->width * header->height))
+    {
+        LOG_WARN("checkpoint %s has another format, starting cold", path);
+        munmap(loaded, loaded_size);
+        loaded = NULL;
+        return -1;
+    }
+
+    const uint8_t *luma  = (const uint8_t *)loaded + header->header_size;
+    int64_t        shift = header->realtime_offset_ns - checkpoint_realtime_offset();
+
+    if (camera_warm_start(luma, header->width, header->width, header->height) == -1)
+    {
+        LOG_WARN("checkpoint %s is for %ux%u frames, starting cold", path,
+                 header->width, header->height);
+        munmap(loaded, loaded_size);
+        loaded = NULL;
+        return -1;
+    }
+
+    scheduler_restore_state(&header->scheduler, shift);
+
+    if ((header->threshold != threshold) || (event_restore_state(&header->event, shift) == -1))
+    {
+        LOG_WARN("checkpoint %s has other event settings, events start over", path);
+    }
+
+    LOG_INFO("warm start from %s, saved %lld s ago", path,
+             (long long)(((int64_t)monotonic_time_ns() - (int64_t)header->saved_ns - shift) /
+                         1000000000ll));
+    return 0;
+}
@@ -0,0 +1,812 @@
+#define _GNU_SOURCE // ptsname_r(), posix_openpt()
+#include "cmux.h"
+#include "log.h"
+#include "metrics.h"
+#include "trace.h"
+#include "util.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#define CMUX_FLAG 0xF9
+#define CMUX_EA   0x01 // last byte of an address, length or message field
+#define CMUX_CR   0x02 // command/response
+#define CMUX_PF   0x10 // poll/final
+
+// Frame types, without the P/F bit.
+#define CMUX_SABM 0x2F
+#define CMUX_UA   0x63
+#define CMUX_DM   0x0F
+#define CMUX_DISC 0x43
+#define CMUX_UIH  0xEF
+#define CMUX_UI   0x03
+
+// Control channel message types, without the EA and C/R bits.
+#define CMUX_MSG_CLD   0xC0 // multiplexer close down
+#define CMUX_MSG_TEST  0x20
+#define CMUX_MSG_FCON  0xA0 // flow control on, for all channels
+#define CMUX_MSG_FCOFF 0x60 // flow control off, for all channels
+#define CMUX_MSG_MSC   0xE0 // modem status of one channel
+#define CMUX_MSG_NSC   0x10 // non supported command response
+
+// V.24 signals of an MSC message.
+#define CMUX_V24_FC  0x02 // the sender can't accept frames
+#define CMUX_V24_RTC 0x04
+#define CMUX_V24_RTR 0x08
+#define CMUX_V24_DV  0x80
+
+#define CMUX_OPEN_TIMEOUT_MS 3000
+#define CMUX_POLL_MS         100  // how often the thread checks for cmux_stop()
+#define CMUX_PATH_SIZE       64
+#define CMUX_HEADER_SIZE     5    // flag, address, control and two length bytes
+#define CMUX_RX_BUF_SIZE     (2 * (CMUX_MAX_FRAME_SIZE + CMUX_HEADER_SIZE + 2))
+
+typedef struct cmux_channel
+{
+    int      master;  // our side of the pseudo-terminal
+    int      slave;   // kept open, so the terminal outlives the ones using it
+    int      open;    // the modem answered SABM with UA
+    int      refused; // the modem answered SABM with DM
+    int      blocked; // the modem asked us to stop sending with MSC
+    uint64_t dropped; // bytes lost since the terminal was last read
+    char     path[CMUX_PATH_SIZE];
+} cmux_channel_t;
+
+struct cmux
+{
+    int            fd;
+    uint32_t       channels;
+    uint32_t       frame_size;
+    cmux_channel_t dlci[CMUX_MAX_CHANNELS + 1]; // 0 is the control channel
+    int            blocked;  // the modem asked us to stop sending with FCoff
+    int            running;
+    pthread_t      thread;
+    uint8_t        rx[CMUX_RX_BUF_SIZE];
+    size_t         rx_length;
+};
+
+// Global module variables
+static uint8_t        crc_table[256];
+static pthread_once_t crc_once    = PTHREAD_ONCE_INIT;
+static pthread_once_t metric_once = PTHREAD_ONCE_INIT;
+static metric_t      *dropped_metric;
+
+/*******************************************************************************
+ *
+ * Function:    cmux_build_crc_table()
+ *
+ * Description: Fills in the table of the reflected CRC-8 with polynomial
+ *              x^8 + x^2 + x + 1 that 27.010 specifies. Runs once for all
+ *              multiplexers.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void cmux_build_crc_table(void)
+{
+    for (int n = 0; n < 256; ++n)
+    {
+        uint8_t value = (uint8_t)n;
+
+        for (int bit = 0; bit < 8; ++bit)
+        {
+            value = (value & 1) ? (uint8_t)((value >> 1) ^ 0xE0) : (uint8_t)(value >> 1);
+        }
+        crc_table[n] = value;
+    }
+}
+
+/*******************************************************************************
+ *
+ * Function:    cmux_fcs()
+ *
+ * Description: Computes the frame check sequence.
+ *
+ * Returns:     The FCS byte.
+ *
+ ******************************************************************************/
+static uint8_t cmux_fcs(const uint8_t *data, size_t length)
+{
+    uint8_t crc = 0xFF;
+
+    while (length-- > 0)
+    {
+        crc = crc_table[crc ^ *data++];
+    }
+
+    return (uint8_t)(0xFF - crc);
+}
+
+/*******************************************************************************
+ *
+ * Function:    cmux_write_all()
+ *
+ * Description: Writes a whole buffer, waiting whenever the serial port
+ *              can't take more.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+static int cmux_write_all(int fd, const uint8_t *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t written = write(fd, data, length);
+
+        if (written == -1)
+        {
+            struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+
+            if ((errno == EAGAIN) && (poll(&pfd, 1, CMUX_OPEN_TIMEOUT_MS) == 1))
+            {
+                continue;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        data   += written;
+        length -= (size_t)written;
+    }
+
+    return 0;
+}
+
+/*******************************************************************************
+ *
+ * Function:    cmux_register_metrics()
+ *
+ * Description: Registers the metrics shared by all multiplexers.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void cmux_register_metrics(void)
+{
+    dropped_metric = metrics_counter("sitemon_cmux_dropped_bytes_total", NULL,
+                                     "Bytes from the modem dropped for a channel not being read.");
+}
+
+/*******************************************************************************
+ *
+ * Function:    cmux_forward()
+ *
+ * Description: Passes data received on a channel to its terminal, as much as
+ *              it takes without waiting. The reader thread serves every
+ *              channel, so the rest is dropped rather than letting a channel
+ *              nobody reads hold up the others.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void cmux_forward(cmux_channel_t *channel, uint32_t dlci, const uint8_t *data,
+                         size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t written = write(channel->master, data, length);
+
+        if (written == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        data   += written;
+        length -= (size_t)written;
+    }
+
+    if (length > 0)
+    {
+        if (channel->dropped == 0)
+        {
+            LOG_WARN("cmux: channel %u is not being read, dropping data", dlci);
+        }
+        channel->dropped += length;
+        metrics_add(dropped_metric, length);
+    }
+    else if (channel->dropped > 0)
+    {
+        LOG_WARN("cmux: dropped %" PRIu64 " bytes for channel %u", channel->dropped, dlci);
+        channel->dropped = 0;
+    }
+}
+
+/*******************************************************************************
+ *
+ * Function:    cmux_send()
+ *
+ * Description: Sends one frame. As the initiator we set C/R in commands and
+ *              clear it in responses.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+static int cmux_send(cmux_t *mux, uint32_t dlci, uint8_t control, int command,
+                     const uint8_t *data, size_t length)
+{
+    uint8_t frame[CMUX_HEADER_SIZE + CMUX_MAX_FRAME_SIZE + 2];
+    size_t  header = 4;
+
+    frame[0] = CMUX_FLAG;
+    frame[1] = (uint8_t)((dlci << 2) | (command ? CMUX_CR : 0) | CMUX_EA);
+    frame[2] = control;
+    if (length < 128)
+    {
+        frame[3] = (uint8_t)((length << 1) | CMUX_EA);
+    }
+    else
+    {
+        frame[3] = (uint8_t)((length & 0x7F) << 1);
+        frame[4] = (uint8_t)(length >> 7);
+        header   = 5;
+    }
+
+    if (length > 0)
+    {
+        memcpy(frame + header, data, length);
+    }
+    frame[header + length]     = cmux_fcs(frame + 1, header - 1);
+    frame[header + length + 1] = CMUX_FLAG;
+
+    return cmux_write_all(mux->fd, frame, header + length + 2);
+}
+
+/*******************************************************************************
+ *
+ * Function:    cmux_send_message()
+ *
+ * Description: Sends a message on the control channel.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+static int cmux_send_message(cmux_t *mux, uint8_t type, int command, const uint8_t *values, size_t length)
+{
+    uint8_t message[2 + 8];
+
+    if (length > sizeof(message) - 2)
+    {
+        return -1;
+    }
+
+    message[0] = (uint8_t)(type | (command ? CMUX_CR : 0) | CMUX_EA);
+    message[1] = (uint8_t)((length << 1) | CMUX_EA);
+    if (length > 0)
+    {
+        memcpy(message + 2, values, length);
+    }
+
+    return cmux_send(mux, 0, CMUX_UIH, 1, message, length + 2);
+}
+
+/*******************************************************************************
+ *
+ * Function:    cmux_handle_message()
+ *
+ * Description: Acts on a message from the modem on the control channel and
+ *              answers the commands among them.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void cmux_handle_message(cmux_t *mux, const uint8_t *info, size_t length)
+{
+    if ((length < 2) || !(info[1] & CMUX_EA))
+    {
+        return;
+    }
+
+    uint8_t        type    = info[0] & 0xFC;
+    int            command = (info[0] & CMUX_CR) != 0;
+    size_t         count   = (size_t)(info[1] >> 1);
+    const uint8_t *values  = info + 2;
+
+    if (count > length - 2)
+    {
+        return;
+    }
+
+    switch (type)
+    {
+        case CMUX_MSG_MSC:
+            if (count >= 2)
+            {
+                uint32_t dlci = values[0] >> 2;
+
+                if ((dlci >= 1) && (dlci <= mux->channels))
+                {
+                    __atomic_store_n(&mux->dlci[dlci].blocked,
+                                     (values[1] & CMUX_V24_FC) != 0, __ATOMIC_RELAXED);
+                }
+            }
+            break;
+
+        case CMUX_MSG_FCON:
+            mux->blocked = 0;
+            break;
+
+        case CMUX_MSG_FCOFF:
+            mux->blocked = 1;
+            break;
+
+        case CMUX_MSG_TEST:
+        case CMUX_MSG_CLD:
+            break;
+
+        default:
+            // Tell the modem which of its commands we don't know.
+            if (command)
+            {
+                cmux_send_message(mux, CMUX_MSG_NSC, 0, info, 1);
+            }
+            return;
+    }
+
+    // A response repeats the values of the command.
+    if (command)
+    {
+        cmux_send_message(mux, type, 0, values, count);
+    }
+}
+
+/*******************************************************************************
+ *
+ * Function:    cmux_handle_frame()
+ *
+ * Description: Acts on a frame received from the modem.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void cmux_handle_frame(cmux_t *mux, uint8_t address, uint8_t control, const uint8_t *info,
+                              size_t length)
+{
+    uint32_t dlci = address >> 2;
+
+    if (dlci > mux->channels)
+    {
+        return;
+    }
+
+    cmux_channel_t *channel = &mux->dlci[dlci];
+
+    switch (control & ~CMUX_PF)
+    {
+        case CMUX_UA:
+            channel->open = 1;
+            break;
+
+        case CMUX_DM:
+            channel->open    = 0;
+            channel->refused = 1;
+            break;
+
+        case CMUX_SABM:
+            channel->open = 1;
+            cmux_send(mux, dlci, CMUX_UA | CMUX_PF, 0, NULL, 0);
+            break;
+
+        case CMUX_DISC:
+            channel->open = 0;
+            cmux_send(mux, dlci, CMUX_UA | CMUX_PF, 0, NULL, 0);
+            break;
+
+        case CMUX_UIH:
+        case CMUX_UI:
+            if (dlci == 0)
+            {
+                cmux_handle_message(mux, info, length);
+            }
+            else if (channel->master != -1)
+            {
+                cmux_forward(channel, dlci, info, length);
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+/*******************************************************************************
+ *
+ * Function:    cmux_parse()
+ *
+ * Description: Handles every complete frame in the receive buffer. Anything
+ *              that isn't a frame with a valid FCS is skipped a byte at a
+ *              time, so the parser finds its way back after line noise.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void cmux_parse(cmux_t *mux)
+{
+    size_t start = 0;
+
+    for (;;)
+    {
+        const uint8_t *frame  = mux->rx + start;
+        size_t         length = mux->rx_length - start;
+
+        // The closing flag of a frame may also open the next one.
+        if ((length > 0) && (frame[0] != CMUX_FLAG))
+        {
+            start += 1;
+            continue;
+        }
+        if ((length >= 2) && (frame[1] == CMUX_FLAG))
+        {
+            start += 1;
+            continue;
+        }
+        if (length < 4)
+        {
+            break;
+        }
+
+        size_t header = 4;
+        size_t count  = frame[3] >> 1;
+
+        if (!(frame[3] & CMUX_EA))
+        {
+            if (length < 5)
+            {
+                break;
+            }
+            count |= (size_t)frame[4] << 7;
+            header = 5;
+        }
+
+        if (count > CMUX_MAX_FRAME_SIZE)
+        {
+            start += 1;
+            continue;
+        }
+        if (length < header + count + 2)
+        {
+            break;
+        }
+
+        // UIH frames are checked over the header only, others over it all.
+        uint8_t type  = frame[2] & ~CMUX_PF;
+        size_t  check = (type == CMUX_UIH) ? header - 1 : header - 1 + count;
+
+        if ((frame[header + count + 1] != CMUX_FLAG) ||
+            (frame[header + count] != cmux_fcs(frame + 1, check)))
+        {
+            start += 1;
+            continue;
+        }
+
+        cmux_handle_frame(mux, frame[1], frame[2], frame + header, count);
+        start += header + count + 1;
+    }
+
+    mux->rx_length -= start;
+    memmove(mux->rx, mux->rx + start, mux->rx_length);
+}
+
+/*******************************************************************************
+ *
+ * Function:    cmux_receive()
+ *
+ * Description: Reads whatever the modem sent within a timeout and handles
+ *              the frames in it.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+static int cmux_receive(cmux_t *mux, int timeout_ms)
+{
+    struct pollfd pfd = { .fd = mux->fd, .events = POLLIN };
+    int           ready = poll(&pfd, 1, timeout_ms);
+
+    if (ready <= 0)
+    {
+        return ((ready == 0) || (errno == EINTR)) ? 0 : -1;
+    }
+
+    ssize_t nread = read(mux->fd, mux->rx + mux->rx_length,
+                         sizeof(mux->rx) - mux->rx_length);
+    if (nread == -1)
+    {
+        return (errno == EINTR) ? 0 : -1;
+    }
+
+    mux->rx_length += (size_t)nread;
+    cmux_parse(mux);
+
+    return 0;
+}
+
+/*******************************************************************************
+ *
+ * Function:    cmux_open_channel()
+ *
+ * Description: Establishes a DLCI with SABM and waits for the modem's UA.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+static int cmux_open_channel(cmux_t *mux, uint32_t dlci)
+{
+    uint64_t deadline = monotonic_time_ns() + CMUX_OPEN_TIMEOUT_MS * 1000000ull;
+
+    if (cmux_send(mux, dlci, CMUX_SABM | CMUX_PF, 1, NULL, 0) == -1)
+    {
+        return -1;
+    }
+
+    while (!mux->dlci[dlci].open && !mux->dlci[dlci].refused)
+    {
+        uint64_t now = monotonic_time_ns();
+
+        if ((now >= deadline) || (cmux_receive(mux, (int)((deadline - now) / 1000000) + 1) == -1))
+        {
+            LOG_ERROR("cmux: no answer to opening channel %u", dlci);
+            return -1;
+        }
+    }
+
+    if (mux->dlci[dlci].refused)
+    {
+        LOG_ERROR("cmux: modem refused channel %u", dlci);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*******************************************************************************
+ *
+ * Function:    cmux_open_terminal()
+ *
+ * Description: Creates the pseudo-terminal a channel is bridged to. Its
+ *              slave side is put in raw mode right away, so that nothing the
+ *              modem sends is echoed back before the terminal is opened.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+static int cmux_open_terminal(cmux_channel_t *channel)
+{
+    struct termios term_config;
+
+    if (((channel->master = posix_openpt(O_RDWR | O_NOCTTY)) == -1) ||
+        (grantpt(channel->master) == -1) || (unlockpt(channel->master) == -1) ||
+        (ptsname_r(channel->master, channel->path, sizeof(channel->path)) != 0) ||
+        ((channel->slave = open(channel->path, O_RDWR | O_NOCTTY)) == -1) ||
+        (tcgetattr(channel->slave, &term_config) == -1))
+    {
+        LOG_ERROR("cmux: failed to create a pseudo-terminal");
+        return -1;
+    }
+
+    cfmakeraw(&term_config);
+    if ((tcsetattr(channel->slave, TCSANOW, &term_config) == -1) ||
+        (fcntl(channel->master, F_SETFL, fcntl(channel->master, F_GETFL) | O_NONBLOCK) == -1))
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*******************************************************************************
+ *
+ * Function:    cmux_close_terminals()
+ *
+ * Description: Removes the pseudo-terminals of all channels.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void cmux_close_terminals(cmux_t *mux)
+{
+    for (uint32_t dlci = 0; dlci <= CMUX_MAX_CHANNELS; ++dlci)
+    {
+        if (mux->dlci[dlci].master != -1)
+        {
+            close(mux->dlci[dlci].master);
+        }
+        if (mux->dlci[dlci].slave != -1)
+        {
+            close(mux->dlci[dlci].slave);
+        }
+        mux->dlci[dlci].master = -1;
+        mux->dlci[dlci].slave  = -1;
+    }
+}
+
+/*******************************************************************************
+ *
+ * Function:    cmux_run()
+ *
+ * Description: Moves data between the serial port and the channels' terminals
+ *              until cmux_stop() is called. A channel's terminal isn't read
+ *              while the modem has asked for that channel to stop.
+ *
+ * Returns:     NULL.
+ *
+ ******************************************************************************/
+static void *cmux_run(void *vargp)
+{
+    struct pollfd pfds[CMUX_MAX_CHANNELS + 1];
+    uint8_t       data[CMUX_MAX_FRAME_SIZE];
+
+    cmux_t *mux = (cmux_t *)vargp;
+
+    TRACE_THREAD_NAME("cmux");
+
+    while (__atomic_load_n(&mux->running, __ATOMIC_ACQUIRE))
+    {
+        pfds[0].fd     = mux->fd;
+        pfds[0].events = POLLIN;
+        for (uint32_t dlci = 1; dlci <= mux->channels; ++dlci)
+        {
+            int blocked = mux->blocked ||
+                          __atomic_load_n(&mux->dlci[dlci].blocked, __ATOMIC_RELAXED);
+
+            pfds[dlci].fd     = mux->dlci[dlci].master;
+            pfds[dlci].events = blocked ? 0 : POLLIN;
+        }
+
+        if (poll(pfds, mux->channels + 1, CMUX_POLL_MS) <= 0)
+        {
+            continue;
+        }
+
+        if ((pfds[0].revents & POLLIN) && (cmux_receive(mux, 0) == -1))
+        {
+            LOG_ERROR("cmux: failed to read from the serial port");
+            SLEEP_MSECONDS(CMUX_POLL_MS);
+        }
+
+        for (uint32_t dlci = 1; dlci <= mux->channels; ++dlci)
+        {
+            if (!(pfds[dlci].revents & POLLIN))
+            {
+                continue;
+            }
+
+            ssize_t nread = read(mux->dlci[dlci].master, data, mux->frame_size);
+
+            if ((nread > 0) && (cmux_send(mux, dlci, CMUX_UIH, 1, data, (size_t)nread) == -1))
+            {
+                LOG_ERROR("cmux: failed to write to the serial port");
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/*******************************************************************************
+ *
+ * Function:    cmux_start()
+ *
+ * Description: Opens the control channel and the virtual channels, each with
+ *              a pseudo-terminal and a modem status message telling the modem
+ *              we're ready, and starts bridging them.
+ *
+ * Returns:     On success, returns the multiplexer. Otherwise, returns NULL.
+ *
+ ******************************************************************************/
+cmux_t *cmux_start(int fd, uint32_t channels, uint32_t frame_size)
+{
+    cmux_t *mux;
+
+    if ((channels == 0) || (channels > CMUX_MAX_CHANNELS) || (frame_size == 0) ||
+        (frame_size > CMUX_MAX_FRAME_SIZE))
+    {
+        return NULL;
+    }
+
+    pthread_once(&crc_once, cmux_build_crc_table);
+    pthread_once(&metric_once, cmux_register_metrics);
+
+    mux = calloc(1, sizeof(*mux));
+    if (mux == NULL)
+    {
+        return NULL;
+    }
+
+    for (uint32_t dlci = 0; dlci <= CMUX_MAX_CHANNELS; ++dlci)
+    {
+        mux->dlci[dlci].master = -1;
+        mux->dlci[dlci].slave  = -1;
+    }
+
+    mux->fd         = fd;
+    mux->channels   = channels;
+    mux->frame_size = frame_size;
+    mux->blocked    = 0;
+    mux->rx_length  = 0;
+
+    if (cmux_open_channel(mux, 0) == -1)
+    {
+        free(mux);
+        return NULL;
+    }
+
+    for (uint32_t dlci = 1; dlci <= channels; ++dlci)
+    {
+        uint8_t status[2] = { (uint8_t)((dlci << 2) | CMUX_CR | CMUX_EA),
+                              CMUX_V24_RTC | CMUX_V24_RTR | CMUX_V24_DV | CMUX_EA };
+
+        if ((cmux_open_terminal(&mux->dlci[dlci]) == -1) ||
+            (cmux_open_channel(mux, dlci) == -1) ||
+            (cmux_send_message(mux, CMUX_MSG_MSC, 1, status, sizeof(status)) == -1))
+        {
+            cmux_close_terminals(mux);
+            free(mux);
+            return NULL;
+        }
+    }
+
+    __atomic_store_n(&mux->running, 1, __ATOMIC_RELEASE);
+    if (pthread_create(&mux->thread, NULL, cmux_run, mux) != 0)
+    {
+        cmux_close_terminals(mux);
+        free(mux);
+        return NULL;
+    }
+
+    LOG_INFO("cmux: %u channels, frames of up to %u bytes", channels, frame_size);
+
+    return mux;
+}
+
+/*******************************************************************************
+ *
+ * Function:    cmux_channel_path()
+ *
+ * Description: Gets the pseudo-terminal of a virtual channel.
+ *
+ * Returns:     The path, or NULL if there is no such channel.
+ *
+ ******************************************************************************/
+const char *cmux_channel_path(const cmux_t *mux, uint32_t channel)
+{
+    if ((mux == NULL) || (channel == 0) || (channel > mux->channels))
+    {
+        return NULL;
+    }
+
+    return mux->dlci[channel].path;
+}
+
+/*******************************************************************************
+ *
+ * Function:    cmux_stop()
+ *
+ * Description: Stops the bridging thread, sends the close down command,
+ *              removes the pseudo-terminals and frees the multiplexer.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+void cmux_stop(cmux_t *mux)
+{
+    if (mux == NULL)
+    {
+        return;
+    }
+
+    __atomic_store_n(&mux->running, 0, __ATOMIC_RELEASE);
+    pthread_join(mux->thread, NULL);
+    cmux_send_message(mux, CMUX_MSG_CLD, 1, NULL, 0);
+    cmux_close_terminals(mux);
+    free(mux);
+}
@@ -0,0 +1,375 @@
+#include "denoise.h"
+#include "metrics.h"
+#include "util.h"
+#include "log.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+    #include <emmintrin.h>
+#elif defined(__ARM_NEON)
+    #include <arm_neon.h>
+#endif
+
+#define DENOISE_BLOCK_PIXELS     16
+#define DENOISE_HISTOGRAM_BINS   256 // of 8-pixel absolute difference sums
+#define DENOISE_MEASURE_ROW_STEP 4   // rows measured while the filter is off
+#define DENOISE_LEVEL_SMOOTHING  8   // frames the noise level averages over
+#define DENOISE_WEIGHT_SHIFT     7   // log2(DENOISE_WEIGHT_ONE)
+
+// Per-pixel blend weight: min(DENOISE_WEIGHT_ONE, still + |difference| * slope).
+typedef struct denoise_weights
+{
+    int16_t still;
+    int16_t slope;
+} denoise_weights_t;
+
+// Global module variables
+static denoise_config_t  config;
+static denoise_weights_t weights;
+static int               initialized;
+static int               filtering;
+static int               level_valid;
+static uint32_t          level;       // see denoise_level()
+static uint32_t          histogram[DENOISE_HISTOGRAM_BINS];
+static metric_t         *cost_metric;
+static metric_t         *level_metric;
+static metric_t         *active_metric;
+
+/*******************************************************************************
+ *
+ * Function:    denoise_pixel()
+ *
+ * Description: Blends one pixel with the same pixel of the previous frame.
+ *              The SIMD versions below compute exactly the same.
+ *
+ * Returns:     The filtered pixel.
+ *
+ ******************************************************************************/
+static inline uint8_t denoise_pixel(uint8_t cur, uint8_t prev, const denoise_weights_t *w)
+{
+    int32_t diff   = (int32_t)cur - (int32_t)prev;
+    int32_t weight = w->still + abs(diff) * w->slope;
+
+    if (weight > DENOISE_WEIGHT_ONE)
+    {
+        weight = DENOISE_WEIGHT_ONE;
+    }
+
+    return (uint8_t)(prev + ((diff * weight + DENOISE_WEIGHT_ONE / 2) >> DENOISE_WEIGHT_SHIFT));
+}
+
+#if defined(__SSE2__)
+
+/*******************************************************************************
+ *
+ * Function:    denoise_block()
+ *
+ * Description: Counts the absolute difference sums of two groups of 8
+ *              pixels in the histogram, one PSADBW for both, and if filter is
+ *              set, blends the 16 pixels with the previous frame in 16-bit
+ *              lanes with SSE2.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static inline void denoise_block(uint8_t *cur, const uint8_t *prev, int filter,
+                                 const denoise_weights_t *w)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i       c    = _mm_loadu_si128((const __m128i *)cur);
+    __m128i       p    = _mm_loadu_si128((const __m128i *)prev);
+    __m128i       sad  = _mm_sad_epu8(c, p);
+    uint32_t      lo   = (uint32_t)_mm_cvtsi128_si32(sad);
+    uint32_t      hi   = (uint32_t)_mm_extract_epi16(sad, 4);
+
+    histogram[(lo < DENOISE_HISTOGRAM_BINS) ? lo : DENOISE_HISTOGRAM_BINS - 1] += 1;
+    histogram[(hi < DENOISE_HISTOGRAM_BINS) ? hi : DENOISE_HISTOGRAM_BINS - 1] += 1;
+
+    if (!filter)
+    {
+        return;
+    }
+
+    const __m128i still = _mm_set1_epi16(w->still);
+    const __m128i slope = _mm_set1_epi16(w->slope);
+    const __m128i one   = _mm_set1_epi16(DENOISE_WEIGHT_ONE);
+    const __m128i half  = _mm_set1_epi16(DENOISE_WEIGHT_ONE / 2);
+    __m128i       d     = _mm_or_si128(_mm_subs_epu8(c, p), _mm_subs_epu8(p, c));
+    __m128i       out[2];
+
+    for (int n = 0; n < 2; ++n)
+    {
+        __m128i c16 = n ? _mm_unpackhi_epi8(c, zero) : _mm_unpacklo_epi8(c, zero);
+        __m128i p16 = n ? _mm_unpackhi_epi8(p, zero) : _mm_unpacklo_epi8(p, zero);
+        __m128i d16 = n ? _mm_unpackhi_epi8(d, zero) : _mm_unpacklo_epi8(d, zero);
+        __m128i wt  = _mm_min_epi16(_mm_adds_epi16(still, _mm_mullo_epi16(d16, slope)), one);
+        __m128i mix = _mm_mullo_epi16(_mm_sub_epi16(c16, p16), wt);
+
+        out[n] = _mm_add_epi16(p16, _mm_srai_epi16(_mm_add_epi16(mix, half),
+                                                   DENOISE_WEIGHT_SHIFT));
+    }
+
+    _mm_storeu_si128((__m128i *)cur, _mm_packus_epi16(out[0], out[1]));
+}
+
+#elif defined(__ARM_NEON)
+
+/*******************************************************************************
+ *
+ * Function:    denoise_block()
+ *
+ * Description: Counts the absolute difference sums of two groups of 8
+ *              pixels in the histogram, pairwise added from VABD, and if
+ *              filter is set, blends the 16 pixels with the previous frame in
+ *              16-bit lanes with NEON.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static inline void denoise_block(uint8_t *cur, const uint8_t *prev, int filter,
+                                 const denoise_weights_t *w)
+{
+    uint8x16_t c   = vld1q_u8(cur);
+    uint8x16_t p   = vld1q_u8(prev);
+    uint8x16_t d   = vabdq_u8(c, p);
+    uint64x2_t sad = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(d)));
+    uint64_t   lo  = vgetq_lane_u64(sad, 0);
+    uint64_t   hi  = vgetq_lane_u64(sad, 1);
+
+    histogram[(lo < DENOISE_HISTOGRAM_BINS) ? lo : DENOISE_HISTOGRAM_BINS - 1] += 1;
+    histogram[(hi < DENOISE_HISTOGRAM_BINS) ? hi : DENOISE_HISTOGRAM_BINS - 1] += 1;
+
+    if (!filter)
+    {
+        return;
+    }
+
+    const int16x8_t still = vdupq_n_s16(w->still);
+    const int16x8_t slope = vdupq_n_s16(w->slope);
+    const int16x8_t one   = vdupq_n_s16(DENOISE_WEIGHT_ONE);
+    int16x8_t       out[2];
+
+    for (int n = 0; n < 2; ++n)
+    {
+        uint8x8_t c8  = n ? vget_high_u8(c) : vget_low_u8(c);
+        uint8x8_t p8  = n ? vget_high_u8(p) : vget_low_u8(p);
+        uint8x8_t d8  = n ? vget_high_u8(d) : vget_low_u8(d);
+        int16x8_t c16 = vreinterpretq_s16_u16(vmovl_u8(c8));
+        int16x8_t p16 = vreinterpretq_s16_u16(vmovl_u8(p8));
+        int16x8_t d16 = vreinterpretq_s16_u16(vmovl_u8(d8));
+        int16x8_t wt  = vminq_s16(vqaddq_s16(still, vmulq_s16(d16, slope)), one);
+        int16x8_t mix = vmulq_s16(vsubq_s16(c16, p16), wt);
+
+        out[n] = vaddq_s16(p16, vrshrq_n_s16(mix, DENOISE_WEIGHT_SHIFT));
+    }
+
+    vst1q_u8(cur, vcombine_u8(vqmovun_s16(out[0]), vqmovun_s16(out[1])));
+}
+
+#else
+
+static inline void denoise_block(uint8_t *cur, const uint8_t *prev, int filter,
+                                 const denoise_weights_t *w)
+{
+    for (uint32_t group = 0; group < DENOISE_BLOCK_PIXELS; group += 8)
+    {
+        uint32_t sad = 0;
+
+        for (uint32_t n = group; n < group + 8; ++n)
+        {
+            sad += (uint32_t)abs((int32_t)cur[n] - (int32_t)prev[n]);
+        }
+        histogram[(sad < DENOISE_HISTOGRAM_BINS) ? sad : DENOISE_HISTOGRAM_BINS - 1] += 1;
+    }
+
+    if (!filter)
+    {
+        return;
+    }
+
+    for (uint32_t n = 0; n < DENOISE_BLOCK_PIXELS; ++n)
+    {
+        cur[n] = denoise_pixel(cur[n], prev[n], w);
+    }
+}
+
+#endif
+
+/*******************************************************************************
+ *
+ * Function:    denoise_row()
+ *
+ * Description: Measures, and if filter is set filters, one row. Pixels past
+ *              the last full block are filtered but not measured.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void denoise_row(uint8_t *cur, const uint8_t *prev, uint32_t width, int filter)
+{
+    uint32_t x = 0;
+
+    for (; x + DENOISE_BLOCK_PIXELS <= width; x += DENOISE_BLOCK_PIXELS)
+    {
+        denoise_block(cur + x, prev + x, filter, &weights);
+    }
+
+    for (; filter && (x < width); ++x)
+    {
+        cur[x] = denoise_pixel(cur[x], prev[x], &weights);
+    }
+}
+
+/*******************************************************************************
+ *
+ * Function:    denoise_init()
+ *
+ * Description: Initialize the filter.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+int denoise_init(const denoise_config_t *cfg)
+{
+    if ((cfg == NULL) || (cfg->off_level > cfg->on_level) || (cfg->still_weight == 0) ||
+        (cfg->still_weight > DENOISE_WEIGHT_ONE) || (cfg->motion_difference == 0))
+    {
+        return -1;
+    }
+
+    cost_metric = metrics_histogram("sitemon_denoise_seconds", NULL,
+        "Time spent estimating noise in and filtering one detection frame.");
+    level_metric = metrics_gauge("sitemon_noise_level", NULL,
+        "Median absolute difference between detection frames, in 1/256 grey levels.");
+    active_metric = metrics_gauge("sitemon_denoise_active", NULL,
+        "1 while detection frames are temporally filtered, otherwise 0.");
+
+    config        = *cfg;
+    weights.still = (int16_t)config.still_weight;
+    weights.slope = (int16_t)((DENOISE_WEIGHT_ONE - config.still_weight +
+                               config.motion_difference - 1) / config.motion_difference);
+    filtering     = 0;
+    level_valid   = 0;
+    initialized   = 1;
+    __atomic_store_n(&level, 0, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+/*******************************************************************************
+ *
+ * Function:    denoise_update_level()
+ *
+ * Description: Takes the median of the histogram as this frame's noise
+ *              level, so that moving objects covering less than half of the
+ *              frame don't count as noise, smooths it over a few frames and
+ *              switches the filter with hysteresis.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void denoise_update_level(void)
+{
+    uint64_t total = 0;
+
+    for (uint32_t bin = 0; bin < DENOISE_HISTOGRAM_BINS; ++bin)
+    {
+        total += histogram[bin];
+    }
+
+    if (total == 0)
+    {
+        return;
+    }
+
+    uint64_t below = 0;
+    uint32_t bin   = 0;
+
+    while ((below + histogram[bin]) * 2 < total)
+    {
+        below += histogram[bin++];
+    }
+
+    // Bins are sums over 8 pixels, i.e. in 1/8 grey levels.
+    int64_t sample  = (int64_t)bin * 32 + 16;
+    int64_t current = level_valid ? (int64_t)level : sample;
+
+    current    += (sample - current) / DENOISE_LEVEL_SMOOTHING;
+    level_valid = 1;
+    __atomic_store_n(&level, (uint32_t)current, __ATOMIC_RELAXED);
+
+    if (!filtering && (level >= config.on_level))
+    {
+        filtering = 1;
+        LOG_INFO("noise level %u/256, temporal filter on", level);
+    }
+    else if (filtering && (level < config.off_level))
+    {
+        filtering = 0;
+        LOG_INFO("noise level %u/256, temporal filter off", level);
+    }
+}
+
+/*******************************************************************************
+ *
+ * Function:    denoise_frame()
+ *
+ * Description: Estimates the noise in a frame and filters it in place if the
+ *              noise level calls for it. The level is measured on every row
+ *              while filtering, which costs little next to the filter, and on
+ *              every DENOISE_MEASURE_ROW_STEP-th row otherwise.
+ *
+ * Returns:     If the frame was filtered, returns 1. If it wasn't, returns 0.
+ *              Returns -1 on error.
+ *
+ ******************************************************************************/
+int denoise_frame(uint8_t *cur, size_t cur_stride,
+                  const uint8_t *prev, size_t prev_stride,
+                  uint32_t width, uint32_t height)
+{
+    if ((cur == NULL) || (prev == NULL))
+    {
+        return -1;
+    }
+
+    if (!initialized)
+    {
+        return 0;
+    }
+
+    uint64_t start_ns = monotonic_time_ns();
+    int      filter   = filtering;
+    uint32_t step     = filter ? 1 : DENOISE_MEASURE_ROW_STEP;
+
+    memset(histogram, 0, sizeof(histogram));
+
+    for (uint32_t row = 0; row < height; row += step)
+    {
+        denoise_row(cur + row * cur_stride, prev + row * prev_stride, width, filter);
+    }
+
+    denoise_update_level();
+
+    metrics_observe(cost_metric, monotonic_time_ns() - start_ns);
+    metrics_set(level_metric, (int64_t)level);
+    metrics_set(active_metric, filtering);
+
+    return filter;
+}
+
+/*******************************************************************************
+ *
+ * Function:    denoise_level()
+ *
+ * Description: Get the current noise level estimate.
+ *
+ * Returns:     The noise level in 1/256 grey levels.
+ *
+ ******************************************************************************/
+uint32_t denoise_level(void)
+{
+    return __atomic_load_n(&level, __ATOMIC_RELAXED);
+}
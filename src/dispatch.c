@@ -0,0 +1,603 @@
+#include "dispatch.h"
+#include "log.h"
+#include "metrics.h"
+#include "trace.h"
+#include "util.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define NSEC_PER_SEC 1000000000ull
+
+#define DISPATCH_DESTINATION_SIZE 32
+#define DISPATCH_PENDING          1 // result of a job not yet sent or given up
+// What a send is taken to cost before one was measured, about what
+// gsm_send_message() waits for the modem.
+#define DISPATCH_INITIAL_LATENCY_NS (6 * NSEC_PER_SEC)
+#define DISPATCH_EWMA_SHIFT         2 // latency moves 1/4 of the way per send
+
+// A message waiting to be sent. It lives on the stack of dispatch_send(),
+// which waits until a worker has given it a result.
+typedef struct dispatch_job
+{
+    struct dispatch_job *next;
+    const char          *destination;
+    const char          *message;
+    uint32_t             tried;    // bit n is set once modem n has tried it
+    uint32_t             attempts;
+    int                  result;   // DISPATCH_PENDING, 0 or -1
+} dispatch_job_t;
+
+typedef struct dispatch_modem
+{
+    gsm_t          *modem;
+    uint32_t        index;
+    pthread_t       thread;
+    pthread_cond_t  wake; // signalled when a job is queued
+    dispatch_job_t *head;
+    dispatch_job_t *tail;
+    uint32_t        depth;      // jobs queued or being sent, and acquirers
+    int             healthy;
+    uint32_t        failures;   // failed checks or sends in a row
+    uint64_t        latency_ns; // moving average of the time a send takes
+    uint64_t        checked_ns; // when the modem last proved it answers
+    // Users of the radio, see dispatch_power(). Guarded by power_mutex, which
+    // is held while the radio is switched so that switches can't overtake
+    // each other.
+    pthread_mutex_t power_mutex;
+    uint32_t        users;
+    char            labels[GSM_NAME_SIZE + 16];        // {modem="name"}
+    char            sent_labels[GSM_NAME_SIZE + 32];   // ...,result="sent"}
+    char            failed_labels[GSM_NAME_SIZE + 32]; // ...,result="failed"}
+    metric_t       *healthy_metric;
+    metric_t       *depth_metric;
+    metric_t       *sent_metric;
+    metric_t       *failed_metric;
+    metric_t       *send_metric;
+} dispatch_modem_t;
+
+// Global module variables
+static dispatch_config_t config;
+static dispatch_modem_t  modems[DISPATCH_MAX_MODEMS];
+static uint32_t          num_modems;
+// Guards the queues, depths and health of all modems.
+static pthread_mutex_t   dispatch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t    dispatch_done  = PTHREAD_COND_INITIALIZER; // a job got its result
+
+/*******************************************************************************
+ *
+ * Function:    dispatch_pick()
+ *
+ * Description: Picks the healthy modem that should be done soonest with a new
+ *              job, going by the jobs ahead of it and the time its recent
+ *              sends took.
+ *
+ * Notes:       Must be called with dispatch_mutex held.
+ *
+ * Returns:     The modem, or NULL if no healthy modem is left outside
+ *              exclude, a mask of modem indexes.
+ *
+ ******************************************************************************/
+static dispatch_modem_t *dispatch_pick(uint32_t exclude)
+{
+    dispatch_modem_t *best      = NULL;
+    uint64_t          best_cost = UINT64_MAX;
+
+    for (uint32_t n = 0; n < num_modems; ++n)
+    {
+        dispatch_modem_t *m = &modems[n];
+
+        if (!m->healthy || (exclude & (1u << n)))
+        {
+            continue;
+        }
+
+        uint64_t cost = (uint64_t)(m->depth + 1) * m->latency_ns;
+        if (cost < best_cost)
+        {
+            best      = m;
+            best_cost = cost;
+        }
+    }
+
+    return best;
+}
+
+/*******************************************************************************
+ *
+ * Function:    dispatch_finish()
+ *
+ * Description: Gives a job its result and wakes the thread waiting for it.
+ *
+ * Notes:       Must be called with dispatch_mutex held.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void dispatch_finish(dispatch_job_t *job, int result)
+{
+    job->result = result;
+    pthread_cond_broadcast(&dispatch_done);
+}
+
+/*******************************************************************************
+ *
+ * Function:    dispatch_route()
+ *
+ * Description: Queues a job on the best healthy modem that hasn't tried it
+ *              yet, or on the best healthy modem if all have. A job that no
+ *              modem can take fails.
+ *
+ * Notes:       Must be called with dispatch_mutex held.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void dispatch_route(dispatch_job_t *job)
+{
+    dispatch_modem_t *m = dispatch_pick(job->tried);
+
+    if (m == NULL)
+    {
+        m = dispatch_pick(0);
+    }
+    if (m == NULL)
+    {
+        LOG_WARN("dispatch: no healthy modem for a message to %s", job->destination);
+        dispatch_finish(job, -1);
+        return;
+    }
+
+    job->next = NULL;
+    if (m->tail == NULL)
+    {
+        m->head = job;
+    }
+    else
+    {
+        m->tail->next = job;
+    }
+    m->tail = job;
+
+    m->depth += 1;
+    metrics_set(m->depth_metric, m->depth);
+    pthread_cond_signal(&m->wake);
+}
+
+/*******************************************************************************
+ *
+ * Function:    dispatch_set_health()
+ *
+ * Description: Takes a modem out of service or puts it back. The queue of a
+ *              modem taken out moves to the others.
+ *
+ * Notes:       Must be called with dispatch_mutex held.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void dispatch_set_health(dispatch_modem_t *m, int healthy)
+{
+    if (m->healthy == healthy)
+    {
+        return;
+    }
+
+    m->healthy = healthy;
+    metrics_set(m->healthy_metric, healthy);
+
+    if (healthy)
+    {
+        LOG_INFO("dispatch: %s answers again, back in service", gsm_name(m->modem));
+        return;
+    }
+
+    LOG_WARN("dispatch: %s taken out of service after %u failures", gsm_name(m->modem),
+             m->failures);
+
+    dispatch_job_t *job = m->head;
+
+    m->head = m->tail = NULL;
+    while (job != NULL)
+    {
+        dispatch_job_t *next = job->next;
+
+        m->depth -= 1;
+        dispatch_route(job);
+        job = next;
+    }
+    metrics_set(m->depth_metric, m->depth);
+}
+
+/*******************************************************************************
+ *
+ * Function:    dispatch_power()
+ *
+ * Description: Counts a user of a modem's radio in or out. With power_save,
+ *              the radio is turned on for the first user and off again when
+ *              the last one is done.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void dispatch_power(dispatch_modem_t *m, int on)
+{
+    pthread_mutex_lock(&m->power_mutex);
+
+    if (on)
+    {
+        if ((m->users++ == 0) && config.power_save)
+        {
+            gsm_set_functionality_mode(m->modem, GSM_FULL_FUNCTIONALITY_MODE);
+        }
+    }
+    else if ((--m->users == 0) && config.power_save)
+    {
+        gsm_set_functionality_mode(m->modem, GSM_MINIMUM_FUNCTIONALITY_MODE);
+    }
+
+    pthread_mutex_unlock(&m->power_mutex);
+}
+
+/*******************************************************************************
+ *
+ * Function:    dispatch_count_failure()
+ *
+ * Description: Counts a failed check or send, and takes the modem out once
+ *              max_failures happened in a row.
+ *
+ * Notes:       Must be called with dispatch_mutex held.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void dispatch_count_failure(dispatch_modem_t *m)
+{
+    m->failures += 1;
+    if (m->failures >= config.max_failures)
+    {
+        dispatch_set_health(m, 0);
+    }
+}
+
+/*******************************************************************************
+ *
+ * Function:    dispatch_sent()
+ *
+ * Description: Books the outcome of a send. A failed job goes to another
+ *              modem until it has been tried max_attempts times.
+ *
+ * Notes:       Must be called with dispatch_mutex held.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void dispatch_sent(dispatch_modem_t *m, dispatch_job_t *job, int ret, uint64_t elapsed_ns)
+{
+    m->depth -= 1;
+    metrics_set(m->depth_metric, m->depth);
+    metrics_observe(m->send_metric, elapsed_ns);
+
+    // Failures count too, a modem that times out is slow.
+    m->latency_ns = m->latency_ns - (m->latency_ns >> DISPATCH_EWMA_SHIFT)
+                  + (elapsed_ns >> DISPATCH_EWMA_SHIFT);
+
+    if (ret == 0)
+    {
+        metrics_add(m->sent_metric, 1);
+        m->failures   = 0;
+        m->checked_ns = monotonic_time_ns();
+        dispatch_finish(job, 0);
+        return;
+    }
+
+    metrics_add(m->failed_metric, 1);
+    LOG_WARN("dispatch: %s failed to send a message to %s", gsm_name(m->modem),
+             job->destination);
+    dispatch_count_failure(m);
+
+    job->tried    |= 1u << m->index;
+    job->attempts += 1;
+    if (job->attempts >= config.max_attempts)
+    {
+        dispatch_finish(job, -1);
+    }
+    else
+    {
+        dispatch_route(job);
+    }
+}
+
+/*******************************************************************************
+ *
+ * Function:    dispatch_checked()
+ *
+ * Description: Books the outcome of a liveness check. A modem that was out
+ *              rejoins as soon as it answers.
+ *
+ * Notes:       Must be called with dispatch_mutex held.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void dispatch_checked(dispatch_modem_t *m, int live)
+{
+    m->checked_ns = monotonic_time_ns();
+
+    if (live)
+    {
+        m->failures = 0;
+        dispatch_set_health(m, 1);
+    }
+    else if (m->healthy)
+    {
+        LOG_WARN("dispatch: %s failed its liveness check", gsm_name(m->modem));
+        dispatch_count_failure(m);
+    }
+}
+
+/*******************************************************************************
+ *
+ * Function:    dispatch_worker()
+ *
+ * Description: Sends the messages queued on one modem, one at a time. While
+ *              the queue is empty, checks every liveness_seconds that the
+ *              modem still answers.
+ *
+ * Returns:     Never returns.
+ *
+ ******************************************************************************/
+static void *dispatch_worker(void *vargp)
+{
+    dispatch_modem_t *m           = (dispatch_modem_t *)vargp;
+    uint64_t          liveness_ns = (uint64_t)config.liveness_seconds * NSEC_PER_SEC;
+
+    TRACE_THREAD_NAME("dispatch");
+
+    pthread_mutex_lock(&dispatch_mutex);
+
+    for (;;)
+    {
+        dispatch_job_t *job = m->head;
+
+        if (job != NULL)
+        {
+            m->head = job->next;
+            if (m->head == NULL)
+            {
+                m->tail = NULL;
+            }
+            pthread_mutex_unlock(&dispatch_mutex);
+
+            TRACE_BEGIN("dispatch send");
+            uint64_t start_ns = monotonic_time_ns();
+            dispatch_power(m, 1);
+            int ret = gsm_send_message(m->modem, job->destination, job->message);
+            dispatch_power(m, 0);
+            uint64_t elapsed_ns = monotonic_time_ns() - start_ns;
+            TRACE_END("dispatch send");
+
+            pthread_mutex_lock(&dispatch_mutex);
+            dispatch_sent(m, job, ret, elapsed_ns);
+            continue;
+        }
+
+        uint64_t due_ns = m->checked_ns + liveness_ns;
+
+        if (monotonic_time_ns() >= due_ns)
+        {
+            pthread_mutex_unlock(&dispatch_mutex);
+            int live = gsm_check_liveness(m->modem);
+            pthread_mutex_lock(&dispatch_mutex);
+
+            dispatch_checked(m, live);
+            continue;
+        }
+
+        struct timespec deadline = {
+            .tv_sec  = (time_t)(due_ns / NSEC_PER_SEC),
+            .tv_nsec = (long)(due_ns % NSEC_PER_SEC),
+        };
+        pthread_cond_timedwait(&m->wake, &dispatch_mutex, &deadline);
+    }
+
+    return NULL;
+}
+
+/*******************************************************************************
+ *
+ * Function:    dispatch_init()
+ *
+ * Description: Registers the metrics of every modem, sets its radio to the
+ *              idle state and starts its worker.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+int dispatch_init(gsm_t *const *list, uint32_t count, const dispatch_config_t *cfg)
+{
+    pthread_condattr_t attr;
+    int                ret = 0;
+
+    if ((list == NULL) || (count == 0) || (count > DISPATCH_MAX_MODEMS) || (cfg == NULL) ||
+        (cfg->liveness_seconds == 0) || (cfg->max_failures == 0) ||
+        (cfg->max_attempts == 0) || (num_modems != 0))
+    {
+        return -1;
+    }
+
+    config = *cfg;
+
+    // The workers wait for the next liveness check on CLOCK_MONOTONIC.
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+
+    for (uint32_t n = 0; n < count; ++n)
+    {
+        dispatch_modem_t *m    = &modems[n];
+        const char       *name = gsm_name(list[n]);
+
+        m->modem      = list[n];
+        m->index      = n;
+        m->healthy    = 1;
+        m->latency_ns = DISPATCH_INITIAL_LATENCY_NS;
+        m->checked_ns = monotonic_time_ns();
+        pthread_cond_init(&m->wake, &attr);
+        pthread_mutex_init(&m->power_mutex, NULL);
+
+        snprintf(m->labels, sizeof(m->labels), "{modem=\"%s\"}", name);
+        snprintf(m->sent_labels, sizeof(m->sent_labels), "{modem=\"%s\",result=\"sent\"}", name);
+        snprintf(m->failed_labels, sizeof(m->failed_labels), "{modem=\"%s\",result=\"failed\"}",
+                 name);
+        m->healthy_metric = metrics_gauge("sitemon_modem_healthy", m->labels,
+                                          "Whether the modem is in service for sending.");
+        m->depth_metric = metrics_gauge("sitemon_modem_queue_depth", m->labels,
+                                        "Messages queued on or being sent by the modem.");
+        m->sent_metric = metrics_counter("sitemon_sms_total", m->sent_labels,
+                                         "SMS send attempts by modem and result.");
+        m->failed_metric = metrics_counter("sitemon_sms_total", m->failed_labels,
+                                           "SMS send attempts by modem and result.");
+        m->send_metric = metrics_histogram("sitemon_sms_send_seconds", m->labels,
+                                           "Time to send one SMS, turning the radio on included.");
+        metrics_set(m->healthy_metric, 1);
+
+        gsm_set_functionality_mode(m->modem, config.power_save ? GSM_MINIMUM_FUNCTIONALITY_MODE
+                                                               : GSM_FULL_FUNCTIONALITY_MODE);
+    }
+
+    pthread_condattr_destroy(&attr);
+
+    pthread_mutex_lock(&dispatch_mutex);
+    num_modems = count;
+    pthread_mutex_unlock(&dispatch_mutex);
+
+    for (uint32_t n = 0; n < count; ++n)
+    {
+        dispatch_modem_t *m = &modems[n];
+
+        if (pthread_create(&m->thread, NULL, dispatch_worker, m) != 0)
+        {
+            // Without a worker it must never be picked.
+            LOG_ERROR("dispatch: failed to start the worker of %s", gsm_name(m->modem));
+            pthread_mutex_lock(&dispatch_mutex);
+            m->healthy = 0;
+            metrics_set(m->healthy_metric, 0);
+            pthread_mutex_unlock(&dispatch_mutex);
+            ret = -1;
+            continue;
+        }
+        pthread_detach(m->thread);
+    }
+
+    LOG_INFO("dispatch: %u modems", count);
+
+    return ret;
+}
+
+/*******************************************************************************
+ *
+ * Function:    dispatch_send()
+ *
+ * Description: Queues a message on the best healthy modem and waits until it
+ *              has been sent or given up.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+int dispatch_send(const char *destination, const char *message)
+{
+    TRACE_SCOPE("dispatch_send");
+
+    dispatch_job_t job = {
+        .destination = destination,
+        .message     = message,
+        .result      = DISPATCH_PENDING,
+    };
+
+    // Both must fit the command buffer of the modem.
+    if ((strlen(destination) >= DISPATCH_DESTINATION_SIZE) ||
+        (strlen(message) > GSM_TX_BUF_SIZE - 2))
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&dispatch_mutex);
+    dispatch_route(&job);
+    while (job.result == DISPATCH_PENDING)
+    {
+        pthread_cond_wait(&dispatch_done, &dispatch_mutex);
+    }
+    pthread_mutex_unlock(&dispatch_mutex);
+
+    if (job.result == -1)
+    {
+        LOG_ERROR("dispatch: gave up on a message to %s after %u attempts", destination,
+                  job.attempts);
+    }
+    return job.result;
+}
+
+/*******************************************************************************
+ *
+ * Function:    dispatch_acquire()
+ *
+ * Description: Picks the best healthy modem and turns its radio on. The
+ *              modem counts as busy until it is released, so messages go to
+ *              the others where they can.
+ *
+ * Returns:     The modem, or NULL if none is healthy.
+ *
+ ******************************************************************************/
+gsm_t *dispatch_acquire(void)
+{
+    pthread_mutex_lock(&dispatch_mutex);
+
+    dispatch_modem_t *m = dispatch_pick(0);
+    if (m != NULL)
+    {
+        m->depth += 1;
+        metrics_set(m->depth_metric, m->depth);
+    }
+
+    pthread_mutex_unlock(&dispatch_mutex);
+
+    if (m == NULL)
+    {
+        return NULL;
+    }
+
+    dispatch_power(m, 1);
+    return m->modem;
+}
+
+/*******************************************************************************
+ *
+ * Function:    dispatch_release()
+ *
+ * Description: Hands back a modem from dispatch_acquire().
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+void dispatch_release(gsm_t *modem)
+{
+    for (uint32_t n = 0; n < num_modems; ++n)
+    {
+        dispatch_modem_t *m = &modems[n];
+
+        if (m->modem != modem)
+        {
+            continue;
+        }
+
+        dispatch_power(m, 0);
+
+        pthread_mutex_lock(&dispatch_mutex);
+        m->depth -= 1;
+        metrics_set(m->depth_metric, m->depth);
+        pthread_mutex_unlock(&dispatch_mutex);
+        return;
+    }
+}
@@ -0,0 +1,374 @@
+#include "event.h"
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// Global module variables
+static event_config_t config;
+static uint64_t       history;     // bit n is set if the frame n frames ago was active
+static uint64_t       window_mask;
+static uint32_t       active_count;  // number of set bits in history
+static uint64_t       frame_number;
+static uint64_t       timestamps[EVENT_MAX_WINDOW];
+static uint32_t       scores[EVENT_MAX_WINDOW];
+static float          flows_x[EVENT_MAX_WINDOW];
+static float          flows_y[EVENT_MAX_WINDOW];
+static int            open;
+static event_t        current;
+
+// What event_wait_travel() sees of the state machine, updated every frame.
+static pthread_mutex_t published_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  published_changed;
+static pthread_once_t  published_once = PTHREAD_ONCE_INIT;
+static event_t         published;
+static int             published_open;
+
+/*******************************************************************************
+ *
+ * Function:    event_init_published()
+ *
+ * Description: Initializes the condition variable, timed against the
+ *              monotonic clock so that setting the time cannot stretch a wait.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void event_init_published(void)
+{
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&published_changed, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+/*******************************************************************************
+ *
+ * Function:    event_publish()
+ *
+ * Description: Makes the current event visible to event_wait_travel() and
+ *              wakes up anyone waiting on it.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void event_publish(void)
+{
+    pthread_once(&published_once, event_init_published);
+
+    pthread_mutex_lock(&published_lock);
+    published      = current;
+    published_open = open;
+    pthread_cond_broadcast(&published_changed);
+    pthread_mutex_unlock(&published_lock);
+}
+
+/*******************************************************************************
+ *
+ * Function:    event_init()
+ *
+ * Description: Initialize the event state machine.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+int event_init(const event_config_t *cfg)
+{
+    if ((cfg == NULL) || (cfg->window == 0) || (cfg->window > EVENT_MAX_WINDOW) ||
+        (cfg->open_count == 0) || (cfg->open_count > cfg->window))
+    {
+        return -1;
+    }
+
+    config       = *cfg;
+    window_mask  = (config.window == 64) ? UINT64_MAX : ((1ull << config.window) - 1);
+    history      = 0;
+    active_count = 0;
+    frame_number = 0;
+    open         = 0;
+    memset(&current, 0, sizeof(current));
+    event_publish();
+
+    return 0;
+}
+
+/*******************************************************************************
+ *
+ * Function:    event_update()
+ *
+ * Description: Feeds the decision for one analyzed frame into the state
+ *              machine. The last window decisions are kept as a bit mask with
+ *              a running count of set bits, so every frame costs the same
+ *              regardless of the window size. When an event opens, its start
+ *              is the oldest active frame still in the window.
+ *
+ * Returns:     What happened to the event state as a result of this frame.
+ *
+ ******************************************************************************/
+event_transition_t event_update(int active, uint32_t score, float flow_x, float flow_y,
+                                uint64_t timestamp_ns, event_t *event)
+{
+    event_transition_t transition;
+    uint32_t           slot = (uint32_t)(frame_number % config.window);
+
+    active = (active != 0);
+
+    // Slide the window by one frame.
+    active_count -= (uint32_t)((history >> (config.window - 1)) & 1);
+    history       = ((history << 1) | (uint64_t)active) & window_mask;
+    active_count += (uint32_t)active;
+    timestamps[slot] = timestamp_ns;
+    scores[slot]     = score;
+    flows_x[slot]    = flow_x;
+    flows_y[slot]    = flow_y;
+    ++frame_number;
+
+    if (!open)
+    {
+        if (active_count < config.open_count)
+        {
+            return EVENT_IDLE;
+        }
+
+        uint32_t age = 63u - (uint32_t)__builtin_clzll(history);
+
+        open = 1;
+        current.id        += 1;
+        current.start_ns   = timestamps[(frame_number - 1 - age) % config.window];
+        current.end_ns     = timestamp_ns;
+        current.peak_score = 0;
+        current.frames     = active_count;
+        current.travel_x   = 0.0f;
+        current.travel_y   = 0.0f;
+
+        for (uint32_t n = 0; n <= age; ++n)
+        {
+            uint32_t past = (uint32_t)((frame_number - 1 - n) % config.window);
+
+            if (!((history >> n) & 1))
+            {
+                continue;
+            }
+            if (scores[past] > current.peak_score)
+            {
+                current.peak_score = scores[past];
+            }
+            current.travel_x += flows_x[past];
+            current.travel_y += flows_y[past];
+        }
+
+        transition = EVENT_OPENED;
+    }
+    else if (active)
+    {
+        current.end_ns    = timestamp_ns;
+        current.frames   += 1;
+        current.travel_x += flow_x;
+        current.travel_y += flow_y;
+        if (score > current.peak_score)
+        {
+            current.peak_score = score;
+        }
+        transition = EVENT_ONGOING;
+    }
+    else if (timestamp_ns - current.end_ns >= (uint64_t)config.quiet_ms * 1000000ull)
+    {
+        // Start the next event from a clean window.
+        open         = 0;
+        history      = 0;
+        active_count = 0;
+        transition   = EVENT_CLOSED;
+    }
+    else
+    {
+        transition = EVENT_ONGOING;
+    }
+
+    event_publish();
+
+    if (event != NULL)
+    {
+        *event = current;
+    }
+
+    return transition;
+}
+
+/*******************************************************************************
+ *
+ * Function:    event_save_state()
+ *
+ * Description: Copies the state of the state machine.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+void event_save_state(event_state_t *state)
+{
+    memset(state, 0, sizeof(*state));
+    state->config       = config;
+    state->history      = history;
+    state->active_count = active_count;
+    state->open         = (uint32_t)open;
+    state->frame_number = frame_number;
+    state->current      = current;
+    memcpy(state->timestamps, timestamps, sizeof(timestamps));
+    memcpy(state->scores, scores, sizeof(scores));
+    memcpy(state->flows_x, flows_x, sizeof(flows_x));
+    memcpy(state->flows_y, flows_y, sizeof(flows_y));
+}
+
+/*******************************************************************************
+ *
+ * Function:    event_shift_time()
+ *
+ * Description: Moves a timestamp to another clock base. Times from before the
+ *              start of the current clock become 0.
+ *
+ * Returns:     The shifted timestamp.
+ *
+ ******************************************************************************/
+static uint64_t event_shift_time(uint64_t timestamp_ns, int64_t shift_ns)
+{
+    if ((shift_ns < 0) && (timestamp_ns < (uint64_t)-shift_ns))
+    {
+        return 0;
+    }
+    return timestamp_ns + (uint64_t)shift_ns;
+}
+
+/*******************************************************************************
+ *
+ * Function:    event_restore_state()
+ *
+ * Description: Continues from a saved state. The settings must be the same,
+ *              as the window history means nothing under other settings.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+int event_restore_state(const event_state_t *state, int64_t shift_ns)
+{
+    if ((state->config.window != config.window) ||
+        (state->config.open_count != config.open_count) ||
+        (state->config.quiet_ms != config.quiet_ms) ||
+        ((state->history & ~window_mask) != 0) ||
+        (state->active_count != (uint32_t)__builtin_popcountll(state->history)))
+    {
+        return -1;
+    }
+
+    history      = state->history;
+    active_count = state->active_count;
+    open         = (state->open != 0);
+    frame_number = state->frame_number;
+    current      = state->current;
+    memcpy(scores, state->scores, sizeof(scores));
+    memcpy(flows_x, state->flows_x, sizeof(flows_x));
+    memcpy(flows_y, state->flows_y, sizeof(flows_y));
+
+    for (uint32_t n = 0; n < EVENT_MAX_WINDOW; ++n)
+    {
+        timestamps[n] = event_shift_time(state->timestamps[n], shift_ns);
+    }
+    current.start_ns = event_shift_time(current.start_ns, shift_ns);
+    current.end_ns   = event_shift_time(current.end_ns, shift_ns);
+    event_publish();
+
+    return 0;
+}
+
+/*******************************************************************************
+ *
+ * Function:    event_describe_travel()
+ *
+ * Description: Describes which way and how fast the moving object of an
+ *              event went, e.g. "approaching, down-left at 40 px/s". Within
+ *              45 degrees of the approach direction counts as approaching.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+void event_describe_travel(const event_t *event, const event_travel_config_t *travel,
+                           char *text, size_t size)
+{
+    static const char *const directions[8] = {
+        "right", "down-right", "down", "down-left", "left", "up-left", "up", "up-right"
+    };
+    double distance = hypot(event->travel_x, event->travel_y);
+    double seconds  = (double)(event->end_ns - event->start_ns) / 1e9;
+
+    text[0] = '\0';
+    if ((distance < travel->min_pixels) || (distance == 0.0))
+    {
+        return;
+    }
+
+    int         sector  = (int)lround(atan2(event->travel_y, event->travel_x) / (M_PI / 4)) & 7;
+    double      toward  = (event->travel_x * travel->approach_x +
+                           event->travel_y * travel->approach_y) /
+                          (distance * hypot(travel->approach_x, travel->approach_y));
+    const char *heading = (toward >= M_SQRT1_2)  ? "approaching"
+                        : (toward <= -M_SQRT1_2) ? "leaving" : "passing";
+
+    if (seconds > 0.0)
+    {
+        snprintf(text, size, "%s, %s at %.0f px/s", heading, directions[sector],
+                 distance / seconds);
+    }
+    else
+    {
+        snprintf(text, size, "%s, %s", heading, directions[sector]);
+    }
+}
+
+/*******************************************************************************
+ *
+ * Function:    event_wait_travel()
+ *
+ * Description: Waits until the event opened as opened has travelled
+ *              min_pixels, has max_frames active frames, has closed, or
+ *              timeout_ms has passed, whichever comes first.
+ *
+ * Returns:     If the event has travelled min_pixels, returns 0. Otherwise,
+ *              returns -1.
+ *
+ ******************************************************************************/
+int event_wait_travel(const event_t *opened, float min_pixels, uint32_t max_frames,
+                      uint32_t timeout_ms, event_t *event)
+{
+    struct timespec deadline;
+    uint32_t        id        = opened->id;
+    int             timed_out = 0;
+    int             ret       = -1;
+
+    pthread_once(&published_once, event_init_published);
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec  += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec  += 1;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&published_lock);
+    while ((published.id == id) && published_open && (published.frames < max_frames) &&
+           (hypot(published.travel_x, published.travel_y) < min_pixels) && !timed_out)
+    {
+        timed_out = (pthread_cond_timedwait(&published_changed, &published_lock, &deadline) != 0);
+    }
+    if (published.id == id)
+    {
+        *event = published;
+        ret    = (hypot(published.travel_x, published.travel_y) >= min_pixels) ? 0 : -1;
+    }
+    pthread_mutex_unlock(&published_lock);
+
+    return ret;
+}
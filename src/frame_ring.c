@@ -0,0 +1,405 @@
+#include "frame_ring.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define FRAME_RING_ALIGN      64 // slots and pixels start on a cache line
+#define FRAME_RING_ROW_ALIGN  16 // rows are padded for SIMD readers
+#define FRAME_RING_NAME_SIZE  64
+#define FRAME_RING_MAX_RETRIES 4
+
+#define FRAME_RING_ROUND_UP(n, a) (((n) + (a) - 1) / (a) * (a))
+
+// The start of the shared memory. magic is written last when the ring is
+// created, so a reader never attaches to a half-initialized ring.
+typedef struct frame_ring_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t slot_size; // bytes from one slot to the next
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t reserved;
+    uint64_t published __attribute__((aligned(FRAME_RING_ALIGN))); // frames published
+} __attribute__((aligned(FRAME_RING_ALIGN))) frame_ring_header_t;
+
+// A slot is followed by its pixels. sequence is 2n+1 while frame n is being
+// written to the slot and 2n+2 once it is complete.
+typedef struct frame_ring_slot
+{
+    uint64_t          sequence;
+    frame_ring_meta_t meta;
+} __attribute__((aligned(FRAME_RING_ALIGN))) frame_ring_slot_t;
+
+struct frame_ring
+{
+    frame_ring_header_t *header;
+    size_t               size;
+    char                 name[FRAME_RING_NAME_SIZE];
+};
+
+struct frame_reader
+{
+    const frame_ring_header_t *header;
+    size_t                     size;
+    uint64_t                   next;    // index of the next frame to read
+    uint64_t                   skipped;
+};
+
+/*******************************************************************************
+ *
+ * Function:    frame_ring_slot()
+ *
+ * Description: Finds the slot that holds a given frame.
+ *
+ * Returns:     A pointer to the slot.
+ *
+ ******************************************************************************/
+static inline frame_ring_slot_t *frame_ring_slot(const frame_ring_header_t *header,
+                                                 uint64_t index)
+{
+    return (frame_ring_slot_t *)((uint8_t *)header + sizeof(frame_ring_header_t) +
+                                 (size_t)(index % header->slots) * header->slot_size);
+}
+
+/*******************************************************************************
+ *
+ * Function:    frame_ring_create()
+ *
+ * Description: Creates the shared-memory ring and maps it for writing.
+ *
+ * Returns:     The ring, or NULL on failure.
+ *
+ ******************************************************************************/
+frame_ring_t *frame_ring_create(const char *name, uint32_t width, uint32_t height,
+                                uint32_t slots)
+{
+    frame_ring_t *ring;
+    int           fd;
+
+    if ((name == NULL) || (strlen(name) >= FRAME_RING_NAME_SIZE) ||
+        (width == 0) || (height == 0) || (slots < 2))
+    {
+        return NULL;
+    }
+
+    uint32_t stride    = FRAME_RING_ROUND_UP(width, FRAME_RING_ROW_ALIGN);
+    uint32_t slot_size = FRAME_RING_ROUND_UP(sizeof(frame_ring_slot_t) + stride * height,
+                                             FRAME_RING_ALIGN);
+    size_t   size      = sizeof(frame_ring_header_t) + (size_t)slot_size * slots;
+
+    if ((ring = calloc(1, sizeof(*ring))) == NULL)
+    {
+        return NULL;
+    }
+
+    // Start from a fresh object so that readers of a previous run notice.
+    shm_unlink(name);
+    if ((fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644)) == -1)
+    {
+        free(ring);
+        return NULL;
+    }
+
+    if (ftruncate(fd, (off_t)size) == -1)
+    {
+        close(fd);
+        shm_unlink(name);
+        free(ring);
+        return NULL;
+    }
+
+    ring->header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ring->header == MAP_FAILED)
+    {
+        shm_unlink(name);
+        free(ring);
+        return NULL;
+    }
+
+    ring->size = size;
+    strcpy(ring->name, name);
+    ring->header->version   = FRAME_RING_VERSION;
+    ring->header->slots     = slots;
+    ring->header->slot_size = slot_size;
+    ring->header->width     = width;
+    ring->header->height    = height;
+    ring->header->stride    = stride;
+    ring->header->published = 0;
+    __atomic_store_n(&ring->header->magic, FRAME_RING_MAGIC, __ATOMIC_RELEASE);
+
+    return ring;
+}
+
+/*******************************************************************************
+ *
+ * Function:    frame_ring_publish()
+ *
+ * Description: Copies a frame into the next slot. The slot's sequence is made
+ *              odd before and even after the copy, which is all a reader
+ *              needs to notice that it raced with the writer.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+void frame_ring_publish(frame_ring_t *ring, const uint8_t *luma, size_t stride,
+                        const frame_ring_meta_t *meta)
+{
+    frame_ring_header_t *header = ring->header;
+    uint64_t             index  = header->published;
+    frame_ring_slot_t   *slot   = frame_ring_slot(header, index);
+    uint8_t             *pixels = (uint8_t *)(slot + 1);
+
+    __atomic_store_n(&slot->sequence, 2 * index + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    slot->meta        = *meta;
+    slot->meta.index  = index;
+    slot->meta.width  = header->width;
+    slot->meta.height = header->height;
+    slot->meta.stride = header->stride;
+
+    for (uint32_t row = 0; row < header->height; ++row)
+    {
+        memcpy(pixels + (size_t)row * header->stride, luma + row * stride, header->width);
+    }
+
+    __atomic_store_n(&slot->sequence, 2 * index + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&header->published, index + 1, __ATOMIC_RELEASE);
+}
+
+/*******************************************************************************
+ *
+ * Function:    frame_ring_destroy()
+ *
+ * Description: Unmaps and removes the ring.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+void frame_ring_destroy(frame_ring_t *ring)
+{
+    if (ring == NULL)
+    {
+        return;
+    }
+
+    munmap(ring->header, ring->size);
+    shm_unlink(ring->name);
+    free(ring);
+}
+
+/*******************************************************************************
+ *
+ * Function:    frame_reader_attach()
+ *
+ * Description: Maps an existing ring read-only and checks that its layout is
+ *              the one this library understands.
+ *
+ * Returns:     The reader, or NULL on failure.
+ *
+ ******************************************************************************/
+frame_reader_t *frame_reader_attach(const char *name)
+{
+    frame_reader_t *reader;
+    struct stat     st;
+    int             fd;
+
+    if ((reader = calloc(1, sizeof(*reader))) == NULL)
+    {
+        return NULL;
+    }
+
+    if ((fd = shm_open(name, O_RDONLY, 0)) == -1)
+    {
+        free(reader);
+        return NULL;
+    }
+
+    if ((fstat(fd, &st) == -1) || ((size_t)st.st_size < sizeof(frame_ring_header_t)))
+    {
+        close(fd);
+        free(reader);
+        return NULL;
+    }
+
+    reader->size   = (size_t)st.st_size;
+    reader->header = mmap(NULL, reader->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (reader->header == MAP_FAILED)
+    {
+        free(reader);
+        return NULL;
+    }
+
+    const frame_ring_header_t *header = reader->header;
+
+    if ((__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != FRAME_RING_MAGIC) ||
+        (header->version != FRAME_RING_VERSION) || (header->slots < 2) ||
+        (sizeof(frame_ring_header_t) + (size_t)header->slot_size * header->slots > reader->size))
+    {
+        frame_reader_detach(reader);
+        return NULL;
+    }
+
+    uint64_t published = __atomic_load_n(&header->published, __ATOMIC_ACQUIRE);
+    reader->next = (published > 0) ? published - 1 : 0;
+
+    return reader;
+}
+
+/*******************************************************************************
+ *
+ * Function:    frame_reader_begin()
+ *
+ * Description: Finds the next unread frame. A reader that has fallen so far
+ *              behind that its next frame may already be overwritten skips
+ *              to the newest one. The slot is checked to hold the expected,
+ *              completely written frame before it is handed out.
+ *
+ * Returns:     1 if a frame is available, 0 if the reader is up to date.
+ *
+ ******************************************************************************/
+int frame_reader_begin(frame_reader_t *reader, frame_view_t *view)
+{
+    const frame_ring_header_t *header = reader->header;
+
+    for (int attempt = 0; attempt < FRAME_RING_MAX_RETRIES; ++attempt)
+    {
+        uint64_t published = __atomic_load_n(&header->published, __ATOMIC_ACQUIRE);
+
+        if (reader->next >= published)
+        {
+            return 0;
+        }
+
+        // The slot after the newest frame is the next one to be overwritten.
+        if (published - reader->next >= header->slots)
+        {
+            reader->skipped += published - 1 - reader->next;
+            reader->next     = published - 1;
+        }
+
+        const frame_ring_slot_t *slot     = frame_ring_slot(header, reader->next);
+        uint64_t                 sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+
+        if (sequence == 2 * reader->next + 2)
+        {
+            view->meta          = slot->meta;
+            view->pixels        = (const uint8_t *)(slot + 1);
+            view->slot_sequence = sequence;
+            reader->next       += 1;
+            if (frame_reader_end(reader, view))
+            {
+                return 1;
+            }
+        }
+
+        // Lapped while looking at the slot, start over from the newest frame.
+        reader->skipped += 1;
+        reader->next     = __atomic_load_n(&header->published, __ATOMIC_ACQUIRE);
+        reader->next     = (reader->next > 0) ? reader->next - 1 : 0;
+    }
+
+    return 0;
+}
+
+/*******************************************************************************
+ *
+ * Function:    frame_reader_end()
+ *
+ * Description: Checks that the slot of a view still holds the same frame.
+ *
+ * Returns:     1 if the frame was intact, 0 if it was overwritten.
+ *
+ ******************************************************************************/
+int frame_reader_end(frame_reader_t *reader, const frame_view_t *view)
+{
+    const frame_ring_slot_t *slot = frame_ring_slot(reader->header, view->meta.index);
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) == view->slot_sequence;
+}
+
+/*******************************************************************************
+ *
+ * Function:    frame_reader_read()
+ *
+ * Description: Copies the next unread frame out of the ring, retrying with a
+ *              newer frame if the writer overwrote it during the copy.
+ *
+ * Returns:     1 if a frame was copied, 0 if the reader is up to date, -1 if
+ *              pixels is too small.
+ *
+ ******************************************************************************/
+int frame_reader_read(frame_reader_t *reader, frame_ring_meta_t *meta,
+                      uint8_t *pixels, size_t size)
+{
+    const frame_ring_header_t *header = reader->header;
+    frame_view_t               view;
+
+    if (size < (size_t)header->stride * header->height)
+    {
+        return -1;
+    }
+
+    for (int attempt = 0; attempt < FRAME_RING_MAX_RETRIES; ++attempt)
+    {
+        if (!frame_reader_begin(reader, &view))
+        {
+            return 0;
+        }
+
+        memcpy(pixels, view.pixels, (size_t)view.meta.stride * view.meta.height);
+
+        if (frame_reader_end(reader, &view))
+        {
+            *meta = view.meta;
+            return 1;
+        }
+        reader->skipped += 1;
+    }
+
+    return 0;
+}
+
+/*******************************************************************************
+ *
+ * Function:    frame_reader_skipped()
+ *
+ * Description: Gets the number of frames the reader missed.
+ *
+ * Returns:     The number of frames skipped so far.
+ *
+ ******************************************************************************/
+uint64_t frame_reader_skipped(const frame_reader_t *reader)
+{
+    return reader->skipped;
+}
+
+/*******************************************************************************
+ *
+ * Function:    frame_reader_detach()
+ *
+ * Description: Unmaps the ring.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+void frame_reader_detach(frame_reader_t *reader)
+{
+    if (reader == NULL)
+    {
+        return;
+    }
+
+    munmap((void *)reader->header, reader->size);
+    free(reader);
+}
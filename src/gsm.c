@@ -1,10 +1,16 @@
 #include "gsm.h"
 #include "serial.h"
 #include "util.h"
-#include "debug.h"
+#include "log.h"
+#include "metrics.h"
+#include "trace.h"
+#include "cmux.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
 #include <pthread.h>
 
 // Control characters
@@ -17,6 +23,18 @@
 #define AT_CMGS  "AT+CMGS"
 #define AT_CSCS  "AT+CSCS"
 #define AT_CFUN  "AT+CFUN"
+#define AT_CSQ   "AT+CSQ"
+#define AT_CREG  "AT+CREG"
+#define AT_SAPBR "AT+SAPBR"
+#define AT_HTTPINIT   "AT+HTTPINIT"
+#define AT_HTTPTERM   "AT+HTTPTERM"
+#define AT_HTTPPARA   "AT+HTTPPARA"
+#define AT_HTTPDATA   "AT+HTTPDATA"
+#define AT_HTTPACTION "AT+HTTPACTION"
+#define AT_HTTPREAD   "AT+HTTPREAD"
+#define AT_IPR   "AT+IPR"
+#define AT_IFC   "AT+IFC"
+#define AT_CMUX  "AT+CMUX"
 #define AT_OK    "OK"
 #define AT_ERROR "ERROR"
 
@@ -29,15 +47,61 @@
 #define GSM_CHARSET_GSM  "GSM"
 #define GSM_CHARSET_UCS2 "UCS2"
 
+// Final result lines that end a command. Matched together with the line end
+// that follows them, so a partially received line never matches.
+#define GSM_FINAL_OK       "OK\r\n"
+#define GSM_FINAL_ERROR    "ERROR"
+#define GSM_FINAL_DOWNLOAD "DOWNLOAD"
+
+// How long to wait for responses on the data channel.
+#define GSM_COMMAND_TIMEOUT_MS  5000
+#define GSM_BEARER_TIMEOUT_MS   30000
+#define GSM_HTTP_DATA_TIMEOUT_MS 30000
+#define GSM_HTTP_TIMEOUT_MS     60000
+#define GSM_HTTP_READ_BUF_SIZE  512
+
+// The rate the modem answers at after power on, before AT+IPR.
+#define GSM_DEFAULT_BAUD 115200
+
+// Background status refresh, see gsm_start_status_monitor().
+#define GSM_STATUS_IDLE_MS        500 // how often idle URCs are read
+#define GSM_STATUS_SETTLE_SECONDS 5   // first poll after the radio is turned on
+#define GSM_CSQ_UNKNOWN           99
+
 // The buffer capacity should be on less than the size to allow for null
 // terminating character.
 #define GSM_RX_BUF_CAPACITY (GSM_RX_BUF_SIZE - 1)
 
-typedef struct gsm
+// The AT command streams. Without the multiplexer they all share the serial
+// port and its lock. With it, each has a virtual channel of its own and a
+// slow command on one no longer holds up the others.
+typedef enum gsm_channel_id
+{
+    GSM_CHANNEL_CONTROL, // setup, SMS and functionality mode
+    GSM_CHANNEL_STATUS,  // the status monitor
+    GSM_CHANNEL_DATA,    // HTTP transfers
+    GSM_NUM_CHANNELS
+} gsm_channel_id_t;
+
+typedef struct gsm_channel
+{
+    gsm_t          *modem;
+    int             fd;
+    pthread_mutex_t mutex;
+    uint32_t        waiters; // threads in gsm_lock()
+    char            tx_buf[GSM_TX_BUF_SIZE];
+    char            rx_buf[GSM_RX_BUF_SIZE];
+} gsm_channel_t;
+
+struct gsm
 {
-    int  fd;
-    char tx_buf[GSM_TX_BUF_SIZE];
-    char rx_buf[GSM_RX_BUF_SIZE];
+    int               fd; // the serial port
+    char              name[GSM_NAME_SIZE];
+    char              labels[GSM_NAME_SIZE + 16]; // {modem="name"}
+    gsm_link_config_t link;
+    cmux_t           *mux; // NULL unless multiplexing
+    gsm_channel_t     channel_pool[GSM_NUM_CHANNELS];
+    gsm_channel_t    *channels[GSM_NUM_CHANNELS];
     struct
     {
         char manufacturer[64]; 
@@ -47,11 +111,147 @@ typedef struct gsm
         char imei[64];         
         char gcap[64];         
     } identification;
-} gsm_t;
 
-// Global singleton GSM object
-static gsm_t           gsm;
-static pthread_mutex_t gsm_mutex;
+    // The latest modem status. Only written with status_mutex held, and read
+    // without any lock: sequence is odd while the status is being written, so
+    // readers retry if it changed or was odd while they copied.
+    struct
+    {
+        uint32_t     sequence;
+        gsm_status_t status;
+    } status_cache __attribute__((aligned(64)));
+    pthread_mutex_t status_mutex;
+    uint64_t        poll_ns; // see gsm_start_status_monitor()
+
+    metric_t *rssi_metric;
+    metric_t *registration_metric;
+};
+
+// Round trip time of each AT command, from writing the command until the
+// response has been read. Shared by all modems and registered by the first
+// gsm_open().
+static pthread_once_t round_trip_once = PTHREAD_ONCE_INIT;
+static struct
+{
+    metric_t *at;
+    metric_t *ati;
+    metric_t *cmgf;
+    metric_t *cscs;
+    metric_t *cmgs;
+    metric_t *cfun;
+    metric_t *http;
+} round_trip;
+
+/****************************************************************************** 
+ *
+ * Function:    gsm_lock()
+ *
+ * Description: Locks a channel, tracing how long the caller waited for it.
+ *              Waiting threads are counted so that the status monitor can
+ *              make way for them.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static inline void gsm_lock(gsm_channel_t *ch)
+{
+    TRACE_BEGIN("gsm channel wait");
+    __atomic_add_fetch(&ch->waiters, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&ch->mutex);
+    __atomic_sub_fetch(&ch->waiters, 1, __ATOMIC_RELAXED);
+    TRACE_END("gsm channel wait");
+}
+
+/****************************************************************************** 
+ *
+ * Function:    gsm_publish_status()
+ *
+ * Description: Replaces the cached status.
+ *
+ * Notes:       Must be called with status_mutex held, which makes it the
+ *              only writer.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void gsm_publish_status(gsm_t *modem, const gsm_status_t *status)
+{
+    uint32_t sequence = modem->status_cache.sequence;
+
+    __atomic_store_n(&modem->status_cache.sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    modem->status_cache.status = *status;
+    __atomic_store_n(&modem->status_cache.sequence, sequence + 2, __ATOMIC_RELEASE);
+
+    metrics_set(modem->rssi_metric, status->rssi_dbm);
+    metrics_set(modem->registration_metric, (int64_t)status->registration);
+}
+
+/****************************************************************************** 
+ *
+ * Function:    gsm_parse_status()
+ *
+ * Description: Picks the signal quality, registration state and
+ *              functionality mode out of anything the modem sent, whether
+ *              responses to AT+CSQ, AT+CREG? and AT+CFUN? or +CREG URCs, and
+ *              publishes them if any were found.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void gsm_parse_status(gsm_t *modem, const char *buf)
+{
+    pthread_mutex_lock(&modem->status_mutex);
+
+    gsm_status_t status  = modem->status_cache.status;
+    uint64_t     now_ns  = monotonic_time_ns();
+    int          changed = 0;
+    const char  *p;
+    unsigned     first, second;
+
+    for (p = buf; (p = strstr(p, "+CSQ:")) != NULL; ++p)
+    {
+        if (sscanf(p, "+CSQ: %u,%u", &first, &second) == 2)
+        {
+            status.rssi_dbm  = (first == GSM_CSQ_UNKNOWN) ? GSM_RSSI_UNKNOWN
+                                                          : -113 + 2 * (int32_t)first;
+            status.ber       = second;
+            status.signal_ns = now_ns;
+            changed          = 1;
+        }
+    }
+
+    // A response to AT+CREG? is "+CREG: n,stat[,lac,ci]", while the URC is
+    // "+CREG: stat[,lac,ci]" with lac in quotes.
+    for (p = buf; (p = strstr(p, "+CREG:")) != NULL; ++p)
+    {
+        int fields = sscanf(p, "+CREG: %u,%u", &first, &second);
+
+        if (fields >= 1)
+        {
+            status.registration    = (gsm_registration_t)((fields == 2) ? second : first);
+            status.registration_ns = now_ns;
+            changed                = 1;
+        }
+    }
+
+    for (p = buf; (p = strstr(p, "+CFUN:")) != NULL; ++p)
+    {
+        if (sscanf(p, "+CFUN: %u", &first) == 1)
+        {
+            status.mode    = (gsm_functionality_mode_t)first;
+            status.mode_ns = now_ns;
+            changed        = 1;
+        }
+    }
+
+    if (changed)
+    {
+        gsm_publish_status(modem, &status);
+    }
+
+    pthread_mutex_unlock(&modem->status_mutex);
+}
 
 /****************************************************************************** 
  *
@@ -65,35 +265,45 @@ static pthread_mutex_t gsm_mutex;
  * Returns:     If GSM modem is connected and reachable, returns 1. Otherwise,
  *              returns 0.
  ******************************************************************************/
-static int gsm_check_liveness()
+int gsm_check_liveness(gsm_t *modem)
 {
-    pthread_mutex_lock(&gsm_mutex);
+    TRACE_SCOPE("AT");
+
+    gsm_channel_t *ch = modem->channels[GSM_CHANNEL_CONTROL];
+
+    gsm_lock(ch);
+
+    uint64_t start_ns = monotonic_time_ns();
 
     // Send AT command to GSM modem.
-    sprintf(gsm.tx_buf, "%s\r", AT);
+    sprintf(ch->tx_buf, "%s\r", AT);
 
-    if (serial_write(gsm.fd, gsm.tx_buf, strlen(gsm.tx_buf)) == -1)
+    if (serial_write(ch->fd, ch->tx_buf, strlen(ch->tx_buf)) == -1)
     {
-        serial_ioflush(gsm.fd);
-        pthread_mutex_unlock(&gsm_mutex);
-        return -1;
+        serial_ioflush(ch->fd);
+        pthread_mutex_unlock(&ch->mutex);
+        return 0;
     }
 
     // Give enough time for GSM modem to have a chance to respond.
+    TRACE_BEGIN("modem response wait");
     SLEEP_MSECONDS(500);
+    TRACE_END("modem response wait");
 
     // Check if GSM modem sent OK response.
     ssize_t nbytes;
-    if ((nbytes = serial_read(gsm.fd, gsm.rx_buf, GSM_RX_BUF_CAPACITY)) == -1)
+    if ((nbytes = serial_read(ch->fd, ch->rx_buf, GSM_RX_BUF_CAPACITY)) == -1)
     {
-        serial_ioflush(gsm.fd);
-        pthread_mutex_unlock(&gsm_mutex);
-        return -1;
+        serial_ioflush(ch->fd);
+        pthread_mutex_unlock(&ch->mutex);
+        return 0;
     }
-    gsm.rx_buf[nbytes] = '\0';
-    int isLive = (strstr(gsm.rx_buf, AT_OK) ? 1 : 0);
+    ch->rx_buf[nbytes] = '\0';
+    gsm_parse_status(modem, ch->rx_buf);
+    metrics_observe(round_trip.at, monotonic_time_ns() - start_ns);
+    int isLive = (strstr(ch->rx_buf, AT_OK) ? 1 : 0);
 
-    pthread_mutex_unlock(&gsm_mutex);
+    pthread_mutex_unlock(&ch->mutex);
 
     return isLive;
 }
@@ -103,39 +313,49 @@ static int gsm_check_liveness()
  * Function:    gsm_read_identification()
  *
  * Description: Reads product identification information from GSM modem and
- *              stores information into gsm.identification structure.
+ *              stores it in the identification of the modem.
  *
  * Returns:     If successful, returns 0. Otherwise, returns -1.
  *
  ******************************************************************************/
-static int gsm_read_identification()
+static int gsm_read_identification(gsm_t *modem)
 {
-    pthread_mutex_lock(&gsm_mutex);
+    TRACE_SCOPE("ATI");
+
+    gsm_channel_t *ch = modem->channels[GSM_CHANNEL_CONTROL];
+
+    gsm_lock(ch);
+
+    uint64_t start_ns = monotonic_time_ns();
 
     // Send ATI command
-    sprintf(gsm.tx_buf, "%s\r", ATI);
+    sprintf(ch->tx_buf, "%s\r", ATI);
 
-    if (serial_write(gsm.fd, gsm.tx_buf, strlen(gsm.tx_buf)) == -1)
+    if (serial_write(ch->fd, ch->tx_buf, strlen(ch->tx_buf)) == -1)
     {
-        serial_ioflush(gsm.fd);
-        pthread_mutex_unlock(&gsm_mutex);
+        serial_ioflush(ch->fd);
+        pthread_mutex_unlock(&ch->mutex);
         return -1;
     }
 
     // Give enough time for modem to respond.
+    TRACE_BEGIN("modem response wait");
     SLEEP_MSECONDS(500);
+    TRACE_END("modem response wait");
 
     // Read response from modem. 
     ssize_t nbytes;
-    if ((nbytes = serial_read(gsm.fd, gsm.rx_buf, GSM_RX_BUF_CAPACITY)) == -1)
+    if ((nbytes = serial_read(ch->fd, ch->rx_buf, GSM_RX_BUF_CAPACITY)) == -1)
     {
-        serial_ioflush(gsm.fd);
-        pthread_mutex_unlock(&gsm_mutex);
+        serial_ioflush(ch->fd);
+        pthread_mutex_unlock(&ch->mutex);
         return -1;
     }
-    gsm.rx_buf[nbytes] = '\0';
+    ch->rx_buf[nbytes] = '\0';
+    gsm_parse_status(modem, ch->rx_buf);
+    metrics_observe(round_trip.ati, monotonic_time_ns() - start_ns);
 
-    char *key = strtok(gsm.rx_buf, ":\n");
+    char *key = strtok(ch->rx_buf, ":\n");
     char *value;
 
     while (key != NULL)
@@ -149,19 +369,19 @@ static int gsm_read_identification()
         // Note that we copy starting at value + 1 because
         // value[0] is white space.
         if (strcmp(key, "Manufacturer") == 0)
-            strcpy(gsm.identification.manufacturer, value + 1);
+            strcpy(modem->identification.manufacturer, value + 1);
         else if (strcmp(key, "Model"))
-            strcpy(gsm.identification.model, value + 1);
+            strcpy(modem->identification.model, value + 1);
         else if (strcmp(key, "Revision"))
-            strcpy(gsm.identification.revision, value + 1);
+            strcpy(modem->identification.revision, value + 1);
         else if (strcmp(key, "SVN"))
-            strcpy(gsm.identification.svn, value + 1);
+            strcpy(modem->identification.svn, value + 1);
         else if (strcmp(key, "IMEI"))
-            strcpy(gsm.identification.imei, value + 1);
+            strcpy(modem->identification.imei, value + 1);
         else if (strcmp(key, "+GCAP"))
-            strcpy(gsm.identification.gcap, value + 1);
+            strcpy(modem->identification.gcap, value + 1);
     }
-    pthread_mutex_unlock(&gsm_mutex);
+    pthread_mutex_unlock(&ch->mutex);
     return 0;
 }
 
@@ -174,35 +394,45 @@ static int gsm_read_identification()
  * Returns:     If successful, returns 0. Otherwise, returns -1.
  *
  ******************************************************************************/
-int gsm_set_message_format(unsigned int fmt)
+static int gsm_set_message_format(gsm_t *modem, unsigned int fmt)
 {
-    pthread_mutex_lock(&gsm_mutex);
+    TRACE_SCOPE("AT+CMGF");
+
+    gsm_channel_t *ch = modem->channels[GSM_CHANNEL_CONTROL];
+
+    gsm_lock(ch);
+
+    uint64_t start_ns = monotonic_time_ns();
 
     // Send AT_CMGF command.
-    sprintf(gsm.tx_buf, "%s=%u\r", AT_CMGF, fmt);
+    sprintf(ch->tx_buf, "%s=%u\r", AT_CMGF, fmt);
 
-    if (serial_write(gsm.fd, gsm.tx_buf, strlen(gsm.tx_buf)) == -1)
+    if (serial_write(ch->fd, ch->tx_buf, strlen(ch->tx_buf)) == -1)
     {
-        serial_ioflush(gsm.fd);
-        pthread_mutex_unlock(&gsm_mutex);
+        serial_ioflush(ch->fd);
+        pthread_mutex_unlock(&ch->mutex);
         return -1;
     }
 
     // Give modem enough time to process command and write response to serial.
+    TRACE_BEGIN("modem response wait");
     SLEEP_MSECONDS(500);
+    TRACE_END("modem response wait");
 
     // Check if modem sent OK response.
     ssize_t nbytes;
-    if ((nbytes = serial_read(gsm.fd, gsm.rx_buf, GSM_RX_BUF_CAPACITY)) == -1)
+    if ((nbytes = serial_read(ch->fd, ch->rx_buf, GSM_RX_BUF_CAPACITY)) == -1)
     {
-        serial_ioflush(gsm.fd);
-        pthread_mutex_unlock(&gsm_mutex);
+        serial_ioflush(ch->fd);
+        pthread_mutex_unlock(&ch->mutex);
         return -1;
     }
-    gsm.rx_buf[nbytes] = '\0';
-    int ret = (strstr(gsm.rx_buf, AT_OK) ? 0 : -1);
+    ch->rx_buf[nbytes] = '\0';
+    gsm_parse_status(modem, ch->rx_buf);
+    metrics_observe(round_trip.cmgf, monotonic_time_ns() - start_ns);
+    int ret = (strstr(ch->rx_buf, AT_OK) ? 0 : -1);
 
-    pthread_mutex_unlock(&gsm_mutex);
+    pthread_mutex_unlock(&ch->mutex);
 
     return ret;
 }
@@ -216,95 +446,548 @@ int gsm_set_message_format(unsigned int fmt)
  * Returns:     If successful, returns 0. Otherwise, returns -1.
  *
  ******************************************************************************/
-static int gsm_set_character_set(const char *charset)
+static int gsm_set_character_set(gsm_t *modem, const char *charset)
 {
-    pthread_mutex_lock(&gsm_mutex);
+    TRACE_SCOPE("AT+CSCS");
+
+    gsm_channel_t *ch = modem->channels[GSM_CHANNEL_CONTROL];
+
+    gsm_lock(ch);
+
+    uint64_t start_ns = monotonic_time_ns();
 
     // Send AT+CSCS command.
-    sprintf(gsm.tx_buf, "%s=\"%s\"\r", AT_CSCS, charset);
+    sprintf(ch->tx_buf, "%s=\"%s\"\r", AT_CSCS, charset);
 
-    if (serial_write(gsm.fd, gsm.tx_buf, strlen(gsm.tx_buf)) == -1)
+    if (serial_write(ch->fd, ch->tx_buf, strlen(ch->tx_buf)) == -1)
     {
-        serial_ioflush(gsm.fd);
-        pthread_mutex_unlock(&gsm_mutex);
+        serial_ioflush(ch->fd);
+        pthread_mutex_unlock(&ch->mutex);
         return -1;
     }
 
     // Give modem enough time to process command and write response to serial.
+    TRACE_BEGIN("modem response wait");
     SLEEP_MSECONDS(500);
+    TRACE_END("modem response wait");
 
     // Check if modem sent OK response.
     ssize_t nbytes;
-    if ((nbytes = serial_read(gsm.fd, gsm.rx_buf, GSM_RX_BUF_CAPACITY)) == -1)
+    if ((nbytes = serial_read(ch->fd, ch->rx_buf, GSM_RX_BUF_CAPACITY)) == -1)
     {
-        serial_ioflush(gsm.fd);
-        pthread_mutex_unlock(&gsm_mutex);
+        serial_ioflush(ch->fd);
+        pthread_mutex_unlock(&ch->mutex);
         return -1;
     }
-    gsm.rx_buf[nbytes] = '\0';
-    int ret = (strstr(gsm.rx_buf, AT_OK) ? 0 : -1);
+    ch->rx_buf[nbytes] = '\0';
+    gsm_parse_status(modem, ch->rx_buf);
+    metrics_observe(round_trip.cscs, monotonic_time_ns() - start_ns);
+    int ret = (strstr(ch->rx_buf, AT_OK) ? 0 : -1);
 
-    pthread_mutex_unlock(&gsm_mutex);
+    pthread_mutex_unlock(&ch->mutex);
 
     return ret; 
 }
 
 /****************************************************************************** 
  *
- * Function:    gsm_init()
+ * Function:    gsm_wait_for()
  *
- * Description: 
+ * Description: Reads responses from the modem until one of the final result
+ *              lines arrives or the timeout expires. Unlike the fixed sleeps
+ *              of the SMS commands, this returns as soon as the modem has
+ *              answered, which keeps the serial link busy during transfers.
  *
- * Returns:     If successful, returns 0. Otherwise, returns -1.
+ * Notes:       Must be called with the channel locked. If buf fills up, its
+ *              older half is discarded.
+ *
+ * Returns:     The index of the final that was received, or -1 on timeout or
+ *              error.
  *
  ******************************************************************************/
-int gsm_init(const char *serial_port)
+static int gsm_wait_for(gsm_channel_t *ch, char *buf, size_t size, const char *const *finals, uint32_t timeout_ms)
 {
-    // Attempt to open serial connection to GSM modem.
-    if((gsm.fd = serial_open(serial_port, B115200)) == -1)
+    size_t   length   = 0;
+    uint64_t deadline = monotonic_time_ns() + (uint64_t)timeout_ms * 1000000ull;
+
+    buf[0] = '\0';
+    for (;;)
+    {
+        for (int n = 0; finals[n] != NULL; ++n)
+        {
+            const char *found = strstr(buf, finals[n]);
+
+            if ((found != NULL) && (strchr(found, '\n') != NULL))
+            {
+                gsm_parse_status(ch->modem, buf);
+                return n;
+            }
+        }
+
+        uint64_t now = monotonic_time_ns();
+        if (now >= deadline)
+        {
+            return -1;
+        }
+
+        struct pollfd pfd = { .fd = ch->fd, .events = POLLIN };
+        int           ready = poll(&pfd, 1, (int)((deadline - now) / 1000000) + 1);
+
+        if ((ready == -1) && (errno != EINTR))
+        {
+            return -1;
+        }
+        if (ready <= 0)
+        {
+            continue;
+        }
+
+        if (length == size - 1)
+        {
+            memmove(buf, buf + length / 2, length - length / 2 + 1);
+            length -= length / 2;
+        }
+
+        ssize_t nread = read(ch->fd, buf + length, size - 1 - length);
+        if (nread == -1)
+        {
+            return -1;
+        }
+        length += (size_t)nread;
+        buf[length] = '\0';
+    }
+}
+
+/****************************************************************************** 
+ *
+ * Function:    gsm_transact()
+ *
+ * Description: Sends a command and waits for its final result.
+ *
+ * Notes:       Must be called with the channel locked. The response is left
+ *              in ch->rx_buf.
+ *
+ * Returns:     The index of the final that was received, or -1 on timeout or
+ *              error.
+ *
+ ******************************************************************************/
+static int gsm_transact(gsm_channel_t *ch, const char *command, const char *const *finals, uint32_t timeout_ms)
+{
+    size_t length = strlen(command);
+
+    if (length + 2 > sizeof(ch->tx_buf))
     {
         return -1;
     }
+    memcpy(ch->tx_buf, command, length);
+    ch->tx_buf[length++] = '\r';
 
+    if (serial_write(ch->fd, (uint8_t *)ch->tx_buf, length) != (ssize_t)length)
+    {
+        serial_ioflush(ch->fd);
+        return -1;
+    }
+
+    return gsm_wait_for(ch, ch->rx_buf, sizeof(ch->rx_buf), finals, timeout_ms);
+}
+
+/****************************************************************************** 
+ *
+ * Function:    gsm_command_ok()
+ *
+ * Description: Sends a command that is expected to answer OK.
+ *
+ * Notes:       Must be called with the channel locked.
+ *
+ * Returns:     If the modem answered OK, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+static int gsm_command_ok(gsm_channel_t *ch, const char *command, uint32_t timeout_ms)
+{
+    static const char *const finals[] = { GSM_FINAL_OK, GSM_FINAL_ERROR, NULL };
+
+    return (gsm_transact(ch, command, finals, timeout_ms) == 0) ? 0 : -1;
+}
+
+/****************************************************************************** 
+ *
+ * Function:    gsm_rate_listed()
+ *
+ * Description: Checks whether a response to AT+IPR=? lists a rate, e.g.
+ *              "+IPR: (0,1200,...,115200),(230400,460800,921600)". Ranges
+ *              such as "(300-921600)" are understood too.
+ *
+ * Returns:     1 if the rate is listed, 0 otherwise.
+ *
+ ******************************************************************************/
+static int gsm_rate_listed(const char *response, uint32_t baud)
+{
+    const char *p = strstr(response, "+IPR:");
+
+    if (p == NULL)
+    {
+        return 0;
+    }
+
+    for (p += strlen("+IPR:"); (*p != '\0') && (*p != '\r') && (*p != '\n'); ++p)
+    {
+        char         *end;
+        unsigned long low, high;
+
+        if ((*p != '(') && (*p != ','))
+        {
+            continue;
+        }
+
+        low = high = strtoul(p + 1, &end, 10);
+        if (end == p + 1)
+        {
+            continue;
+        }
+        if (*end == '-')
+        {
+            high = strtoul(end + 1, &end, 10);
+        }
+        if ((baud >= low) && (baud <= high))
+        {
+            return 1;
+        }
+        p = end - 1;
+    }
+
+    return 0;
+}
+
+/****************************************************************************** 
+ *
+ * Function:    gsm_negotiate_link()
+ *
+ * Description: Turns on RTS/CTS flow control if configured and the modem
+ *              agrees to it, and moves the link to the configured rate if the
+ *              modem supports it. The new rate is checked with AT, and both
+ *              sides go back to GSM_DEFAULT_BAUD if that fails.
+ *
+ * Notes:       Any step the modem refuses is skipped, so the link is left
+ *              working at worst at the rate it was opened with.
+ *
+ * Returns:     If the modem is still reachable, returns 0. Otherwise,
+ *              returns -1.
+ *
+ ******************************************************************************/
+static int gsm_negotiate_link(gsm_t *modem)
+{
+    static const char *const finals[] = { GSM_FINAL_OK, GSM_FINAL_ERROR, NULL };
+    gsm_channel_t *ch  = modem->channels[GSM_CHANNEL_CONTROL];
+    uint32_t       baud = modem->link.baud;
+    char           command[GSM_TX_BUF_SIZE];
+    int            ret = 0;
+
+    gsm_lock(ch);
+
+    if (modem->link.flow_control)
+    {
+        if ((gsm_command_ok(ch, AT_IFC "=2,2", GSM_COMMAND_TIMEOUT_MS) == 0) &&
+            (serial_set_flow_control(modem->fd, 1) == 0))
+        {
+            LOG_INFO("%s: RTS/CTS flow control on", modem->name);
+        }
+        else
+        {
+            LOG_WARN("%s: modem refused RTS/CTS flow control", modem->name);
+        }
+    }
+
+    if ((baud != 0) && (baud != GSM_DEFAULT_BAUD))
+    {
+        snprintf(command, sizeof(command), "%s=%u", AT_IPR, (unsigned)baud);
+
+        if ((gsm_transact(ch, AT_IPR "=?", finals, GSM_COMMAND_TIMEOUT_MS) != 0) ||
+            !gsm_rate_listed(ch->rx_buf, baud))
+        {
+            LOG_WARN("%s: modem doesn't support %u baud", modem->name, (unsigned)baud);
+        }
+        else if (gsm_command_ok(ch, command, GSM_COMMAND_TIMEOUT_MS) == -1)
+        {
+            LOG_WARN("%s: modem refused %u baud", modem->name, (unsigned)baud);
+        }
+        else if ((serial_set_baud(modem->fd, baud) == 0) &&
+                 (gsm_command_ok(ch, AT, GSM_COMMAND_TIMEOUT_MS) == 0))
+        {
+            LOG_INFO("%s: link at %u baud", modem->name, (unsigned)baud);
+        }
+        else
+        {
+            // Ask the modem to go back, in case it hears us, then listen at
+            // the old rate either way.
+            snprintf(command, sizeof(command), "%s=%u", AT_IPR, GSM_DEFAULT_BAUD);
+            gsm_command_ok(ch, command, GSM_COMMAND_TIMEOUT_MS);
+            serial_set_baud(modem->fd, GSM_DEFAULT_BAUD);
+            serial_ioflush(modem->fd);
+
+            if (gsm_command_ok(ch, AT, GSM_COMMAND_TIMEOUT_MS) == 0)
+            {
+                LOG_WARN("%s: no answer at %u baud, staying at %u", modem->name, (unsigned)baud,
+                         GSM_DEFAULT_BAUD);
+            }
+            else
+            {
+                LOG_ERROR("%s: modem lost while changing to %u baud", modem->name, (unsigned)baud);
+                ret = -1;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&ch->mutex);
+
+    return ret;
+}
+
+/****************************************************************************** 
+ *
+ * Function:    gsm_start_multiplexer()
+ *
+ * Description: Switches the modem to the 27.010 multiplexer and gives every
+ *              AT command stream a virtual channel of its own.
+ *
+ * Notes:       If the modem refuses AT+CMUX, all streams keep sharing the
+ *              serial port.
+ *
+ * Returns:     If the modem can still be used, returns 0. Otherwise, returns
+ *              -1.
+ *
+ ******************************************************************************/
+static int gsm_start_multiplexer(gsm_t *modem)
+{
+    gsm_channel_t *ch = modem->channels[GSM_CHANNEL_CONTROL];
+    uint32_t       frame_size = (modem->link.frame_size != 0) ? modem->link.frame_size
+                                                              : CMUX_DEFAULT_FRAME_SIZE;
+    char           command[GSM_TX_BUF_SIZE];
+
+    snprintf(command, sizeof(command), "%s=0,0,,%u", AT_CMUX, (unsigned)frame_size);
+
+    gsm_lock(ch);
+    int ret = gsm_command_ok(ch, command, GSM_COMMAND_TIMEOUT_MS);
+    pthread_mutex_unlock(&ch->mutex);
+
+    if (ret == -1)
+    {
+        LOG_WARN("%s: modem refused multiplexing, commands share the link", modem->name);
+        return 0;
+    }
+
+    modem->mux = cmux_start(modem->fd, GSM_NUM_CHANNELS, frame_size);
+    if (modem->mux == NULL)
+    {
+        LOG_ERROR("%s: failed to start the multiplexer", modem->name);
+        return -1;
+    }
+
+    for (int n = 0; n < GSM_NUM_CHANNELS; ++n)
+    {
+        modem->channel_pool[n].fd = serial_open(cmux_channel_path(modem->mux, n + 1), B115200);
+        if (modem->channel_pool[n].fd == -1)
+        {
+            LOG_ERROR("%s: failed to open multiplexer channel %d", modem->name, n + 1);
+            return -1;
+        }
+        modem->channels[n] = &modem->channel_pool[n];
+    }
+    LOG_INFO("%s: %d multiplexed channels", modem->name, GSM_NUM_CHANNELS);
+
+    return 0;
+}
+
+/****************************************************************************** 
+ *
+ * Function:    gsm_close_link()
+ *
+ * Description: Closes the multiplexer channels, if any, and the serial port.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void gsm_close_link(gsm_t *modem)
+{
+    for (int n = 0; n < GSM_NUM_CHANNELS; ++n)
+    {
+        if ((modem->channel_pool[n].fd != -1) && (modem->channel_pool[n].fd != modem->fd))
+        {
+            serial_close(modem->channel_pool[n].fd);
+        }
+        modem->channel_pool[n].fd = -1;
+        modem->channels[n]        = &modem->channel_pool[0];
+    }
+
+    cmux_stop(modem->mux);
+    modem->mux = NULL;
+    serial_close(modem->fd);
+    modem->fd = -1;
+}
+
+/****************************************************************************** 
+ *
+ * Function:    gsm_register_round_trip()
+ *
+ * Description: Registers the AT command round trip histograms shared by all
+ *              modems.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void gsm_register_round_trip(void)
+{
+    const char *name = "sitemon_at_round_trip_seconds";
+    const char *help = "Time from writing an AT command until its response is read.";
+    round_trip.at   = metrics_histogram(name, "{command=\"AT\"}", help);
+    round_trip.ati  = metrics_histogram(name, "{command=\"ATI\"}", help);
+    round_trip.cmgf = metrics_histogram(name, "{command=\"CMGF\"}", help);
+    round_trip.cscs = metrics_histogram(name, "{command=\"CSCS\"}", help);
+    round_trip.cmgs = metrics_histogram(name, "{command=\"CMGS\"}", help);
+    round_trip.cfun = metrics_histogram(name, "{command=\"CFUN\"}", help);
+    round_trip.http = metrics_histogram(name, "{command=\"HTTPACTION\"}", help);
+}
+
+/****************************************************************************** 
+ *
+ * Function:    gsm_setup()
+ *
+ * Description: Brings a freshly opened modem up: checks that it answers,
+ *              sets up the link and reads its identification, then sets up
+ *              text mode SMS.
+ *
+ * Returns:     If successful, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+static int gsm_setup(gsm_t *modem)
+{
     // Check that modem is connected and responding to AT commands.
-    if (!gsm_check_liveness())
+    if (!gsm_check_liveness(modem))
+    {
+        LOG_ERROR("%s: failed liveness check", modem->name);
+        return -1;
+    }
+    LOG_INFO("%s: passed liveness check", modem->name);
+
+    // Speed the link up, then split it into channels.
+    if ((gsm_negotiate_link(modem) == -1) ||
+        (modem->link.multiplex && (gsm_start_multiplexer(modem) == -1)))
     {
-        DEBUG_LOG(stdout, "gsm_init: failed liveness check\n");
-        serial_close(gsm.fd);
         return -1;
     }
-    DEBUG_LOG(stdout, "gsm_init: passed liveness check\n");
 
     // Read product identification info from SIM controller.
-    if (gsm_read_identification() == -1)
+    if (gsm_read_identification(modem) == -1)
     {
-        DEBUG_LOG(stdout, "gsm_init: failed to read identification registers\n");
-        serial_close(gsm.fd);
+        LOG_ERROR("%s: failed to read identification registers", modem->name);
         return -1;
     }
-    DEBUG_LOG(stdout, "gsm_init: read identification registers\n");
+    LOG_INFO("%s: read identification registers", modem->name);
 
     // Set the message format to text mode.
-    if (gsm_set_message_format(GSM_MESSAGE_FORMAT_TEXT_MODE) == -1)
+    if (gsm_set_message_format(modem, GSM_MESSAGE_FORMAT_TEXT_MODE) == -1)
     {
-        DEBUG_LOG(stdout, "gsm_init: failed to set message format to text mode\n");
-        serial_close(gsm.fd);
+        LOG_ERROR("%s: failed to set message format to text mode", modem->name);
         return -1;
     }
-    DEBUG_LOG(stdout, "gsm_init: set message format to text mode\n");
+    LOG_INFO("%s: set message format to text mode", modem->name);
 
     // Set the character set to GSM.
-    if (gsm_set_character_set(GSM_CHARSET_GSM) == -1)
+    if (gsm_set_character_set(modem, GSM_CHARSET_GSM) == -1)
     {
-        DEBUG_LOG(stdout, "gsm_init: failed to set character set to GSM\n");
-        serial_close(gsm.fd);
+        LOG_ERROR("%s: failed to set character set to GSM", modem->name);
         return -1;
     }
-    DEBUG_LOG(stdout, "gsm_init: set character set to GSM\n");
+    LOG_INFO("%s: set character set to GSM", modem->name);
 
     return 0;
 }
 
+/****************************************************************************** 
+ *
+ * Function:    gsm_open()
+ *
+ * Description: Opens a modem and sets it up for SMS messaging.
+ *
+ * Returns:     If successful, returns the modem. Otherwise, returns NULL.
+ *
+ ******************************************************************************/
+gsm_t *gsm_open(const char *device, const char *name, const gsm_link_config_t *link)
+{
+    gsm_t *modem;
+
+    pthread_once(&round_trip_once, gsm_register_round_trip);
+
+    // The status cache is aligned to a cache line, so the modem must be too.
+    modem = aligned_alloc(_Alignof(gsm_t), sizeof(*modem));
+    if (modem == NULL)
+    {
+        return NULL;
+    }
+    memset(modem, 0, sizeof(*modem));
+
+    snprintf(modem->name, sizeof(modem->name), "%s", name);
+    snprintf(modem->labels, sizeof(modem->labels), "{modem=\"%s\"}", modem->name);
+    if (link != NULL)
+    {
+        modem->link = *link;
+    }
+
+    gsm_status_t unknown = {
+        .rssi_dbm     = GSM_RSSI_UNKNOWN,
+        .ber          = GSM_CSQ_UNKNOWN,
+        .registration = GSM_REGISTRATION_UNKNOWN,
+        .mode         = GSM_FUNCTIONALITY_MODE_ERROR,
+    };
+    modem->status_cache.status = unknown;
+    pthread_mutex_init(&modem->status_mutex, NULL);
+
+    // Attempt to open serial connection to GSM modem.
+    if((modem->fd = serial_open(device, B115200)) == -1)
+    {
+        LOG_ERROR("%s: failed to open %s", modem->name, device);
+        free(modem);
+        return NULL;
+    }
+
+    // Until the multiplexer runs, all commands share the serial port.
+    for (int n = 0; n < GSM_NUM_CHANNELS; ++n)
+    {
+        pthread_mutex_init(&modem->channel_pool[n].mutex, NULL);
+        modem->channel_pool[n].modem = modem;
+        modem->channel_pool[n].fd    = (n == 0) ? modem->fd : -1;
+        modem->channels[n]           = &modem->channel_pool[0];
+    }
+
+    if (gsm_setup(modem) == -1)
+    {
+        gsm_close_link(modem);
+        free(modem);
+        return NULL;
+    }
+
+    // Registered only once the modem is up, as metrics are never removed.
+    modem->rssi_metric = metrics_gauge("sitemon_modem_rssi_dbm", modem->labels,
+                                       "Received signal strength reported by AT+CSQ.");
+    modem->registration_metric = metrics_gauge("sitemon_modem_registration", modem->labels,
+                                               "Network registration state reported by AT+CREG.");
+
+    return modem;
+}
+
+/****************************************************************************** 
+ *
+ * Function:    gsm_name()
+ *
+ * Description: Gets the name a modem was opened with.
+ *
+ * Returns:     The name.
+ *
+ ******************************************************************************/
+const char *gsm_name(const gsm_t *modem)
+{
+    return modem->name;
+}
+
 /****************************************************************************** 
  *
  * Function:    gsm_print_identification()
@@ -314,16 +997,18 @@ int gsm_init(const char *serial_port)
  * Returns:     None defined.
  *
  ******************************************************************************/
-void gsm_print_identification(FILE *stream)
-{
-    pthread_mutex_lock(&gsm_mutex);
-    fprintf(stream, "Manufacturer: %s\n", gsm.identification.manufacturer);
-    fprintf(stream, "Model:        %s\n", gsm.identification.model);
-    fprintf(stream, "Revision:     %s\n", gsm.identification.revision);
-    fprintf(stream, "SVN:          %s\n", gsm.identification.svn);
-    fprintf(stream, "IMEI:         %s\n", gsm.identification.imei);
-    fprintf(stream, "GCAP:         %s\n", gsm.identification.gcap);
-    pthread_mutex_unlock(&gsm_mutex);
+void gsm_print_identification(gsm_t *modem, FILE *stream)
+{
+    gsm_channel_t *ch = modem->channels[GSM_CHANNEL_CONTROL];
+
+    gsm_lock(ch);
+    fprintf(stream, "Manufacturer: %s\n", modem->identification.manufacturer);
+    fprintf(stream, "Model:        %s\n", modem->identification.model);
+    fprintf(stream, "Revision:     %s\n", modem->identification.revision);
+    fprintf(stream, "SVN:          %s\n", modem->identification.svn);
+    fprintf(stream, "IMEI:         %s\n", modem->identification.imei);
+    fprintf(stream, "GCAP:         %s\n", modem->identification.gcap);
+    pthread_mutex_unlock(&ch->mutex);
 }
 
 /****************************************************************************** 
@@ -337,68 +1022,82 @@ void gsm_print_identification(FILE *stream)
  * Returns:     If successful, returns 0. Otherwise, returns -1.
  *
  ******************************************************************************/
-int gsm_send_message(const char *destination, const char *message)
+int gsm_send_message(gsm_t *modem, const char *destination, const char *message)
 {
-    pthread_mutex_lock(&gsm_mutex);
+    TRACE_SCOPE("AT+CMGS");
+
+    gsm_channel_t *ch = modem->channels[GSM_CHANNEL_CONTROL];
+
+    gsm_lock(ch);
+
+    uint64_t start_ns = monotonic_time_ns();
 
     // Send AT+CMGS command with destination address.
-    sprintf(gsm.tx_buf, "%s=\"%s\"\r", AT_CMGS, destination);
+    sprintf(ch->tx_buf, "%s=\"%s\"\r", AT_CMGS, destination);
 
-    if (serial_write(gsm.fd, gsm.tx_buf, strlen(gsm.tx_buf)) == -1)
+    if (serial_write(ch->fd, ch->tx_buf, strlen(ch->tx_buf)) == -1)
     {
-        serial_ioflush(gsm.fd);
-        pthread_mutex_unlock(&gsm_mutex);
+        serial_ioflush(ch->fd);
+        pthread_mutex_unlock(&ch->mutex);
         return -1;
     }
 
     // Give modem enough time to process command and write response to serial.
+    TRACE_BEGIN("modem response wait");
     SLEEP_MSECONDS(500);
+    TRACE_END("modem response wait");
 
     // Check if modem responded with the prompt character '>'.
     ssize_t nbytes;
-    if ((nbytes = serial_read(gsm.fd, gsm.rx_buf, GSM_RX_BUF_CAPACITY)) == -1)
+    if ((nbytes = serial_read(ch->fd, ch->rx_buf, GSM_RX_BUF_CAPACITY)) == -1)
     {
-        serial_ioflush(gsm.fd);
-        pthread_mutex_unlock(&gsm_mutex);
+        serial_ioflush(ch->fd);
+        pthread_mutex_unlock(&ch->mutex);
         return -1;
     }
-    gsm.rx_buf[nbytes] = '\0';
+    ch->rx_buf[nbytes] = '\0';
+    gsm_parse_status(modem, ch->rx_buf);
 
-    if (strchr(gsm.rx_buf, '>') == NULL)
+    if (strchr(ch->rx_buf, '>') == NULL)
     {
-        serial_ioflush(gsm.fd);
-        pthread_mutex_unlock(&gsm_mutex);
+        serial_ioflush(ch->fd);
+        pthread_mutex_unlock(&ch->mutex);
         return -1;
     }
 
     // Send the message. Note that the modem waits for a Cntl-Z character to
     // indicate the end of the message to be sent.
-    strcpy(gsm.tx_buf, message);
-    nbytes = strlen(gsm.tx_buf);
-    gsm.tx_buf[nbytes++] = CTRL_Z;
+    strcpy(ch->tx_buf, message);
+    nbytes = strlen(ch->tx_buf);
+    ch->tx_buf[nbytes++] = CTRL_Z;
 
-    if (serial_write(gsm.fd, gsm.tx_buf, nbytes) == -1)
+    if (serial_write(ch->fd, ch->tx_buf, nbytes) == -1)
     {
-        serial_ioflush(gsm.fd);
-        pthread_mutex_unlock(&gsm_mutex);
+        serial_ioflush(ch->fd);
+        pthread_mutex_unlock(&ch->mutex);
         return -1;
     }
 
     // Give modem enough time to process command and write response to serial.
+    TRACE_BEGIN("+CMGS delivery wait");
     SLEEP_SECONDS(5);
+    TRACE_END("+CMGS delivery wait");
 
     // Check if message was successfully sent. 
-    if ((nbytes = serial_read(gsm.fd, gsm.rx_buf, GSM_RX_BUF_CAPACITY)) == -1)
+    if ((nbytes = serial_read(ch->fd, ch->rx_buf, GSM_RX_BUF_CAPACITY)) == -1)
     {
-        serial_ioflush(gsm.fd);
-        pthread_mutex_unlock(&gsm_mutex);
+        serial_ioflush(ch->fd);
+        pthread_mutex_unlock(&ch->mutex);
         return -1;
     }
-    gsm.rx_buf[nbytes] = '\0';
+    ch->rx_buf[nbytes] = '\0';
+    gsm_parse_status(modem, ch->rx_buf);
+    metrics_observe(round_trip.cmgs, monotonic_time_ns() - start_ns);
+    int ret = (strstr(ch->rx_buf, "+CMGS") ? 0 : -1);
 
-    pthread_mutex_unlock(&gsm_mutex);
+    pthread_mutex_unlock(&ch->mutex);
 
-    return (strstr(gsm.rx_buf, "+CMGS") ? 0 : -1);
+    return ret;
 }
 
 /****************************************************************************** 
@@ -410,42 +1109,65 @@ int gsm_send_message(const char *destination, const char *message)
  * Returns:     If successful, returns 0. Otherwise, returns -1.
  *
  ******************************************************************************/
-int gsm_set_functionality_mode(gsm_functionality_mode_t mode)
+int gsm_set_functionality_mode(gsm_t *modem, gsm_functionality_mode_t mode)
 {
-    pthread_mutex_lock(&gsm_mutex); 
+    TRACE_SCOPE("AT+CFUN=");
+
+    gsm_channel_t *ch = modem->channels[GSM_CHANNEL_CONTROL];
+
+    gsm_lock(ch);
 
     if (mode == GSM_FUNCTIONALITY_MODE_ERROR)
     {
-        pthread_mutex_unlock(&gsm_mutex);
+        pthread_mutex_unlock(&ch->mutex);
         return -1;
     }
 
     ssize_t nbytes;
 
+    uint64_t start_ns = monotonic_time_ns();
+
     // Send AT+CFUN command to change mode.
-    sprintf(gsm.tx_buf, "%s=%u\r", AT_CFUN, (unsigned) mode);
+    sprintf(ch->tx_buf, "%s=%u\r", AT_CFUN, (unsigned) mode);
 
-    if (serial_write(gsm.fd, gsm.tx_buf, strlen(gsm.tx_buf)) == -1)
+    if (serial_write(ch->fd, ch->tx_buf, strlen(ch->tx_buf)) == -1)
     {
-        serial_ioflush(gsm.fd);
-        pthread_mutex_unlock(&gsm_mutex);
+        serial_ioflush(ch->fd);
+        pthread_mutex_unlock(&ch->mutex);
         return -1;
     }
 
     // Give modem enough time to proces command and write output to serial.
+    TRACE_BEGIN("modem response wait");
     SLEEP_SECONDS(1);
+    TRACE_END("modem response wait");
 
     // Check that modem responded with OK.
-    if ((nbytes = serial_read(gsm.fd, gsm.rx_buf, GSM_RX_BUF_CAPACITY)) == -1)
+    if ((nbytes = serial_read(ch->fd, ch->rx_buf, GSM_RX_BUF_CAPACITY)) == -1)
     {
-        serial_ioflush(gsm.fd);
-        pthread_mutex_unlock(&gsm_mutex);
+        serial_ioflush(ch->fd);
+        pthread_mutex_unlock(&ch->mutex);
         return -1;
     }
-    gsm.rx_buf[nbytes] = '\0';
-    int ret = (strstr(gsm.rx_buf, AT_OK) ? 0 : -1);
+    ch->rx_buf[nbytes] = '\0';
+    gsm_parse_status(modem, ch->rx_buf);
+    metrics_observe(round_trip.cfun, monotonic_time_ns() - start_ns);
+    int ret = (strstr(ch->rx_buf, AT_OK) ? 0 : -1);
+
+    if (ret == 0)
+    {
+        pthread_mutex_lock(&modem->status_mutex);
+
+        gsm_status_t status = modem->status_cache.status;
+
+        status.mode    = mode;
+        status.mode_ns = monotonic_time_ns();
+        gsm_publish_status(modem, &status);
+
+        pthread_mutex_unlock(&modem->status_mutex);
+    }
 
-    pthread_mutex_unlock(&gsm_mutex);
+    pthread_mutex_unlock(&ch->mutex);
 
     return ret;
 }
@@ -460,40 +1182,50 @@ int gsm_set_functionality_mode(gsm_functionality_mode_t mode)
  *              GSM_FUNCTIONALITY_MODE_ERROR.
  *
  ******************************************************************************/
-gsm_functionality_mode_t gsm_get_functionality_mode()
+gsm_functionality_mode_t gsm_get_functionality_mode(gsm_t *modem)
 {
-    pthread_mutex_lock(&gsm_mutex); 
+    TRACE_SCOPE("AT+CFUN?");
+
+    gsm_channel_t *ch = modem->channels[GSM_CHANNEL_CONTROL];
+
+    gsm_lock(ch);
+
+    uint64_t start_ns = monotonic_time_ns();
 
     // Send AT+CFUN command to change mode.
-    sprintf(gsm.tx_buf, "%s?\r", AT_CFUN);
+    sprintf(ch->tx_buf, "%s?\r", AT_CFUN);
 
-    if (serial_write(gsm.fd, gsm.tx_buf, strlen(gsm.tx_buf)) == -1)
+    if (serial_write(ch->fd, ch->tx_buf, strlen(ch->tx_buf)) == -1)
     {
-        serial_ioflush(gsm.fd);
-        pthread_mutex_unlock(&gsm_mutex);
+        serial_ioflush(ch->fd);
+        pthread_mutex_unlock(&ch->mutex);
         return GSM_FUNCTIONALITY_MODE_ERROR;
     }
 
     // Give modem enough time to proces command and write output to serial.
+    TRACE_BEGIN("modem response wait");
     SLEEP_MSECONDS(500);
+    TRACE_END("modem response wait");
 
     // Check that modem responded with OK.
     ssize_t nbytes;
-    if ((nbytes = serial_read(gsm.fd, gsm.rx_buf, GSM_RX_BUF_CAPACITY)) == -1)
+    if ((nbytes = serial_read(ch->fd, ch->rx_buf, GSM_RX_BUF_CAPACITY)) == -1)
     {
-        serial_ioflush(gsm.fd);
-        pthread_mutex_unlock(&gsm_mutex);
+        serial_ioflush(ch->fd);
+        pthread_mutex_unlock(&ch->mutex);
         return GSM_FUNCTIONALITY_MODE_ERROR;
     }
-    gsm.rx_buf[nbytes] = '\0';
+    ch->rx_buf[nbytes] = '\0';
+    gsm_parse_status(modem, ch->rx_buf);
+    metrics_observe(round_trip.cfun, monotonic_time_ns() - start_ns);
 
     // Find the returned value for the mode.
     const char KEY[] = "+CFUN:";
     char *pkey;
 
-    if ((pkey = strstr(gsm.rx_buf, KEY)) == NULL)
+    if ((pkey = strstr(ch->rx_buf, KEY)) == NULL)
     {
-        pthread_mutex_unlock(&gsm_mutex);
+        pthread_mutex_unlock(&ch->mutex);
         return GSM_FUNCTIONALITY_MODE_ERROR;
     }
     pkey += strlen(KEY);
@@ -504,15 +1236,401 @@ gsm_functionality_mode_t gsm_get_functionality_mode()
     {
         case GSM_MINIMUM_FUNCTIONALITY_MODE:
             mode = GSM_MINIMUM_FUNCTIONALITY_MODE;
+            break;
         case GSM_FULL_FUNCTIONALITY_MODE:
             mode = GSM_FULL_FUNCTIONALITY_MODE;
+            break;
         case GSM_FLIGHT_MODE:
             mode = GSM_FLIGHT_MODE;
+            break;
         default:
             mode = GSM_FUNCTIONALITY_MODE_ERROR;
+            break;
     }
 
-    pthread_mutex_unlock(&gsm_mutex);
+    pthread_mutex_unlock(&ch->mutex);
 
     return mode;
-}
\ No newline at end of file
+}
+
+/****************************************************************************** 
+ *
+ * Function:    gsm_write_all()
+ *
+ * Description: Writes a whole buffer to the modem, however the writes are
+ *              split by the serial driver.
+ *
+ * Returns:     If successful, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+static int gsm_write_all(gsm_channel_t *ch, const uint8_t *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t written = serial_write(ch->fd, (uint8_t *)data, length);
+
+        if (written <= 0)
+        {
+            if ((written == -1) && (errno == EINTR))
+            {
+                continue;
+            }
+            return -1;
+        }
+        data   += written;
+        length -= (size_t)written;
+    }
+    return 0;
+}
+
+/****************************************************************************** 
+ *
+ * Function:    gsm_data_open()
+ *
+ * Description: Opens the GPRS bearer and the modem's HTTP service.
+ *
+ * Returns:     If successful, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+int gsm_data_open(gsm_t *modem, const char *apn)
+{
+    TRACE_SCOPE("gsm_data_open");
+
+    gsm_channel_t *ch = modem->channels[GSM_CHANNEL_DATA];
+    char           command[GSM_TX_BUF_SIZE];
+    int            ret = -1;
+
+    gsm_lock(ch);
+
+    snprintf(command, sizeof(command), "%s=3,1,\"APN\",\"%s\"", AT_SAPBR, apn);
+    if ((gsm_command_ok(ch, AT_SAPBR "=3,1,\"Contype\",\"GPRS\"", GSM_COMMAND_TIMEOUT_MS) == 0) &&
+        (gsm_command_ok(ch, command, GSM_COMMAND_TIMEOUT_MS) == 0))
+    {
+        // Answers ERROR if the bearer is already open, which is fine.
+        gsm_command_ok(ch, AT_SAPBR "=1,1", GSM_BEARER_TIMEOUT_MS);
+
+        // Terminate a session left over from an interrupted transfer first.
+        gsm_command_ok(ch, AT_HTTPTERM, GSM_COMMAND_TIMEOUT_MS);
+        if ((gsm_command_ok(ch, AT_HTTPINIT, GSM_COMMAND_TIMEOUT_MS) == 0) &&
+            (gsm_command_ok(ch, AT_HTTPPARA "=\"CID\",1", GSM_COMMAND_TIMEOUT_MS) == 0))
+        {
+            ret = 0;
+        }
+    }
+
+    pthread_mutex_unlock(&ch->mutex);
+
+    if (ret == -1)
+    {
+        LOG_ERROR("%s: failed to open the data channel", modem->name);
+    }
+    return ret;
+}
+
+/****************************************************************************** 
+ *
+ * Function:    gsm_http_request()
+ *
+ * Description: Performs one HTTP request through the modem's HTTP service.
+ *              Every step waits for the modem's answer instead of sleeping,
+ *              and a POST body is written in one go once the modem asks for
+ *              it with DOWNLOAD.
+ *
+ * Returns:     The HTTP status, or -1 if the request could not be made.
+ *
+ ******************************************************************************/
+int gsm_http_request(gsm_t *modem, gsm_http_method_t method, const char *url,
+                     const uint8_t *body, size_t length, char *response,
+                     size_t response_size)
+{
+    TRACE_SCOPE("gsm_http_request");
+
+    static const char *const data_finals[]   = { GSM_FINAL_DOWNLOAD, GSM_FINAL_ERROR, NULL };
+    static const char *const action_finals[] = { "+HTTPACTION:", GSM_FINAL_ERROR, NULL };
+    gsm_channel_t *ch = modem->channels[GSM_CHANNEL_DATA];
+    char     command[GSM_TX_BUF_SIZE];
+    int      status = -1;
+    unsigned action, size = 0;
+
+    if (response != NULL && response_size > 0)
+    {
+        response[0] = '\0';
+    }
+
+    if (snprintf(command, sizeof(command), "%s=\"URL\",\"%s\"", AT_HTTPPARA, url) >=
+        (int)sizeof(command))
+    {
+        return -1;
+    }
+
+    gsm_lock(ch);
+
+    if (gsm_command_ok(ch, command, GSM_COMMAND_TIMEOUT_MS) == -1)
+    {
+        pthread_mutex_unlock(&ch->mutex);
+        return -1;
+    }
+
+    if (method == GSM_HTTP_POST)
+    {
+        snprintf(command, sizeof(command), "%s=%u,%u", AT_HTTPDATA, (unsigned)length,
+                 GSM_HTTP_DATA_TIMEOUT_MS);
+        if ((gsm_command_ok(ch, AT_HTTPPARA "=\"CONTENT\",\"application/octet-stream\"",
+                            GSM_COMMAND_TIMEOUT_MS) == -1) ||
+            (gsm_transact(ch, command, data_finals, GSM_COMMAND_TIMEOUT_MS) != 0))
+        {
+            pthread_mutex_unlock(&ch->mutex);
+            return -1;
+        }
+
+        TRACE_BEGIN("HTTPDATA body");
+        int written = gsm_write_all(ch, body, length);
+        TRACE_END("HTTPDATA body");
+
+        static const char *const ok_finals[] = { GSM_FINAL_OK, GSM_FINAL_ERROR, NULL };
+        if ((written == -1) ||
+            (gsm_wait_for(ch, ch->rx_buf, sizeof(ch->rx_buf), ok_finals, GSM_HTTP_DATA_TIMEOUT_MS) != 0))
+        {
+            serial_ioflush(ch->fd);
+            pthread_mutex_unlock(&ch->mutex);
+            return -1;
+        }
+    }
+
+    uint64_t start_ns = monotonic_time_ns();
+
+    // OK comes first, the result follows once the server has answered.
+    snprintf(command, sizeof(command), "%s=%d", AT_HTTPACTION, (int)method);
+    if (gsm_transact(ch, command, action_finals, GSM_HTTP_TIMEOUT_MS) == 0)
+    {
+        const char *result = strstr(ch->rx_buf, "+HTTPACTION:");
+
+        if (sscanf(result, "+HTTPACTION: %u,%d,%u", &action, &status, &size) != 3)
+        {
+            status = -1;
+        }
+        metrics_observe(round_trip.http, monotonic_time_ns() - start_ns);
+    }
+
+    if ((status != -1) && (size > 0) && (response != NULL) && (response_size > 0))
+    {
+        static const char *const read_finals[] = { GSM_FINAL_OK, GSM_FINAL_ERROR, NULL };
+        char  reply[GSM_HTTP_READ_BUF_SIZE];
+        int   sent;
+
+        snprintf(command, sizeof(command), "%s\r", AT_HTTPREAD);
+        sent = (serial_write(ch->fd, (uint8_t *)command, strlen(command)) != -1);
+        if (sent && (gsm_wait_for(ch, reply, sizeof(reply), read_finals, GSM_COMMAND_TIMEOUT_MS) == 0))
+        {
+            const char *data = strstr(reply, "+HTTPREAD:");
+            unsigned    count;
+
+            if ((data != NULL) && (sscanf(data, "+HTTPREAD: %u", &count) == 1) &&
+                ((data = strchr(data, '\n')) != NULL))
+            {
+                data += 1;
+                count = (count < response_size - 1) ? count : (unsigned)(response_size - 1);
+                strncpy(response, data, count);
+                response[count] = '\0';
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&ch->mutex);
+
+    return status;
+}
+
+/****************************************************************************** 
+ *
+ * Function:    gsm_data_close()
+ *
+ * Description: Closes the modem's HTTP service and the GPRS bearer.
+ *
+ * Returns:     If successful, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+int gsm_data_close(gsm_t *modem)
+{
+    gsm_channel_t *ch = modem->channels[GSM_CHANNEL_DATA];
+
+    gsm_lock(ch);
+
+    int ret = gsm_command_ok(ch, AT_HTTPTERM, GSM_COMMAND_TIMEOUT_MS);
+    if (gsm_command_ok(ch, AT_SAPBR "=0,1", GSM_BEARER_TIMEOUT_MS) == -1)
+    {
+        ret = -1;
+    }
+
+    pthread_mutex_unlock(&ch->mutex);
+
+    return ret;
+}
+
+/****************************************************************************** 
+ *
+ * Function:    gsm_get_status()
+ *
+ * Description: Copies the cached status without taking any lock, retrying
+ *              if the copy raced with an update.
+ *
+ * Returns:     If any status has been received, returns 0. Otherwise,
+ *              returns -1.
+ *
+ ******************************************************************************/
+int gsm_get_status(gsm_t *modem, gsm_status_t *status)
+{
+    uint32_t before, after;
+
+    do
+    {
+        before = __atomic_load_n(&modem->status_cache.sequence, __ATOMIC_ACQUIRE);
+        *status = modem->status_cache.status;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&modem->status_cache.sequence, __ATOMIC_RELAXED);
+    } while ((before != after) || (before & 1));
+
+    return (before == 0) ? -1 : 0;
+}
+
+/****************************************************************************** 
+ *
+ * Function:    gsm_registration_string()
+ *
+ * Description: Names a registration state.
+ *
+ * Returns:     The name.
+ *
+ ******************************************************************************/
+const char *gsm_registration_string(gsm_registration_t registration)
+{
+    switch (registration)
+    {
+        case GSM_REGISTRATION_NONE:      return "not registered";
+        case GSM_REGISTRATION_HOME:      return "home";
+        case GSM_REGISTRATION_SEARCHING: return "searching";
+        case GSM_REGISTRATION_DENIED:    return "denied";
+        case GSM_REGISTRATION_ROAMING:   return "roaming";
+        default:                         return "unknown";
+    }
+}
+
+/****************************************************************************** 
+ *
+ * Function:    gsm_status_monitor()
+ *
+ * Description: Keeps the status cache fresh. Every GSM_STATUS_IDLE_MS it
+ *              reads whatever URCs arrived while no command was running, and
+ *              while the radio is on it polls AT+CSQ and AT+CREG? every
+ *              poll_seconds. It only takes the status channel when it is
+ *              free and skips a poll when another thread is waiting for it,
+ *              so a command waits at most for one short status query. With
+ *              the multiplexer running, commands on the other channels don't
+ *              wait at all.
+ *
+ * Returns:     Never returns.
+ *
+ ******************************************************************************/
+static void *gsm_status_monitor(void *vargp)
+{
+    static const char *const finals[] = { GSM_FINAL_OK, GSM_FINAL_ERROR, NULL };
+    gsm_t         *modem = (gsm_t *)vargp;
+    gsm_channel_t *ch    = modem->channels[GSM_CHANNEL_STATUS];
+    uint64_t next_ns  = 0; // when to poll next, 0 while the radio is off
+    char     buf[GSM_RX_BUF_SIZE];
+
+    TRACE_THREAD_NAME("gsm status");
+
+    for (;;)
+    {
+        SLEEP_MSECONDS(GSM_STATUS_IDLE_MS);
+
+        if (pthread_mutex_trylock(&ch->mutex) != 0)
+        {
+            continue;
+        }
+
+        struct pollfd pfd = { .fd = ch->fd, .events = POLLIN };
+        if (poll(&pfd, 1, 0) == 1)
+        {
+            ssize_t nread = read(ch->fd, buf, sizeof(buf) - 1);
+
+            if (nread > 0)
+            {
+                buf[nread] = '\0';
+                gsm_parse_status(modem, buf);
+            }
+        }
+
+        uint64_t     now_ns = monotonic_time_ns();
+        gsm_status_t status;
+
+        gsm_get_status(modem, &status);
+        if (status.mode != GSM_FULL_FUNCTIONALITY_MODE)
+        {
+            next_ns = 0;
+        }
+        else if (next_ns == 0)
+        {
+            next_ns = now_ns + GSM_STATUS_SETTLE_SECONDS * 1000000000ull;
+        }
+        else if (now_ns >= next_ns)
+        {
+            TRACE_SCOPE("gsm status poll");
+
+            // Polls are postponed rather than make a command wait.
+            if (__atomic_load_n(&ch->waiters, __ATOMIC_RELAXED) == 0)
+            {
+                gsm_transact(ch, AT_CSQ, finals, GSM_COMMAND_TIMEOUT_MS);
+            }
+            if (__atomic_load_n(&ch->waiters, __ATOMIC_RELAXED) == 0)
+            {
+                gsm_transact(ch, AT_CREG "?", finals, GSM_COMMAND_TIMEOUT_MS);
+                next_ns = now_ns + modem->poll_ns;
+            }
+        }
+
+        pthread_mutex_unlock(&ch->mutex);
+    }
+
+    return NULL;
+}
+
+/****************************************************************************** 
+ *
+ * Function:    gsm_start_status_monitor()
+ *
+ * Description: Turns on registration URCs and starts refreshing the status
+ *              cache in the background.
+ *
+ * Returns:     If successful, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+int gsm_start_status_monitor(gsm_t *modem, uint32_t poll_seconds)
+{
+    gsm_channel_t *ch = modem->channels[GSM_CHANNEL_STATUS];
+    pthread_t      thread;
+
+    gsm_lock(ch);
+    int ret = gsm_command_ok(ch, AT_CREG "=1", GSM_COMMAND_TIMEOUT_MS);
+    if (ret == 0)
+    {
+        ret = gsm_command_ok(ch, AT_CREG "?", GSM_COMMAND_TIMEOUT_MS);
+    }
+    pthread_mutex_unlock(&ch->mutex);
+
+    if (ret == -1)
+    {
+        LOG_ERROR("%s: failed to enable registration URCs", modem->name);
+        return -1;
+    }
+
+    modem->poll_ns = (uint64_t)poll_seconds * 1000000000ull;
+    if (pthread_create(&thread, NULL, gsm_status_monitor, modem) != 0)
+    {
+        return -1;
+    }
+    pthread_detach(thread);
+
+    return 0;
+}
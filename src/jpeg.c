@@ -0,0 +1,917 @@
+#include "jpeg.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__SSE2__)
+    #include <emmintrin.h>
+#elif defined(__ARM_NEON)
+    #include <arm_neon.h>
+#endif
+
+#define JPEG_BLOCK_SIZE   8
+#define JPEG_MAX_QUALITY  100
+#define JPEG_MAX_COEF     1023 // keeps AC values within the standard tables
+#define JPEG_HEADER_SIZE  330  // markers written before and after the scan
+
+// Worst case of one entropy coded block: 64 symbols of at most 27 bits each,
+// every byte of which may need a stuffed zero after it.
+#define JPEG_BLOCK_MAX_BYTES (2 * (64 * 27 + 7) / 8)
+
+// Constants of the AAN DCT with 8 fractional bits, as in libjpeg's ifast DCT.
+#define JPEG_FIX_0_382683433  98
+#define JPEG_FIX_0_541196100 139
+#define JPEG_FIX_0_707106781 181
+#define JPEG_FIX_1_306562965 334
+
+// A 32-bit word of the scan has a 0xFF byte, which needs a zero stuffed
+// after it.
+#define JPEG_HAS_FF(word) (((~(word)) - 0x01010101u) & (word) & 0x80808080u)
+
+// Quantization and Huffman code tables of one quality level.
+typedef struct jpeg_tables
+{
+    float    scale[64];    // multiplies the DCT output into quantized values
+    uint8_t  dqt[64];      // quantization table in zigzag order, for the header
+    uint16_t dc_code[12];
+    uint8_t  dc_size[12];
+    uint16_t ac_code[256];
+    uint8_t  ac_size[256];
+} jpeg_tables_t;
+
+// Output of the entropy coder. Bits are collected in a 64-bit word and
+// written out 32 at a time.
+typedef struct jpeg_writer
+{
+    uint8_t *out;
+    size_t   length;
+    size_t   size;
+    uint64_t bits;     // pending bits, the newest in the lowest bits
+    uint32_t count;    // number of pending bits
+    int      overflow; // out was too small
+} jpeg_writer_t;
+
+// Global module variables
+static jpeg_tables_t *jpeg_cache[JPEG_MAX_QUALITY + 1]; // built on first use
+
+// Position in the block of each coefficient in zigzag order.
+static const uint8_t jpeg_zigzag[64] =
+{
+     0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+};
+
+// Luminance quantization table of the JPEG standard, Annex K.
+static const uint8_t jpeg_luma_quant[64] =
+{
+    16, 11, 10, 16,  24,  40,  51,  61,
+    12, 12, 14, 19,  26,  58,  60,  55,
+    14, 13, 16, 24,  40,  57,  69,  56,
+    14, 17, 22, 29,  51,  87,  80,  62,
+    18, 22, 37, 56,  68, 109, 103,  77,
+    24, 35, 55, 64,  81, 104, 113,  92,
+    49, 64, 78, 87, 103, 121, 120, 101,
+    72, 92, 95, 98, 112, 100, 103,  99
+};
+
+// Luminance Huffman tables of the JPEG standard, Annex K: the number of codes
+// of each length, then the symbols in order of their codes.
+static const uint8_t jpeg_dc_bits[16] = { 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 };
+static const uint8_t jpeg_dc_values[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+static const uint8_t jpeg_ac_bits[16] = { 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d };
+static const uint8_t jpeg_ac_values[162] =
+{
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+    0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+    0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+    0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+    0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+    0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+    0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+    0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa
+};
+
+// One 1D AAN DCT over eight values d[0] to d[7], in place, with the add,
+// subtract and fixed-point multiply of a path defined as JPEG_ADD, JPEG_SUB
+// and JPEG_MUL. The outputs are off by the AAN scale factors, which the
+// quantization divides out again.
+#define JPEG_DCT_1D(type, d)                                                   \
+    do                                                                         \
+    {                                                                          \
+        type tmp0 = JPEG_ADD(d[0], d[7]), tmp7 = JPEG_SUB(d[0], d[7]);         \
+        type tmp1 = JPEG_ADD(d[1], d[6]), tmp6 = JPEG_SUB(d[1], d[6]);         \
+        type tmp2 = JPEG_ADD(d[2], d[5]), tmp5 = JPEG_SUB(d[2], d[5]);         \
+        type tmp3 = JPEG_ADD(d[3], d[4]), tmp4 = JPEG_SUB(d[3], d[4]);         \
+                                                                               \
+        type tmp10 = JPEG_ADD(tmp0, tmp3), tmp13 = JPEG_SUB(tmp0, tmp3);       \
+        type tmp11 = JPEG_ADD(tmp1, tmp2), tmp12 = JPEG_SUB(tmp1, tmp2);       \
+        type z1    = JPEG_MUL(JPEG_ADD(tmp12, tmp13), JPEG_FIX_0_707106781);   \
+                                                                               \
+        d[0] = JPEG_ADD(tmp10, tmp11);                                         \
+        d[4] = JPEG_SUB(tmp10, tmp11);                                         \
+        d[2] = JPEG_ADD(tmp13, z1);                                            \
+        d[6] = JPEG_SUB(tmp13, z1);                                            \
+                                                                               \
+        tmp10 = JPEG_ADD(tmp4, tmp5);                                          \
+        tmp11 = JPEG_ADD(tmp5, tmp6);                                          \
+        tmp12 = JPEG_ADD(tmp6, tmp7);                                          \
+                                                                               \
+        type z5  = JPEG_MUL(JPEG_SUB(tmp10, tmp12), JPEG_FIX_0_382683433);     \
+        type z2  = JPEG_ADD(JPEG_MUL(tmp10, JPEG_FIX_0_541196100), z5);        \
+        type z4  = JPEG_ADD(JPEG_MUL(tmp12, JPEG_FIX_1_306562965), z5);        \
+        type z3  = JPEG_MUL(tmp11, JPEG_FIX_0_707106781);                      \
+        type z11 = JPEG_ADD(tmp7, z3);                                         \
+        type z13 = JPEG_SUB(tmp7, z3);                                         \
+                                                                               \
+        d[5] = JPEG_ADD(z13, z2);                                              \
+        d[3] = JPEG_SUB(z13, z2);                                              \
+        d[1] = JPEG_ADD(z11, z4);                                              \
+        d[7] = JPEG_SUB(z11, z4);                                              \
+    } while (0)
+
+#if defined(__SSE2__)
+
+// Eight transforms at once in the 16-bit lanes. The values of the second
+// pass need all 16 bits, so the multiplies are done in 32-bit lanes.
+#define JPEG_ADD(a, b) _mm_add_epi16(a, b)
+#define JPEG_SUB(a, b) _mm_sub_epi16(a, b)
+#define JPEG_MUL(a, c) jpeg_mul(a, c)
+
+/*******************************************************************************
+ *
+ * Function:    jpeg_mul()
+ *
+ * Description: Multiplies eight values by a constant with 8 fractional bits.
+ *              Each value is paired with itself and PMADDWD multiplies the
+ *              pair by (constant, 0), which gives the full 32-bit product.
+ *
+ * Returns:     The (value * constant) >> 8 of the scalar path.
+ *
+ ******************************************************************************/
+static inline __m128i jpeg_mul(__m128i a, int16_t c)
+{
+    const __m128i k  = _mm_set1_epi32(c);
+    __m128i       lo = _mm_madd_epi16(_mm_unpacklo_epi16(a, a), k);
+    __m128i       hi = _mm_madd_epi16(_mm_unpackhi_epi16(a, a), k);
+
+    return _mm_packs_epi32(_mm_srai_epi32(lo, 8), _mm_srai_epi32(hi, 8));
+}
+
+/*******************************************************************************
+ *
+ * Function:    jpeg_transpose()
+ *
+ * Description: Transposes an 8x8 block of 16-bit values held one row per
+ *              register.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static inline void jpeg_transpose(__m128i r[8])
+{
+    __m128i a0 = _mm_unpacklo_epi16(r[0], r[1]);
+    __m128i a1 = _mm_unpackhi_epi16(r[0], r[1]);
+    __m128i a2 = _mm_unpacklo_epi16(r[2], r[3]);
+    __m128i a3 = _mm_unpackhi_epi16(r[2], r[3]);
+    __m128i a4 = _mm_unpacklo_epi16(r[4], r[5]);
+    __m128i a5 = _mm_unpackhi_epi16(r[4], r[5]);
+    __m128i a6 = _mm_unpacklo_epi16(r[6], r[7]);
+    __m128i a7 = _mm_unpackhi_epi16(r[6], r[7]);
+
+    __m128i b0 = _mm_unpacklo_epi32(a0, a2);
+    __m128i b1 = _mm_unpackhi_epi32(a0, a2);
+    __m128i b2 = _mm_unpacklo_epi32(a1, a3);
+    __m128i b3 = _mm_unpackhi_epi32(a1, a3);
+    __m128i b4 = _mm_unpacklo_epi32(a4, a6);
+    __m128i b5 = _mm_unpackhi_epi32(a4, a6);
+    __m128i b6 = _mm_unpacklo_epi32(a5, a7);
+    __m128i b7 = _mm_unpackhi_epi32(a5, a7);
+
+    r[0] = _mm_unpacklo_epi64(b0, b4);
+    r[1] = _mm_unpackhi_epi64(b0, b4);
+    r[2] = _mm_unpacklo_epi64(b1, b5);
+    r[3] = _mm_unpackhi_epi64(b1, b5);
+    r[4] = _mm_unpacklo_epi64(b2, b6);
+    r[5] = _mm_unpackhi_epi64(b2, b6);
+    r[6] = _mm_unpacklo_epi64(b3, b7);
+    r[7] = _mm_unpackhi_epi64(b3, b7);
+}
+
+/*******************************************************************************
+ *
+ * Function:    jpeg_transform()
+ *
+ * Description: Level shifts, transforms and quantizes one block with SSE2.
+ *              The columns are transformed first, on the transposed rows,
+ *              then the rows. The quantized values are rounded to nearest in
+ *              single precision and saturated to JPEG_MAX_COEF.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void jpeg_transform(const uint8_t *src, size_t stride, const jpeg_tables_t *tables,
+                           int16_t *quant)
+{
+    const __m128i zero  = _mm_setzero_si128();
+    const __m128i level = _mm_set1_epi16(128);
+    const __m128i limit = _mm_set1_epi16(JPEG_MAX_COEF);
+    __m128i       d[JPEG_BLOCK_SIZE];
+
+    for (int row = 0; row < JPEG_BLOCK_SIZE; ++row)
+    {
+        __m128i pixels = _mm_loadl_epi64((const __m128i *)(src + row * stride));
+        d[row] = _mm_sub_epi16(_mm_unpacklo_epi8(pixels, zero), level);
+    }
+
+    jpeg_transpose(d);
+    JPEG_DCT_1D(__m128i, d);
+    jpeg_transpose(d);
+    JPEG_DCT_1D(__m128i, d);
+
+    for (int row = 0; row < JPEG_BLOCK_SIZE; ++row)
+    {
+        __m128i sign = _mm_srai_epi16(d[row], 15);
+        __m128  lo   = _mm_cvtepi32_ps(_mm_unpacklo_epi16(d[row], sign));
+        __m128  hi   = _mm_cvtepi32_ps(_mm_unpackhi_epi16(d[row], sign));
+
+        lo = _mm_mul_ps(lo, _mm_loadu_ps(tables->scale + row * JPEG_BLOCK_SIZE));
+        hi = _mm_mul_ps(hi, _mm_loadu_ps(tables->scale + row * JPEG_BLOCK_SIZE + 4));
+
+        __m128i q = _mm_packs_epi32(_mm_cvtps_epi32(lo), _mm_cvtps_epi32(hi));
+        q = _mm_min_epi16(_mm_max_epi16(q, _mm_sub_epi16(zero, limit)), limit);
+        _mm_storeu_si128((__m128i *)(quant + row * JPEG_BLOCK_SIZE), q);
+    }
+}
+
+/*******************************************************************************
+ *
+ * Function:    jpeg_nonzero()
+ *
+ * Description: Finds the non-zero values of a block with SSE2.
+ *
+ * Returns:     A mask with bit n set if coef[n] is not zero.
+ *
+ ******************************************************************************/
+static inline uint64_t jpeg_nonzero(const int16_t *coef)
+{
+    const __m128i zero = _mm_setzero_si128();
+    uint64_t      mask = 0;
+
+    for (int n = 0; n < 64; n += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(coef + n));
+        __m128i b = _mm_loadu_si128((const __m128i *)(coef + n + 8));
+        __m128i z = _mm_cmpeq_epi8(_mm_packs_epi16(a, b), zero);
+
+        mask |= (uint64_t)(uint16_t)~_mm_movemask_epi8(z) << n;
+    }
+
+    return mask;
+}
+
+#elif defined(__ARM_NEON)
+
+// Eight transforms at once in the 16-bit lanes. The values of the second
+// pass need all 16 bits, so the multiplies are done in 32-bit lanes.
+#define JPEG_ADD(a, b) vaddq_s16(a, b)
+#define JPEG_SUB(a, b) vsubq_s16(a, b)
+#define JPEG_MUL(a, c) jpeg_mul(a, c)
+
+/*******************************************************************************
+ *
+ * Function:    jpeg_mul()
+ *
+ * Description: Multiplies eight values by a constant with 8 fractional bits,
+ *              widening to the full 32-bit products with VMULL.
+ *
+ * Returns:     The (value * constant) >> 8 of the scalar path.
+ *
+ ******************************************************************************/
+static inline int16x8_t jpeg_mul(int16x8_t a, int16_t c)
+{
+    const int16x4_t k  = vdup_n_s16(c);
+    int32x4_t       lo = vmull_s16(vget_low_s16(a), k);
+    int32x4_t       hi = vmull_s16(vget_high_s16(a), k);
+
+    return vcombine_s16(vshrn_n_s32(lo, 8), vshrn_n_s32(hi, 8));
+}
+
+/*******************************************************************************
+ *
+ * Function:    jpeg_transpose()
+ *
+ * Description: Transposes an 8x8 block of 16-bit values held one row per
+ *              register.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static inline void jpeg_transpose(int16x8_t r[8])
+{
+    int16x8x2_t t0 = vtrnq_s16(r[0], r[1]);
+    int16x8x2_t t1 = vtrnq_s16(r[2], r[3]);
+    int16x8x2_t t2 = vtrnq_s16(r[4], r[5]);
+    int16x8x2_t t3 = vtrnq_s16(r[6], r[7]);
+
+    int32x4x2_t u0 = vtrnq_s32(vreinterpretq_s32_s16(t0.val[0]), vreinterpretq_s32_s16(t1.val[0]));
+    int32x4x2_t u1 = vtrnq_s32(vreinterpretq_s32_s16(t0.val[1]), vreinterpretq_s32_s16(t1.val[1]));
+    int32x4x2_t u2 = vtrnq_s32(vreinterpretq_s32_s16(t2.val[0]), vreinterpretq_s32_s16(t3.val[0]));
+    int32x4x2_t u3 = vtrnq_s32(vreinterpretq_s32_s16(t2.val[1]), vreinterpretq_s32_s16(t3.val[1]));
+
+    r[0] = vreinterpretq_s16_s32(vcombine_s32(vget_low_s32(u0.val[0]), vget_low_s32(u2.val[0])));
+    r[1] = vreinterpretq_s16_s32(vcombine_s32(vget_low_s32(u1.val[0]), vget_low_s32(u3.val[0])));
+    r[2] = vreinterpretq_s16_s32(vcombine_s32(vget_low_s32(u0.val[1]), vget_low_s32(u2.val[1])));
+    r[3] = vreinterpretq_s16_s32(vcombine_s32(vget_low_s32(u1.val[1]), vget_low_s32(u3.val[1])));
+    r[4] = vreinterpretq_s16_s32(vcombine_s32(vget_high_s32(u0.val[0]), vget_high_s32(u2.val[0])));
+    r[5] = vreinterpretq_s16_s32(vcombine_s32(vget_high_s32(u1.val[0]), vget_high_s32(u3.val[0])));
+    r[6] = vreinterpretq_s16_s32(vcombine_s32(vget_high_s32(u0.val[1]), vget_high_s32(u2.val[1])));
+    r[7] = vreinterpretq_s16_s32(vcombine_s32(vget_high_s32(u1.val[1]), vget_high_s32(u3.val[1])));
+}
+
+/*******************************************************************************
+ *
+ * Function:    jpeg_round()
+ *
+ * Description: Converts to integers, rounding to nearest.
+ *
+ * Returns:     The rounded values.
+ *
+ ******************************************************************************/
+static inline int32x4_t jpeg_round(float32x4_t v)
+{
+#if defined(__aarch64__)
+    return vcvtnq_s32_f32(v);
+#else
+    // Round half away from zero, ARMv7 only converts towards zero.
+    uint32x4_t sign = vandq_u32(vreinterpretq_u32_f32(v), vdupq_n_u32(0x80000000u));
+    float32x4_t half = vreinterpretq_f32_u32(vorrq_u32(sign, vreinterpretq_u32_f32(vdupq_n_f32(0.5f))));
+    return vcvtq_s32_f32(vaddq_f32(v, half));
+#endif
+}
+
+/*******************************************************************************
+ *
+ * Function:    jpeg_transform()
+ *
+ * Description: Level shifts, transforms and quantizes one block with NEON.
+ *              The columns are transformed first, on the transposed rows,
+ *              then the rows. The quantized values are rounded to nearest in
+ *              single precision and saturated to JPEG_MAX_COEF.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void jpeg_transform(const uint8_t *src, size_t stride, const jpeg_tables_t *tables,
+                           int16_t *quant)
+{
+    const int16x8_t level = vdupq_n_s16(128);
+    const int16x8_t limit = vdupq_n_s16(JPEG_MAX_COEF);
+    int16x8_t       d[JPEG_BLOCK_SIZE];
+
+    for (int row = 0; row < JPEG_BLOCK_SIZE; ++row)
+    {
+        d[row] = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(src + row * stride))), level);
+    }
+
+    jpeg_transpose(d);
+    JPEG_DCT_1D(int16x8_t, d);
+    jpeg_transpose(d);
+    JPEG_DCT_1D(int16x8_t, d);
+
+    for (int row = 0; row < JPEG_BLOCK_SIZE; ++row)
+    {
+        float32x4_t lo = vcvtq_f32_s32(vmovl_s16(vget_low_s16(d[row])));
+        float32x4_t hi = vcvtq_f32_s32(vmovl_s16(vget_high_s16(d[row])));
+
+        lo = vmulq_f32(lo, vld1q_f32(tables->scale + row * JPEG_BLOCK_SIZE));
+        hi = vmulq_f32(hi, vld1q_f32(tables->scale + row * JPEG_BLOCK_SIZE + 4));
+
+        int16x8_t q = vcombine_s16(vqmovn_s32(jpeg_round(lo)), vqmovn_s32(jpeg_round(hi)));
+        q = vminq_s16(vmaxq_s16(q, vnegq_s16(limit)), limit);
+        vst1q_s16(quant + row * JPEG_BLOCK_SIZE, q);
+    }
+}
+
+#else
+
+#define JPEG_ADD(a, b) ((a) + (b))
+#define JPEG_SUB(a, b) ((a) - (b))
+#define JPEG_MUL(a, c) (((a) * (c)) >> 8)
+
+/*******************************************************************************
+ *
+ * Function:    jpeg_transform()
+ *
+ * Description: Level shifts, transforms and quantizes one block, one row and
+ *              then one column at a time.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void jpeg_transform(const uint8_t *src, size_t stride, const jpeg_tables_t *tables,
+                           int16_t *quant)
+{
+    int32_t block[64];
+
+    for (int row = 0; row < JPEG_BLOCK_SIZE; ++row)
+    {
+        int32_t *d = block + row * JPEG_BLOCK_SIZE;
+
+        for (int col = 0; col < JPEG_BLOCK_SIZE; ++col)
+        {
+            d[col] = (int32_t)src[row * stride + col] - 128;
+        }
+        JPEG_DCT_1D(int32_t, d);
+    }
+
+    for (int col = 0; col < JPEG_BLOCK_SIZE; ++col)
+    {
+        int32_t d[JPEG_BLOCK_SIZE];
+
+        for (int row = 0; row < JPEG_BLOCK_SIZE; ++row)
+        {
+            d[row] = block[row * JPEG_BLOCK_SIZE + col];
+        }
+        JPEG_DCT_1D(int32_t, d);
+        for (int row = 0; row < JPEG_BLOCK_SIZE; ++row)
+        {
+            block[row * JPEG_BLOCK_SIZE + col] = d[row];
+        }
+    }
+
+    for (int n = 0; n < 64; ++n)
+    {
+        long q = lrintf((float)block[n] * tables->scale[n]);
+
+        q = (q < -JPEG_MAX_COEF) ? -JPEG_MAX_COEF : (q > JPEG_MAX_COEF) ? JPEG_MAX_COEF : q;
+        quant[n] = (int16_t)q;
+    }
+}
+
+#endif
+
+#if !defined(__SSE2__)
+
+/*******************************************************************************
+ *
+ * Function:    jpeg_nonzero()
+ *
+ * Description: Finds the non-zero values of a block.
+ *
+ * Returns:     A mask with bit n set if coef[n] is not zero.
+ *
+ ******************************************************************************/
+static inline uint64_t jpeg_nonzero(const int16_t *coef)
+{
+    uint64_t mask = 0;
+
+    for (int n = 0; n < 64; ++n)
+    {
+        mask |= (uint64_t)(coef[n] != 0) << n;
+    }
+
+    return mask;
+}
+
+#endif
+
+/*******************************************************************************
+ *
+ * Function:    jpeg_build_codes()
+ *
+ * Description: Assigns the Huffman codes of a table given by the number of
+ *              codes of each length, as in Annex C of the standard.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void jpeg_build_codes(const uint8_t bits[16], const uint8_t *values, uint16_t *codes,
+                             uint8_t *sizes)
+{
+    uint32_t code = 0;
+    size_t   k    = 0;
+
+    for (int length = 1; length <= 16; ++length)
+    {
+        for (int n = 0; n < bits[length - 1]; ++n, ++k)
+        {
+            codes[values[k]] = (uint16_t)code++;
+            sizes[values[k]] = (uint8_t)length;
+        }
+        code <<= 1;
+    }
+}
+
+/*******************************************************************************
+ *
+ * Function:    jpeg_tables()
+ *
+ * Description: Gets the tables of a quality level, building them the first
+ *              time. The quantization table is the standard one scaled like
+ *              libjpeg does, and the AAN scale factors and the 8 of the DCT
+ *              normalization are folded into the multipliers. Threads that
+ *              race to build the same level keep whichever tables were
+ *              published first.
+ *
+ * Returns:     The tables, or NULL if out of memory.
+ *
+ ******************************************************************************/
+static const jpeg_tables_t *jpeg_tables(int quality)
+{
+    static const double aan[JPEG_BLOCK_SIZE] =
+    {
+        1.0, 1.387039845, 1.306562965, 1.175875602,
+        1.0, 0.785694958, 0.541196100, 0.275899379
+    };
+    jpeg_tables_t *tables   = __atomic_load_n(&jpeg_cache[quality], __ATOMIC_ACQUIRE);
+    jpeg_tables_t *expected = NULL;
+    int            scaling  = (quality < 50) ? 5000 / quality : 200 - 2 * quality;
+
+    if (tables != NULL)
+    {
+        return tables;
+    }
+
+    if ((tables = calloc(1, sizeof(*tables))) == NULL)
+    {
+        return NULL;
+    }
+
+    for (int n = 0; n < 64; ++n)
+    {
+        int q = (jpeg_luma_quant[n] * scaling + 50) / 100;
+
+        q = (q < 1) ? 1 : (q > 255) ? 255 : q;
+        tables->scale[n] = (float)(1.0 / (q * aan[n / JPEG_BLOCK_SIZE] *
+                                          aan[n % JPEG_BLOCK_SIZE] * 8.0));
+        for (int k = 0; k < 64; ++k)
+        {
+            if (jpeg_zigzag[k] == n)
+            {
+                tables->dqt[k] = (uint8_t)q;
+            }
+        }
+    }
+
+    jpeg_build_codes(jpeg_dc_bits, jpeg_dc_values, tables->dc_code, tables->dc_size);
+    jpeg_build_codes(jpeg_ac_bits, jpeg_ac_values, tables->ac_code, tables->ac_size);
+
+    if (!__atomic_compare_exchange_n(&jpeg_cache[quality], &expected, tables, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        free(tables);
+        tables = expected;
+    }
+
+    return tables;
+}
+
+/*******************************************************************************
+ *
+ * Function:    jpeg_put_byte()
+ *
+ * Description: Writes one byte of the scan, stuffing a zero after 0xFF.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static inline void jpeg_put_byte(jpeg_writer_t *w, uint8_t byte)
+{
+    if (w->length + 1 + (byte == 0xFF) > w->size)
+    {
+        w->overflow = 1;
+        return;
+    }
+
+    w->out[w->length++] = byte;
+    if (byte == 0xFF)
+    {
+        w->out[w->length++] = 0x00;
+    }
+}
+
+/*******************************************************************************
+ *
+ * Function:    jpeg_flush_word()
+ *
+ * Description: Writes the oldest 32 pending bits. Words without a 0xFF byte
+ *              are copied without looking at each byte.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void jpeg_flush_word(jpeg_writer_t *w)
+{
+    uint32_t word = (uint32_t)(w->bits >> (w->count - 32));
+
+    w->count -= 32;
+
+    if ((w->size - w->length >= 4) && !JPEG_HAS_FF(word))
+    {
+        w->out[w->length++] = (uint8_t)(word >> 24);
+        w->out[w->length++] = (uint8_t)(word >> 16);
+        w->out[w->length++] = (uint8_t)(word >> 8);
+        w->out[w->length++] = (uint8_t)word;
+        return;
+    }
+
+    for (int shift = 24; shift >= 0; shift -= 8)
+    {
+        jpeg_put_byte(w, (uint8_t)(word >> shift));
+    }
+}
+
+/*******************************************************************************
+ *
+ * Function:    jpeg_put_bits()
+ *
+ * Description: Appends up to 32 bits to the scan.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static inline void jpeg_put_bits(jpeg_writer_t *w, uint32_t value, uint32_t size)
+{
+    w->bits   = (w->bits << size) | value;
+    w->count += size;
+
+    if (w->count >= 32)
+    {
+        jpeg_flush_word(w);
+    }
+}
+
+/*******************************************************************************
+ *
+ * Function:    jpeg_flush_bits()
+ *
+ * Description: Pads the scan to a whole byte with one bits and writes all
+ *              pending bits.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void jpeg_flush_bits(jpeg_writer_t *w)
+{
+    uint32_t pad = (8 - w->count % 8) % 8;
+
+    w->bits   = (w->bits << pad) | ((1u << pad) - 1);
+    w->count += pad;
+
+    while (w->count >= 8)
+    {
+        w->count -= 8;
+        jpeg_put_byte(w, (uint8_t)(w->bits >> w->count));
+    }
+}
+
+/*******************************************************************************
+ *
+ * Function:    jpeg_put_value()
+ *
+ * Description: Appends the Huffman code of a symbol followed by the extra
+ *              bits of its value, in one go.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static inline void jpeg_put_value(jpeg_writer_t *w, uint32_t code, uint32_t code_size,
+                                  int value, uint32_t nbits)
+{
+    uint32_t extra = (uint32_t)((value < 0) ? value - 1 : value) & ((1u << nbits) - 1);
+
+    jpeg_put_bits(w, (code << nbits) | extra, code_size + nbits);
+}
+
+/*******************************************************************************
+ *
+ * Function:    jpeg_bit_length()
+ *
+ * Description: Gets the size category of a value.
+ *
+ * Returns:     The number of bits of the magnitude of value, 0 for 0.
+ *
+ ******************************************************************************/
+static inline uint32_t jpeg_bit_length(int value)
+{
+    uint32_t magnitude = (uint32_t)((value < 0) ? -value : value);
+
+    return (magnitude == 0) ? 0 : 32 - (uint32_t)__builtin_clz(magnitude);
+}
+
+/*******************************************************************************
+ *
+ * Function:    jpeg_encode_block()
+ *
+ * Description: Entropy codes one quantized block. The runs of zeros are
+ *              found from the mask of non-zero values in zigzag order rather
+ *              than by testing each value.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void jpeg_encode_block(jpeg_writer_t *w, const jpeg_tables_t *tables,
+                              const int16_t *quant, int *dc)
+{
+    int16_t  zz[64] __attribute__((aligned(16)));
+    uint32_t last = 0;
+
+    for (int k = 0; k < 64; ++k)
+    {
+        zz[k] = quant[jpeg_zigzag[k]];
+    }
+
+    int      diff  = zz[0] - *dc;
+    uint32_t nbits = jpeg_bit_length(diff);
+
+    *dc = zz[0];
+    jpeg_put_value(w, tables->dc_code[nbits], tables->dc_size[nbits], diff, nbits);
+
+    for (uint64_t mask = jpeg_nonzero(zz) & ~1ull; mask != 0; mask &= mask - 1)
+    {
+        uint32_t k   = (uint32_t)__builtin_ctzll(mask);
+        uint32_t run = k - last - 1;
+
+        for (; run >= 16; run -= 16)
+        {
+            jpeg_put_bits(w, tables->ac_code[0xF0], tables->ac_size[0xF0]);
+        }
+
+        uint32_t symbol;
+
+        nbits  = jpeg_bit_length(zz[k]);
+        symbol = (run << 4) | nbits;
+        jpeg_put_value(w, tables->ac_code[symbol], tables->ac_size[symbol], zz[k], nbits);
+        last = k;
+    }
+
+    if (last != 63)
+    {
+        jpeg_put_bits(w, tables->ac_code[0x00], tables->ac_size[0x00]);
+    }
+}
+
+/*******************************************************************************
+ *
+ * Function:    jpeg_put_header()
+ *
+ * Description: Writes the markers that come before the scan: JFIF, the
+ *              quantization table, the frame header, the Huffman tables and
+ *              the scan header.
+ *
+ * Returns:     The number of bytes written, or 0 if out is too small.
+ *
+ ******************************************************************************/
+static size_t jpeg_put_header(uint8_t *out, size_t size, const jpeg_tables_t *tables,
+                              uint32_t width, uint32_t height)
+{
+    static const uint8_t jfif[] =
+    {
+        0xFF, 0xD8,                                            // SOI
+        0xFF, 0xE0, 0x00, 0x10, 'J', 'F', 'I', 'F', 0x00,      // APP0
+        0x01, 0x01, 0x00, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00,
+        0xFF, 0xDB, 0x00, 0x43, 0x00                           // DQT, table 0
+    };
+    uint8_t *p = out;
+
+    if (size < JPEG_HEADER_SIZE)
+    {
+        return 0;
+    }
+
+    memcpy(p, jfif, sizeof(jfif));
+    p += sizeof(jfif);
+    memcpy(p, tables->dqt, 64);
+    p += 64;
+
+    // SOF0: 8-bit samples, one component with id 1, no subsampling.
+    *p++ = 0xFF; *p++ = 0xC0; *p++ = 0x00; *p++ = 0x0B; *p++ = 0x08;
+    *p++ = (uint8_t)(height >> 8); *p++ = (uint8_t)height;
+    *p++ = (uint8_t)(width >> 8);  *p++ = (uint8_t)width;
+    *p++ = 0x01; *p++ = 0x01; *p++ = 0x11; *p++ = 0x00;
+
+    // DHT: DC table 0, then AC table 0.
+    *p++ = 0xFF; *p++ = 0xC4; *p++ = 0x00; *p++ = 3 + 16 + sizeof(jpeg_dc_values);
+    *p++ = 0x00;
+    memcpy(p, jpeg_dc_bits, 16);
+    p += 16;
+    memcpy(p, jpeg_dc_values, sizeof(jpeg_dc_values));
+    p += sizeof(jpeg_dc_values);
+
+    *p++ = 0xFF; *p++ = 0xC4; *p++ = 0x00; *p++ = 3 + 16 + sizeof(jpeg_ac_values);
+    *p++ = 0x10;
+    memcpy(p, jpeg_ac_bits, 16);
+    p += 16;
+    memcpy(p, jpeg_ac_values, sizeof(jpeg_ac_values));
+    p += sizeof(jpeg_ac_values);
+
+    // SOS: component 1 with tables 0, spectral selection 0 to 63.
+    *p++ = 0xFF; *p++ = 0xDA; *p++ = 0x00; *p++ = 0x08; *p++ = 0x01;
+    *p++ = 0x01; *p++ = 0x00; *p++ = 0x00; *p++ = 0x3F; *p++ = 0x00;
+
+    return (size_t)(p - out);
+}
+
+/*******************************************************************************
+ *
+ * Function:    jpeg_max_size()
+ *
+ * Description: Gets the size of the JPEG of a frame in the worst case.
+ *
+ * Returns:     The size in bytes.
+ *
+ ******************************************************************************/
+size_t jpeg_max_size(uint32_t width, uint32_t height)
+{
+    size_t blocks = (size_t)((width + JPEG_BLOCK_SIZE - 1) / JPEG_BLOCK_SIZE) *
+                    ((height + JPEG_BLOCK_SIZE - 1) / JPEG_BLOCK_SIZE);
+
+    return JPEG_HEADER_SIZE + blocks * JPEG_BLOCK_MAX_BYTES;
+}
+
+/*******************************************************************************
+ *
+ * Function:    jpeg_encode()
+ *
+ * Description: Compresses a luma frame block by block, straight into out.
+ *              Blocks on the right and bottom edges that stick out of the
+ *              frame are padded by repeating the last column and row.
+ *
+ * Returns:     On success, returns the length of the JPEG. Otherwise, returns
+ *              -1.
+ *
+ ******************************************************************************/
+ssize_t jpeg_encode(const uint8_t *luma, size_t stride, uint32_t width, uint32_t height,
+                    int quality, uint8_t *out, size_t size)
+{
+    const jpeg_tables_t *tables;
+    jpeg_writer_t        w;
+    int16_t              quant[64] __attribute__((aligned(16)));
+    uint8_t              edge[64];
+    int                  dc = 0;
+
+    if ((luma == NULL) || (out == NULL) || (width == 0) || (height == 0) ||
+        (width > JPEG_MAX_DIMENSION) || (height > JPEG_MAX_DIMENSION))
+    {
+        return -1;
+    }
+
+    quality = (quality < 1) ? 1 : (quality > JPEG_MAX_QUALITY) ? JPEG_MAX_QUALITY : quality;
+    if ((tables = jpeg_tables(quality)) == NULL)
+    {
+        return -1;
+    }
+
+    memset(&w, 0, sizeof(w));
+    w.out  = out;
+    w.size = size;
+    if ((w.length = jpeg_put_header(out, size, tables, width, height)) == 0)
+    {
+        return -1;
+    }
+
+    for (uint32_t y = 0; (y < height) && !w.overflow; y += JPEG_BLOCK_SIZE)
+    {
+        for (uint32_t x = 0; x < width; x += JPEG_BLOCK_SIZE)
+        {
+            const uint8_t *block = luma + (size_t)y * stride + x;
+
+            if ((x + JPEG_BLOCK_SIZE > width) || (y + JPEG_BLOCK_SIZE > height))
+            {
+                for (uint32_t row = 0; row < JPEG_BLOCK_SIZE; ++row)
+                {
+                    uint32_t src_row = (y + row < height) ? row : height - 1 - y;
+
+                    for (uint32_t col = 0; col < JPEG_BLOCK_SIZE; ++col)
+                    {
+                        uint32_t src_col = (x + col < width) ? col : width - 1 - x;
+
+                        edge[row * JPEG_BLOCK_SIZE + col] = block[src_row * stride + src_col];
+                    }
+                }
+                jpeg_transform(edge, JPEG_BLOCK_SIZE, tables, quant);
+            }
+            else
+            {
+                jpeg_transform(block, stride, tables, quant);
+            }
+
+            jpeg_encode_block(&w, tables, quant, &dc);
+        }
+    }
+
+    jpeg_flush_bits(&w);
+    if (w.overflow || (w.size - w.length < 2))
+    {
+        return -1;
+    }
+    w.out[w.length++] = 0xFF; // EOI
+    w.out[w.length++] = 0xD9;
+
+    return (ssize_t)w.length;
+}
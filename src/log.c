@@ -0,0 +1,689 @@
+#include "log.h"
+#include "util.h"
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define LOG_RING_MASK        (LOG_RING_RECORDS - 1)
+#define LOG_STRING_BYTES     112 // string arguments are copied into this space
+#define LOG_PATH_SIZE        256
+#define LOG_FLUSH_INTERVAL_MS 100
+#define LOG_LINE_SIZE        512
+
+// How a conversion reads its argument, following the printf rules.
+typedef enum log_arg_type
+{
+    LOG_ARG_INT,
+    LOG_ARG_LONG,
+    LOG_ARG_LLONG,
+    LOG_ARG_SIZE,
+    LOG_ARG_INTMAX,
+    LOG_ARG_PTRDIFF,
+    LOG_ARG_DOUBLE,
+    LOG_ARG_LDOUBLE,
+    LOG_ARG_STRING,
+    LOG_ARG_POINTER,
+    LOG_ARG_NONE // %% and %n
+} log_arg_type_t;
+
+typedef struct log_spec
+{
+    log_arg_type_t type;
+    uint32_t       stars; // '*' widths and precisions, each an int argument
+} log_spec_t;
+
+typedef union log_arg
+{
+    int64_t     i;
+    double      d;
+    const void *p;
+    uint64_t    offset; // of a string argument in log_record_t.strings
+} log_arg_t;
+
+typedef struct log_record
+{
+    uint64_t    timestamp_ns;
+    log_site_t *site;
+    log_arg_t   args[LOG_MAX_ARGS];
+    char        strings[LOG_STRING_BYTES];
+} log_record_t;
+
+// One thread's messages. The owning thread advances head and the writer
+// thread advances tail, each on its own cache line. When the thread exits the
+// ring is handed to the next new thread.
+typedef struct log_ring
+{
+    uint64_t     head __attribute__((aligned(64)));
+    uint64_t     dropped;
+    uint32_t     in_use;
+    uint64_t     tail __attribute__((aligned(64)));
+    log_record_t records[LOG_RING_RECORDS] __attribute__((aligned(64)));
+} log_ring_t;
+
+// Global module variables
+log_level_t                 log_threshold = LOG_LEVEL_INFO;
+static log_ring_t           rings[LOG_MAX_THREADS];
+static pthread_key_t        ring_key;
+static pthread_once_t       ring_key_once = PTHREAD_ONCE_INIT;
+static __thread log_ring_t *thread_ring;
+static __thread int         thread_unlogged;
+static uint64_t             dropped_untracked; // messages of threads without a ring
+static uint64_t             dropped_reported;
+static pthread_mutex_t      writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t            writer_thread;
+static log_config_t         config;
+static char                 path[LOG_PATH_SIZE];
+static FILE                *stream;
+static uint64_t             stream_bytes;
+
+static const char *const level_names[] = { "ERROR", "WARN", "INFO", "DEBUG" };
+
+/*******************************************************************************
+ *
+ * Function:    log_parse_spec()
+ *
+ * Description: Parses one conversion specification of a printf format.
+ *
+ * Returns:     A pointer to the character after the conversion.
+ *
+ ******************************************************************************/
+static const char *log_parse_spec(const char *p, log_spec_t *spec)
+{
+    // p points at the '%'.
+    ++p;
+    spec->stars = 0;
+
+    while (*p && strchr("-+ #0", *p))
+    {
+        ++p;
+    }
+    for (int precision = 0; precision < 2; ++precision)
+    {
+        if (*p == '*')
+        {
+            ++spec->stars;
+            ++p;
+        }
+        while ((*p >= '0') && (*p <= '9'))
+        {
+            ++p;
+        }
+        if ((precision == 0) && (*p == '.'))
+        {
+            ++p;
+            continue;
+        }
+        break;
+    }
+
+    char length = 0;
+    if (*p && strchr("hlLzjt", *p))
+    {
+        length = *p++;
+        if (((length == 'h') || (length == 'l')) && (*p == length))
+        {
+            length = (length == 'l') ? 'q' : 'h';
+            ++p;
+        }
+    }
+
+    switch (*p)
+    {
+        case 'd': case 'i': case 'u': case 'o': case 'x': case 'X': case 'c':
+            spec->type = (length == 'l') ? LOG_ARG_LONG
+                       : (length == 'q') ? LOG_ARG_LLONG
+                       : (length == 'z') ? LOG_ARG_SIZE
+                       : (length == 'j') ? LOG_ARG_INTMAX
+                       : (length == 't') ? LOG_ARG_PTRDIFF
+                       : LOG_ARG_INT;
+            break;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            spec->type = (length == 'L') ? LOG_ARG_LDOUBLE : LOG_ARG_DOUBLE;
+            break;
+        case 's':
+            spec->type = LOG_ARG_STRING;
+            break;
+        case 'p':
+            spec->type = LOG_ARG_POINTER;
+            break;
+        default:
+            spec->type = LOG_ARG_NONE;
+            break;
+    }
+
+    if (*p)
+    {
+        ++p;
+    }
+    return p;
+}
+
+/*******************************************************************************
+ *
+ * Function:    log_parse_site()
+ *
+ * Description: Works out the type of every argument of a call site from its
+ *              format string. Two threads may do this at once, but they
+ *              store the same values.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void log_parse_site(log_site_t *site)
+{
+    const char *p     = site->format;
+    uint32_t    nargs = 0;
+
+    while ((p = strchr(p, '%')) != NULL)
+    {
+        log_spec_t spec;
+
+        p = log_parse_spec(p, &spec);
+        for (uint32_t n = 0; (n < spec.stars) && (nargs < LOG_MAX_ARGS); ++n)
+        {
+            site->types[nargs++] = LOG_ARG_INT;
+        }
+        if ((spec.type != LOG_ARG_NONE) && (nargs < LOG_MAX_ARGS))
+        {
+            site->types[nargs++] = (uint8_t)spec.type;
+        }
+    }
+
+    site->nargs = nargs;
+    __atomic_store_n(&site->parsed, 1, __ATOMIC_RELEASE);
+}
+
+/*******************************************************************************
+ *
+ * Function:    log_release_ring()
+ *
+ * Description: Runs when a thread that owns a ring exits and frees the ring
+ *              for the next thread. Messages still in it are written as usual.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void log_release_ring(void *ring)
+{
+    __atomic_store_n(&((log_ring_t *)ring)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+/*******************************************************************************
+ *
+ * Function:    log_create_key()
+ *
+ * Description: Creates the key whose destructor releases a thread's ring.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void log_create_key(void)
+{
+    pthread_key_create(&ring_key, log_release_ring);
+}
+
+/*******************************************************************************
+ *
+ * Function:    log_ring()
+ *
+ * Description: Returns the calling thread's ring, claiming a free one on
+ *              first use.
+ *
+ * Returns:     The ring of the calling thread, or NULL if every ring is taken.
+ *
+ ******************************************************************************/
+static inline log_ring_t *log_ring(void)
+{
+    if ((thread_ring != NULL) || thread_unlogged)
+    {
+        return thread_ring;
+    }
+
+    pthread_once(&ring_key_once, log_create_key);
+    for (uint32_t index = 0; index < LOG_MAX_THREADS; ++index)
+    {
+        uint32_t in_use = 0;
+
+        if (__atomic_compare_exchange_n(&rings[index].in_use, &in_use, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            thread_ring = &rings[index];
+            pthread_setspecific(ring_key, thread_ring);
+            return thread_ring;
+        }
+    }
+
+    thread_unlogged = 1;
+    return NULL;
+}
+
+/*******************************************************************************
+ *
+ * Function:    log_write()
+ *
+ * Description: Record a message. The arguments are copied as they are, with
+ *              strings copied into the record, and the record is published by
+ *              a release store of the ring's head. When the ring is full the
+ *              message is dropped and counted.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+void log_write(log_site_t *site, const char *format, ...)
+{
+    log_ring_t *ring = log_ring();
+
+    (void)format;
+    if (ring == NULL)
+    {
+        __atomic_fetch_add(&dropped_untracked, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    uint64_t head = ring->head;
+
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOG_RING_RECORDS)
+    {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    if (!__atomic_load_n(&site->parsed, __ATOMIC_ACQUIRE))
+    {
+        log_parse_site(site);
+    }
+
+    log_record_t *record  = &ring->records[head & LOG_RING_MASK];
+    uint32_t      strings = 0;
+    va_list       ap;
+
+    record->timestamp_ns = monotonic_time_ns();
+    record->site         = site;
+
+    va_start(ap, format);
+    for (uint32_t n = 0; n < site->nargs; ++n)
+    {
+        log_arg_t *arg = &record->args[n];
+
+        switch (site->types[n])
+        {
+            case LOG_ARG_INT:     arg->i = va_arg(ap, int);          break;
+            case LOG_ARG_LONG:    arg->i = va_arg(ap, long);         break;
+            case LOG_ARG_LLONG:   arg->i = va_arg(ap, long long);    break;
+            case LOG_ARG_SIZE:    arg->i = (int64_t)va_arg(ap, size_t); break;
+            case LOG_ARG_INTMAX:  arg->i = va_arg(ap, intmax_t);     break;
+            case LOG_ARG_PTRDIFF: arg->i = va_arg(ap, ptrdiff_t);    break;
+            case LOG_ARG_DOUBLE:  arg->d = va_arg(ap, double);       break;
+            case LOG_ARG_LDOUBLE: arg->d = (double)va_arg(ap, long double); break;
+            case LOG_ARG_POINTER: arg->p = va_arg(ap, void *);       break;
+            case LOG_ARG_STRING:
+            {
+                const char *str  = va_arg(ap, const char *);
+                size_t      room = LOG_STRING_BYTES - 1 - strings;
+                size_t      len  = strnlen((str != NULL) ? str : "(null)", room);
+
+                // Strings that don't fit are truncated; the last byte is
+                // always a terminator, so a full record yields empty strings.
+                arg->offset = strings;
+                memcpy(&record->strings[strings], (str != NULL) ? str : "(null)", len);
+                record->strings[strings + len] = '\0';
+                strings += (uint32_t)len + ((strings + len < LOG_STRING_BYTES - 1) ? 1 : 0);
+                break;
+            }
+        }
+    }
+    va_end(ap);
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*******************************************************************************
+ *
+ * Function:    log_format_arg()
+ *
+ * Description: Formats a single conversion with the argument it recorded.
+ *              The specification is passed to snprintf unchanged, together
+ *              with an argument of the type it reads.
+ *
+ * Returns:     The number of characters snprintf would have written.
+ *
+ ******************************************************************************/
+static int log_format_arg(char *out, size_t size, const char *spec, const log_spec_t *parsed,
+                          const log_record_t *record, uint32_t *n)
+{
+    const log_site_t *site = record->site;
+    int               star[2] = { 0, 0 };
+
+    for (uint32_t s = 0; s < parsed->stars; ++s)
+    {
+        star[s] = (*n < site->nargs) ? (int)record->args[(*n)++].i : 0;
+    }
+
+    if ((parsed->type == LOG_ARG_NONE) || (*n >= site->nargs))
+    {
+        // %% prints itself, %n and unrecorded arguments print nothing useful.
+        return snprintf(out, size, "%s", (spec[1] == '%') ? "%" : "");
+    }
+
+    const log_arg_t *arg = &record->args[(*n)++];
+
+    #define LOG_FORMAT(value) \
+        ((parsed->stars == 0) ? snprintf(out, size, spec, value) \
+         : (parsed->stars == 1) ? snprintf(out, size, spec, star[0], value) \
+         : snprintf(out, size, spec, star[0], star[1], value))
+
+    switch (parsed->type)
+    {
+        case LOG_ARG_INT:     return LOG_FORMAT((int)arg->i);
+        case LOG_ARG_LONG:    return LOG_FORMAT((long)arg->i);
+        case LOG_ARG_LLONG:   return LOG_FORMAT((long long)arg->i);
+        case LOG_ARG_SIZE:    return LOG_FORMAT((size_t)arg->i);
+        case LOG_ARG_INTMAX:  return LOG_FORMAT((intmax_t)arg->i);
+        case LOG_ARG_PTRDIFF: return LOG_FORMAT((ptrdiff_t)arg->i);
+        case LOG_ARG_DOUBLE:  return LOG_FORMAT(arg->d);
+        case LOG_ARG_LDOUBLE: return LOG_FORMAT((long double)arg->d);
+        case LOG_ARG_POINTER: return LOG_FORMAT(arg->p);
+        case LOG_ARG_STRING:  return LOG_FORMAT(&record->strings[arg->offset]);
+        default:              return 0;
+    }
+
+    #undef LOG_FORMAT
+}
+
+/*******************************************************************************
+ *
+ * Function:    log_format()
+ *
+ * Description: Formats a record into a line of text prefixed with the wall
+ *              clock time, the level and the source location.
+ *
+ * Returns:     The length of the line.
+ *
+ ******************************************************************************/
+static size_t log_format(char *line, size_t size, const log_record_t *record,
+                         int64_t realtime_offset_ns)
+{
+    const log_site_t *site = record->site;
+    const char       *file = strrchr(site->file, '/');
+    int64_t           ns   = (int64_t)record->timestamp_ns + realtime_offset_ns;
+    time_t            secs = (time_t)(ns / 1000000000);
+    struct tm         tm;
+    size_t            len;
+    uint32_t          n = 0;
+
+    localtime_r(&secs, &tm);
+    len  = strftime(line, size, "%Y-%m-%d %H:%M:%S", &tm);
+    len += (size_t)snprintf(line + len, size - len, ".%06u %-5s %s:%u ",
+                            (unsigned)((ns / 1000) % 1000000), level_names[site->level],
+                            (file != NULL) ? file + 1 : site->file, site->line);
+
+    for (const char *p = site->format; *p && (len < size - 1);)
+    {
+        const char *percent = strchr(p, '%');
+        size_t      literal = (percent != NULL) ? (size_t)(percent - p) : strlen(p);
+
+        if (literal > size - 1 - len)
+        {
+            literal = size - 1 - len;
+        }
+        memcpy(line + len, p, literal);
+        len += literal;
+        p   += literal;
+
+        if (percent != NULL && (len < size - 1))
+        {
+            char       spec[32];
+            log_spec_t parsed;
+            const char *end = log_parse_spec(percent, &parsed);
+            size_t      spec_len = (size_t)(end - percent);
+
+            if (spec_len >= sizeof(spec))
+            {
+                spec_len = sizeof(spec) - 1;
+            }
+            memcpy(spec, percent, spec_len);
+            spec[spec_len] = '\0';
+
+            int written = log_format_arg(line + len, size - len, spec, &parsed, record, &n);
+            if (written > 0)
+            {
+                len += ((size_t)written < size - len) ? (size_t)written : size - 1 - len;
+            }
+            p = end;
+        }
+    }
+
+    // Every message is a line of its own, whether or not it ends in a newline.
+    if ((len > 0) && (line[len - 1] == '\n'))
+    {
+        --len;
+    }
+    line[len++] = '\n';
+    line[len]   = '\0';
+
+    return len;
+}
+
+/*******************************************************************************
+ *
+ * Function:    log_rotate()
+ *
+ * Description: Renames path to path.1, path.1 to path.2 and so on, dropping
+ *              the oldest file, and starts a new file at path.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void log_rotate(void)
+{
+    char from[LOG_PATH_SIZE + 16];
+    char to[LOG_PATH_SIZE + 16];
+
+    fclose(stream);
+    for (uint32_t n = config.max_files; n > 1; --n)
+    {
+        snprintf(from, sizeof(from), "%s.%u", path, n - 1);
+        snprintf(to, sizeof(to), "%s.%u", path, n);
+        rename(from, to);
+    }
+    snprintf(to, sizeof(to), "%s.1", path);
+    rename(path, to);
+
+    if ((stream = fopen(path, "a")) == NULL)
+    {
+        stream = stdout;
+    }
+    stream_bytes = 0;
+}
+
+/*******************************************************************************
+ *
+ * Function:    log_emit()
+ *
+ * Description: Writes a line to the log file, rotating it first if it is full.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void log_emit(const char *line, size_t len)
+{
+    if (stream == NULL)
+    {
+        stream = stdout;
+    }
+    if ((stream != stdout) && (config.max_files > 0) && (config.max_bytes > 0) &&
+        (stream_bytes + len > config.max_bytes))
+    {
+        log_rotate();
+    }
+    fwrite(line, 1, len, stream);
+    stream_bytes += len;
+}
+
+/*******************************************************************************
+ *
+ * Function:    log_drain()
+ *
+ * Description: Writes out every message that was published when it started,
+ *              merging the rings in timestamp order. Called with writer_mutex
+ *              held, so there is a single consumer for every ring.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void log_drain(void)
+{
+    uint64_t heads[LOG_MAX_THREADS];
+    uint64_t dropped = __atomic_load_n(&dropped_untracked, __ATOMIC_RELAXED);
+    char     line[LOG_LINE_SIZE];
+    uint64_t realtime_ns;
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    realtime_ns = (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+    // Recomputed every pass, so that NTP setting the clock after boot shows.
+    int64_t offset = (int64_t)(realtime_ns - monotonic_time_ns());
+
+    for (uint32_t r = 0; r < LOG_MAX_THREADS; ++r)
+    {
+        heads[r] = __atomic_load_n(&rings[r].head, __ATOMIC_ACQUIRE);
+        dropped += __atomic_load_n(&rings[r].dropped, __ATOMIC_RELAXED);
+    }
+
+    for (;;)
+    {
+        log_ring_t *oldest = NULL;
+
+        for (uint32_t r = 0; r < LOG_MAX_THREADS; ++r)
+        {
+            log_ring_t *ring = &rings[r];
+
+            if ((ring->tail < heads[r]) &&
+                ((oldest == NULL) ||
+                 (ring->records[ring->tail & LOG_RING_MASK].timestamp_ns <
+                  oldest->records[oldest->tail & LOG_RING_MASK].timestamp_ns)))
+            {
+                oldest = ring;
+            }
+        }
+        if (oldest == NULL)
+        {
+            break;
+        }
+
+        size_t len = log_format(line, sizeof(line),
+                                &oldest->records[oldest->tail & LOG_RING_MASK], offset);
+        __atomic_store_n(&oldest->tail, oldest->tail + 1, __ATOMIC_RELEASE);
+        log_emit(line, len);
+    }
+
+    if (dropped != dropped_reported)
+    {
+        int len = snprintf(line, sizeof(line), "%llu log messages dropped\n",
+                           (unsigned long long)(dropped - dropped_reported));
+        log_emit(line, (size_t)len);
+        dropped_reported = dropped;
+    }
+}
+
+/*******************************************************************************
+ *
+ * Function:    log_flush()
+ *
+ * Description: Write every buffered message before returning.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+void log_flush(void)
+{
+    pthread_mutex_lock(&writer_mutex);
+    log_drain();
+    fflush(stream);
+    pthread_mutex_unlock(&writer_mutex);
+}
+
+/*******************************************************************************
+ *
+ * Function:    log_writer()
+ *
+ * Description: Background thread that periodically writes out the messages.
+ *
+ * Returns:     Never returns.
+ *
+ ******************************************************************************/
+static void *log_writer(void *arg)
+{
+    (void)arg;
+
+    for (;;)
+    {
+        log_flush();
+        SLEEP_MSECONDS(LOG_FLUSH_INTERVAL_MS);
+    }
+
+    return NULL;
+}
+
+/*******************************************************************************
+ *
+ * Function:    log_set_level()
+ *
+ * Description: Change which messages are logged.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+void log_set_level(log_level_t level)
+{
+    __atomic_store_n(&log_threshold, level, __ATOMIC_RELAXED);
+}
+
+/*******************************************************************************
+ *
+ * Function:    log_init()
+ *
+ * Description: Opens the log file and starts the background writer thread.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+int log_init(const log_config_t *cfg)
+{
+    if (cfg == NULL)
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&writer_mutex);
+    config = *cfg;
+    stream = stdout;
+    if (cfg->path != NULL)
+    {
+        if ((strlen(cfg->path) >= sizeof(path)) || ((stream = fopen(cfg->path, "a")) == NULL))
+        {
+            stream = stdout;
+            pthread_mutex_unlock(&writer_mutex);
+            return -1;
+        }
+        strcpy(path, cfg->path);
+        stream_bytes = (uint64_t)ftell(stream);
+    }
+    pthread_mutex_unlock(&writer_mutex);
+
+    log_set_level(cfg->level);
+
+    if (pthread_create(&writer_thread, NULL, log_writer, NULL) != 0)
+    {
+        return -1;
+    }
+    pthread_detach(writer_thread);
+
+    return atexit(log_flush);
+}
@@ -1,43 +1,597 @@
 #include "camera.h"
+#include "scheduler.h"
+#include "blob.h"
+#include "event.h"
+#include "metrics.h"
+#include "trace.h"
+#include "frame_ring.h"
+#include "store.h"
+#include "snapshot.h"
+#include "upload.h"
+#include "checkpoint.h"
+#include "pool.h"
+#include "denoise.h"
 #include "gsm.h"
+#include "dispatch.h"
+#include "settings.h"
 #include "util.h"
-#include "debug.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <time.h>
 
 #define VIDEO_DEVICE_FILE    "/dev/video0"
+#define VIDEO_STILL_DEVICE   NULL // e.g. "/dev/video2", NULL switches formats
 #define VIDEO_OUTPUT_DIR     "/home/pi/Pictures"
-#define GSM_DEVICE_FILE      "/dev/ttyUSB2"
+#define VIDEO_DETECT_WIDTH   320
+#define VIDEO_DETECT_HEIGHT  240
+#define VIDEO_STILL_WIDTH    1280
+#define VIDEO_STILL_HEIGHT   960
+#define GSM_DEVICE_FILES     { "/dev/ttyUSB2" } // one per modem, at most SETTINGS_MAX_MODEMS
 #define GSM_DESTINATION      "15599078609"
 #define GSM_MESSAGE          "Motion detected"
+#define GSM_MESSAGE_SIZE     160 // one SMS
+#define TRAVEL_TEXT_SIZE     48
+#define STATUS_TEXT_SIZE     64 // signal suffix of an alert, kept whole
+#define GSM_STATUS_POLL_SECONDS 60
+#define GSM_LINK_BAUD        460800
+#define GSM_CMUX_FRAME_SIZE  127
+#define GSM_LIVENESS_SECONDS 60
+#define GSM_MAX_FAILURES     3 // failed checks or sends before a modem is taken out
+#define GSM_MAX_ATTEMPTS     3 // modems an alert is tried on
+#define ALERT_INTERVAL_SECONDS 0 // least time between two alerts
+#define ALERTS_PER_HOUR      0   // 0 for no limit
 #define AVG_PIXEL_DIFFERENCE  5
 #define NUM_FRAMES_TO_CAPTURE 10 
+#define STILL_INTERVAL_MS     1000
+#define STILL_REPEAT_SCORE    (2 * 256) // summed change below which a still repeats
+#define STILL_KEYFRAME_INTERVAL 5
+#define DETECT_FULL_FPS       10
+#define DETECT_MIN_FPS        2
+#define DETECT_IDLE_LEVELS    4
+#define DETECT_QUIET_SECONDS  60
+#define DETECT_WAKE_SCORE     ((AVG_PIXEL_DIFFERENCE * 256) / 2)
+#define STATS_INTERVAL_SECONDS 3600
+#define DENOISE_ON_LEVEL      (AVG_PIXEL_DIFFERENCE * 128) // noise levels, 1/256 grey
+#define DENOISE_OFF_LEVEL     (AVG_PIXEL_DIFFERENCE * 64)  // levels, to switch at
+#define DENOISE_STILL_WEIGHT  32 // of 128, i.e. still pixels keep 3/4 of the past
+#define DENOISE_MOTION_DIFFERENCE 20 // grey levels from which pixels aren't filtered
+#define BLOB_BLOCK_DIFFERENCE 12 // grey levels for a block to count as changed
+#define BLOB_MIN_BLOCKS       2
+#define BLOB_MAX_BLOCKS       150
+#define SEARCH_MAX_BLOCKS     48 // most changed blocks tracked per frame
+#define SEARCH_RANGE_PIXELS   12 // fastest movement tracked between frames
+#define TRAVEL_MIN_PIXELS     16 // shorter travel has no direction
+#define APPROACH_X            0  // which way someone coming towards the gate
+#define APPROACH_Y            1  // moves in the picture, x right and y down
+#define ALERT_TRAVEL_FRAMES   10   // an alert waits for its direction at most
+#define ALERT_TRAVEL_WAIT_MS  1500 // this many active frames or this long
+#define EVENT_WINDOW_FRAMES   8 // an event opens when EVENT_OPEN_FRAMES of the
+#define EVENT_OPEN_FRAMES     3 // last EVENT_WINDOW_FRAMES frames show motion
+#define EVENT_QUIET_MS        5000
+#define METRICS_TEXT_FILE     "/tmp/sitemon.prom"
+#define METRICS_SOCKET        "/tmp/sitemon-metrics.sock"
+#define METRICS_INTERVAL_SECONDS 60
+#define TRACE_OUTPUT_FILE     "/tmp/sitemon-trace.json"
+#define LOG_FILE              "/home/pi/sitemon.log"
+#define LOG_MAX_BYTES         (1024 * 1024)
+#define LOG_MAX_FILES         3
+#define FRAME_RING_SLOTS      8
+#define STORE_DIR             "/home/pi/Pictures/store"
+#define STORE_SEGMENTS        64
+#define STORE_SEGMENT_BYTES   (16 * 1024 * 1024)
+#define STORE_MAX_FRAMES      8192
+#define UPLOAD_URL            "http://example.com/sitemon/upload"
+#define UPLOAD_APN            "internet"
+#define UPLOAD_MIN_CHUNK      1024
+#define UPLOAD_MAX_CHUNK      (32 * 1024)
+#define UPLOAD_CHUNK_MS       4000
+#define UPLOAD_MAX_ATTEMPTS   5
+#define SNAPSHOT_SCALE        2
+#define SNAPSHOT_MAX_BYTES    (VIDEO_DETECT_WIDTH * VIDEO_DETECT_HEIGHT + 64)
+#define SNAPSHOT_ID_SIZE      32
+#define ANALYSIS_THREADS      0 // one per online CPU
+#define CHECKPOINT_FILE       "/home/pi/sitemon.state"
+#define CHECKPOINT_INTERVAL_SECONDS 60
+#define SETTINGS_FILE         "/home/pi/sitemon.conf" // overrides the defaults above
+#define CAPTURE_MEMORY        CAMERA_MEMORY_USERPTR
+
+// Everything the alert thread needs, so the main loop can go on right away.
+typedef struct alert
+{
+    event_t         event;
+    char            id[SNAPSHOT_ID_SIZE];
+    // Copied from the settings in force when the event opened.
+    char            message[SETTINGS_MESSAGE_SIZE];
+    uint32_t        recipient_count;
+    char            recipients[SETTINGS_MAX_RECIPIENTS][SETTINGS_RECIPIENT_SIZE];
+    camera_frame_t  frame;           // handle is NULL if there is no frame
+    size_t          snapshot_length; // 0 if there is no snapshot
+    uint8_t         snapshot[SNAPSHOT_MAX_BYTES];
+} alert_t;
+
+static const event_travel_config_t travel_config = {
+    .approach_x = APPROACH_X,
+    .approach_y = APPROACH_Y,
+    .min_pixels = TRAVEL_MIN_PIXELS
+};
+
+static metric_t *alert_latency_metric;
+static metric_t *blob_metric;
+static metric_t *events_metric;
 
 static void *on_motion_detected(void *vargp)
 {
-    gsm_set_functionality_mode(GSM_FULL_FUNCTIONALITY_MODE);
-    gsm_send_message(GSM_DESTINATION, GSM_MESSAGE);
-    gsm_set_functionality_mode(GSM_MINIMUM_FUNCTIONALITY_MODE);
+    alert_t     *alert = (alert_t *)vargp;
+    gsm_t       *modem;
+    gsm_status_t status;
+    char         travel[TRAVEL_TEXT_SIZE];
+    char         suffix[STATUS_TEXT_SIZE] = "";
+    char         message[GSM_MESSAGE_SIZE];
+    int          sent = 0;
+
+    TRACE_THREAD_NAME("gsm alert");
+
+    // Encoded straight from the capture buffer, which goes back to the
+    // camera right after.
+    if (alert->frame.handle != NULL)
+    {
+        ssize_t length = snapshot_encode(alert->frame.luma, alert->frame.stride,
+                                         alert->frame.width, alert->frame.height,
+                                         SNAPSHOT_SCALE, alert->snapshot,
+                                         sizeof(alert->snapshot));
+        alert->snapshot_length = (length > 0) ? (size_t)length : 0;
+        camera_release_frame(&alert->frame);
+    }
+
+    // The event opens before its object has moved far enough to tell which
+    // way it goes, so give it a few more frames.
+    event_wait_travel(&alert->event, TRAVEL_MIN_PIXELS, ALERT_TRAVEL_FRAMES,
+                      ALERT_TRAVEL_WAIT_MS, &alert->event);
+
+    // Held for the upload, which leaves the other modems free for the SMS.
+    modem = dispatch_acquire();
+
+    // The cached status, never a query that would delay the alert.
+    if ((modem != NULL) && (gsm_get_status(modem, &status) == 0) && (status.signal_ns != 0))
+    {
+        snprintf(suffix, sizeof(suffix), " (signal %d dBm %llu s ago, %s)",
+                 (int)status.rssi_dbm,
+                 (unsigned long long)((monotonic_time_ns() - status.signal_ns) / 1000000000ull),
+                 gsm_registration_string(status.registration));
+    }
+
+    // A long message or travel text is cut, not the status after it.
+    event_describe_travel(&alert->event, &travel_config, travel, sizeof(travel));
+    snprintf(message, sizeof(message) - strlen(suffix), "%s%s%s", alert->message,
+             (travel[0] != '\0') ? ", " : "", travel);
+    strcat(message, suffix);
+
+    for (uint32_t n = 0; n < alert->recipient_count; ++n)
+    {
+        // The latency is up to the first recipient that got the alert.
+        if ((dispatch_send(alert->recipients[n], message) == 0) && !sent)
+        {
+            metrics_observe(alert_latency_metric, monotonic_time_ns() - alert->event.start_ns);
+            sent = 1;
+        }
+    }
+    if ((modem != NULL) && (alert->snapshot_length > 0))
+    {
+        upload_snapshot(modem, alert->id, alert->snapshot, alert->snapshot_length);
+    }
+    dispatch_release(modem);
+
+    free(alert);
     return NULL;
 }
 
+/*******************************************************************************
+ *
+ * Function:    analyze_frame()
+ *
+ * Description: Feeds the result of camera_detect_motion() into the event
+ *              state machine. Motion only counts as activity if it comes
+ *              from objects of a plausible size.
+ *
+ * Returns:     What happened to the event state as a result of this frame.
+ *
+ ******************************************************************************/
+static event_transition_t analyze_frame(int detected, const motion_result_t *motion,
+                                        event_t *event)
+{
+    static blob_result_t blobs; // only the main thread analyzes frames
+
+    // Held for this frame only, so a reload applies from the next one.
+    const settings_t *settings = settings_acquire();
+    int               active   = 0;
+
+    if (detected == 1)
+    {
+        active = (blob_analyze(motion, &settings->blob_filter, &blobs) > 0);
+        metrics_observe(blob_metric, blobs.elapsed_ns);
+    }
+    settings_release(settings);
+
+    return event_update(active, motion->score, motion->flow_x, motion->flow_y,
+                        motion->timestamp_ns, event);
+}
+
+/*******************************************************************************
+ *
+ * Function:    report_event_closed()
+ *
+ * Description: Saves the checkpoint and logs the summary of a closed event.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void report_event_closed(const event_t *event, uint32_t threshold)
+{
+    char travel[TRAVEL_TEXT_SIZE];
+
+    checkpoint_save(CHECKPOINT_FILE, threshold);
+    event_describe_travel(event, &travel_config, travel, sizeof(travel));
+    LOG_INFO("event %u: %llu ms, %u frames, peak score %u%s%s",
+             event->id,
+             (unsigned long long)((event->end_ns - event->start_ns) / 1000000),
+             event->frames, event->peak_score,
+             (travel[0] != '\0') ? ", " : "", travel);
+}
+
+/*******************************************************************************
+ *
+ * Function:    watch_between_stills()
+ *
+ * Description: Keeps analyzing detection frames until the next still is due,
+ *              which tells the camera how much the scene changed since the
+ *              last still and keeps the open event's frames, peak score and
+ *              travel up to date. Just waits if the camera can't detect
+ *              motion while taking stills.
+ *
+ * Returns:     EVENT_CLOSED if the event closed, which ends the stills, and
+ *              EVENT_ONGOING otherwise.
+ *
+ ******************************************************************************/
+static event_transition_t watch_between_stills(uint32_t threshold, uint32_t interval_ms,
+                                               event_t *event)
+{
+    uint64_t        due_ns = monotonic_time_ns() + (uint64_t)interval_ms * 1000000ull;
+    motion_result_t motion;
+
+    while (monotonic_time_ns() < due_ns)
+    {
+        int detected = camera_detect_motion((uint8_t)threshold, &motion);
+
+        if (detected == -1)
+        {
+            uint64_t now_ns = monotonic_time_ns();
+
+            if (now_ns < due_ns)
+            {
+                SLEEP_USECONDS((due_ns - now_ns) / 1000);
+            }
+            return EVENT_ONGOING;
+        }
+
+        if (analyze_frame(detected, &motion, event) == EVENT_CLOSED)
+        {
+            report_event_closed(event, threshold);
+            return EVENT_CLOSED;
+        }
+    }
+
+    return EVENT_ONGOING;
+}
+
+/*******************************************************************************
+ *
+ * Function:    prepare_alert()
+ *
+ * Description: Holds the newest detection frame for the snapshot of an
+ *              alert and copies what to send and to whom. An alert without a
+ *              snapshot is still sent.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void prepare_alert(alert_t *alert, const event_t *event, const settings_t *settings)
+{
+    alert->event           = *event;
+    alert->snapshot_length = 0;
+    alert->recipient_count = settings->recipient_count;
+    memcpy(alert->recipients, settings->recipients, sizeof(alert->recipients));
+    memcpy(alert->message, settings->message, sizeof(alert->message));
+    snprintf(alert->id, sizeof(alert->id), "%lld-%u", (long long)time(NULL), event->id);
+
+    if (camera_hold_frame(&alert->frame) == -1)
+    {
+        alert->frame.handle = NULL;
+    }
+}
+
+/*******************************************************************************
+ *
+ * Function:    alert_allowed()
+ *
+ * Description: Applies the alert rate limits: at least alert_interval_seconds
+ *              between two alerts and at most max_alerts_per_hour in each
+ *              hour counted from the first alert in it.
+ *
+ * Returns:     1 if an alert may be sent now, which counts it, 0 otherwise.
+ *
+ ******************************************************************************/
+static int alert_allowed(const settings_t *settings)
+{
+    static uint64_t last_ns;  // last alert, 0 before the first
+    static uint64_t hour_ns;  // start of the current hour
+    static uint32_t in_hour;  // alerts in the current hour
+    uint64_t        now_ns = monotonic_time_ns();
+
+    if ((last_ns != 0) &&
+        (now_ns - last_ns < (uint64_t)settings->alert_interval_seconds * 1000000000ull))
+    {
+        return 0;
+    }
+
+    if ((last_ns == 0) || (now_ns - hour_ns >= 3600ull * 1000000000ull))
+    {
+        hour_ns = now_ns;
+        in_hour = 0;
+    }
+    if ((settings->max_alerts_per_hour != 0) && (in_hour >= settings->max_alerts_per_hour))
+    {
+        return 0;
+    }
+
+    in_hour += 1;
+    last_ns  = now_ns;
+    return 1;
+}
+
 int main()
 {
     pthread_t gsm_thread;
-    camera_init(VIDEO_DEVICE_FILE);
-    gsm_init(GSM_DEVICE_FILE);
-    gsm_set_functionality_mode(GSM_MINIMUM_FUNCTIONALITY_MODE);
+    scheduler_config_t schedule = {
+        .full_fps      = DETECT_FULL_FPS,
+        .min_fps       = DETECT_MIN_FPS,
+        .idle_levels   = DETECT_IDLE_LEVELS,
+        .quiet_seconds = DETECT_QUIET_SECONDS,
+        .wake_score    = DETECT_WAKE_SCORE,
+    };
+    settings_t defaults = {
+        .threshold   = AVG_PIXEL_DIFFERENCE,
+        .blob_filter = {
+            .block_threshold = BLOB_BLOCK_DIFFERENCE * 256,
+            .min_area        = BLOB_MIN_BLOCKS,
+            .max_area        = BLOB_MAX_BLOCKS,
+        },
+        .stills                 = NUM_FRAMES_TO_CAPTURE,
+        .recipient_count        = 1,
+        .recipients             = { GSM_DESTINATION },
+        .message                = GSM_MESSAGE,
+        .alert_interval_seconds = ALERT_INTERVAL_SECONDS,
+        .max_alerts_per_hour    = ALERTS_PER_HOUR,
+        .video_device           = VIDEO_DEVICE_FILE,
+    };
+    event_config_t hysteresis = {
+        .window     = EVENT_WINDOW_FRAMES,
+        .open_count = EVENT_OPEN_FRAMES,
+        .quiet_ms   = EVENT_QUIET_MS,
+    };
+    log_config_t logging = {
+        .path      = LOG_FILE,
+        .max_bytes = LOG_MAX_BYTES,
+        .max_files = LOG_MAX_FILES,
+        .level     = LOG_LEVEL_INFO,
+    };
+    store_config_t storage = {
+        .dir           = STORE_DIR,
+        .segments      = STORE_SEGMENTS,
+        .segment_bytes = STORE_SEGMENT_BYTES,
+        .max_frames    = STORE_MAX_FRAMES,
+    };
+    denoise_config_t night = {
+        .on_level          = DENOISE_ON_LEVEL,
+        .off_level         = DENOISE_OFF_LEVEL,
+        .still_weight      = DENOISE_STILL_WEIGHT,
+        .motion_difference = DENOISE_MOTION_DIFFERENCE,
+    };
+    motion_search_config_t search = {
+        .block_threshold = BLOB_BLOCK_DIFFERENCE * 256,
+        .max_blocks      = SEARCH_MAX_BLOCKS,
+        .range           = SEARCH_RANGE_PIXELS,
+    };
+    camera_dedup_config_t dedup = {
+        .threshold         = STILL_REPEAT_SCORE,
+        .keyframe_interval = STILL_KEYFRAME_INTERVAL,
+    };
+    upload_config_t uploads = {
+        .url             = UPLOAD_URL,
+        .apn             = UPLOAD_APN,
+        .min_chunk       = UPLOAD_MIN_CHUNK,
+        .max_chunk       = UPLOAD_MAX_CHUNK,
+        .target_chunk_ms = UPLOAD_CHUNK_MS,
+        .max_attempts    = UPLOAD_MAX_ATTEMPTS,
+    };
+    gsm_link_config_t link = {
+        .baud         = GSM_LINK_BAUD,
+        .flow_control = 1,
+        .multiplex    = 1,
+        .frame_size   = GSM_CMUX_FRAME_SIZE,
+    };
+    dispatch_config_t alerts = {
+        .liveness_seconds = GSM_LIVENESS_SECONDS,
+        .max_failures     = GSM_MAX_FAILURES,
+        .max_attempts     = GSM_MAX_ATTEMPTS,
+        .power_save       = 1,
+    };
+    metrics_export_config_t exporter = {
+        .text_file        = METRICS_TEXT_FILE,
+        .interval_seconds = METRICS_INTERVAL_SECONDS,
+        .socket_path      = METRICS_SOCKET,
+    };
+    const char     *gsm_devices[] = GSM_DEVICE_FILES;
+    gsm_t          *modems[DISPATCH_MAX_MODEMS];
+    uint32_t        num_modems = 0;
+    settings_t      boot;
+    uint32_t        threshold;
+    motion_result_t motion;
+    event_t         event;
+
+    // Before any thread is created, see trace_init().
+    TRACE_INIT(TRACE_OUTPUT_FILE);
+    TRACE_THREAD_NAME("main");
+    log_init(&logging);
+
+    alert_latency_metric = metrics_histogram("sitemon_motion_to_alert_seconds", NULL,
+        "Time from the first frame of an event until its SMS was sent.");
+    blob_metric = metrics_histogram("sitemon_blob_seconds", NULL,
+        "Time spent labeling changed regions of one frame.");
+    events_metric = metrics_counter("sitemon_events_total", NULL,
+        "Motion events opened.");
+
+    for (size_t n = 0; n < sizeof(gsm_devices) / sizeof(gsm_devices[0]); ++n)
+    {
+        snprintf(defaults.modems[n], sizeof(defaults.modems[n]), "%s", gsm_devices[n]);
+        defaults.modem_count = (uint32_t)(n + 1);
+    }
+    settings_init(&defaults, SETTINGS_FILE);
+    // Devices are only read here, a reload can't move them.
+    const settings_t *startup = settings_acquire();
+    boot = *startup;
+    settings_release(startup);
+    threshold = boot.threshold;
+
+    pool_init(ANALYSIS_THREADS);
+    camera_set_memory(CAPTURE_MEMORY);
+    camera_init(boot.video_device, VIDEO_DETECT_WIDTH, VIDEO_DETECT_HEIGHT);
+    camera_init_stills(VIDEO_STILL_DEVICE, VIDEO_STILL_WIDTH, VIDEO_STILL_HEIGHT);
+    camera_publish_frames(FRAME_RING_NAME, FRAME_RING_SLOTS);
+    camera_set_dedup(&dedup);
+    camera_set_motion_search(&search);
+    denoise_init(&night);
+    // Stills fall back to one file each in VIDEO_OUTPUT_DIR without a store.
+    store_open(&storage);
+    scheduler_init(&schedule);
+    event_init(&hysteresis);
+    metrics_start_exporter(&exporter);
+    for (uint32_t n = 0; n < boot.modem_count; ++n)
+    {
+        char name[GSM_NAME_SIZE];
+
+        snprintf(name, sizeof(name), "modem%u", n);
+        if (num_modems == DISPATCH_MAX_MODEMS)
+        {
+            break;
+        }
+        if ((modems[num_modems] = gsm_open(boot.modems[n], name, &link)) != NULL)
+        {
+            gsm_start_status_monitor(modems[num_modems], GSM_STATUS_POLL_SECONDS);
+            num_modems += 1;
+        }
+    }
+    // Without any modem alerts fail, but motion is still recorded.
+    dispatch_init(modems, num_modems, &alerts);
+    upload_init(&uploads);
+    checkpoint_load(CHECKPOINT_FILE, threshold);
+    settings_watch();
+
+    time_t stats_time      = time(NULL);
+    time_t checkpoint_time = time(NULL);
 
     for (;;)
     {
-        if (camera_detect_motion(AVG_PIXEL_DIFFERENCE))
+        if (time(NULL) - stats_time >= STATS_INTERVAL_SECONDS)
+        {
+            scheduler_log_stats();
+            stats_time = time(NULL);
+        }
+
+        if (time(NULL) - checkpoint_time >= CHECKPOINT_INTERVAL_SECONDS)
+        {
+            checkpoint_save(CHECKPOINT_FILE, threshold);
+            checkpoint_time = time(NULL);
+        }
+
+        // The threshold in force for this frame, see analyze_frame().
+        const settings_t *current = settings_acquire();
+
+        threshold = current->threshold;
+        settings_release(current);
+
+        int detected = scheduler_detect_motion((uint8_t)threshold, &motion);
+
+        if (detected == -1)
+        {
+            continue;
+        }
+
+        switch (analyze_frame(detected, &motion, &event))
         {
-            pthread_create(&gsm_thread, NULL, on_motion_detected, NULL);
-            for (int frame = 0; frame < NUM_FRAMES_TO_CAPTURE; ++frame)
+            case EVENT_OPENED:
             {
-                camera_capture_frame(VIDEO_OUTPUT_DIR);
-                SLEEP_SECONDS(1);
+                const settings_t *settings = settings_acquire();
+                uint32_t          stills   = settings->stills;
+                alert_t          *alert    = NULL;
+
+                metrics_add(events_metric, 1);
+                TRACE_INSTANT("event opened");
+                if (alert_allowed(settings))
+                {
+                    alert = malloc(sizeof(*alert));
+                    if (alert != NULL)
+                    {
+                        prepare_alert(alert, &event, settings);
+                    }
+                }
+                else
+                {
+                    LOG_INFO("event %u: alert held back by the rate limit", event.id);
+                }
+                settings_release(settings);
+
+                // A restart during the event must not raise a second alert.
+                checkpoint_save(CHECKPOINT_FILE, threshold);
+                checkpoint_time = time(NULL);
+                if (alert != NULL)
+                {
+                    if (pthread_create(&gsm_thread, NULL, on_motion_detected, alert) == 0)
+                    {
+                        pthread_detach(gsm_thread);
+                    }
+                    else
+                    {
+                        camera_release_frame(&alert->frame);
+                        free(alert);
+                    }
+                }
+                // The frames between stills still count towards the event.
+                camera_begin_stills();
+                for (uint32_t frame = 0; frame < stills; ++frame)
+                {
+                    camera_capture_frame(VIDEO_OUTPUT_DIR);
+                    if (watch_between_stills(threshold, STILL_INTERVAL_MS, &event) ==
+                        EVENT_CLOSED)
+                    {
+                        checkpoint_time = time(NULL);
+                        break;
+                    }
+                }
+                camera_end_stills();
+                break;
             }
+
+            case EVENT_CLOSED:
+                report_event_closed(&event, threshold);
+                checkpoint_time = time(NULL);
+                break;
+
+            default:
+                break;
         }
     }
 
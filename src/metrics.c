@@ -0,0 +1,583 @@
+#include "metrics.h"
+#include "log.h"
+#include "util.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define METRICS_MAX_SLOTS         4096
+#define METRICS_SUB_BITS          2
+#define METRICS_SUB_BUCKETS       (1u << METRICS_SUB_BITS)
+#define METRICS_OCTAVES           40 // durations up to about an hour
+#define METRICS_BUCKETS           (METRICS_OCTAVES * METRICS_SUB_BUCKETS)
+#define METRICS_HISTOGRAM_SLOTS   (METRICS_BUCKETS + 2) // buckets, count, sum
+#define METRICS_EXPORT_MIN_BUCKET 35  // first exported bucket, up to 1.024 us
+#define METRICS_EXPORT_MAX_BUCKET 139 // last exported bucket, up to 68.7 s
+
+typedef enum metrics_type
+{
+    METRICS_COUNTER,
+    METRICS_GAUGE,
+    METRICS_HISTOGRAM
+} metrics_type_t;
+
+struct metric
+{
+    const char     *name;
+    const char     *labels;
+    const char     *help;
+    metrics_type_t  type;
+    uint32_t        slot;  // first slot in every shard (counters, histograms)
+    int64_t         gauge; // gauges are set, not summed, so they aren't sharded
+};
+
+// The slots a thread updates. Each shard is a multiple of the cache line
+// size, so threads never write to the same line.
+typedef struct metrics_shard
+{
+    uint64_t slots[METRICS_MAX_SLOTS];
+} __attribute__((aligned(64))) metrics_shard_t;
+
+// Global module variables
+static metric_t                registry[METRICS_MAX_METRICS];
+static uint32_t                num_metrics; // published with release semantics
+static uint32_t                num_slots;
+static pthread_mutex_t         registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static metrics_shard_t         shards[METRICS_MAX_THREADS];
+static uint32_t                next_shard;
+static __thread metrics_shard_t *thread_shard;
+static metrics_export_config_t export_config;
+static pthread_t               exporter_thread;
+
+/*******************************************************************************
+ *
+ * Function:    metrics_shard()
+ *
+ * Description: Returns the calling thread's shard, assigning one round-robin
+ *              on first use.
+ *
+ * Returns:     The shard of the calling thread.
+ *
+ ******************************************************************************/
+static inline metrics_shard_t *metrics_shard(void)
+{
+    if (thread_shard == NULL)
+    {
+        uint32_t index = __atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED);
+        thread_shard = &shards[index % METRICS_MAX_THREADS];
+    }
+    return thread_shard;
+}
+
+/*******************************************************************************
+ *
+ * Function:    metrics_bucket()
+ *
+ * Description: Maps a value to its log-linear bucket. Values below four get
+ *              a bucket each; above that every power of two is split into
+ *              METRICS_SUB_BUCKETS equal parts using the bits that follow the
+ *              most significant one.
+ *
+ * Returns:     The bucket index.
+ *
+ ******************************************************************************/
+static inline uint32_t metrics_bucket(uint64_t value)
+{
+    if (value < METRICS_SUB_BUCKETS)
+    {
+        return (uint32_t)value;
+    }
+
+    uint32_t msb    = 63u - (uint32_t)__builtin_clzll(value);
+    uint32_t sub    = (uint32_t)(value >> (msb - METRICS_SUB_BITS)) & (METRICS_SUB_BUCKETS - 1);
+    uint32_t bucket = (msb - METRICS_SUB_BITS + 1) * METRICS_SUB_BUCKETS + sub;
+
+    return (bucket < METRICS_BUCKETS) ? bucket : METRICS_BUCKETS - 1;
+}
+
+/*******************************************************************************
+ *
+ * Function:    metrics_bucket_limit()
+ *
+ * Description: Computes the exclusive upper bound of a bucket.
+ *
+ * Returns:     The smallest value that falls in a later bucket.
+ *
+ ******************************************************************************/
+static uint64_t metrics_bucket_limit(uint32_t bucket)
+{
+    if (bucket < METRICS_SUB_BUCKETS)
+    {
+        return bucket + 1;
+    }
+
+    uint32_t octave = bucket / METRICS_SUB_BUCKETS;
+    uint32_t sub    = bucket % METRICS_SUB_BUCKETS;
+    uint32_t msb    = octave + METRICS_SUB_BITS - 1;
+
+    return (uint64_t)(METRICS_SUB_BUCKETS + sub + 1) << (msb - METRICS_SUB_BITS);
+}
+
+/*******************************************************************************
+ *
+ * Function:    metrics_register()
+ *
+ * Description: Adds a metric to the registry. Registration is rare and takes
+ *              a mutex; the metric is published to the lock-free readers only
+ *              once it is fully initialized.
+ *
+ * Returns:     A handle to the metric, or NULL if the registry is full.
+ *
+ ******************************************************************************/
+static metric_t *metrics_register(const char *name, const char *labels, const char *help,
+                                  metrics_type_t type, uint32_t slots)
+{
+    metric_t *metric = NULL;
+
+    pthread_mutex_lock(&registry_mutex);
+
+    if ((num_metrics < METRICS_MAX_METRICS) && (num_slots + slots <= METRICS_MAX_SLOTS))
+    {
+        metric = &registry[num_metrics];
+        metric->name   = name;
+        metric->labels = labels;
+        metric->help   = help;
+        metric->type   = type;
+        metric->slot   = num_slots;
+        metric->gauge  = 0;
+        num_slots += slots;
+        __atomic_store_n(&num_metrics, num_metrics + 1, __ATOMIC_RELEASE);
+    }
+    else
+    {
+        LOG_ERROR("no room to register %s", name);
+    }
+
+    pthread_mutex_unlock(&registry_mutex);
+
+    return metric;
+}
+
+/*******************************************************************************
+ *
+ * Function:    metrics_counter()
+ *
+ * Description: Register a monotonically increasing counter.
+ *
+ * Returns:     A handle to the counter, or NULL if the registry is full.
+ *
+ ******************************************************************************/
+metric_t *metrics_counter(const char *name, const char *labels, const char *help)
+{
+    return metrics_register(name, labels, help, METRICS_COUNTER, 1);
+}
+
+/*******************************************************************************
+ *
+ * Function:    metrics_gauge()
+ *
+ * Description: Register a gauge.
+ *
+ * Returns:     A handle to the gauge, or NULL if the registry is full.
+ *
+ ******************************************************************************/
+metric_t *metrics_gauge(const char *name, const char *labels, const char *help)
+{
+    return metrics_register(name, labels, help, METRICS_GAUGE, 0);
+}
+
+/*******************************************************************************
+ *
+ * Function:    metrics_histogram()
+ *
+ * Description: Register a histogram of durations in nanoseconds.
+ *
+ * Returns:     A handle to the histogram, or NULL if the registry is full.
+ *
+ ******************************************************************************/
+metric_t *metrics_histogram(const char *name, const char *labels, const char *help)
+{
+    return metrics_register(name, labels, help, METRICS_HISTOGRAM, METRICS_HISTOGRAM_SLOTS);
+}
+
+/*******************************************************************************
+ *
+ * Function:    metrics_add()
+ *
+ * Description: Add to a counter in the calling thread's shard.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+void metrics_add(metric_t *metric, uint64_t n)
+{
+    if (metric != NULL)
+    {
+        __atomic_fetch_add(&metrics_shard()->slots[metric->slot], n, __ATOMIC_RELAXED);
+    }
+}
+
+/*******************************************************************************
+ *
+ * Function:    metrics_set()
+ *
+ * Description: Set the value of a gauge.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+void metrics_set(metric_t *metric, int64_t value)
+{
+    if (metric != NULL)
+    {
+        __atomic_store_n(&metric->gauge, value, __ATOMIC_RELAXED);
+    }
+}
+
+/*******************************************************************************
+ *
+ * Function:    metrics_observe()
+ *
+ * Description: Record a value in a histogram in the calling thread's shard.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+void metrics_observe(metric_t *metric, uint64_t ns)
+{
+    if (metric != NULL)
+    {
+        uint64_t *slots = &metrics_shard()->slots[metric->slot];
+
+        __atomic_fetch_add(&slots[metrics_bucket(ns)], 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&slots[METRICS_BUCKETS], 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&slots[METRICS_BUCKETS + 1], ns, __ATOMIC_RELAXED);
+    }
+}
+
+/*******************************************************************************
+ *
+ * Function:    metrics_sum()
+ *
+ * Description: Adds up one slot across all shards.
+ *
+ * Returns:     The total.
+ *
+ ******************************************************************************/
+static uint64_t metrics_sum(uint32_t slot)
+{
+    uint64_t total = 0;
+
+    for (uint32_t shard = 0; shard < METRICS_MAX_THREADS; ++shard)
+    {
+        total += __atomic_load_n(&shards[shard].slots[slot], __ATOMIC_RELAXED);
+    }
+
+    return total;
+}
+
+/*******************************************************************************
+ *
+ * Function:    metrics_print_bucket()
+ *
+ * Description: Prints one cumulative histogram bucket, merging the le label
+ *              into the metric's own labels.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void metrics_print_bucket(FILE *stream, const metric_t *metric,
+                                 const char *le, uint64_t count)
+{
+    if ((metric->labels != NULL) && (strlen(metric->labels) > 2))
+    {
+        fprintf(stream, "%s_bucket%.*s,le=\"%s\"} %llu\n", metric->name,
+                (int)strlen(metric->labels) - 1, metric->labels, le,
+                (unsigned long long)count);
+    }
+    else
+    {
+        fprintf(stream, "%s_bucket{le=\"%s\"} %llu\n", metric->name, le,
+                (unsigned long long)count);
+    }
+}
+
+/*******************************************************************************
+ *
+ * Function:    metrics_print_series()
+ *
+ * Description: Prints the samples of one registered metric. Histogram
+ *              buckets between about 1 us and 69 s are exported; the rest are
+ *              folded into their neighbours.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void metrics_print_series(FILE *stream, const metric_t *metric)
+{
+    const char *labels = (metric->labels != NULL) ? metric->labels : "";
+
+    switch (metric->type)
+    {
+        case METRICS_COUNTER:
+            fprintf(stream, "%s%s %llu\n", metric->name, labels,
+                    (unsigned long long)metrics_sum(metric->slot));
+            break;
+
+        case METRICS_GAUGE:
+            fprintf(stream, "%s%s %lld\n", metric->name, labels,
+                    (long long)__atomic_load_n(&metric->gauge, __ATOMIC_RELAXED));
+            break;
+
+        case METRICS_HISTOGRAM:
+        {
+            uint64_t cumulative = 0;
+            char     le[32];
+
+            for (uint32_t bucket = 0; bucket < METRICS_BUCKETS; ++bucket)
+            {
+                cumulative += metrics_sum(metric->slot + bucket);
+
+                if ((bucket >= METRICS_EXPORT_MIN_BUCKET) &&
+                    (bucket <= METRICS_EXPORT_MAX_BUCKET))
+                {
+                    snprintf(le, sizeof(le), "%.9g",
+                             (double)metrics_bucket_limit(bucket) / 1e9);
+                    metrics_print_bucket(stream, metric, le, cumulative);
+                }
+            }
+
+            metrics_print_bucket(stream, metric, "+Inf", cumulative);
+            fprintf(stream, "%s_sum%s %.9f\n", metric->name, labels,
+                    (double)metrics_sum(metric->slot + METRICS_BUCKETS + 1) / 1e9);
+            fprintf(stream, "%s_count%s %llu\n", metric->name, labels,
+                    (unsigned long long)metrics_sum(metric->slot + METRICS_BUCKETS));
+            break;
+        }
+    }
+}
+
+/*******************************************************************************
+ *
+ * Function:    metrics_print()
+ *
+ * Description: Write every registered metric in the Prometheus text
+ *              exposition format. Metrics that share a name, e.g. one per
+ *              modem, are registered in any order but printed as one family:
+ *              its HELP and TYPE, then all of its samples.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+void metrics_print(FILE *stream)
+{
+    static const char *type_names[] = { "counter", "gauge", "histogram" };
+    uint32_t count = __atomic_load_n(&num_metrics, __ATOMIC_ACQUIRE);
+
+    for (uint32_t index = 0; index < count; ++index)
+    {
+        const metric_t *metric = &registry[index];
+        int             first  = 1;
+
+        for (uint32_t other = 0; other < index; ++other)
+        {
+            if (strcmp(registry[other].name, metric->name) == 0)
+            {
+                first = 0;
+                break;
+            }
+        }
+
+        // Printed with the first of its family.
+        if (!first)
+        {
+            continue;
+        }
+
+        fprintf(stream, "# HELP %s %s\n", metric->name, metric->help);
+        fprintf(stream, "# TYPE %s %s\n", metric->name, type_names[metric->type]);
+
+        for (uint32_t other = index; other < count; ++other)
+        {
+            if (strcmp(registry[other].name, metric->name) == 0)
+            {
+                metrics_print_series(stream, &registry[other]);
+            }
+        }
+    }
+}
+
+/*******************************************************************************
+ *
+ * Function:    metrics_write_text_file()
+ *
+ * Description: Rewrites the metrics text file by writing a temporary file
+ *              next to it and renaming it over the old one.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+static int metrics_write_text_file(const char *path)
+{
+    char  temp[256];
+    FILE *file;
+
+    snprintf(temp, sizeof(temp), "%s.tmp", path);
+
+    if ((file = fopen(temp, "w")) == NULL)
+    {
+        return -1;
+    }
+
+    metrics_print(file);
+
+    if (fclose(file) != 0)
+    {
+        unlink(temp);
+        return -1;
+    }
+
+    return rename(temp, path);
+}
+
+/*******************************************************************************
+ *
+ * Function:    metrics_open_socket()
+ *
+ * Description: Creates the listening Unix domain socket, replacing any stale
+ *              one left behind by a previous run.
+ *
+ * Returns:     On success, returns the listening descriptor. Otherwise,
+ *              returns -1.
+ *
+ ******************************************************************************/
+static int metrics_open_socket(const char *path)
+{
+    struct sockaddr_un address;
+    int                fd;
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(address.sun_path))
+    {
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+    unlink(path);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+    {
+        return -1;
+    }
+
+    if ((bind(fd, (struct sockaddr *)&address, sizeof(address)) == -1) ||
+        (listen(fd, 4) == -1))
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/*******************************************************************************
+ *
+ * Function:    metrics_exporter()
+ *
+ * Description: Background thread that rewrites the text file periodically
+ *              and answers connections on the socket in between.
+ *
+ * Returns:     Never returns.
+ *
+ ******************************************************************************/
+static void *metrics_exporter(void *vargp)
+{
+    int      listen_fd = -1;
+    uint64_t interval  = (uint64_t)export_config.interval_seconds * 1000000000ull;
+    uint64_t next_ns   = monotonic_time_ns() + interval;
+
+    (void)vargp;
+
+    if ((export_config.socket_path != NULL) &&
+        ((listen_fd = metrics_open_socket(export_config.socket_path)) == -1))
+    {
+        LOG_ERROR("failed to open socket %s",
+                  export_config.socket_path);
+    }
+
+    for (;;)
+    {
+        uint64_t      now_ns  = monotonic_time_ns();
+        int           timeout = -1;
+        struct pollfd pfd     = { .fd = listen_fd, .events = POLLIN };
+
+        if (export_config.text_file != NULL)
+        {
+            timeout = (now_ns >= next_ns) ? 0 : (int)((next_ns - now_ns) / 1000000);
+        }
+
+        if ((poll(&pfd, 1, timeout) == 1) && (pfd.revents & POLLIN))
+        {
+            int   client = accept(listen_fd, NULL, NULL);
+            FILE *reply  = (client != -1) ? fdopen(client, "w") : NULL;
+
+            if (reply != NULL)
+            {
+                metrics_print(reply);
+                fclose(reply);
+            }
+            else if (client != -1)
+            {
+                close(client);
+            }
+        }
+
+        if ((export_config.text_file != NULL) && (monotonic_time_ns() >= next_ns))
+        {
+            if (metrics_write_text_file(export_config.text_file) == -1)
+            {
+                LOG_ERROR("failed to write %s",
+                          export_config.text_file);
+            }
+            next_ns += interval;
+        }
+    }
+
+    return NULL;
+}
+
+/*******************************************************************************
+ *
+ * Function:    metrics_start_exporter()
+ *
+ * Description: Start the background thread that exports the metrics.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+int metrics_start_exporter(const metrics_export_config_t *config)
+{
+    if ((config == NULL) ||
+        ((config->text_file == NULL) && (config->socket_path == NULL)) ||
+        ((config->text_file != NULL) && (config->interval_seconds == 0)))
+    {
+        return -1;
+    }
+
+    export_config = *config;
+
+    if (pthread_create(&exporter_thread, NULL, metrics_exporter, NULL) != 0)
+    {
+        return -1;
+    }
+
+    pthread_detach(exporter_thread);
+    return 0;
+}
@@ -0,0 +1,874 @@
+#include "motion.h"
+#include "pool.h"
+#include "log.h"
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+    #include <emmintrin.h>
+#elif defined(__ARM_NEON)
+    #include <arm_neon.h>
+#endif
+
+// Added to both variances when matching contrast, in grey levels squared, so
+// that flat frames (lens cap, darkness) don't produce huge gains.
+#define MOTION_VARIANCE_FLOOR 4.0
+#define MOTION_MIN_GAIN       0.25
+#define MOTION_MAX_GAIN       4.0
+
+// Frames are analyzed in horizontal stripes of this many block rows. The
+// stripes don't depend on the number of threads, so neither do the scores.
+#define MOTION_STRIPE_BLOCK_ROWS 4
+// Smaller frames are analyzed on the calling thread alone, as waking the
+// pool would cost more than it saves.
+#define MOTION_PARALLEL_MIN_PIXELS (640 * 480)
+#define MOTION_CACHE_LINE        64
+
+// A displacement is only believed if it leaves at most this fraction of the
+// differences found without it, so that flat blocks and lighting changes
+// don't produce random vectors.
+#define MOTION_SEARCH_MAX_RESIDUAL 0.75
+// Vectors vote for the flow of a frame in a grid of every displacement.
+#define MOTION_FLOW_SIDE (2 * MOTION_MAX_SEARCH_RANGE + 1)
+
+// Raw moments of one block of the reference (a) and current (b) frames. For
+// a 16x16 block every sum fits in 32 bits.
+typedef struct motion_moments
+{
+    uint32_t n;
+    uint32_t sum_a;
+    uint32_t sum_b;
+    uint32_t sum_aa;
+    uint32_t sum_bb;
+    uint32_t sum_ab;
+    uint32_t sum_absdiff;
+    uint32_t reserved; // two blocks to a 64-byte cache line
+} motion_moments_t;
+
+// What one stripe adds to the frame totals. Each stripe has its own cache
+// line, so threads never write to the same line.
+typedef struct motion_partial
+{
+    uint64_t n;
+    uint64_t sum_a;
+    uint64_t sum_b;
+    uint64_t sum_aa;
+    uint64_t sum_bb;
+    uint64_t sum_absdiff;
+    double   total_rms;
+} __attribute__((aligned(MOTION_CACHE_LINE))) motion_partial_t;
+
+// The frames and lighting correction of the analysis in progress.
+typedef struct motion_job
+{
+    const uint8_t *ref;
+    size_t         ref_stride;
+    const uint8_t *cur;
+    size_t         cur_stride;
+    double         gain;
+    double         offset;
+} motion_job_t;
+
+// The block matching search of one block.
+typedef struct motion_search
+{
+    const uint8_t *ref;        // the block's own position in the reference frame
+    size_t         ref_stride;
+    const uint8_t *cur;        // the block in the current frame
+    size_t         cur_stride;
+    int32_t        min_dx;     // displacements that keep the match in the frame
+    int32_t        max_dx;
+    int32_t        min_dy;
+    int32_t        max_dy;
+    int32_t        best_dx;
+    int32_t        best_dy;
+    uint32_t       best_sad;
+} motion_search_t;
+
+// Displacements tried around the best one so far, see motion_search_block().
+static const int8_t motion_large_diamond[8][2] = {
+    { 2, 0 }, { -2, 0 }, { 0, 2 }, { 0, -2 }, { 1, 1 }, { 1, -1 }, { -1, 1 }, { -1, -1 }
+};
+static const int8_t motion_small_diamond[4][2] = {
+    { 1, 0 }, { -1, 0 }, { 0, 1 }, { 0, -1 }
+};
+
+// Global module variables
+static uint32_t          frame_width;
+static uint32_t          frame_height;
+static uint32_t          blocks_x;
+static uint32_t          blocks_y;
+static uint32_t          moments_pitch; // blocks from one row of moments to the next
+static uint32_t          stripes;
+static motion_moments_t *moments;
+static motion_partial_t *partials;      // one per stripe
+static uint16_t         *block_scores;
+static motion_vector_t  *vectors;
+static uint32_t          flow_votes[MOTION_FLOW_SIDE * MOTION_FLOW_SIDE];
+
+/*******************************************************************************
+ *
+ * Function:    motion_moments_scalar()
+ *
+ * Description: Accumulates the moments of a block one pixel at a time. Used
+ *              for partial blocks at the right and bottom edges and when no
+ *              SIMD instruction set is available.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void motion_moments_scalar(const uint8_t *a, size_t a_stride,
+                                  const uint8_t *b, size_t b_stride,
+                                  uint32_t cols, uint32_t rows,
+                                  motion_moments_t *m)
+{
+    memset(m, 0, sizeof(*m));
+    m->n = cols * rows;
+
+    for (uint32_t row = 0; row < rows; ++row)
+    {
+        for (uint32_t col = 0; col < cols; ++col)
+        {
+            uint32_t va = a[row * a_stride + col];
+            uint32_t vb = b[row * b_stride + col];
+
+            m->sum_a       += va;
+            m->sum_b       += vb;
+            m->sum_aa      += va * va;
+            m->sum_bb      += vb * vb;
+            m->sum_ab      += va * vb;
+            m->sum_absdiff += (va > vb) ? (va - vb) : (vb - va);
+        }
+    }
+}
+
+#if defined(__SSE2__)
+
+static inline uint32_t motion_hsum_epi32(__m128i v)
+{
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return (uint32_t)_mm_cvtsi128_si32(v);
+}
+
+static inline uint32_t motion_hsum_epi64(__m128i v)
+{
+    v = _mm_add_epi64(v, _mm_unpackhi_epi64(v, v));
+    return (uint32_t)_mm_cvtsi128_si32(v);
+}
+
+/*******************************************************************************
+ *
+ * Function:    motion_moments_block()
+ *
+ * Description: Accumulates the moments of a full 16 pixel wide block with
+ *              SSE2. Sums use PSADBW against zero, the absolute difference
+ *              uses PSADBW between the frames and the products use PMADDWD.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void motion_moments_block(const uint8_t *a, size_t a_stride,
+                                 const uint8_t *b, size_t b_stride,
+                                 uint32_t rows, motion_moments_t *m)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i sa = zero, sb = zero, sd = zero, aa = zero, bb = zero, ab = zero;
+
+    for (uint32_t row = 0; row < rows; ++row)
+    {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + row * a_stride));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + row * b_stride));
+
+        sa = _mm_add_epi64(sa, _mm_sad_epu8(va, zero));
+        sb = _mm_add_epi64(sb, _mm_sad_epu8(vb, zero));
+        sd = _mm_add_epi64(sd, _mm_sad_epu8(va, vb));
+
+        __m128i alo = _mm_unpacklo_epi8(va, zero);
+        __m128i ahi = _mm_unpackhi_epi8(va, zero);
+        __m128i blo = _mm_unpacklo_epi8(vb, zero);
+        __m128i bhi = _mm_unpackhi_epi8(vb, zero);
+
+        aa = _mm_add_epi32(aa, _mm_add_epi32(_mm_madd_epi16(alo, alo), _mm_madd_epi16(ahi, ahi)));
+        bb = _mm_add_epi32(bb, _mm_add_epi32(_mm_madd_epi16(blo, blo), _mm_madd_epi16(bhi, bhi)));
+        ab = _mm_add_epi32(ab, _mm_add_epi32(_mm_madd_epi16(alo, blo), _mm_madd_epi16(ahi, bhi)));
+    }
+
+    m->n           = MOTION_BLOCK_SIZE * rows;
+    m->sum_a       = motion_hsum_epi64(sa);
+    m->sum_b       = motion_hsum_epi64(sb);
+    m->sum_absdiff = motion_hsum_epi64(sd);
+    m->sum_aa      = motion_hsum_epi32(aa);
+    m->sum_bb      = motion_hsum_epi32(bb);
+    m->sum_ab      = motion_hsum_epi32(ab);
+}
+
+/*******************************************************************************
+ *
+ * Function:    motion_sad_block()
+ *
+ * Description: Sums the absolute differences between two full blocks with
+ *              SSE2, one PSADBW per row.
+ *
+ * Returns:     The sum.
+ *
+ ******************************************************************************/
+static uint32_t motion_sad_block(const uint8_t *a, size_t a_stride,
+                                 const uint8_t *b, size_t b_stride)
+{
+    __m128i sd = _mm_setzero_si128();
+
+    for (uint32_t row = 0; row < MOTION_BLOCK_SIZE; ++row)
+    {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + row * a_stride));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + row * b_stride));
+
+        sd = _mm_add_epi64(sd, _mm_sad_epu8(va, vb));
+    }
+
+    return motion_hsum_epi64(sd);
+}
+
+#elif defined(__ARM_NEON)
+
+static inline uint32_t motion_hsum_u16(uint16x8_t v)
+{
+    uint64x2_t s = vpaddlq_u32(vpaddlq_u16(v));
+    return (uint32_t)(vgetq_lane_u64(s, 0) + vgetq_lane_u64(s, 1));
+}
+
+static inline uint32_t motion_hsum_u32(uint32x4_t v)
+{
+    uint64x2_t s = vpaddlq_u32(v);
+    return (uint32_t)(vgetq_lane_u64(s, 0) + vgetq_lane_u64(s, 1));
+}
+
+/*******************************************************************************
+ *
+ * Function:    motion_moments_block()
+ *
+ * Description: Accumulates the moments of a full 16 pixel wide block with
+ *              NEON. Byte sums and absolute differences are pairwise added
+ *              into 16-bit lanes, products are widened with VMULL and pairwise
+ *              added into 32-bit lanes.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void motion_moments_block(const uint8_t *a, size_t a_stride,
+                                 const uint8_t *b, size_t b_stride,
+                                 uint32_t rows, motion_moments_t *m)
+{
+    uint16x8_t sa = vdupq_n_u16(0), sb = vdupq_n_u16(0), sd = vdupq_n_u16(0);
+    uint32x4_t aa = vdupq_n_u32(0), bb = vdupq_n_u32(0), ab = vdupq_n_u32(0);
+
+    for (uint32_t row = 0; row < rows; ++row)
+    {
+        uint8x16_t va = vld1q_u8(a + row * a_stride);
+        uint8x16_t vb = vld1q_u8(b + row * b_stride);
+
+        sa = vpadalq_u8(sa, va);
+        sb = vpadalq_u8(sb, vb);
+        sd = vpadalq_u8(sd, vabdq_u8(va, vb));
+
+        aa = vpadalq_u16(aa, vmull_u8(vget_low_u8(va), vget_low_u8(va)));
+        aa = vpadalq_u16(aa, vmull_u8(vget_high_u8(va), vget_high_u8(va)));
+        bb = vpadalq_u16(bb, vmull_u8(vget_low_u8(vb), vget_low_u8(vb)));
+        bb = vpadalq_u16(bb, vmull_u8(vget_high_u8(vb), vget_high_u8(vb)));
+        ab = vpadalq_u16(ab, vmull_u8(vget_low_u8(va), vget_low_u8(vb)));
+        ab = vpadalq_u16(ab, vmull_u8(vget_high_u8(va), vget_high_u8(vb)));
+    }
+
+    m->n           = MOTION_BLOCK_SIZE * rows;
+    m->sum_a       = motion_hsum_u16(sa);
+    m->sum_b       = motion_hsum_u16(sb);
+    m->sum_absdiff = motion_hsum_u16(sd);
+    m->sum_aa      = motion_hsum_u32(aa);
+    m->sum_bb      = motion_hsum_u32(bb);
+    m->sum_ab      = motion_hsum_u32(ab);
+}
+
+/*******************************************************************************
+ *
+ * Function:    motion_sad_block()
+ *
+ * Description: Sums the absolute differences between two full blocks with
+ *              NEON, pairwise added into 16-bit lanes.
+ *
+ * Returns:     The sum.
+ *
+ ******************************************************************************/
+static uint32_t motion_sad_block(const uint8_t *a, size_t a_stride,
+                                 const uint8_t *b, size_t b_stride)
+{
+    uint16x8_t sd = vdupq_n_u16(0);
+
+    for (uint32_t row = 0; row < MOTION_BLOCK_SIZE; ++row)
+    {
+        sd = vpadalq_u8(sd, vabdq_u8(vld1q_u8(a + row * a_stride), vld1q_u8(b + row * b_stride)));
+    }
+
+    return motion_hsum_u16(sd);
+}
+
+#else
+
+static void motion_moments_block(const uint8_t *a, size_t a_stride,
+                                 const uint8_t *b, size_t b_stride,
+                                 uint32_t rows, motion_moments_t *m)
+{
+    motion_moments_scalar(a, a_stride, b, b_stride, MOTION_BLOCK_SIZE, rows, m);
+}
+
+static uint32_t motion_sad_block(const uint8_t *a, size_t a_stride,
+                                 const uint8_t *b, size_t b_stride)
+{
+    uint32_t sad = 0;
+
+    for (uint32_t row = 0; row < MOTION_BLOCK_SIZE; ++row)
+    {
+        for (uint32_t col = 0; col < MOTION_BLOCK_SIZE; ++col)
+        {
+            uint32_t va = a[row * a_stride + col];
+            uint32_t vb = b[row * b_stride + col];
+
+            sad += (va > vb) ? (va - vb) : (vb - va);
+        }
+    }
+
+    return sad;
+}
+
+#endif
+
+/*******************************************************************************
+ *
+ * Function:    motion_init()
+ *
+ * Description: Initialize the module for frames of a given size.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+int motion_init(uint32_t width, uint32_t height)
+{
+    free(moments);
+    free(partials);
+    free(block_scores);
+    free(vectors);
+    moments      = NULL;
+    partials     = NULL;
+    block_scores = NULL;
+    vectors      = NULL;
+
+    frame_width  = width;
+    frame_height = height;
+    blocks_x     = (width  + MOTION_BLOCK_SIZE - 1) / MOTION_BLOCK_SIZE;
+    blocks_y     = (height + MOTION_BLOCK_SIZE - 1) / MOTION_BLOCK_SIZE;
+    stripes      = (blocks_y + MOTION_STRIPE_BLOCK_ROWS - 1) / MOTION_STRIPE_BLOCK_ROWS;
+
+    // Rows of moments start on a cache line, so stripes never share one.
+    uint32_t per_line = MOTION_CACHE_LINE / sizeof(motion_moments_t);
+    moments_pitch     = (blocks_x + per_line - 1) / per_line * per_line;
+
+    moments      = aligned_alloc(MOTION_CACHE_LINE,
+                                 (size_t)moments_pitch * blocks_y * sizeof(*moments));
+    partials     = aligned_alloc(MOTION_CACHE_LINE, (size_t)stripes * sizeof(*partials));
+    block_scores = calloc((size_t)blocks_x * blocks_y, sizeof(*block_scores));
+    vectors      = calloc((size_t)blocks_x * blocks_y, sizeof(*vectors));
+
+    if ((moments == NULL) || (partials == NULL) || (block_scores == NULL) || (vectors == NULL))
+    {
+        LOG_ERROR("failed to allocate block statistics");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*******************************************************************************
+ *
+ * Function:    motion_moments_stripe()
+ *
+ * Description: Collects the moments of every block in a stripe and their
+ *              totals. Runs on the pool, see pool_run().
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void motion_moments_stripe(void *vargp, uint32_t stripe)
+{
+    const motion_job_t *job     = (const motion_job_t *)vargp;
+    motion_partial_t   *partial = &partials[stripe];
+    uint32_t            first   = stripe * MOTION_STRIPE_BLOCK_ROWS;
+    uint32_t            last    = (first + MOTION_STRIPE_BLOCK_ROWS < blocks_y)
+                                ? first + MOTION_STRIPE_BLOCK_ROWS : blocks_y;
+    motion_partial_t    sums;
+
+    memset(&sums, 0, sizeof(sums));
+
+    for (uint32_t by = first; by < last; ++by)
+    {
+        uint32_t       y    = by * MOTION_BLOCK_SIZE;
+        uint32_t       rows = (frame_height - y < MOTION_BLOCK_SIZE) ? frame_height - y
+                                                                     : MOTION_BLOCK_SIZE;
+        const uint8_t *a    = job->ref + y * job->ref_stride;
+        const uint8_t *b    = job->cur + y * job->cur_stride;
+
+        for (uint32_t bx = 0; bx < blocks_x; ++bx)
+        {
+            uint32_t          x    = bx * MOTION_BLOCK_SIZE;
+            motion_moments_t *m    = &moments[by * moments_pitch + bx];
+
+            if (frame_width - x >= MOTION_BLOCK_SIZE)
+            {
+                motion_moments_block(a + x, job->ref_stride, b + x, job->cur_stride, rows, m);
+            }
+            else
+            {
+                motion_moments_scalar(a + x, job->ref_stride, b + x, job->cur_stride,
+                                      frame_width - x, rows, m);
+            }
+
+            sums.n           += m->n;
+            sums.sum_a       += m->sum_a;
+            sums.sum_b       += m->sum_b;
+            sums.sum_aa      += m->sum_aa;
+            sums.sum_bb      += m->sum_bb;
+            sums.sum_absdiff += m->sum_absdiff;
+        }
+    }
+
+    *partial = sums;
+}
+
+/*******************************************************************************
+ *
+ * Function:    motion_score_stripe()
+ *
+ * Description: Derives the energy left in every block of a stripe after the
+ *              lighting correction from the block's moments. Runs on the
+ *              pool, see pool_run().
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void motion_score_stripe(void *vargp, uint32_t stripe)
+{
+    const motion_job_t *job    = (const motion_job_t *)vargp;
+    double              gain   = job->gain;
+    double              offset = job->offset;
+    double              total  = 0.0;
+    uint32_t            first  = stripe * MOTION_STRIPE_BLOCK_ROWS;
+    uint32_t            last   = (first + MOTION_STRIPE_BLOCK_ROWS < blocks_y)
+                               ? first + MOTION_STRIPE_BLOCK_ROWS : blocks_y;
+
+    for (uint32_t by = first; by < last; ++by)
+    {
+        for (uint32_t bx = 0; bx < blocks_x; ++bx)
+        {
+            const motion_moments_t *m = &moments[by * moments_pitch + bx];
+
+            // sum((b - gain * a - offset)^2) expanded in terms of the moments.
+            double energy = (double)m->sum_bb
+                          + gain * gain * (double)m->sum_aa
+                          + offset * offset * (double)m->n
+                          - 2.0 * gain * (double)m->sum_ab
+                          - 2.0 * offset * (double)m->sum_b
+                          + 2.0 * gain * offset * (double)m->sum_a;
+            double rms    = (energy > 0.0) ? sqrt(energy / (double)m->n) : 0.0;
+
+            block_scores[by * blocks_x + bx] = (uint16_t)(rms * 256.0 + 0.5);
+            total += rms;
+        }
+    }
+
+    partials[stripe].total_rms = total;
+}
+
+/*******************************************************************************
+ *
+ * Function:    motion_run()
+ *
+ * Description: Runs a pass over all stripes, on the pool for large frames.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void motion_run(pool_task_t task, motion_job_t *job)
+{
+    if ((size_t)frame_width * frame_height >= MOTION_PARALLEL_MIN_PIXELS)
+    {
+        pool_run(task, job, stripes);
+        return;
+    }
+
+    for (uint32_t stripe = 0; stripe < stripes; ++stripe)
+    {
+        task(job, stripe);
+    }
+}
+
+/*******************************************************************************
+ *
+ * Function:    motion_analyze()
+ *
+ * Description: Scores the difference between two luma frames. A single pass
+ *              over the pixels collects per-block sums, squares and cross
+ *              products of both frames. From their totals the reference
+ *              frame is matched to the current frame's mean and contrast,
+ *              and the energy left in each block after that correction is
+ *              derived from the block's own moments without touching the
+ *              pixels again. Both passes are split into stripes of block
+ *              rows whose results are added up in stripe order, so the
+ *              scores are the same however many threads did the work.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+int motion_analyze(const uint8_t *ref, size_t ref_stride,
+                   const uint8_t *cur, size_t cur_stride,
+                   motion_result_t *result)
+{
+    if ((moments == NULL) || (ref == NULL) || (cur == NULL) || (result == NULL))
+    {
+        return -1;
+    }
+
+    motion_job_t job = {
+        .ref        = ref,
+        .ref_stride = ref_stride,
+        .cur        = cur,
+        .cur_stride = cur_stride,
+    };
+
+    motion_run(motion_moments_stripe, &job);
+
+    uint64_t n = 0, sum_a = 0, sum_b = 0, sum_aa = 0, sum_bb = 0, sum_absdiff = 0;
+
+    for (uint32_t stripe = 0; stripe < stripes; ++stripe)
+    {
+        n           += partials[stripe].n;
+        sum_a       += partials[stripe].sum_a;
+        sum_b       += partials[stripe].sum_b;
+        sum_aa      += partials[stripe].sum_aa;
+        sum_bb      += partials[stripe].sum_bb;
+        sum_absdiff += partials[stripe].sum_absdiff;
+    }
+
+    // Match the reference to the current frame's mean and contrast:
+    // b ~ gain * a + offset, with gain = stddev(b) / stddev(a).
+    double mean_a = (double)sum_a / (double)n;
+    double mean_b = (double)sum_b / (double)n;
+    double var_a  = (double)sum_aa / (double)n - mean_a * mean_a;
+    double var_b  = (double)sum_bb / (double)n - mean_b * mean_b;
+    double gain   = sqrt((var_b + MOTION_VARIANCE_FLOOR) / (var_a + MOTION_VARIANCE_FLOOR));
+
+    if (gain < MOTION_MIN_GAIN)
+    {
+        gain = MOTION_MIN_GAIN;
+    }
+    else if (gain > MOTION_MAX_GAIN)
+    {
+        gain = MOTION_MAX_GAIN;
+    }
+
+    job.gain   = gain;
+    job.offset = mean_b - gain * mean_a;
+
+    motion_run(motion_score_stripe, &job);
+
+    double total   = 0.0;
+    size_t nblocks = (size_t)blocks_x * blocks_y;
+
+    for (uint32_t stripe = 0; stripe < stripes; ++stripe)
+    {
+        total += partials[stripe].total_rms;
+    }
+
+    result->score        = (uint32_t)(total * 256.0 / (double)nblocks + 0.5);
+    result->raw_score    = (uint32_t)((sum_absdiff << 8) / n);
+    result->gain         = (float)gain;
+    result->offset       = (float)job.offset;
+    result->blocks_x     = blocks_x;
+    result->blocks_y     = blocks_y;
+    result->block_scores = block_scores;
+    result->vector_count = 0;
+    result->vectors      = vectors;
+    result->flow_x       = 0.0f;
+    result->flow_y       = 0.0f;
+    result->flow_blocks  = 0;
+
+    return 0;
+}
+
+/*******************************************************************************
+ *
+ * Function:    motion_try()
+ *
+ * Description: Matches a block against the reference frame at one
+ *              displacement, and keeps the displacement if it matches better
+ *              than the best so far. Displacements that would take the match
+ *              out of the frame are skipped.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void motion_try(motion_search_t *search, int32_t dx, int32_t dy)
+{
+    if ((dx < search->min_dx) || (dx > search->max_dx) ||
+        (dy < search->min_dy) || (dy > search->max_dy))
+    {
+        return;
+    }
+
+    // The content at p in the current frame was at p - d in the reference.
+    const uint8_t *ref = search->ref - (ptrdiff_t)dy * (ptrdiff_t)search->ref_stride - dx;
+    uint32_t       sad = motion_sad_block(ref, search->ref_stride, search->cur, search->cur_stride);
+
+    if (sad < search->best_sad)
+    {
+        search->best_dx  = dx;
+        search->best_dy  = dy;
+        search->best_sad = sad;
+    }
+}
+
+/*******************************************************************************
+ *
+ * Function:    motion_search_block()
+ *
+ * Description: Finds the displacement of one block with a diamond search.
+ *              Starting from the better of no displacement and a predicted
+ *              one, the large diamond is moved to its best point until the
+ *              center is best, then the small diamond refines that to one
+ *              pixel. Each step moves the diamond, so at most range steps
+ *              are taken.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void motion_search_block(motion_search_t *search, uint32_t range,
+                                int32_t predicted_dx, int32_t predicted_dy)
+{
+    motion_try(search, predicted_dx, predicted_dy);
+
+    for (uint32_t step = 0; step < range; ++step)
+    {
+        int32_t dx = search->best_dx;
+        int32_t dy = search->best_dy;
+
+        for (uint32_t n = 0; n < 8; ++n)
+        {
+            motion_try(search, dx + motion_large_diamond[n][0], dy + motion_large_diamond[n][1]);
+        }
+
+        if ((search->best_dx == dx) && (search->best_dy == dy))
+        {
+            break;
+        }
+    }
+
+    int32_t dx = search->best_dx;
+    int32_t dy = search->best_dy;
+
+    for (uint32_t n = 0; n < 4; ++n)
+    {
+        motion_try(search, dx + motion_small_diamond[n][0], dy + motion_small_diamond[n][1]);
+    }
+}
+
+/*******************************************************************************
+ *
+ * Function:    motion_flow()
+ *
+ * Description: Finds the displacement most of the moving content shares.
+ *              Every vector votes for its displacement with how much better
+ *              it matches than no displacement. The displacement whose votes
+ *              and those of its 8 neighbours add up to the most wins, and the
+ *              flow is the weighted mean of the vectors in that neighbourhood,
+ *              so a walking person isn't outvoted by a few swaying branches.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void motion_flow(uint32_t count, motion_result_t *result)
+{
+    int32_t  side      = MOTION_FLOW_SIDE;
+    int32_t  win_dx    = 0;
+    int32_t  win_dy    = 0;
+    uint64_t win_votes = 0;
+
+    for (int32_t y = 0; y < side; ++y)
+    {
+        for (int32_t x = 0; x < side; ++x)
+        {
+            uint64_t votes = 0;
+
+            for (int32_t ny = y - 1; ny <= y + 1; ++ny)
+            {
+                for (int32_t nx = x - 1; nx <= x + 1; ++nx)
+                {
+                    if ((nx >= 0) && (nx < side) && (ny >= 0) && (ny < side))
+                    {
+                        votes += flow_votes[ny * side + nx];
+                    }
+                }
+            }
+
+            if (votes > win_votes)
+            {
+                win_votes = votes;
+                win_dx    = x - MOTION_MAX_SEARCH_RANGE;
+                win_dy    = y - MOTION_MAX_SEARCH_RANGE;
+            }
+        }
+    }
+
+    double   sum_x  = 0.0;
+    double   sum_y  = 0.0;
+    double   weight = 0.0;
+    uint32_t agree  = 0;
+
+    for (uint32_t n = 0; n < count; ++n)
+    {
+        const motion_vector_t *v = &vectors[n];
+
+        if ((abs(v->dx - win_dx) <= 1) && (abs(v->dy - win_dy) <= 1))
+        {
+            double w = (double)(v->still_sad - v->sad);
+
+            sum_x  += w * v->dx;
+            sum_y  += w * v->dy;
+            weight += w;
+            agree  += 1;
+        }
+    }
+
+    if (weight > 0.0)
+    {
+        result->flow_x      = (float)(sum_x / weight);
+        result->flow_y      = (float)(sum_y / weight);
+        result->flow_blocks = agree;
+    }
+}
+
+/*******************************************************************************
+ *
+ * Function:    motion_estimate()
+ *
+ * Description: Finds how the changed blocks of a frame pair moved. Only full
+ *              blocks whose score reaches the threshold are searched, and if
+ *              there are more of them than config->max_blocks, every n-th of
+ *              them is, spread evenly over the frame. Together with the step
+ *              limit of the diamond search that bounds the work per frame
+ *              however much of the scene changed. Each search is seeded with
+ *              the previous block's vector, as neighbouring blocks of one
+ *              object move alike.
+ *
+ * Returns:     On success, returns the number of vectors found. Otherwise,
+ *              returns -1.
+ *
+ ******************************************************************************/
+int motion_estimate(const uint8_t *ref, size_t ref_stride,
+                    const uint8_t *cur, size_t cur_stride,
+                    const motion_search_config_t *config, motion_result_t *result)
+{
+    if ((vectors == NULL) || (ref == NULL) || (cur == NULL) || (config == NULL) ||
+        (result == NULL) || (config->range > MOTION_MAX_SEARCH_RANGE))
+    {
+        return -1;
+    }
+
+    result->vector_count = 0;
+    result->vectors      = vectors;
+    result->flow_x       = 0.0f;
+    result->flow_y       = 0.0f;
+    result->flow_blocks  = 0;
+
+    uint32_t full_x  = frame_width / MOTION_BLOCK_SIZE;
+    uint32_t full_y  = frame_height / MOTION_BLOCK_SIZE;
+    uint32_t changed = 0;
+
+    for (uint32_t by = 0; by < full_y; ++by)
+    {
+        for (uint32_t bx = 0; bx < full_x; ++bx)
+        {
+            changed += (block_scores[by * blocks_x + bx] >= config->block_threshold);
+        }
+    }
+
+    if ((changed == 0) || (config->max_blocks == 0))
+    {
+        return 0;
+    }
+
+    uint32_t every        = (changed + config->max_blocks - 1) / config->max_blocks;
+    uint32_t seen         = 0;
+    uint32_t count        = 0;
+    int32_t  predicted_dx = 0;
+    int32_t  predicted_dy = 0;
+    int32_t  range        = (int32_t)config->range;
+
+    memset(flow_votes, 0, sizeof(flow_votes));
+
+    for (uint32_t by = 0; by < full_y; ++by)
+    {
+        for (uint32_t bx = 0; bx < full_x; ++bx)
+        {
+            if ((block_scores[by * blocks_x + bx] < config->block_threshold) ||
+                ((seen++ % every) != 0))
+            {
+                continue;
+            }
+
+            int32_t         x      = (int32_t)(bx * MOTION_BLOCK_SIZE);
+            int32_t         y      = (int32_t)(by * MOTION_BLOCK_SIZE);
+            motion_search_t search = {
+                .ref        = ref + (size_t)y * ref_stride + (size_t)x,
+                .ref_stride = ref_stride,
+                .cur        = cur + (size_t)y * cur_stride + (size_t)x,
+                .cur_stride = cur_stride,
+                .min_dx     = (x + MOTION_BLOCK_SIZE - (int32_t)frame_width > -range)
+                            ? x + MOTION_BLOCK_SIZE - (int32_t)frame_width : -range,
+                .max_dx     = (x < range) ? x : range,
+                .min_dy     = (y + MOTION_BLOCK_SIZE - (int32_t)frame_height > -range)
+                            ? y + MOTION_BLOCK_SIZE - (int32_t)frame_height : -range,
+                .max_dy     = (y < range) ? y : range,
+            };
+
+            search.best_sad = motion_sad_block(search.ref, ref_stride, search.cur, cur_stride);
+            uint32_t still_sad = search.best_sad;
+
+            motion_search_block(&search, config->range, predicted_dx, predicted_dy);
+
+            if (((search.best_dx == 0) && (search.best_dy == 0)) ||
+                ((double)search.best_sad > MOTION_SEARCH_MAX_RESIDUAL * (double)still_sad))
+            {
+                continue;
+            }
+
+            predicted_dx = search.best_dx;
+            predicted_dy = search.best_dy;
+
+            vectors[count].bx        = (uint16_t)bx;
+            vectors[count].by        = (uint16_t)by;
+            vectors[count].dx        = (int8_t)search.best_dx;
+            vectors[count].dy        = (int8_t)search.best_dy;
+            vectors[count].sad       = (uint16_t)search.best_sad;
+            vectors[count].still_sad = (uint16_t)still_sad;
+            count += 1;
+
+            flow_votes[(search.best_dy + MOTION_MAX_SEARCH_RANGE) * MOTION_FLOW_SIDE +
+                       (search.best_dx + MOTION_MAX_SEARCH_RANGE)] += still_sad - search.best_sad;
+        }
+    }
+
+    result->vector_count = count;
+    motion_flow(count, result);
+
+    return (int)count;
+}
@@ -0,0 +1,165 @@
+#include "pixfmt.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__SSE2__)
+    #include <emmintrin.h>
+#elif defined(__ARM_NEON)
+    #include <arm_neon.h>
+#endif
+
+#ifdef SITEMON_WITH_MJPEG
+    #include <stdio.h>
+    #include <setjmp.h>
+    #include <jpeglib.h>
+#endif
+
+/*******************************************************************************
+ *
+ * Function:    pixfmt_yuyv_to_luma()
+ *
+ * Description: Extracts the luma plane of a packed YUYV image. Every other
+ *              byte of a YUYV row is a luma sample, so 16 pixels are
+ *              deinterleaved per SIMD iteration and the remainder of the row
+ *              is handled one pixel at a time.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+void pixfmt_yuyv_to_luma(uint8_t *dst, size_t dst_stride,
+                         const uint8_t *src, size_t src_stride,
+                         uint32_t width, uint32_t height)
+{
+    for (uint32_t row = 0; row < height; ++row)
+    {
+        const uint8_t *in  = src + row * src_stride;
+        uint8_t       *out = dst + row * dst_stride;
+        uint32_t       col = 0;
+
+#if defined(__SSE2__)
+        const __m128i mask = _mm_set1_epi16(0x00FF);
+        for (; col + 16 <= width; col += 16)
+        {
+            __m128i lo = _mm_loadu_si128((const __m128i *)(in + 2 * col));
+            __m128i hi = _mm_loadu_si128((const __m128i *)(in + 2 * col + 16));
+            lo = _mm_and_si128(lo, mask);
+            hi = _mm_and_si128(hi, mask);
+            _mm_storeu_si128((__m128i *)(out + col), _mm_packus_epi16(lo, hi));
+        }
+#elif defined(__ARM_NEON)
+        for (; col + 16 <= width; col += 16)
+        {
+            uint8x16x2_t yuyv = vld2q_u8(in + 2 * col);
+            vst1q_u8(out + col, yuyv.val[0]);
+        }
+#endif
+        for (; col < width; ++col)
+        {
+            out[col] = in[2 * col];
+        }
+    }
+}
+
+#ifdef SITEMON_WITH_MJPEG
+
+// libjpeg reports fatal errors through a callback that must not return, so
+// we jump back into pixfmt_mjpeg_to_luma() instead of exiting the process.
+typedef struct pixfmt_jpeg_error
+{
+    struct jpeg_error_mgr manager;
+    jmp_buf               escape;
+} pixfmt_jpeg_error_t;
+
+static void pixfmt_jpeg_error_exit(j_common_ptr cinfo)
+{
+    pixfmt_jpeg_error_t *error = (pixfmt_jpeg_error_t *)cinfo->err;
+    longjmp(error->escape, 1);
+}
+
+/*******************************************************************************
+ *
+ * Function:    pixfmt_mjpeg_to_luma()
+ *
+ * Description: Decodes the luma plane of a motion-JPEG frame. Requesting a
+ *              grey-scale output lets the decoder skip the inverse DCT,
+ *              upsampling and colour conversion of both chroma components.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+int pixfmt_mjpeg_to_luma(uint8_t *dst, size_t dst_stride,
+                         const uint8_t *src, size_t nbytes,
+                         uint32_t width, uint32_t height)
+{
+    struct jpeg_decompress_struct cinfo;
+    pixfmt_jpeg_error_t           error;
+
+    cinfo.err = jpeg_std_error(&error.manager);
+    error.manager.error_exit = pixfmt_jpeg_error_exit;
+
+    if (setjmp(error.escape))
+    {
+        jpeg_destroy_decompress(&cinfo);
+        return -1;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, (unsigned char *)src, nbytes);
+
+    if (jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK)
+    {
+        jpeg_destroy_decompress(&cinfo);
+        return -1;
+    }
+
+    cinfo.out_color_space     = JCS_GRAYSCALE;
+    cinfo.dct_method          = JDCT_IFAST;
+    cinfo.do_fancy_upsampling = FALSE;
+    cinfo.do_block_smoothing  = FALSE;
+
+    jpeg_start_decompress(&cinfo);
+
+    if ((cinfo.output_width != width) || (cinfo.output_height != height))
+    {
+        jpeg_abort_decompress(&cinfo);
+        jpeg_destroy_decompress(&cinfo);
+        return -1;
+    }
+
+    while (cinfo.output_scanline < cinfo.output_height)
+    {
+        JSAMPROW row = dst + cinfo.output_scanline * dst_stride;
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+
+    return 0;
+}
+
+#else
+
+/*******************************************************************************
+ *
+ * Function:    pixfmt_mjpeg_to_luma()
+ *
+ * Description: Placeholder used when the MJPEG decode path is compiled out.
+ *
+ * Returns:     Always returns -1.
+ *
+ ******************************************************************************/
+int pixfmt_mjpeg_to_luma(uint8_t *dst, size_t dst_stride,
+                         const uint8_t *src, size_t nbytes,
+                         uint32_t width, uint32_t height)
+{
+    (void)dst;
+    (void)dst_stride;
+    (void)src;
+    (void)nbytes;
+    (void)width;
+    (void)height;
+    return -1;
+}
+
+#endif // SITEMON_WITH_MJPEG
@@ -0,0 +1,236 @@
+#define _GNU_SOURCE // pthread_setaffinity_np()
+#include "pool.h"
+#include "trace.h"
+#include "log.h"
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+// Spins before sleeping on the futex. Jobs of one frame follow each other
+// closely, while frames are far apart, so only a short spin pays off.
+#define POOL_SPIN_ITERATIONS 4096
+
+#if defined(__x86_64__) || defined(__i386__)
+    #define POOL_CPU_RELAX() __builtin_ia32_pause()
+#elif defined(__arm__) || defined(__aarch64__)
+    #define POOL_CPU_RELAX() __asm__ __volatile__("yield")
+#else
+    #define POOL_CPU_RELAX() ((void)0)
+#endif
+
+// The job being run. Written by pool_run() before generation is incremented.
+typedef struct pool_job
+{
+    pool_task_t task;
+    void       *arg;
+    uint32_t    stripes;
+} pool_job_t;
+
+// Global module variables
+static pthread_t  workers[POOL_MAX_THREADS];
+static uint32_t   nthreads = 1;
+static pool_job_t job;
+static uint32_t   generation __attribute__((aligned(64))); // incremented per job
+static uint32_t   pending    __attribute__((aligned(64))); // workers still busy
+
+/*******************************************************************************
+ *
+ * Function:    pool_futex_wait()
+ *
+ * Description: Waits until *word no longer holds value, spinning briefly
+ *              before going to sleep in the kernel.
+ *
+ * Returns:     The new value of *word.
+ *
+ ******************************************************************************/
+static uint32_t pool_futex_wait(uint32_t *word, uint32_t value)
+{
+    uint32_t current;
+
+    for (int spin = 0; spin < POOL_SPIN_ITERATIONS; ++spin)
+    {
+        if ((current = __atomic_load_n(word, __ATOMIC_ACQUIRE)) != value)
+        {
+            return current;
+        }
+        POOL_CPU_RELAX();
+    }
+
+    while ((current = __atomic_load_n(word, __ATOMIC_ACQUIRE)) == value)
+    {
+        syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+    }
+    return current;
+}
+
+/*******************************************************************************
+ *
+ * Function:    pool_futex_wake()
+ *
+ * Description: Wakes the threads sleeping on a word.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void pool_futex_wake(uint32_t *word, int count)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+/*******************************************************************************
+ *
+ * Function:    pool_run_share()
+ *
+ * Description: Runs the stripes of the current job that belong to a thread.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void pool_run_share(uint32_t thread)
+{
+    for (uint32_t stripe = thread; stripe < job.stripes; stripe += nthreads)
+    {
+        job.task(job.arg, stripe);
+    }
+}
+
+/*******************************************************************************
+ *
+ * Function:    pool_worker()
+ *
+ * Description: Waits for jobs and runs its share of each. The last worker to
+ *              finish wakes the thread that started the job.
+ *
+ * Returns:     Never returns.
+ *
+ ******************************************************************************/
+static void *pool_worker(void *vargp)
+{
+    uint32_t thread = (uint32_t)(uintptr_t)vargp;
+    uint32_t seen   = 0;
+
+    TRACE_THREAD_NAME("pool worker");
+
+    for (;;)
+    {
+        seen = pool_futex_wait(&generation, seen);
+
+        TRACE_BEGIN("pool stripes");
+        pool_run_share(thread);
+        TRACE_END("pool stripes");
+
+        if (__atomic_sub_fetch(&pending, 1, __ATOMIC_ACQ_REL) == 0)
+        {
+            pool_futex_wake(&pending, 1);
+        }
+    }
+
+    return NULL;
+}
+
+/*******************************************************************************
+ *
+ * Function:    pool_init()
+ *
+ * Description: Starts the worker threads, pinning worker n to CPU n modulo
+ *              the number of CPUs. With at most one thread per CPU, the
+ *              default, no worker lands on CPU 0, which leaves it free for
+ *              the caller of pool_run(). Neither the caller nor the other
+ *              threads of the daemon are pinned, so they may run anywhere.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+int pool_init(uint32_t threads)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (threads == 0)
+    {
+        threads = (cpus > 0) ? (uint32_t)cpus : 1;
+    }
+    if (threads > POOL_MAX_THREADS)
+    {
+        threads = POOL_MAX_THREADS;
+    }
+
+    for (uint32_t n = 1; n < threads; ++n)
+    {
+        if (pthread_create(&workers[n], NULL, pool_worker, (void *)(uintptr_t)n) != 0)
+        {
+            LOG_ERROR("failed to start pool worker %u", n);
+            return -1;
+        }
+
+        if (cpus > 1)
+        {
+            cpu_set_t set;
+
+            CPU_ZERO(&set);
+            CPU_SET((int)(n % (uint32_t)cpus), &set);
+            pthread_setaffinity_np(workers[n], sizeof(set), &set);
+        }
+
+        // Only counted once running, so a failure leaves a working pool.
+        nthreads = n + 1;
+    }
+
+    LOG_INFO("pool of %u threads on %ld CPUs", nthreads, cpus);
+    return 0;
+}
+
+/*******************************************************************************
+ *
+ * Function:    pool_size()
+ *
+ * Description: Gets the number of threads jobs are split across.
+ *
+ * Returns:     The number of threads.
+ *
+ ******************************************************************************/
+uint32_t pool_size(void)
+{
+    return nthreads;
+}
+
+/*******************************************************************************
+ *
+ * Function:    pool_run()
+ *
+ * Description: Publishes a job, wakes the workers, runs the caller's share
+ *              and waits for the rest.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+void pool_run(pool_task_t task, void *arg, uint32_t stripes)
+{
+    job.task    = task;
+    job.arg     = arg;
+    job.stripes = stripes;
+
+    if ((nthreads == 1) || (stripes <= 1))
+    {
+        for (uint32_t stripe = 0; stripe < stripes; ++stripe)
+        {
+            task(arg, stripe);
+        }
+        return;
+    }
+
+    __atomic_store_n(&pending, nthreads - 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&generation, 1, __ATOMIC_RELEASE);
+    pool_futex_wake(&generation, INT_MAX);
+
+    pool_run_share(0);
+
+    uint32_t left;
+    while ((left = __atomic_load_n(&pending, __ATOMIC_ACQUIRE)) != 0)
+    {
+        pool_futex_wait(&pending, left);
+    }
+}
@@ -0,0 +1,317 @@
+#include "scheduler.h"
+#include "camera.h"
+#include "log.h"
+#include "metrics.h"
+#include "util.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#define NSEC_PER_SEC 1000000000ull
+
+// Global module variables
+static scheduler_config_t config;
+static scheduler_stats_t  stats;
+static uint64_t           start_ns;
+static uint64_t           active_ns;   // last time the scene looked active
+static uint64_t           interval_ns; // time between analyzed frames
+static uint64_t           full_interval_ns;
+static uint64_t           frame_ns;    // capture time of the last analyzed frame
+static uint64_t           cpu_prev_ns;
+static uint64_t           wall_prev_ns;
+static metric_t          *level_metric;
+static metric_t          *fps_metric;
+static metric_t          *analyzed_metric;
+static metric_t          *skipped_metric;
+static metric_t          *latency_metric;
+
+/*******************************************************************************
+ *
+ * Function:    scheduler_cpu_time_ns()
+ *
+ * Description: Reads the user and system CPU time consumed by the process.
+ *
+ * Returns:     The CPU time in nanoseconds.
+ *
+ ******************************************************************************/
+static uint64_t scheduler_cpu_time_ns(void)
+{
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) == -1)
+    {
+        return 0;
+    }
+
+    return ((uint64_t)usage.ru_utime.tv_sec + (uint64_t)usage.ru_stime.tv_sec) * NSEC_PER_SEC
+         + ((uint64_t)usage.ru_utime.tv_usec + (uint64_t)usage.ru_stime.tv_usec) * 1000ull;
+}
+
+/*******************************************************************************
+ *
+ * Function:    scheduler_set_level()
+ *
+ * Description: Moves to an idle level. The camera frame rate is halved per
+ *              level until min_fps is reached; whatever reduction the camera
+ *              could not provide is made up for by skipping frames.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void scheduler_set_level(uint32_t level)
+{
+    uint32_t fps = config.full_fps >> level;
+
+    if (fps < config.min_fps)
+    {
+        fps = config.min_fps;
+    }
+
+    if (fps != stats.fps)
+    {
+        int granted = camera_set_frame_rate(fps);
+
+        // Cameras without frame rate control keep running at their old rate.
+        if (granted > 0)
+        {
+            stats.fps = (uint32_t)granted;
+        }
+    }
+
+    // Analyze one frame every (skip + 1) so that the analysis rate is
+    // full_fps / 2^level whatever frame rate the camera settled on.
+    uint64_t factor = ((uint64_t)stats.fps << level) / config.full_fps;
+
+    stats.level = level;
+    stats.skip  = (factor > 1) ? (uint32_t)(factor - 1) : 0;
+    interval_ns = (stats.skip + 1) * NSEC_PER_SEC / stats.fps;
+
+    metrics_set(level_metric, stats.level);
+    metrics_set(fps_metric, stats.fps);
+
+    LOG_INFO("idle level %u, %u fps, analyzing 1 in %u frames", stats.level, stats.fps, stats.skip + 1);
+}
+
+/*******************************************************************************
+ *
+ * Function:    scheduler_init()
+ *
+ * Description: Initialize the scheduler and set the camera to full rate.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+int scheduler_init(const scheduler_config_t *cfg)
+{
+    if ((cfg == NULL) || (cfg->full_fps == 0) || (cfg->min_fps == 0) ||
+        (cfg->idle_levels >= SCHEDULER_MAX_LEVELS))
+    {
+        return -1;
+    }
+
+    config = *cfg;
+    memset(&stats, 0, sizeof(stats));
+    frame_ns = 0;
+
+    if (level_metric == NULL)
+    {
+        level_metric = metrics_gauge("sitemon_scheduler_idle_level", NULL,
+                                     "Idle level of the frame scheduler, 0 is full rate.");
+        fps_metric = metrics_gauge("sitemon_scheduler_fps", NULL,
+                                   "Frame rate granted by the camera.");
+        analyzed_metric = metrics_counter("sitemon_scheduler_frames_total",
+                                          "{result=\"analyzed\"}",
+                                          "Frames analyzed or skipped by the scheduler.");
+        skipped_metric = metrics_counter("sitemon_scheduler_frames_total",
+                                         "{result=\"skipped\"}",
+                                         "Frames analyzed or skipped by the scheduler.");
+        latency_metric = metrics_histogram("sitemon_scheduler_added_latency_seconds", NULL,
+                                           "Detection latency added by idling, per wake-up.");
+    }
+
+    // Until the camera says otherwise assume it runs at full rate.
+    int granted = camera_set_frame_rate(config.full_fps);
+    stats.fps = (granted > 0) ? (uint32_t)granted : config.full_fps;
+    scheduler_set_level(0);
+    full_interval_ns = interval_ns;
+
+    start_ns     = monotonic_time_ns();
+    active_ns    = start_ns;
+    wall_prev_ns = start_ns;
+    cpu_prev_ns  = scheduler_cpu_time_ns();
+
+    return 0;
+}
+
+/*******************************************************************************
+ *
+ * Function:    scheduler_detect_motion()
+ *
+ * Description: Skips as many frames as the current idle level calls for and
+ *              then runs camera_detect_motion() on the next one. A score at
+ *              or above wake_score returns to full rate immediately, while
+ *              quiet_seconds without one drops to the next idle level.
+ *
+ *              The latency a wake-up adds is measured from the capture times
+ *              of the frame that saw it and of the frame analyzed before: the
+ *              activity may have started right after the earlier one, and at
+ *              full rate it would have been seen full_interval_ns later.
+ *
+ * Returns:     The result of camera_detect_motion().
+ *
+ ******************************************************************************/
+int scheduler_detect_motion(uint8_t avg_pixel_diff, motion_result_t *result)
+{
+    motion_result_t scores;
+
+    for (uint32_t frame = 0; frame < stats.skip; ++frame)
+    {
+        if (camera_skip_frame() == 0)
+        {
+            ++stats.frames_skipped;
+            metrics_add(skipped_metric, 1);
+        }
+    }
+
+    int      motion  = camera_detect_motion(avg_pixel_diff, &scores);
+    uint64_t now_ns  = monotonic_time_ns();
+    uint64_t prev_ns = frame_ns;
+
+    frame_ns = ((motion != -1) && (scores.timestamp_ns != 0)) ? scores.timestamp_ns : now_ns;
+    ++stats.frames_analyzed;
+    metrics_add(analyzed_metric, 1);
+
+    if (result != NULL)
+    {
+        *result = scores;
+    }
+
+    if ((motion == 1) || (scores.score >= config.wake_score))
+    {
+        if (stats.level > 0)
+        {
+            uint64_t gap   = ((prev_ns != 0) && (frame_ns > prev_ns)) ? frame_ns - prev_ns : 0;
+            uint64_t added = (gap > full_interval_ns) ? gap - full_interval_ns : 0;
+
+            stats.added_latency_last_ns   = added;
+            stats.added_latency_total_ns += added;
+            if (added > stats.added_latency_max_ns)
+            {
+                stats.added_latency_max_ns = added;
+            }
+            ++stats.wakeups;
+            metrics_observe(latency_metric, added);
+
+            scheduler_set_level(0);
+        }
+        active_ns = now_ns;
+    }
+    else if ((stats.level < config.idle_levels) &&
+             (now_ns - active_ns >= config.quiet_seconds * NSEC_PER_SEC))
+    {
+        scheduler_set_level(stats.level + 1);
+        active_ns = now_ns;
+    }
+
+    return motion;
+}
+
+/*******************************************************************************
+ *
+ * Function:    scheduler_get_stats()
+ *
+ * Description: Get the scheduler's current state and cost. CPU use is
+ *              measured over the time since the previous call.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+void scheduler_get_stats(scheduler_stats_t *out)
+{
+    uint64_t now_ns = monotonic_time_ns();
+    uint64_t cpu_ns = scheduler_cpu_time_ns();
+
+    if (now_ns > wall_prev_ns)
+    {
+        stats.cpu_percent = 100.0 * (double)(cpu_ns - cpu_prev_ns)
+                                  / (double)(now_ns - wall_prev_ns);
+    }
+    wall_prev_ns = now_ns;
+    cpu_prev_ns  = cpu_ns;
+
+    if (now_ns > start_ns)
+    {
+        stats.frames_analyzed_per_hour = (double)stats.frames_analyzed * 3600.0
+                                       * (double)NSEC_PER_SEC
+                                       / (double)(now_ns - start_ns);
+    }
+
+    *out = stats;
+}
+
+/*******************************************************************************
+ *
+ * Function:    scheduler_log_stats()
+ *
+ * Description: Logs the scheduler's current state and cost. The same values,
+ *              except CPU use, are exported as metrics as they change.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+void scheduler_log_stats(void)
+{
+    scheduler_stats_t current;
+    scheduler_get_stats(&current);
+
+    LOG_INFO("idle level %u (%u fps, 1 in %u frames), CPU %.1f%%, %llu frames analyzed "
+             "(%.0f/h), %llu skipped, added latency last %llu ms, max %llu ms, %u wakeups",
+             current.level, current.fps, current.skip + 1, current.cpu_percent,
+             (unsigned long long)current.frames_analyzed, current.frames_analyzed_per_hour,
+             (unsigned long long)current.frames_skipped,
+             (unsigned long long)(current.added_latency_last_ns / 1000000),
+             (unsigned long long)(current.added_latency_max_ns / 1000000),
+             current.wakeups);
+}
+
+/*******************************************************************************
+ *
+ * Function:    scheduler_save_state()
+ *
+ * Description: Copies the idle level and when the scene was last active.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+void scheduler_save_state(scheduler_state_t *state)
+{
+    memset(state, 0, sizeof(*state));
+    state->level     = stats.level;
+    state->active_ns = active_ns;
+}
+
+/*******************************************************************************
+ *
+ * Function:    scheduler_restore_state()
+ *
+ * Description: Continues at a saved idle level. The quiet period towards the
+ *              next level counts from when the scene was last active, but
+ *              never from the future.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+void scheduler_restore_state(const scheduler_state_t *state, int64_t shift_ns)
+{
+    uint32_t level  = (state->level < config.idle_levels) ? state->level : config.idle_levels;
+    uint64_t now_ns = monotonic_time_ns();
+    int64_t  active = (int64_t)state->active_ns + shift_ns;
+
+    if (level != stats.level)
+    {
+        scheduler_set_level(level);
+    }
+    active_ns = ((active > 0) && ((uint64_t)active < now_ns)) ? (uint64_t)active : now_ns;
+}
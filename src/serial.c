@@ -4,6 +4,7 @@
 #include <unistd.h>
 #include <termios.h>
 #include "serial.h"
+#include "trace.h"
 
 int serial_open(const char *device, speed_t baud)
 {
@@ -61,6 +62,8 @@ int serial_open(const char *device, speed_t baud)
 
 ssize_t serial_write(int fd, uint8_t *buffer, size_t nbytes)
 {
+    TRACE_SCOPE("serial_write");
+
     if ((fd < 0) || (buffer == NULL))
     {
         return -1;
@@ -71,6 +74,8 @@ ssize_t serial_write(int fd, uint8_t *buffer, size_t nbytes)
 
 ssize_t serial_read(int fd, uint8_t *buffer, size_t nbytes)
 {
+    TRACE_SCOPE("serial_read");
+
     if ((fd == 0) || (buffer == NULL))
     {
         return -1;
@@ -99,6 +104,64 @@ ssize_t serial_read(int fd, uint8_t *buffer, size_t nbytes)
     return nread;
 }
 
+int serial_set_baud(int fd, uint32_t baud)
+{
+    static const struct
+    {
+        uint32_t baud;
+        speed_t  speed;
+    } speeds[] =
+    {
+        { 9600, B9600 }, { 19200, B19200 }, { 38400, B38400 }, { 57600, B57600 },
+        { 115200, B115200 }, { 230400, B230400 }, { 460800, B460800 },
+        { 921600, B921600 }, { 1000000, B1000000 }, { 1500000, B1500000 },
+        { 2000000, B2000000 }, { 3000000, B3000000 }, { 4000000, B4000000 },
+    };
+    struct termios term_config;
+
+    for (size_t n = 0; n < sizeof(speeds) / sizeof(speeds[0]); ++n)
+    {
+        if (speeds[n].baud != baud)
+        {
+            continue;
+        }
+
+        // Let the modem's answer to the rate change go out at the old rate.
+        if ((tcdrain(fd) == -1) || (tcgetattr(fd, &term_config) == -1))
+        {
+            return -1;
+        }
+
+        cfsetospeed(&term_config, speeds[n].speed);
+        cfsetispeed(&term_config, speeds[n].speed);
+
+        return tcsetattr(fd, TCSANOW, &term_config);
+    }
+
+    return -1;
+}
+
+int serial_set_flow_control(int fd, int on)
+{
+    struct termios term_config;
+
+    if (tcgetattr(fd, &term_config) == -1)
+    {
+        return -1;
+    }
+
+    if (on)
+    {
+        term_config.c_cflag |= CRTSCTS;
+    }
+    else
+    {
+        term_config.c_cflag &= ~CRTSCTS;
+    }
+
+    return tcsetattr(fd, TCSANOW, &term_config);
+}
+
 int serial_ioflush(int fd)
 {
     return tcflush(fd, TCIOFLUSH);
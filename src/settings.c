@@ -0,0 +1,650 @@
+#include "settings.h"
+#include "log.h"
+#include "metrics.h"
+#include "trace.h"
+#include "util.h"
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#define SETTINGS_LINE_SIZE    256
+#define SETTINGS_FILE_SIZE    PATH_MAX
+#define SETTINGS_EVENT_BUFFER 4096
+#define SETTINGS_MAX_THRESHOLD 255 // the threshold is a grey level
+
+// Global module variables
+static char        settings_path[SETTINGS_FILE_SIZE];
+static settings_t  defaults_copy;     // what the file is applied over
+static settings_t *current;           // the settings in force
+static uint32_t    reader_phase;      // which counter new readers use
+static uint32_t    readers[2];        // readers in each phase
+static __thread uint32_t thread_phase; // phase of the outermost acquire
+static __thread uint32_t thread_depth; // nesting of acquires in this thread
+static pthread_t   watch_thread;
+static metric_t   *applied_metric;
+static metric_t   *rejected_metric;
+
+/*******************************************************************************
+ *
+ * Function:    settings_uncomment()
+ *
+ * Description: Cuts a comment off a line. A line whose first character other
+ *              than white space is '#' is all comment. Further on, a '#' only
+ *              starts a comment as a word of its own, with white space on
+ *              both sides, so that values like "Gate #2 open" stay whole.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void settings_uncomment(char *line)
+{
+    char *text = line;
+
+    while (isspace((unsigned char)*text))
+    {
+        ++text;
+    }
+    if (*text == '#')
+    {
+        *text = '\0';
+        return;
+    }
+
+    for (char *hash = strchr(text, '#'); hash != NULL; hash = strchr(hash + 1, '#'))
+    {
+        if (isspace((unsigned char)hash[-1]) &&
+            ((hash[1] == '\0') || isspace((unsigned char)hash[1])))
+        {
+            *hash = '\0';
+            return;
+        }
+    }
+}
+
+/*******************************************************************************
+ *
+ * Function:    settings_trim()
+ *
+ * Description: Cuts the white space around a string off.
+ *
+ * Returns:     The start of the trimmed string.
+ *
+ ******************************************************************************/
+static char *settings_trim(char *text)
+{
+    char *end = text + strlen(text);
+
+    while ((end > text) && isspace((unsigned char)end[-1]))
+    {
+        --end;
+    }
+    *end = '\0';
+
+    while (isspace((unsigned char)*text))
+    {
+        ++text;
+    }
+    return text;
+}
+
+/*******************************************************************************
+ *
+ * Function:    settings_number()
+ *
+ * Description: Parses a whole decimal number within [min, max].
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+static int settings_number(const char *text, uint32_t min, uint32_t max, uint32_t *value)
+{
+    char         *end;
+    unsigned long number;
+
+    errno  = 0;
+    number = strtoul(text, &end, 10);
+    if ((end == text) || (*end != '\0') || (errno != 0) || (text[0] == '-') ||
+        (number < min) || (number > max))
+    {
+        return -1;
+    }
+
+    *value = (uint32_t)number;
+    return 0;
+}
+
+/*******************************************************************************
+ *
+ * Function:    settings_string()
+ *
+ * Description: Copies a string value that must fit its field.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+static int settings_string(const char *text, char *field, size_t size)
+{
+    size_t length = strlen(text);
+
+    if ((length == 0) || (length >= size))
+    {
+        return -1;
+    }
+
+    memcpy(field, text, length + 1);
+    return 0;
+}
+
+/*******************************************************************************
+ *
+ * Function:    settings_zone()
+ *
+ * Description: Parses a zone given as "x0 y0 x1 y1" in blocks.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+static int settings_zone(const char *text, blob_zone_t *zone)
+{
+    unsigned x0, y0, x1, y1;
+    int      consumed = 0;
+
+    if ((sscanf(text, "%u %u %u %u%n", &x0, &y0, &x1, &y1, &consumed) != 4) ||
+        (text[consumed] != '\0') || (x0 > x1) || (y0 > y1) || (x1 > UINT16_MAX) ||
+        (y1 > UINT16_MAX))
+    {
+        return -1;
+    }
+
+    zone->x0 = (uint16_t)x0;
+    zone->y0 = (uint16_t)y0;
+    zone->x1 = (uint16_t)x1;
+    zone->y1 = (uint16_t)y1;
+    return 0;
+}
+
+/*******************************************************************************
+ *
+ * Function:    settings_apply()
+ *
+ * Description: Applies one "key = value" pair. The first recipient, zone or
+ *              modem given clears the inherited list.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+static int settings_apply(settings_t *settings, const char *key, const char *value,
+                          uint32_t *seen_lists)
+{
+    enum { SEEN_RECIPIENTS = 1, SEEN_ZONES = 2, SEEN_MODEMS = 4 };
+    blob_config_t *filter = &settings->blob_filter;
+    uint32_t       number;
+
+    if (strcmp(key, "threshold") == 0)
+    {
+        return settings_number(value, 1, SETTINGS_MAX_THRESHOLD, &settings->threshold);
+    }
+    if (strcmp(key, "block_threshold") == 0)
+    {
+        // Entered in grey levels like the threshold, stored in 1/256 levels.
+        if (settings_number(value, 1, SETTINGS_MAX_THRESHOLD, &number) == -1)
+        {
+            return -1;
+        }
+        filter->block_threshold = (uint16_t)(number * 256);
+        return 0;
+    }
+    if (strcmp(key, "min_blob_blocks") == 0)
+    {
+        return settings_number(value, 1, UINT32_MAX, &filter->min_area);
+    }
+    if (strcmp(key, "max_blob_blocks") == 0)
+    {
+        return settings_number(value, 1, UINT32_MAX, &filter->max_area);
+    }
+    if (strcmp(key, "zone") == 0)
+    {
+        if (!(*seen_lists & SEEN_ZONES))
+        {
+            *seen_lists       |= SEEN_ZONES;
+            filter->zone_count = 0;
+        }
+        if ((filter->zone_count == BLOB_MAX_ZONES) ||
+            (settings_zone(value, &filter->zones[filter->zone_count]) == -1))
+        {
+            return -1;
+        }
+        filter->zone_count += 1;
+        return 0;
+    }
+    if (strcmp(key, "stills") == 0)
+    {
+        return settings_number(value, 0, UINT32_MAX, &settings->stills);
+    }
+    if (strcmp(key, "recipient") == 0)
+    {
+        if (!(*seen_lists & SEEN_RECIPIENTS))
+        {
+            *seen_lists               |= SEEN_RECIPIENTS;
+            settings->recipient_count  = 0;
+        }
+        if ((settings->recipient_count == SETTINGS_MAX_RECIPIENTS) ||
+            (settings_string(value, settings->recipients[settings->recipient_count],
+                             SETTINGS_RECIPIENT_SIZE) == -1))
+        {
+            return -1;
+        }
+        settings->recipient_count += 1;
+        return 0;
+    }
+    if (strcmp(key, "message") == 0)
+    {
+        return settings_string(value, settings->message, sizeof(settings->message));
+    }
+    if (strcmp(key, "alert_interval") == 0)
+    {
+        return settings_number(value, 0, UINT32_MAX, &settings->alert_interval_seconds);
+    }
+    if (strcmp(key, "max_alerts_per_hour") == 0)
+    {
+        return settings_number(value, 0, UINT32_MAX, &settings->max_alerts_per_hour);
+    }
+    if (strcmp(key, "video_device") == 0)
+    {
+        return settings_string(value, settings->video_device, sizeof(settings->video_device));
+    }
+    if (strcmp(key, "modem") == 0)
+    {
+        if (!(*seen_lists & SEEN_MODEMS))
+        {
+            *seen_lists           |= SEEN_MODEMS;
+            settings->modem_count  = 0;
+        }
+        if ((settings->modem_count == SETTINGS_MAX_MODEMS) ||
+            (settings_string(value, settings->modems[settings->modem_count],
+                             SETTINGS_PATH_SIZE) == -1))
+        {
+            return -1;
+        }
+        settings->modem_count += 1;
+        return 0;
+    }
+
+    return -1;
+}
+
+/*******************************************************************************
+ *
+ * Function:    settings_parse()
+ *
+ * Description: Reads the settings file over a copy of a base. Any line that
+ *              can't be used rejects the whole file, so a half edited file
+ *              never takes effect.
+ *
+ * Returns:     On success, returns 0. If the file doesn't exist, returns 1.
+ *              Otherwise, returns -1.
+ *
+ ******************************************************************************/
+static int settings_parse(const settings_t *base, settings_t *settings)
+{
+    FILE    *file = fopen(settings_path, "r");
+    char     line[SETTINGS_LINE_SIZE];
+    uint32_t number     = 0;
+    uint32_t seen_lists = 0;
+    int      ret        = 0;
+
+    if (file == NULL)
+    {
+        return (errno == ENOENT) ? 1 : -1;
+    }
+
+    *settings = *base;
+
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        number += 1;
+
+        if ((strchr(line, '\n') == NULL) && !feof(file))
+        {
+            LOG_ERROR("%s:%u: line too long", settings_path, number);
+            ret = -1;
+            break;
+        }
+
+        settings_uncomment(line);
+
+        char *text   = settings_trim(line);
+        char *equals = strchr(text, '=');
+
+        if (text[0] == '\0')
+        {
+            continue;
+        }
+
+        if (equals != NULL)
+        {
+            *equals = '\0';
+        }
+        if ((equals == NULL) ||
+            (settings_apply(settings, settings_trim(text), settings_trim(equals + 1),
+                            &seen_lists) == -1))
+        {
+            LOG_ERROR("%s:%u: invalid setting \"%s\"", settings_path, number, text);
+            ret = -1;
+            break;
+        }
+    }
+
+    if ((ret == 0) && ferror(file))
+    {
+        ret = -1;
+    }
+    if ((ret == 0) && (settings->blob_filter.max_area < settings->blob_filter.min_area))
+    {
+        LOG_ERROR("%s: max_blob_blocks is below min_blob_blocks", settings_path);
+        ret = -1;
+    }
+
+    fclose(file);
+    return ret;
+}
+
+/*******************************************************************************
+ *
+ * Function:    settings_synchronize()
+ *
+ * Description: Waits until every reader that may have seen the settings in
+ *              force before the last swap is done. Readers that started
+ *              after the swap can only see the new settings. New readers are
+ *              moved to the other counter before each counter is drained, so
+ *              a steady stream of readers can't hold the wait up.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void settings_synchronize(void)
+{
+    for (int round = 0; round < 2; ++round)
+    {
+        uint32_t phase = __atomic_load_n(&reader_phase, __ATOMIC_SEQ_CST);
+
+        __atomic_store_n(&reader_phase, phase ^ 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&readers[phase], __ATOMIC_SEQ_CST) != 0)
+        {
+            SLEEP_MSECONDS(1);
+        }
+    }
+}
+
+/*******************************************************************************
+ *
+ * Function:    settings_reload()
+ *
+ * Description: Reads the file again on top of the defaults and swaps the
+ *              result in, so that a key taken out of the file gets its
+ *              default back. The old settings are freed once no reader can
+ *              see them any more.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+static int settings_reload(void)
+{
+    TRACE_SCOPE("settings reload");
+
+    settings_t *old      = current; // only this thread swaps once running
+    settings_t *settings = malloc(sizeof(*settings));
+
+    if (settings == NULL)
+    {
+        return -1;
+    }
+
+    if (settings_parse(&defaults_copy, settings) != 0)
+    {
+        LOG_WARN("settings in %s not applied, keeping the current ones", settings_path);
+        metrics_add(rejected_metric, 1);
+        free(settings);
+        return -1;
+    }
+
+    if ((strcmp(settings->video_device, old->video_device) != 0) ||
+        (settings->modem_count != old->modem_count) ||
+        (memcmp(settings->modems, old->modems, sizeof(settings->modems)) != 0))
+    {
+        LOG_WARN("device changes in %s take effect after a restart", settings_path);
+    }
+
+    __atomic_store_n(&current, settings, __ATOMIC_SEQ_CST);
+    settings_synchronize();
+    free(old);
+
+    LOG_INFO("settings reloaded: threshold %u, %u zones, %u recipients, %u stills",
+             settings->threshold, settings->blob_filter.zone_count,
+             settings->recipient_count, settings->stills);
+    metrics_add(applied_metric, 1);
+    return 0;
+}
+
+/*******************************************************************************
+ *
+ * Function:    settings_init()
+ *
+ * Description: Puts the defaults in force, with the settings file applied
+ *              over them if there is one.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+int settings_init(const settings_t *defaults, const char *path)
+{
+    settings_t *settings;
+    int         ret;
+
+    if ((defaults == NULL) || (path == NULL) || (current != NULL) ||
+        (strlen(path) >= sizeof(settings_path)))
+    {
+        return -1;
+    }
+
+    settings = malloc(sizeof(*settings));
+    if (settings == NULL)
+    {
+        return -1;
+    }
+
+    strcpy(settings_path, path);
+    defaults_copy = *defaults;
+    applied_metric = metrics_counter("sitemon_settings_reloads_total", "{result=\"applied\"}",
+                                     "Changes of the settings file, by whether they were applied.");
+    rejected_metric = metrics_counter("sitemon_settings_reloads_total", "{result=\"rejected\"}",
+                                      "Changes of the settings file, by whether they were applied.");
+
+    ret = settings_parse(&defaults_copy, settings);
+    if (ret == 1)
+    {
+        LOG_INFO("no settings in %s, using the defaults", path);
+    }
+    else if (ret == -1)
+    {
+        LOG_ERROR("settings in %s not applied, using the defaults", path);
+    }
+    if (ret != 0)
+    {
+        *settings = defaults_copy;
+    }
+
+    __atomic_store_n(&current, settings, __ATOMIC_RELEASE);
+
+    return (ret == -1) ? -1 : 0;
+}
+
+/*******************************************************************************
+ *
+ * Function:    settings_watcher()
+ *
+ * Description: Reloads the settings whenever the file is written or replaced.
+ *              The directory is watched rather than the file, so that editors
+ *              that save by renaming a new file over the old one are caught
+ *              too.
+ *
+ * Returns:     Never returns, unless inotify fails.
+ *
+ ******************************************************************************/
+static void *settings_watcher(void *vargp)
+{
+    int         fd   = (int)(intptr_t)vargp;
+    const char *name = strrchr(settings_path, '/');
+    char        buf[SETTINGS_EVENT_BUFFER]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    TRACE_THREAD_NAME("settings");
+
+    name = (name != NULL) ? name + 1 : settings_path;
+
+    for (;;)
+    {
+        ssize_t length = read(fd, buf, sizeof(buf));
+        int     changed = 0;
+
+        if (length == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            LOG_ERROR("settings: failed to read inotify events");
+            break;
+        }
+
+        for (char *p = buf; p < buf + length; )
+        {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+
+            if ((event->len > 0) && (strcmp(event->name, name) == 0))
+            {
+                changed = 1;
+            }
+            p += sizeof(*event) + event->len;
+        }
+
+        if (changed)
+        {
+            settings_reload();
+        }
+    }
+
+    close(fd);
+    return NULL;
+}
+
+/*******************************************************************************
+ *
+ * Function:    settings_watch()
+ *
+ * Description: Starts watching the directory of the settings file.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+int settings_watch(void)
+{
+    char  dir[SETTINGS_FILE_SIZE];
+    char *slash;
+    int   fd;
+
+    if (current == NULL)
+    {
+        return -1;
+    }
+
+    strcpy(dir, settings_path);
+    slash = strrchr(dir, '/');
+    if (slash == NULL)
+    {
+        strcpy(dir, ".");
+    }
+    else if (slash == dir)
+    {
+        dir[1] = '\0'; // a file in /
+    }
+    else
+    {
+        *slash = '\0';
+    }
+
+    fd = inotify_init1(IN_CLOEXEC);
+    if (fd == -1)
+    {
+        LOG_ERROR("settings: failed to start inotify");
+        return -1;
+    }
+
+    // Written in place, or renamed into place by an editor. Not on creation,
+    // as a new file is still empty then and would read as all defaults.
+    if (inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) == -1)
+    {
+        LOG_ERROR("settings: failed to watch %s", dir);
+        close(fd);
+        return -1;
+    }
+
+    if (pthread_create(&watch_thread, NULL, settings_watcher, (void *)(intptr_t)fd) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    pthread_detach(watch_thread);
+
+    LOG_INFO("watching %s for settings changes", settings_path);
+    return 0;
+}
+
+/*******************************************************************************
+ *
+ * Function:    settings_acquire()
+ *
+ * Description: Counts the thread in as a reader of the current phase and
+ *              gets the settings in force. The count is taken before the
+ *              pointer is read, so a reload either waits for this reader or
+ *              has already swapped the new settings in.
+ *
+ * Returns:     The settings.
+ *
+ ******************************************************************************/
+const settings_t *settings_acquire(void)
+{
+    if (thread_depth++ == 0)
+    {
+        thread_phase = __atomic_load_n(&reader_phase, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&readers[thread_phase], 1, __ATOMIC_SEQ_CST);
+    }
+
+    return __atomic_load_n(&current, __ATOMIC_SEQ_CST);
+}
+
+/*******************************************************************************
+ *
+ * Function:    settings_release()
+ *
+ * Description: Counts the thread out as a reader once its outermost acquire
+ *              is released.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+void settings_release(const settings_t *settings)
+{
+    (void)settings;
+
+    if (--thread_depth == 0)
+    {
+        __atomic_sub_fetch(&readers[thread_phase], 1, __ATOMIC_RELEASE);
+    }
+}
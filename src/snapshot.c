@@ -0,0 +1,93 @@
+#include "snapshot.h"
+#include "jpeg.h"
+#include <stdlib.h>
+
+/*******************************************************************************
+ *
+ * Function:    snapshot_downscale()
+ *
+ * Description: Averages each scale x scale block of the frame into one pixel.
+ *              Rows and columns that don't fill a whole block are dropped.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void snapshot_downscale(uint8_t *dst, const uint8_t *src, size_t stride,
+                               uint32_t width, uint32_t height, uint32_t scale)
+{
+    uint32_t area = scale * scale;
+
+    for (uint32_t y = 0; y < height; ++y)
+    {
+        const uint8_t *block = src + (size_t)y * scale * stride;
+
+        for (uint32_t x = 0; x < width; ++x, block += scale)
+        {
+            uint32_t sum = 0;
+
+            for (uint32_t row = 0; row < scale; ++row)
+            {
+                for (uint32_t col = 0; col < scale; ++col)
+                {
+                    sum += block[row * stride + col];
+                }
+            }
+            *dst++ = (uint8_t)((sum + area / 2) / area);
+        }
+    }
+}
+
+/*******************************************************************************
+ *
+ * Function:    snapshot_encode()
+ *
+ * Description: Downscales and compresses a frame.
+ *
+ * Returns:     On success, returns the length of the encoded image. Otherwise,
+ *              returns -1.
+ *
+ ******************************************************************************/
+ssize_t snapshot_encode(const uint8_t *luma, size_t stride, uint32_t width, uint32_t height,
+                        uint32_t scale, uint8_t *out, size_t size)
+{
+    uint8_t *pixels;
+    ssize_t  ret;
+
+    if ((scale == 0) || (width / scale == 0) || (height / scale == 0))
+    {
+        return -1;
+    }
+
+    if (scale == 1)
+    {
+        return jpeg_encode(luma, stride, width, height, SNAPSHOT_QUALITY, out, size);
+    }
+
+    width  /= scale;
+    height /= scale;
+
+    if ((pixels = malloc((size_t)width * height)) == NULL)
+    {
+        return -1;
+    }
+    snapshot_downscale(pixels, luma, stride, width, height, scale);
+
+    ret = jpeg_encode(pixels, width, width, height, SNAPSHOT_QUALITY, out, size);
+
+    free(pixels);
+    return ret;
+}
+
+/*******************************************************************************
+ *
+ * Function:    snapshot_extension()
+ *
+ * Description: Gets the file extension of the encoded images.
+ *
+ * Returns:     "jpg".
+ *
+ ******************************************************************************/
+const char *snapshot_extension(void)
+{
+    return "jpg";
+}
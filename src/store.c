@@ -0,0 +1,587 @@
+#include "store.h"
+#include "log.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#define STORE_INDEX_MAGIC   0x53494458u // "SIDX"
+#define STORE_RECORD_MAGIC  0x53524543u // "SREC"
+#define STORE_VERSION       2
+#define STORE_RECORD_ALIGN  4096        // records start on a flash page
+#define STORE_PATH_SIZE     256
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024 // the Linux limit, not exposed without _XOPEN_SOURCE
+#endif
+
+// Written in front of every frame in a segment, so that a reused segment
+// can be told apart from the frame an index entry points to.
+typedef struct store_record
+{
+    uint32_t magic;
+    uint32_t length;
+    uint64_t timestamp_ns;
+} store_record_t;
+
+// The start of the index file, followed by capacity entries. Entries
+// oldest..next-1 (modulo capacity) are valid and in time order.
+typedef struct store_index
+{
+    uint32_t      magic;
+    uint32_t      version;
+    uint32_t      segments;
+    uint32_t      segment_bytes;
+    uint32_t      capacity;
+    uint32_t      write_segment;
+    uint32_t      write_offset;
+    uint32_t      reserved;
+    uint64_t      oldest;
+    uint64_t      next;
+    uint64_t      last_timestamp_ns;
+    store_entry_t entries[];
+} store_index_t;
+
+// Global module variables
+static store_config_t  config;
+static char            dir[STORE_PATH_SIZE];
+static store_index_t  *index_map;
+static size_t          index_size;
+static int             segment_fd = -1;
+static pthread_mutex_t store_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*******************************************************************************
+ *
+ * Function:    store_segment_path()
+ *
+ * Description: Builds the file name of a segment.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void store_segment_path(char *path, size_t size, uint32_t segment)
+{
+    snprintf(path, size, "%s/segment-%04u", dir, segment);
+}
+
+/*******************************************************************************
+ *
+ * Function:    store_open_segment()
+ *
+ * Description: Makes a segment the one frames are appended to.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+static int store_open_segment(uint32_t segment)
+{
+    char path[STORE_PATH_SIZE + 16];
+
+    if (segment_fd != -1)
+    {
+        close(segment_fd);
+    }
+
+    store_segment_path(path, sizeof(path), segment);
+    if ((segment_fd = open(path, O_RDWR)) == -1)
+    {
+        LOG_ERROR("failed to open segment %s", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*******************************************************************************
+ *
+ * Function:    store_preallocate()
+ *
+ * Description: Creates every segment of the pool at its full size, so that
+ *              appending never allocates blocks or changes file sizes.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+static int store_preallocate(void)
+{
+    char path[STORE_PATH_SIZE + 16];
+
+    for (uint32_t segment = 0; segment < config.segments; ++segment)
+    {
+        int fd;
+
+        store_segment_path(path, sizeof(path), segment);
+        if ((fd = open(path, O_RDWR | O_CREAT, 0660)) == -1)
+        {
+            LOG_ERROR("failed to create segment %s", path);
+            return -1;
+        }
+
+        int err = posix_fallocate(fd, 0, (off_t)config.segment_bytes);
+        close(fd);
+        if (err != 0)
+        {
+            LOG_ERROR("failed to preallocate segment %s: %s", path, strerror(err));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*******************************************************************************
+ *
+ * Function:    store_open()
+ *
+ * Description: Opens the store, creating it if needed.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+int store_open(const store_config_t *cfg)
+{
+    char path[STORE_PATH_SIZE + 16];
+    int  fd;
+
+    if ((cfg == NULL) || (cfg->dir == NULL) || (strlen(cfg->dir) >= sizeof(dir)) ||
+        (cfg->segments == 0) || (cfg->max_frames == 0) ||
+        (cfg->segment_bytes < STORE_RECORD_ALIGN))
+    {
+        return -1;
+    }
+
+    store_close();
+    pthread_mutex_lock(&store_mutex);
+
+    config = *cfg;
+    strcpy(dir, cfg->dir);
+    if ((mkdir(dir, 0770) == -1) && (errno != EEXIST))
+    {
+        LOG_ERROR("failed to create store directory %s", dir);
+        pthread_mutex_unlock(&store_mutex);
+        return -1;
+    }
+
+    if (store_preallocate() == -1)
+    {
+        pthread_mutex_unlock(&store_mutex);
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "%s/index", dir);
+    index_size = sizeof(store_index_t) + (size_t)config.max_frames * sizeof(store_entry_t);
+    if ((fd = open(path, O_RDWR | O_CREAT, 0660)) == -1)
+    {
+        LOG_ERROR("failed to open store index %s", path);
+        pthread_mutex_unlock(&store_mutex);
+        return -1;
+    }
+
+    struct stat st;
+    int         resized = (fstat(fd, &st) == -1) || ((size_t)st.st_size != index_size);
+
+    if (resized && (ftruncate(fd, (off_t)index_size) == -1))
+    {
+        close(fd);
+        pthread_mutex_unlock(&store_mutex);
+        return -1;
+    }
+
+    index_map = mmap(NULL, index_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (index_map == MAP_FAILED)
+    {
+        index_map = NULL;
+        pthread_mutex_unlock(&store_mutex);
+        return -1;
+    }
+
+    if (resized || (index_map->magic != STORE_INDEX_MAGIC) ||
+        (index_map->version != STORE_VERSION) ||
+        (index_map->segments != config.segments) ||
+        (index_map->segment_bytes != config.segment_bytes) ||
+        (index_map->capacity != config.max_frames) ||
+        (index_map->write_segment >= config.segments))
+    {
+        LOG_INFO("starting a new store in %s", dir);
+        memset(index_map, 0, sizeof(store_index_t));
+        index_map->version       = STORE_VERSION;
+        index_map->segments      = config.segments;
+        index_map->segment_bytes = config.segment_bytes;
+        index_map->capacity      = config.max_frames;
+        index_map->magic         = STORE_INDEX_MAGIC;
+    }
+
+    int ret = store_open_segment(index_map->write_segment);
+
+    pthread_mutex_unlock(&store_mutex);
+    if (ret == -1)
+    {
+        store_close();
+    }
+
+    return ret;
+}
+
+/*******************************************************************************
+ *
+ * Function:    store_is_open()
+ *
+ * Description: Checks whether the store has been opened.
+ *
+ * Returns:     1 if the store is open, 0 otherwise.
+ *
+ ******************************************************************************/
+int store_is_open(void)
+{
+    pthread_mutex_lock(&store_mutex);
+    int is_open = (index_map != NULL);
+    pthread_mutex_unlock(&store_mutex);
+
+    return is_open;
+}
+
+/*******************************************************************************
+ *
+ * Function:    store_next_segment()
+ *
+ * Description: Moves appending on to the next segment of the pool. The index
+ *              entries of the frames in it are the oldest ones, and are
+ *              dropped before its space is reused.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+static int store_next_segment(void)
+{
+    uint32_t segment = (index_map->write_segment + 1) % config.segments;
+
+    while ((index_map->oldest < index_map->next) &&
+           (index_map->entries[index_map->oldest % config.max_frames].segment == segment))
+    {
+        index_map->oldest += 1;
+    }
+
+    index_map->write_segment = segment;
+    index_map->write_offset  = 0;
+
+    return store_open_segment(segment);
+}
+
+/*******************************************************************************
+ *
+ * Function:    store_append()
+ *
+ * Description: Appends a frame to the current segment, moving on to the next
+ *              one if it doesn't fit. The frame is written before its index
+ *              entry is published by advancing index->next.
+ *
+ * Returns:     On success, returns the number of bytes stored. Otherwise,
+ *              returns -1.
+ *
+ ******************************************************************************/
+ssize_t store_append(uint64_t timestamp_ns, const struct iovec *iov, int iovcnt)
+{
+    store_record_t record;
+    size_t         length = 0;
+
+    for (int n = 0; n < iovcnt; ++n)
+    {
+        length += iov[n].iov_len;
+    }
+
+    pthread_mutex_lock(&store_mutex);
+
+    if ((index_map == NULL) || (sizeof(record) + length > config.segment_bytes))
+    {
+        pthread_mutex_unlock(&store_mutex);
+        return -1;
+    }
+
+    if ((index_map->write_offset + sizeof(record) + length > config.segment_bytes) &&
+        (store_next_segment() == -1))
+    {
+        pthread_mutex_unlock(&store_mutex);
+        return -1;
+    }
+
+    // Time-range lookups rely on the index being sorted, even when the clock
+    // is set back. Records also never share a timestamp, which store_read()
+    // tells a reused segment apart by.
+    if (timestamp_ns <= index_map->last_timestamp_ns)
+    {
+        timestamp_ns = index_map->last_timestamp_ns + 1;
+    }
+
+    record.magic        = STORE_RECORD_MAGIC;
+    record.length       = (uint32_t)length;
+    record.timestamp_ns = timestamp_ns;
+
+    off_t offset = (off_t)index_map->write_offset;
+
+    if (pwrite(segment_fd, &record, sizeof(record), offset) != (ssize_t)sizeof(record))
+    {
+        LOG_ERROR("failed to write to segment %u", index_map->write_segment);
+        pthread_mutex_unlock(&store_mutex);
+        return -1;
+    }
+    offset += sizeof(record);
+
+    for (int first = 0; first < iovcnt; first += IOV_MAX)
+    {
+        int     count   = (iovcnt - first < IOV_MAX) ? iovcnt - first : IOV_MAX;
+        ssize_t written = pwritev(segment_fd, &iov[first], count, offset);
+        size_t  expected = 0;
+
+        for (int n = first; n < first + count; ++n)
+        {
+            expected += iov[n].iov_len;
+        }
+        if ((written < 0) || ((size_t)written != expected))
+        {
+            LOG_ERROR("failed to write to segment %u", index_map->write_segment);
+            pthread_mutex_unlock(&store_mutex);
+            return -1;
+        }
+        offset += written;
+    }
+
+    if (index_map->next - index_map->oldest >= config.max_frames)
+    {
+        index_map->oldest += 1;
+    }
+
+    store_entry_t *entry = &index_map->entries[index_map->next % config.max_frames];
+
+    entry->timestamp_ns = timestamp_ns;
+    entry->stored_ns    = timestamp_ns;
+    entry->segment      = index_map->write_segment;
+    entry->offset       = index_map->write_offset + (uint32_t)sizeof(record);
+    entry->length       = (uint32_t)length;
+    entry->flags        = 0;
+
+    index_map->last_timestamp_ns = timestamp_ns;
+    index_map->write_offset      = (uint32_t)((offset + STORE_RECORD_ALIGN - 1) /
+                                              STORE_RECORD_ALIGN * STORE_RECORD_ALIGN);
+    __atomic_store_n(&index_map->next, index_map->next + 1, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&store_mutex);
+
+    return (ssize_t)length;
+}
+
+/*******************************************************************************
+ *
+ * Function:    store_append_repeat()
+ *
+ * Description: Appends an index entry that points at the data of the newest
+ *              frame. That data is in the current segment, so the entry is
+ *              dropped together with it when the segment is reused.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+int store_append_repeat(uint64_t timestamp_ns)
+{
+    pthread_mutex_lock(&store_mutex);
+
+    if ((index_map == NULL) || (index_map->next == index_map->oldest))
+    {
+        pthread_mutex_unlock(&store_mutex);
+        return -1;
+    }
+
+    if (timestamp_ns < index_map->last_timestamp_ns)
+    {
+        timestamp_ns = index_map->last_timestamp_ns;
+    }
+
+    if (index_map->next - index_map->oldest >= config.max_frames)
+    {
+        index_map->oldest += 1;
+    }
+
+    store_entry_t *last  = &index_map->entries[(index_map->next - 1) % config.max_frames];
+    store_entry_t *entry = &index_map->entries[index_map->next % config.max_frames];
+
+    *entry = *last;
+    entry->timestamp_ns = timestamp_ns;
+    entry->flags       |= STORE_ENTRY_REPEAT;
+
+    index_map->last_timestamp_ns = timestamp_ns;
+    __atomic_store_n(&index_map->next, index_map->next + 1, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&store_mutex);
+
+    return 0;
+}
+
+/*******************************************************************************
+ *
+ * Function:    store_lower_bound()
+ *
+ * Description: Binary search for the first frame at or after a time.
+ *
+ * Returns:     The logical index of that frame, or index->next if none is.
+ *
+ ******************************************************************************/
+static uint64_t store_lower_bound(uint64_t timestamp_ns)
+{
+    uint64_t low  = index_map->oldest;
+    uint64_t high = index_map->next;
+
+    while (low < high)
+    {
+        uint64_t middle = low + (high - low) / 2;
+
+        if (index_map->entries[middle % config.max_frames].timestamp_ns < timestamp_ns)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    return low;
+}
+
+/*******************************************************************************
+ *
+ * Function:    store_find()
+ *
+ * Description: Finds the frames captured in a time range with two binary
+ *              searches over the index.
+ *
+ * Returns:     The number of frames in the range, or -1 if the store is not
+ *              open.
+ *
+ ******************************************************************************/
+int store_find(uint64_t from_ns, uint64_t to_ns, store_entry_t *entries,
+               uint32_t max_entries)
+{
+    pthread_mutex_lock(&store_mutex);
+
+    if (index_map == NULL)
+    {
+        pthread_mutex_unlock(&store_mutex);
+        return -1;
+    }
+
+    uint64_t first = store_lower_bound(from_ns);
+    uint64_t end   = (to_ns > from_ns) ? store_lower_bound(to_ns) : first;
+
+    for (uint64_t n = first; (n < end) && (n - first < max_entries); ++n)
+    {
+        entries[n - first] = index_map->entries[n % config.max_frames];
+    }
+
+    pthread_mutex_unlock(&store_mutex);
+
+    return (int)(end - first);
+}
+
+/*******************************************************************************
+ *
+ * Function:    store_check_record()
+ *
+ * Description: Checks that the record in front of a frame in its segment is
+ *              the one the index entry was made for.
+ *
+ * Returns:     1 if it is, 0 otherwise.
+ *
+ ******************************************************************************/
+static int store_check_record(int fd, const store_entry_t *entry)
+{
+    store_record_t record;
+
+    return (pread(fd, &record, sizeof(record), entry->offset - sizeof(record)) == sizeof(record)) &&
+           (record.magic == STORE_RECORD_MAGIC) && (record.length == entry->length) &&
+           (record.timestamp_ns == entry->stored_ns);
+}
+
+/*******************************************************************************
+ *
+ * Function:    store_read()
+ *
+ * Description: Reads a frame back, after checking that the record in front
+ *              of it belongs to the same frame. The record is checked again
+ *              once the frame is read, as the segment may have been reused
+ *              in between, and the data read would then be someone else's.
+ *
+ * Returns:     On success, returns the number of bytes read. Otherwise,
+ *              returns -1.
+ *
+ ******************************************************************************/
+ssize_t store_read(const store_entry_t *entry, void *buffer, size_t size)
+{
+    char    path[STORE_PATH_SIZE + 16];
+    ssize_t nread = -1;
+    int     fd;
+
+    if ((entry->length > size) || (entry->offset < sizeof(store_record_t)))
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&store_mutex);
+    store_segment_path(path, sizeof(path), entry->segment);
+    pthread_mutex_unlock(&store_mutex);
+
+    if ((fd = open(path, O_RDONLY)) == -1)
+    {
+        return -1;
+    }
+
+    if (store_check_record(fd, entry))
+    {
+        nread = pread(fd, buffer, entry->length, entry->offset);
+
+        // A reused segment is written from its start, over the record first.
+        if ((nread != -1) && !store_check_record(fd, entry))
+        {
+            nread = -1;
+        }
+    }
+    close(fd);
+
+    return nread;
+}
+
+/*******************************************************************************
+ *
+ * Function:    store_close()
+ *
+ * Description: Flushes and closes the store.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+void store_close(void)
+{
+    pthread_mutex_lock(&store_mutex);
+
+    if (segment_fd != -1)
+    {
+        fdatasync(segment_fd);
+        close(segment_fd);
+        segment_fd = -1;
+    }
+    if (index_map != NULL)
+    {
+        msync(index_map, index_size, MS_SYNC);
+        munmap(index_map, index_size);
+        index_map = NULL;
+    }
+
+    pthread_mutex_unlock(&store_mutex);
+}
@@ -0,0 +1,375 @@
+#include "trace.h"
+
+#ifdef SITEMON_WITH_TRACE
+
+#include "log.h"
+#include "util.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#define TRACE_RING_MASK (TRACE_RING_EVENTS - 1)
+#define TRACE_PATH_SIZE 256
+
+typedef struct trace_record
+{
+    uint64_t    timestamp_ns;
+    const char *name;
+    uint32_t    tid;
+    char        phase;
+} trace_record_t;
+
+// One thread's events. Only the owning thread writes to it; head counts every
+// event ever recorded and is published with release semantics after the
+// event it covers has been written. When the thread exits the ring is handed
+// to the next new thread, which is why every event carries its thread id.
+typedef struct trace_ring
+{
+    uint64_t       head;
+    uint32_t       in_use;
+    uint32_t       tid;
+    const char    *name;
+    trace_record_t events[TRACE_RING_EVENTS];
+} __attribute__((aligned(64))) trace_ring_t;
+
+// Global module variables
+static trace_ring_t           rings[TRACE_MAX_THREADS];
+static pthread_key_t          ring_key;
+static pthread_once_t         ring_key_once = PTHREAD_ONCE_INIT;
+static __thread trace_ring_t *thread_ring;
+static __thread int           thread_untraced;
+static char                   dump_path[TRACE_PATH_SIZE];
+static pthread_mutex_t        dump_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t              signal_thread;
+static sigset_t               dump_signals;
+
+/*******************************************************************************
+ *
+ * Function:    trace_release_ring()
+ *
+ * Description: Runs when a thread that owns a ring exits and frees the ring
+ *              for the next thread. The events already in it are kept.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void trace_release_ring(void *ring)
+{
+    __atomic_store_n(&((trace_ring_t *)ring)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+/*******************************************************************************
+ *
+ * Function:    trace_create_key()
+ *
+ * Description: Creates the key whose destructor releases a thread's ring.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void trace_create_key(void)
+{
+    pthread_key_create(&ring_key, trace_release_ring);
+}
+
+/*******************************************************************************
+ *
+ * Function:    trace_claim_ring()
+ *
+ * Description: Claims a free ring for the calling thread.
+ *
+ * Returns:     The claimed ring, or NULL if every ring is in use.
+ *
+ ******************************************************************************/
+static trace_ring_t *trace_claim_ring(void)
+{
+    pthread_once(&ring_key_once, trace_create_key);
+
+    for (uint32_t index = 0; index < TRACE_MAX_THREADS; ++index)
+    {
+        trace_ring_t *ring   = &rings[index];
+        uint32_t      in_use = 0;
+
+        if (__atomic_compare_exchange_n(&ring->in_use, &in_use, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            __atomic_store_n(&ring->name, NULL, __ATOMIC_RELAXED);
+            __atomic_store_n(&ring->tid, (uint32_t)syscall(SYS_gettid), __ATOMIC_RELAXED);
+            pthread_setspecific(ring_key, ring);
+            return ring;
+        }
+    }
+    return NULL;
+}
+
+/*******************************************************************************
+ *
+ * Function:    trace_ring()
+ *
+ * Description: Returns the calling thread's ring, claiming one on first use.
+ *
+ * Returns:     The ring of the calling thread, or NULL if every ring is taken.
+ *
+ ******************************************************************************/
+static inline trace_ring_t *trace_ring(void)
+{
+    if ((thread_ring == NULL) && !thread_untraced)
+    {
+        thread_ring     = trace_claim_ring();
+        thread_untraced = (thread_ring == NULL);
+    }
+    return thread_ring;
+}
+
+/*******************************************************************************
+ *
+ * Function:    trace_thread_name()
+ *
+ * Description: Name the calling thread in the trace.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+void trace_thread_name(const char *name)
+{
+    trace_ring_t *ring = trace_ring();
+
+    if (ring != NULL)
+    {
+        __atomic_store_n(&ring->name, name, __ATOMIC_RELEASE);
+    }
+}
+
+/*******************************************************************************
+ *
+ * Function:    trace_event()
+ *
+ * Description: Record an event for the calling thread. The slot is written
+ *              before the new head is published, so a reader that sees the
+ *              head also sees the event.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+void trace_event(const char *name, char phase)
+{
+    trace_ring_t *ring = trace_ring();
+
+    if (ring == NULL)
+    {
+        return;
+    }
+
+    uint64_t        head  = ring->head;
+    trace_record_t *event = &ring->events[head & TRACE_RING_MASK];
+
+    event->timestamp_ns = monotonic_time_ns();
+    event->name         = name;
+    event->tid          = ring->tid;
+    event->phase        = phase;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*******************************************************************************
+ *
+ * Function:    trace_snapshot()
+ *
+ * Description: Copies the events of a ring that another thread may still be
+ *              writing to. Events the writer may have overwritten while they
+ *              were copied are dropped from the front of the copy.
+ *
+ * Returns:     The number of events copied, starting at *first.
+ *
+ ******************************************************************************/
+static uint32_t trace_snapshot(trace_ring_t *ring, trace_record_t *copy, uint64_t *first)
+{
+    uint64_t end   = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t start = (end > TRACE_RING_EVENTS) ? end - TRACE_RING_EVENTS : 0;
+
+    for (uint64_t n = start; n < end; ++n)
+    {
+        copy[n & TRACE_RING_MASK] = ring->events[n & TRACE_RING_MASK];
+    }
+
+    // The writer may be filling slot head right now, which held event
+    // head - TRACE_RING_EVENTS.
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+
+    if (head + 1 > start + TRACE_RING_EVENTS)
+    {
+        start = head + 1 - TRACE_RING_EVENTS;
+    }
+
+    *first = start;
+    return (start < end) ? (uint32_t)(end - start) : 0;
+}
+
+/*******************************************************************************
+ *
+ * Function:    trace_dump()
+ *
+ * Description: Write every buffered event to a file in the Chrome trace event
+ *              format. The file is written under a temporary name and renamed
+ *              into place, so a reader never sees a partial trace.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+int trace_dump(const char *path)
+{
+    char            tmp_path[TRACE_PATH_SIZE + 8];
+    trace_record_t *copy;
+    FILE           *file;
+    int             pid = (int)getpid();
+    int             separator = 0;
+
+    if ((copy = malloc(sizeof(trace_record_t) * TRACE_RING_EVENTS)) == NULL)
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&dump_mutex);
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    if ((file = fopen(tmp_path, "w")) == NULL)
+    {
+        LOG_ERROR("failed to open %s", tmp_path);
+        pthread_mutex_unlock(&dump_mutex);
+        free(copy);
+        return -1;
+    }
+
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    for (uint32_t r = 0; r < TRACE_MAX_THREADS; ++r)
+    {
+        trace_ring_t *ring = &rings[r];
+        const char   *name = __atomic_load_n(&ring->name, __ATOMIC_ACQUIRE);
+        uint64_t      first;
+        uint32_t      nevents = trace_snapshot(ring, copy, &first);
+
+        if (name != NULL)
+        {
+            fprintf(file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,"
+                    "\"args\":{\"name\":\"%s\"}}", separator ? "," : "", pid,
+                    __atomic_load_n(&ring->tid, __ATOMIC_RELAXED), name);
+            separator = 1;
+        }
+
+        for (uint32_t n = 0; n < nevents; ++n)
+        {
+            const trace_record_t *event = &copy[(first + n) & TRACE_RING_MASK];
+
+            fprintf(file, "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu.%03u,"
+                    "\"pid\":%d,\"tid\":%u%s}", separator ? "," : "",
+                    event->name, event->phase,
+                    (unsigned long long)(event->timestamp_ns / 1000),
+                    (unsigned)(event->timestamp_ns % 1000),
+                    pid, event->tid, (event->phase == 'i') ? ",\"s\":\"t\"" : "");
+            separator = 1;
+        }
+    }
+    fprintf(file, "\n]}\n");
+
+    int ret = (fclose(file) == 0) ? rename(tmp_path, path) : -1;
+
+    pthread_mutex_unlock(&dump_mutex);
+    free(copy);
+
+    return ret;
+}
+
+/*******************************************************************************
+ *
+ * Function:    trace_dump_at_exit()
+ *
+ * Description: Writes the trace when the process exits normally.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void trace_dump_at_exit(void)
+{
+    trace_dump(dump_path);
+}
+
+/*******************************************************************************
+ *
+ * Function:    trace_signal_thread()
+ *
+ * Description: Waits for the dump signals, which every other thread blocks.
+ *              Dumping here rather than in a signal handler lets it use stdio
+ *              safely. SIGINT and SIGTERM are re-raised with their default
+ *              action once the trace is written.
+ *
+ * Returns:     Never returns.
+ *
+ ******************************************************************************/
+static void *trace_signal_thread(void *arg)
+{
+    (void)arg;
+
+    for (;;)
+    {
+        int sig;
+
+        if (sigwait(&dump_signals, &sig) != 0)
+        {
+            continue;
+        }
+
+        trace_dump(dump_path);
+
+        if (sig != SIGUSR2)
+        {
+            sigset_t one;
+
+            sigemptyset(&one);
+            sigaddset(&one, sig);
+            signal(sig, SIG_DFL);
+            pthread_sigmask(SIG_UNBLOCK, &one, NULL);
+            raise(sig);
+        }
+    }
+
+    return NULL;
+}
+
+/*******************************************************************************
+ *
+ * Function:    trace_init()
+ *
+ * Description: Install the dump handlers.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+int trace_init(const char *path)
+{
+    if ((path == NULL) || (strlen(path) >= sizeof(dump_path)))
+    {
+        return -1;
+    }
+    strcpy(dump_path, path);
+
+    sigemptyset(&dump_signals);
+    sigaddset(&dump_signals, SIGUSR2);
+    sigaddset(&dump_signals, SIGINT);
+    sigaddset(&dump_signals, SIGTERM);
+
+    if ((pthread_sigmask(SIG_BLOCK, &dump_signals, NULL) != 0) ||
+        (pthread_create(&signal_thread, NULL, trace_signal_thread, NULL) != 0))
+    {
+        return -1;
+    }
+    pthread_detach(signal_thread);
+
+    return atexit(trace_dump_at_exit);
+}
+
+#endif // SITEMON_WITH_TRACE
@@ -0,0 +1,244 @@
+#include "upload.h"
+#include "gsm.h"
+#include "metrics.h"
+#include "trace.h"
+#include "util.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#define UPLOAD_URL_SIZE      200 // fits in an AT+HTTPPARA="URL" command
+#define UPLOAD_RESPONSE_SIZE 32
+#define UPLOAD_CHUNK_ALIGN   256
+#define UPLOAD_HTTP_OK       200
+
+// The newest chunk weighs 1/2^UPLOAD_EWMA_SHIFT in the throughput estimate.
+#define UPLOAD_EWMA_SHIFT    2
+
+// Global module variables
+static upload_config_t upload_config;
+static int             upload_ready;
+static metric_t       *bytes_metric;
+static metric_t       *chunk_metric;
+static metric_t       *retry_metric;
+
+/*******************************************************************************
+ *
+ * Function:    upload_init()
+ *
+ * Description: Stores the upload settings and registers the upload metrics.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+int upload_init(const upload_config_t *config)
+{
+    if ((config->url == NULL) || (config->apn == NULL) || (config->min_chunk == 0) ||
+        (config->max_chunk < config->min_chunk) || (config->max_attempts == 0))
+    {
+        return -1;
+    }
+
+    upload_config = *config;
+
+    if (!upload_ready)
+    {
+        bytes_metric = metrics_counter("sitemon_upload_bytes_total", NULL,
+                                       "Snapshot bytes committed by the upload server.");
+        chunk_metric = metrics_histogram("sitemon_upload_chunk_seconds", NULL,
+                                         "Time to send one snapshot chunk over the modem.");
+        retry_metric = metrics_counter("sitemon_upload_retries_total", NULL,
+                                       "Snapshot chunks that had to be sent again.");
+    }
+    upload_ready = 1;
+
+    return 0;
+}
+
+/*******************************************************************************
+ *
+ * Function:    upload_request()
+ *
+ * Description: Sends one request and parses the committed offset the server
+ *              answers with.
+ *
+ * Returns:     On success, returns 0 and stores the offset in committed.
+ *              Otherwise, returns -1.
+ *
+ ******************************************************************************/
+static int upload_request(gsm_t *modem, gsm_http_method_t method, const char *url,
+                          const uint8_t *body, size_t length, size_t *committed)
+{
+    char               response[UPLOAD_RESPONSE_SIZE];
+    char              *end;
+    unsigned long long offset;
+
+    int status = gsm_http_request(modem, method, url, body, length, response, sizeof(response));
+    if (status != UPLOAD_HTTP_OK)
+    {
+        LOG_WARN("upload request failed with status %d", status);
+        return -1;
+    }
+
+    offset = strtoull(response, &end, 10);
+    if (end == response)
+    {
+        LOG_WARN("upload server sent no offset");
+        return -1;
+    }
+
+    *committed = (size_t)offset;
+    return 0;
+}
+
+/*******************************************************************************
+ *
+ * Function:    upload_chunk_size()
+ *
+ * Description: Sizes the next chunk so that it takes about target_chunk_ms
+ *              at the estimated throughput.
+ *
+ * Returns:     The chunk size in bytes.
+ *
+ ******************************************************************************/
+static uint32_t upload_chunk_size(uint64_t bytes_per_second)
+{
+    uint64_t size = bytes_per_second * upload_config.target_chunk_ms / 1000;
+
+    size -= size % UPLOAD_CHUNK_ALIGN;
+    if (size < upload_config.min_chunk)
+    {
+        size = upload_config.min_chunk;
+    }
+    if (size > upload_config.max_chunk)
+    {
+        size = upload_config.max_chunk;
+    }
+    return (uint32_t)size;
+}
+
+/*******************************************************************************
+ *
+ * Function:    upload_send()
+ *
+ * Description: Asks the server how much of the snapshot it has and sends the
+ *              rest chunk by chunk. A failed chunk halves the chunk size and
+ *              the offset is asked for again before retrying.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+static int upload_send(gsm_t *modem, const char *id, const uint8_t *data, size_t length)
+{
+    char     url[UPLOAD_URL_SIZE];
+    size_t   offset     = 0;
+    uint32_t chunk      = upload_config.min_chunk;
+    uint64_t throughput = 0; // bytes per second
+    uint32_t failures   = 0;
+    int      known      = 0; // whether offset is what the server has
+
+    while (!known || (offset < length))
+    {
+        if (failures == upload_config.max_attempts)
+        {
+            LOG_ERROR("upload of %s stopped at %zu of %zu bytes", id, offset, length);
+            return -1;
+        }
+
+        if (!known)
+        {
+            snprintf(url, sizeof(url), "%s?id=%s", upload_config.url, id);
+            if (upload_request(modem, GSM_HTTP_GET, url, NULL, 0, &offset) == -1)
+            {
+                failures += 1;
+                continue;
+            }
+            if (offset > length)
+            {
+                LOG_ERROR("upload server has %zu bytes of %s, expected at most %zu",
+                          offset, id, length);
+                return -1;
+            }
+            known = 1;
+            continue;
+        }
+
+        size_t   size     = (length - offset < chunk) ? length - offset : chunk;
+        size_t   previous = offset;
+        uint64_t start_ns = monotonic_time_ns();
+
+        snprintf(url, sizeof(url), "%s?id=%s&offset=%zu&total=%zu",
+                 upload_config.url, id, offset, length);
+        if ((upload_request(modem, GSM_HTTP_POST, url, data + offset, size, &offset) == -1) ||
+            (offset != previous + size))
+        {
+            // Whatever the server stored is asked for before trying again.
+            metrics_add(retry_metric, 1);
+            failures += 1;
+            known     = 0;
+            offset    = previous;
+            chunk     = (chunk / 2 < upload_config.min_chunk) ? upload_config.min_chunk
+                                                              : chunk / 2;
+            continue;
+        }
+
+        uint64_t elapsed_ns = monotonic_time_ns() - start_ns;
+        uint64_t rate       = (uint64_t)size * 1000000000ull / (elapsed_ns + 1);
+
+        metrics_observe(chunk_metric, elapsed_ns);
+        metrics_add(bytes_metric, size);
+
+        throughput = (throughput == 0)
+                   ? rate
+                   : throughput - (throughput >> UPLOAD_EWMA_SHIFT) + (rate >> UPLOAD_EWMA_SHIFT);
+        chunk      = upload_chunk_size(throughput);
+        failures   = 0;
+
+        LOG_DEBUG("upload of %s at %zu of %zu bytes, %" PRIu64 " B/s, next chunk %u",
+                  id, offset, length, throughput, chunk);
+    }
+
+    return 0;
+}
+
+/*******************************************************************************
+ *
+ * Function:    upload_snapshot()
+ *
+ * Description: Opens the data channel, uploads a snapshot and closes the
+ *              channel again.
+ *
+ * Returns:     On success, returns 0. Otherwise, returns -1.
+ *
+ ******************************************************************************/
+int upload_snapshot(gsm_t *modem, const char *id, const uint8_t *data, size_t length)
+{
+    TRACE_SCOPE("upload snapshot");
+
+    if (!upload_ready)
+    {
+        return -1;
+    }
+
+    if (strlen(upload_config.url) + strlen(id) + 64 > UPLOAD_URL_SIZE)
+    {
+        LOG_ERROR("upload URL too long for %s", id);
+        return -1;
+    }
+
+    if (gsm_data_open(modem, upload_config.apn) == -1)
+    {
+        return -1;
+    }
+
+    int ret = upload_send(modem, id, data, length);
+    gsm_data_close(modem);
+
+    if (ret == 0)
+    {
+        LOG_INFO("uploaded snapshot %s, %zu bytes", id, length);
+    }
+    return ret;
+}
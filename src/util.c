@@ -1,5 +1,6 @@
 #include "util.h"
 #include <ctype.h>
+#include <time.h>
 
 /******************************************************************************
  *
@@ -24,3 +25,17 @@ int has_alphanumeric(const char *str)
     return has_alnum;
 }
 
+/******************************************************************************
+ *
+ * Function:    monotonic_time_ns()
+ *
+ * Description: Reads the monotonic clock.
+ *
+ * Returns:     The value of CLOCK_MONOTONIC in nanoseconds.
+ *******************************************************************************/
+uint64_t monotonic_time_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
@@ -0,0 +1,147 @@
+/**
+ * @file cmux_test.c
+ *
+ * @brief Opens the fake modem with the multiplexer and checks that the link
+ *        was set up as asked, and that an SMS which the network takes its
+ *        time over on the control channel doesn't hold up gsm_data_open()
+ *        on the data channel, nor does a channel that isn't being read.
+ * @author Aramayis Orkusyan
+ * @date December 9, 2019
+ * @copyright GNU General Public License v3.0
+ */
+
+#include "fake_modem.h"
+#include "gsm.h"
+#include "util.h"
+#include <pthread.h>
+#include <stdio.h>
+
+#define TEST_CMGS_DELAY_MS 3000
+#define TEST_SMS_HEAD_MS   300  // head start of the SMS, so it is under way
+#define TEST_DATA_OPEN_MS  2000 // gsm_data_open() must be done within this
+#define TEST_FLOOD_BYTES   (256 * 1024) // more than a terminal buffers
+
+typedef struct test_sms
+{
+    gsm_t   *modem;
+    int      result;
+    uint64_t done_ns;
+} test_sms_t;
+
+/*******************************************************************************
+ *
+ * Function:    test_send_sms()
+ *
+ * Description: Sends the SMS on its own thread.
+ *
+ * Returns:     NULL.
+ *
+ ******************************************************************************/
+static void *test_send_sms(void *vargp)
+{
+    test_sms_t *sms = vargp;
+
+    sms->result  = gsm_send_message(sms->modem, "5550100", "Motion at the gate");
+    sms->done_ns = monotonic_time_ns();
+
+    return NULL;
+}
+
+/*******************************************************************************
+ *
+ * Function:    test_expect()
+ *
+ * Description: Checks that a command reached the modem on the given DLCI.
+ *
+ * Returns:     0 if it did, 1 otherwise.
+ *
+ ******************************************************************************/
+static int test_expect(fake_modem_t *fake, const char *command, int dlci)
+{
+    int received = fake_modem_received(fake, command);
+
+    if (received != dlci)
+    {
+        fprintf(stderr, "FAIL %s: expected on DLCI %d, got %d\n", command, dlci, received);
+        return 1;
+    }
+
+    return 0;
+}
+
+int main(void)
+{
+    // The status channel isn't read until the status monitor starts, so
+    // what the modem sends on it must not hold up the other channels.
+    const fake_modem_config_t config = { .multiplex = 1, .cmgs_delay_ms = TEST_CMGS_DELAY_MS,
+                                         .flood_dlci = 2, .flood_bytes = TEST_FLOOD_BYTES };
+    const gsm_link_config_t   link   = { .baud = 460800, .flow_control = 1, .multiplex = 1,
+                                         .frame_size = 127 };
+    fake_modem_t *fake = fake_modem_start(&config);
+    test_sms_t    sms  = { 0 };
+    pthread_t     thread;
+    int           failed = 0;
+
+    if (fake == NULL)
+    {
+        fprintf(stderr, "setup failed\n");
+        return 1;
+    }
+
+    if ((sms.modem = gsm_open(fake_modem_path(fake), "fake", &link)) == NULL)
+    {
+        fprintf(stderr, "FAIL gsm_open\n");
+        fake_modem_stop(fake);
+        return 1;
+    }
+
+    // The link is negotiated before the multiplexer starts.
+    failed += test_expect(fake, "AT+IFC=2,2", 0);
+    failed += test_expect(fake, "AT+IPR=?", 0);
+    failed += test_expect(fake, "AT+IPR=460800", 0);
+    failed += test_expect(fake, "AT+CMUX=", 0);
+
+    if (pthread_create(&thread, NULL, test_send_sms, &sms) != 0)
+    {
+        fprintf(stderr, "setup failed\n");
+        return 1;
+    }
+    SLEEP_MSECONDS(TEST_SMS_HEAD_MS);
+
+    uint64_t start_ns = monotonic_time_ns();
+    int      opened   = gsm_data_open(sms.modem, "fake");
+    uint64_t done_ns  = monotonic_time_ns();
+    uint64_t took_ms  = (done_ns - start_ns) / 1000000;
+
+    pthread_join(thread, NULL);
+
+    if (opened == -1)
+    {
+        fprintf(stderr, "FAIL gsm_data_open\n");
+        failed += 1;
+    }
+    else if ((took_ms > TEST_DATA_OPEN_MS) || (done_ns > sms.done_ns))
+    {
+        fprintf(stderr, "FAIL gsm_data_open took %llu ms, waiting for the SMS\n",
+                (unsigned long long)took_ms);
+        failed += 1;
+    }
+    if (sms.result == -1)
+    {
+        fprintf(stderr, "FAIL gsm_send_message\n");
+        failed += 1;
+    }
+
+    // SMS on the control channel, HTTP on the data channel.
+    failed += test_expect(fake, "AT+CMGS=", 1);
+    failed += test_expect(fake, "Motion at the gate", 1);
+    failed += test_expect(fake, "AT+SAPBR=1,1", 3);
+    failed += test_expect(fake, "AT+HTTPINIT", 3);
+
+    printf("gsm_data_open took %llu ms during the SMS, %d failures\n",
+           (unsigned long long)took_ms, failed);
+
+    fake_modem_stop(fake);
+
+    return failed ? 1 : 0;
+}
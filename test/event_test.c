@@ -0,0 +1,146 @@
+/**
+ * @file event_test.c
+ *
+ * @brief Feeds a moving blob through event_update() while an alert thread
+ *        waits for its travel as the daemon's does, and checks the direction
+ *        the alert would be sent with. When the event opens the blob has not
+ *        moved far enough to tell, so the alert has to wait for it.
+ * @author Aramayis Orkusyan
+ * @date December 9, 2019
+ * @copyright GNU General Public License v3.0
+ */
+
+#include "event.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TEST_TRAVEL_SIZE    48
+#define TEST_FRAME_NS       100000000ull // 10 fps
+#define TEST_FRAMES         30
+#define TEST_FRAME_DELAY_US 2000 // so the alert thread waits on some frames
+#define TEST_WAIT_MS        5000
+#define TEST_MIN_PIXELS     16.0f
+
+static const event_travel_config_t travel_config = {
+    .approach_x = 0.0f,
+    .approach_y = 1.0f,
+    .min_pixels = TEST_MIN_PIXELS
+};
+
+typedef struct test_alert
+{
+    event_t  event;
+    uint32_t max_frames;
+    int      result;
+    char     travel[TEST_TRAVEL_SIZE];
+} test_alert_t;
+
+/*******************************************************************************
+ *
+ * Function:    test_alert()
+ *
+ * Description: Waits for the travel and describes it, on its own thread.
+ *
+ * Returns:     NULL.
+ *
+ ******************************************************************************/
+static void *test_alert(void *vargp)
+{
+    test_alert_t *alert = vargp;
+
+    alert->result = event_wait_travel(&alert->event, TEST_MIN_PIXELS, alert->max_frames,
+                                      TEST_WAIT_MS, &alert->event);
+    event_describe_travel(&alert->event, &travel_config, alert->travel, sizeof(alert->travel));
+
+    return NULL;
+}
+
+/*******************************************************************************
+ *
+ * Function:    test_blob()
+ *
+ * Description: Runs one event of a blob moving by flow_x, flow_y pixels per
+ *              frame and checks the alert's travel text against expected.
+ *
+ * Returns:     0 if it matched, 1 otherwise.
+ *
+ ******************************************************************************/
+static int test_blob(const char *name, float flow_x, float flow_y, uint32_t max_frames,
+                     int expected_result, const char *expected)
+{
+    const event_config_t config = { .window = 8, .open_count = 3, .quiet_ms = 500 };
+    test_alert_t         alert;
+    pthread_t            thread;
+    int                  started = 0;
+    char                 travel[TEST_TRAVEL_SIZE];
+    uint64_t             timestamp_ns = 0;
+
+    memset(&alert, 0, sizeof(alert));
+    alert.max_frames = max_frames;
+    event_init(&config);
+
+    for (uint32_t frame = 0; frame < TEST_FRAMES + 10; ++frame)
+    {
+        int                active = (frame < TEST_FRAMES);
+        event_t            event;
+        event_transition_t transition;
+
+        timestamp_ns += TEST_FRAME_NS;
+        transition = event_update(active, 1000, active ? flow_x : 0.0f,
+                                  active ? flow_y : 0.0f, timestamp_ns, &event);
+
+        if (transition == EVENT_OPENED)
+        {
+            // Sent right away the alert would have no direction yet.
+            event_describe_travel(&event, &travel_config, travel, sizeof(travel));
+            if (travel[0] != '\0')
+            {
+                fprintf(stderr, "FAIL %s: travel told on opening: %s\n", name, travel);
+                return 1;
+            }
+
+            alert.event = event;
+            if (pthread_create(&thread, NULL, test_alert, &alert) != 0)
+            {
+                fprintf(stderr, "FAIL %s: thread not started\n", name);
+                return 1;
+            }
+            started = 1;
+        }
+        usleep(TEST_FRAME_DELAY_US);
+    }
+
+    if (!started)
+    {
+        fprintf(stderr, "FAIL %s: no event opened\n", name);
+        return 1;
+    }
+    pthread_join(thread, NULL);
+
+    if ((alert.result != expected_result) ||
+        (strncmp(alert.travel, expected, strlen(expected)) != 0) ||
+        ((expected[0] == '\0') && (alert.travel[0] != '\0')))
+    {
+        fprintf(stderr, "FAIL %s: got %d \"%s\", expected %d \"%s...\"\n", name,
+                alert.result, alert.travel, expected_result, expected);
+        return 1;
+    }
+    printf("%s: \"%s\" after %u frames\n", name, alert.travel, alert.event.frames);
+
+    return 0;
+}
+
+int main(void)
+{
+    int failed = 0;
+
+    failed += test_blob("approaching", 0.5f, 2.0f, TEST_FRAMES, 0, "approaching, down at ");
+    failed += test_blob("leaving", -0.5f, -3.0f, TEST_FRAMES, 0, "leaving, up at ");
+    failed += test_blob("passing", 4.0f, 0.0f, TEST_FRAMES, 0, "passing, right at ");
+    // A blob that stays put gives up after max_frames, without a direction.
+    failed += test_blob("stationary", 0.0f, 0.0f, 10, -1, "");
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,773 @@
+#define _GNU_SOURCE // ptsname_r(), posix_openpt()
+#include "fake_modem.h"
+#include "util.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#define FAKE_MAX_DLCI      4
+#define FAKE_PATH_SIZE     64
+#define FAKE_LINE_SIZE     512
+#define FAKE_BODY_SIZE     65536 // largest AT+HTTPDATA accepted
+#define FAKE_RESPONSE_SIZE 256
+#define FAKE_RX_SIZE       4096
+#define FAKE_FRAME_SIZE    127   // payload of the frames sent back
+#define FAKE_LOG_SIZE      512
+#define FAKE_LOG_TEXT_SIZE 96
+#define FAKE_MAX_PENDING   8
+#define FAKE_PENDING_SIZE  64
+#define FAKE_POLL_MS       20
+
+#define FAKE_CTRL_Z 0x1A
+
+// 27.010 framing, see cmux.c for the other end.
+#define FAKE_FLAG 0xF9
+#define FAKE_EA   0x01
+#define FAKE_PF   0x10
+#define FAKE_SABM 0x2F
+#define FAKE_UA   0x63
+#define FAKE_DISC 0x43
+#define FAKE_UIH  0xEF
+
+#define FAKE_OK "\r\nOK\r\n"
+
+// One AT command stream: the serial port, or one DLCI of the multiplexer.
+typedef struct fake_session
+{
+    char     line[FAKE_LINE_SIZE];
+    size_t   line_length;
+    int      sms;           // collecting the text of an SMS until Ctrl-Z
+    uint8_t *body;          // AT+HTTPDATA body
+    size_t   body_length;
+    size_t   body_missing;  // raw body bytes still to come after DOWNLOAD
+    int      has_body;
+    char     url[FAKE_LINE_SIZE];
+    char     response[FAKE_RESPONSE_SIZE];
+} fake_session_t;
+
+// A reply sent once some time has passed, e.g. +CMGS.
+typedef struct fake_pending
+{
+    uint64_t due_ns;
+    uint32_t dlci;
+    char     text[FAKE_PENDING_SIZE];
+} fake_pending_t;
+
+typedef struct fake_log_entry
+{
+    int  dlci;
+    char text[FAKE_LOG_TEXT_SIZE];
+} fake_log_entry_t;
+
+struct fake_modem
+{
+    fake_modem_config_t config;
+    int                 master;
+    int                 slave; // kept open, so the terminal outlives gsm_open()
+    char                path[FAKE_PATH_SIZE];
+    pthread_t           thread;
+    int                 running;
+    int                 mux;
+    fake_session_t      sessions[FAKE_MAX_DLCI + 1];
+    uint8_t             rx[FAKE_RX_SIZE];
+    size_t              rx_length;
+    fake_pending_t      pending[FAKE_MAX_PENDING];
+    pthread_mutex_t     log_mutex;
+    fake_log_entry_t    log[FAKE_LOG_SIZE];
+    uint32_t            log_count;
+};
+
+/*******************************************************************************
+ *
+ * Function:    fake_fcs()
+ *
+ * Description: Computes the 27.010 frame check sequence, bit by bit so that
+ *              it doesn't share the table of cmux.c.
+ *
+ * Returns:     The FCS byte.
+ *
+ ******************************************************************************/
+static uint8_t fake_fcs(const uint8_t *data, size_t length)
+{
+    uint8_t crc = 0xFF;
+
+    while (length-- > 0)
+    {
+        crc ^= *data++;
+        for (int bit = 0; bit < 8; ++bit)
+        {
+            crc = (crc & 1) ? (uint8_t)((crc >> 1) ^ 0xE0) : (uint8_t)(crc >> 1);
+        }
+    }
+
+    return (uint8_t)(0xFF - crc);
+}
+
+/*******************************************************************************
+ *
+ * Function:    fake_write()
+ *
+ * Description: Writes a whole buffer to the terminal.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void fake_write(fake_modem_t *modem, const uint8_t *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t written = write(modem->master, data, length);
+
+        if (written == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return;
+        }
+        data   += written;
+        length -= (size_t)written;
+    }
+}
+
+/*******************************************************************************
+ *
+ * Function:    fake_frame()
+ *
+ * Description: Sends one frame on a DLCI.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void fake_frame(fake_modem_t *modem, uint32_t dlci, uint8_t control, const uint8_t *data,
+                       size_t length)
+{
+    uint8_t frame[FAKE_FRAME_SIZE + 6];
+
+    frame[0] = FAKE_FLAG;
+    frame[1] = (uint8_t)((dlci << 2) | FAKE_EA);
+    frame[2] = control;
+    frame[3] = (uint8_t)((length << 1) | FAKE_EA);
+    memcpy(frame + 4, data, length);
+    frame[4 + length] = fake_fcs(frame + 1, 3);
+    frame[5 + length] = FAKE_FLAG;
+
+    fake_write(modem, frame, length + 6);
+}
+
+/*******************************************************************************
+ *
+ * Function:    fake_send()
+ *
+ * Description: Sends data on a session, in UIH frames once multiplexing.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void fake_send(fake_modem_t *modem, uint32_t dlci, const void *data, size_t length)
+{
+    const uint8_t *bytes = data;
+
+    if (!modem->mux)
+    {
+        fake_write(modem, bytes, length);
+        return;
+    }
+
+    while (length > 0)
+    {
+        size_t size = (length < FAKE_FRAME_SIZE) ? length : FAKE_FRAME_SIZE;
+
+        fake_frame(modem, dlci, FAKE_UIH, bytes, size);
+        bytes  += size;
+        length -= size;
+    }
+}
+
+/*******************************************************************************
+ *
+ * Function:    fake_reply()
+ *
+ * Description: Sends a string on a session.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void fake_reply(fake_modem_t *modem, uint32_t dlci, const char *text)
+{
+    fake_send(modem, dlci, text, strlen(text));
+}
+
+/*******************************************************************************
+ *
+ * Function:    fake_reply_later()
+ *
+ * Description: Queues a reply to be sent after a delay, without holding up
+ *              the other sessions.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void fake_reply_later(fake_modem_t *modem, uint32_t dlci, const char *text,
+                             uint32_t delay_ms)
+{
+    for (int n = 0; n < FAKE_MAX_PENDING; ++n)
+    {
+        if (modem->pending[n].due_ns == 0)
+        {
+            modem->pending[n].due_ns = monotonic_time_ns() + delay_ms * 1000000ull;
+            modem->pending[n].dlci   = dlci;
+            snprintf(modem->pending[n].text, sizeof(modem->pending[n].text), "%s", text);
+            return;
+        }
+    }
+
+    fake_reply(modem, dlci, text);
+}
+
+/*******************************************************************************
+ *
+ * Function:    fake_log()
+ *
+ * Description: Logs a command received on a DLCI.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void fake_log(fake_modem_t *modem, uint32_t dlci, const char *text)
+{
+    char line[FAKE_LOG_TEXT_SIZE];
+
+    // text lives in the modem too, so it is cut to size apart from the log.
+    snprintf(line, sizeof(line), "%s", text);
+
+    pthread_mutex_lock(&modem->log_mutex);
+    if (modem->log_count < FAKE_LOG_SIZE)
+    {
+        fake_log_entry_t *entry = &modem->log[modem->log_count++];
+
+        entry->dlci = (int)dlci;
+        memcpy(entry->text, line, sizeof(entry->text));
+    }
+    pthread_mutex_unlock(&modem->log_mutex);
+}
+
+/*******************************************************************************
+ *
+ * Function:    fake_http_action()
+ *
+ * Description: Hands a request of the HTTP service to the server callback
+ *              and reports its result the way the modem does, after OK.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void fake_http_action(fake_modem_t *modem, uint32_t dlci, fake_session_t *session,
+                             int method)
+{
+    char result[FAKE_PENDING_SIZE];
+    int  status = 404;
+
+    session->response[0] = '\0';
+    if (modem->config.http != NULL)
+    {
+        status = modem->config.http(modem->config.http_arg, method, session->url,
+                                    (method == 1) && session->has_body ? session->body : NULL,
+                                    session->has_body ? session->body_length : 0,
+                                    session->response, sizeof(session->response));
+    }
+    session->has_body = 0;
+
+    fake_reply(modem, dlci, FAKE_OK);
+    snprintf(result, sizeof(result), "\r\n+HTTPACTION: %d,%d,%zu\r\n", method, status,
+             strlen(session->response));
+    fake_reply(modem, dlci, result);
+}
+
+/*******************************************************************************
+ *
+ * Function:    fake_command()
+ *
+ * Description: Answers one AT command.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void fake_command(fake_modem_t *modem, uint32_t dlci, fake_session_t *session,
+                         const char *command)
+{
+    unsigned length, timeout;
+    int      method;
+    char     reply[FAKE_RESPONSE_SIZE + 64];
+
+    fake_log(modem, dlci, command);
+
+    if ((strcmp(command, "AT") == 0) || (strncmp(command, "AT+IFC=", 7) == 0) ||
+        (strncmp(command, "AT+CMGF=", 8) == 0) || (strncmp(command, "AT+CSCS=", 8) == 0) ||
+        (strncmp(command, "AT+CFUN=", 8) == 0) || (strncmp(command, "AT+SAPBR=", 9) == 0) ||
+        (strcmp(command, "AT+HTTPINIT") == 0) || (strcmp(command, "AT+HTTPTERM") == 0))
+    {
+        fake_reply(modem, dlci, FAKE_OK);
+    }
+    else if (strcmp(command, "ATI") == 0)
+    {
+        fake_reply(modem, dlci, "\r\nManufacturer: FAKE\r\nModel: FAKE-1\r\nRevision: 1.0\r\n"
+                                "SVN: 01\r\nIMEI: 000000000000000\r\n+GCAP: +CGSM\r\n" FAKE_OK);
+    }
+    else if (strcmp(command, "AT+IPR=?") == 0)
+    {
+        fake_reply(modem, dlci, "\r\n+IPR: (0,9600,19200,38400,57600,115200),"
+                                "(230400,460800,921600)\r\n" FAKE_OK);
+    }
+    else if (strncmp(command, "AT+IPR=", 7) == 0)
+    {
+        fake_reply(modem, dlci, FAKE_OK);
+    }
+    else if (strncmp(command, "AT+CMUX=", 8) == 0)
+    {
+        if (modem->config.multiplex && !modem->mux)
+        {
+            fake_reply(modem, dlci, FAKE_OK);
+            modem->mux = 1;
+        }
+        else
+        {
+            fake_reply(modem, dlci, "\r\nERROR\r\n");
+        }
+    }
+    else if (strcmp(command, "AT+CFUN?") == 0)
+    {
+        fake_reply(modem, dlci, "\r\n+CFUN: 1\r\n" FAKE_OK);
+    }
+    else if (strcmp(command, "AT+CSQ") == 0)
+    {
+        fake_reply(modem, dlci, "\r\n+CSQ: 20,0\r\n" FAKE_OK);
+    }
+    else if (strcmp(command, "AT+CREG?") == 0)
+    {
+        fake_reply(modem, dlci, "\r\n+CREG: 0,1\r\n" FAKE_OK);
+    }
+    else if (strncmp(command, "AT+CMGS=", 8) == 0)
+    {
+        session->sms = 1;
+        fake_reply(modem, dlci, "\r\n> ");
+    }
+    else if (strncmp(command, "AT+HTTPPARA=\"URL\",\"", 19) == 0)
+    {
+        snprintf(session->url, sizeof(session->url), "%s", command + 19);
+        session->url[strcspn(session->url, "\"")] = '\0';
+        fake_reply(modem, dlci, FAKE_OK);
+    }
+    else if (strncmp(command, "AT+HTTPPARA=", 12) == 0)
+    {
+        fake_reply(modem, dlci, FAKE_OK);
+    }
+    else if ((sscanf(command, "AT+HTTPDATA=%u,%u", &length, &timeout) == 2) &&
+             (length <= FAKE_BODY_SIZE))
+    {
+        session->body_length  = 0;
+        session->body_missing = length;
+        session->has_body     = 1;
+        fake_reply(modem, dlci, (length > 0) ? "\r\nDOWNLOAD\r\n" : "\r\nDOWNLOAD\r\n" FAKE_OK);
+    }
+    else if (sscanf(command, "AT+HTTPACTION=%d", &method) == 1)
+    {
+        fake_http_action(modem, dlci, session, method);
+    }
+    else if (strcmp(command, "AT+HTTPREAD") == 0)
+    {
+        snprintf(reply, sizeof(reply), "\r\n+HTTPREAD: %zu\r\n%s" FAKE_OK,
+                 strlen(session->response), session->response);
+        fake_reply(modem, dlci, reply);
+    }
+    else
+    {
+        fake_reply(modem, dlci, "\r\nERROR\r\n");
+    }
+}
+
+/*******************************************************************************
+ *
+ * Function:    fake_feed()
+ *
+ * Description: Takes bytes received on a session: command lines, the text
+ *              of an SMS or the raw body of AT+HTTPDATA.
+ *
+ * Returns:     The number of bytes taken. Fewer than given if the session
+ *              switched the link to the multiplexer.
+ *
+ ******************************************************************************/
+static size_t fake_feed(fake_modem_t *modem, uint32_t dlci, const uint8_t *data, size_t length)
+{
+    fake_session_t *session = &modem->sessions[dlci];
+    int             mux     = modem->mux;
+
+    for (size_t n = 0; n < length; ++n)
+    {
+        uint8_t byte = data[n];
+
+        if (session->body_missing > 0)
+        {
+            session->body[session->body_length++] = byte;
+            if (--session->body_missing == 0)
+            {
+                fake_reply(modem, dlci, FAKE_OK);
+            }
+        }
+        else if (session->sms && (byte == FAKE_CTRL_Z))
+        {
+            session->line[session->line_length] = '\0';
+            session->line_length = 0;
+            session->sms         = 0;
+            fake_log(modem, dlci, session->line);
+            fake_reply_later(modem, dlci, "\r\n+CMGS: 7\r\n" FAKE_OK,
+                             modem->config.cmgs_delay_ms);
+        }
+        else if (!session->sms && (byte == '\r'))
+        {
+            session->line[session->line_length] = '\0';
+            session->line_length = 0;
+            if (session->line[0] != '\0')
+            {
+                fake_command(modem, dlci, session, session->line);
+            }
+            if (modem->mux != mux)
+            {
+                return n + 1;
+            }
+        }
+        else if ((byte != '\n') && (session->line_length < FAKE_LINE_SIZE - 1))
+        {
+            session->line[session->line_length++] = (char)byte;
+        }
+    }
+
+    return length;
+}
+
+/*******************************************************************************
+ *
+ * Function:    fake_flood()
+ *
+ * Description: Sends unsolicited data on a DLCI, as a modem does with URCs
+ *              on a channel that might not be read.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void fake_flood(fake_modem_t *modem, uint32_t dlci, uint32_t length)
+{
+    static const char urc[] = "\r\n+CSQ: 20,0\r\n";
+
+    while (length > 0)
+    {
+        uint32_t size = (length < sizeof(urc) - 1) ? length : (uint32_t)(sizeof(urc) - 1);
+
+        fake_send(modem, dlci, urc, size);
+        length -= size;
+    }
+}
+
+/*******************************************************************************
+ *
+ * Function:    fake_parse_frames()
+ *
+ * Description: Handles every complete frame received. Frames with a bad FCS
+ *              are skipped, so a framing bug on the other end shows up as
+ *              commands that are never answered.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void fake_parse_frames(fake_modem_t *modem)
+{
+    size_t start = 0;
+
+    for (;;)
+    {
+        const uint8_t *frame  = modem->rx + start;
+        size_t         length = modem->rx_length - start;
+
+        if ((length > 0) && (frame[0] != FAKE_FLAG))
+        {
+            start += 1;
+            continue;
+        }
+        if ((length >= 2) && (frame[1] == FAKE_FLAG))
+        {
+            start += 1;
+            continue;
+        }
+        if (length < 4)
+        {
+            break;
+        }
+
+        size_t header = 4;
+        size_t count  = frame[3] >> 1;
+
+        if (!(frame[3] & FAKE_EA))
+        {
+            if (length < 5)
+            {
+                break;
+            }
+            count |= (size_t)frame[4] << 7;
+            header = 5;
+        }
+        if (length < header + count + 2)
+        {
+            break;
+        }
+
+        uint32_t dlci    = frame[1] >> 2;
+        uint8_t  control = frame[2] & ~FAKE_PF;
+        size_t   check   = (control == FAKE_UIH) ? header - 1 : header - 1 + count;
+
+        if ((frame[header + count + 1] != FAKE_FLAG) ||
+            (frame[header + count] != fake_fcs(frame + 1, check)) || (dlci > FAKE_MAX_DLCI))
+        {
+            start += 1;
+            continue;
+        }
+
+        if ((control == FAKE_SABM) || (control == FAKE_DISC))
+        {
+            fake_frame(modem, dlci, FAKE_UA | FAKE_PF, NULL, 0);
+        }
+        if ((control == FAKE_SABM) && (dlci == modem->config.flood_dlci))
+        {
+            fake_flood(modem, dlci, modem->config.flood_bytes);
+        }
+        else if ((control == FAKE_UIH) && (dlci > 0))
+        {
+            fake_feed(modem, dlci, frame + header, count);
+        }
+        start += header + count + 1;
+    }
+
+    modem->rx_length -= start;
+    memmove(modem->rx, modem->rx + start, modem->rx_length);
+}
+
+/*******************************************************************************
+ *
+ * Function:    fake_receive()
+ *
+ * Description: Takes bytes read from the terminal, as AT commands until the
+ *              multiplexer starts and as frames from then on.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+static void fake_receive(fake_modem_t *modem, const uint8_t *data, size_t length)
+{
+    if (!modem->mux)
+    {
+        size_t taken = fake_feed(modem, 0, data, length);
+
+        data   += taken;
+        length -= taken;
+    }
+
+    if (modem->mux && (length > 0))
+    {
+        if (length > sizeof(modem->rx) - modem->rx_length)
+        {
+            length = sizeof(modem->rx) - modem->rx_length;
+        }
+        memcpy(modem->rx + modem->rx_length, data, length);
+        modem->rx_length += length;
+        fake_parse_frames(modem);
+    }
+}
+
+/*******************************************************************************
+ *
+ * Function:    fake_run()
+ *
+ * Description: Answers the terminal and sends delayed replies once due,
+ *              until fake_modem_stop() is called.
+ *
+ * Returns:     NULL.
+ *
+ ******************************************************************************/
+static void *fake_run(void *vargp)
+{
+    fake_modem_t *modem = vargp;
+    uint8_t       data[FAKE_RX_SIZE];
+
+    while (__atomic_load_n(&modem->running, __ATOMIC_ACQUIRE))
+    {
+        struct pollfd pfd = { .fd = modem->master, .events = POLLIN };
+
+        if (poll(&pfd, 1, FAKE_POLL_MS) == 1)
+        {
+            ssize_t nread = read(modem->master, data, sizeof(data));
+
+            if (nread > 0)
+            {
+                fake_receive(modem, data, (size_t)nread);
+            }
+        }
+
+        uint64_t now = monotonic_time_ns();
+        for (int n = 0; n < FAKE_MAX_PENDING; ++n)
+        {
+            if ((modem->pending[n].due_ns != 0) && (modem->pending[n].due_ns <= now))
+            {
+                modem->pending[n].due_ns = 0;
+                fake_reply(modem, modem->pending[n].dlci, modem->pending[n].text);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/*******************************************************************************
+ *
+ * Function:    fake_modem_start()
+ *
+ * Description: Creates the pseudo-terminal, in raw mode, and starts the
+ *              thread that answers on it.
+ *
+ * Returns:     The modem, or NULL on failure.
+ *
+ ******************************************************************************/
+fake_modem_t *fake_modem_start(const fake_modem_config_t *config)
+{
+    fake_modem_t  *modem = calloc(1, sizeof(*modem));
+    struct termios term_config;
+
+    if (modem == NULL)
+    {
+        return NULL;
+    }
+
+    modem->config = *config;
+    modem->master = -1;
+    modem->slave  = -1;
+    pthread_mutex_init(&modem->log_mutex, NULL);
+
+    for (int n = 0; n <= FAKE_MAX_DLCI; ++n)
+    {
+        if ((modem->sessions[n].body = malloc(FAKE_BODY_SIZE)) == NULL)
+        {
+            fake_modem_stop(modem);
+            return NULL;
+        }
+    }
+
+    if (((modem->master = posix_openpt(O_RDWR | O_NOCTTY)) == -1) ||
+        (grantpt(modem->master) == -1) || (unlockpt(modem->master) == -1) ||
+        (ptsname_r(modem->master, modem->path, sizeof(modem->path)) != 0) ||
+        ((modem->slave = open(modem->path, O_RDWR | O_NOCTTY)) == -1) ||
+        (tcgetattr(modem->slave, &term_config) == -1))
+    {
+        fake_modem_stop(modem);
+        return NULL;
+    }
+
+    cfmakeraw(&term_config);
+    if (tcsetattr(modem->slave, TCSANOW, &term_config) == -1)
+    {
+        fake_modem_stop(modem);
+        return NULL;
+    }
+
+    __atomic_store_n(&modem->running, 1, __ATOMIC_RELEASE);
+    if (pthread_create(&modem->thread, NULL, fake_run, modem) != 0)
+    {
+        modem->running = 0;
+        fake_modem_stop(modem);
+        return NULL;
+    }
+
+    return modem;
+}
+
+/*******************************************************************************
+ *
+ * Function:    fake_modem_path()
+ *
+ * Description: Gets the pseudo-terminal of the modem.
+ *
+ * Returns:     The path.
+ *
+ ******************************************************************************/
+const char *fake_modem_path(const fake_modem_t *modem)
+{
+    return modem->path;
+}
+
+/*******************************************************************************
+ *
+ * Function:    fake_modem_received()
+ *
+ * Description: Looks a command up in the log.
+ *
+ * Returns:     The DLCI of the first match, or -1 if there is none.
+ *
+ ******************************************************************************/
+int fake_modem_received(fake_modem_t *modem, const char *prefix)
+{
+    int dlci = -1;
+
+    pthread_mutex_lock(&modem->log_mutex);
+    for (uint32_t n = 0; n < modem->log_count; ++n)
+    {
+        if (strncmp(modem->log[n].text, prefix, strlen(prefix)) == 0)
+        {
+            dlci = modem->log[n].dlci;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&modem->log_mutex);
+
+    return dlci;
+}
+
+/*******************************************************************************
+ *
+ * Function:    fake_modem_stop()
+ *
+ * Description: Stops the answering thread and frees the modem.
+ *
+ * Returns:     None defined.
+ *
+ ******************************************************************************/
+void fake_modem_stop(fake_modem_t *modem)
+{
+    if (modem == NULL)
+    {
+        return;
+    }
+
+    if (__atomic_load_n(&modem->running, __ATOMIC_ACQUIRE))
+    {
+        __atomic_store_n(&modem->running, 0, __ATOMIC_RELEASE);
+        pthread_join(modem->thread, NULL);
+    }
+    if (modem->master != -1)
+    {
+        close(modem->master);
+    }
+    if (modem->slave != -1)
+    {
+        close(modem->slave);
+    }
+    for (int n = 0; n <= FAKE_MAX_DLCI; ++n)
+    {
+        free(modem->sessions[n].body);
+    }
+    pthread_mutex_destroy(&modem->log_mutex);
+    free(modem);
+}
@@ -0,0 +1,77 @@
+/**
+ * @file fake_modem.h
+ *
+ * @brief A stand-in for the GSM modem on a pseudo-terminal, for tests that
+ *        run gsm.c against it in the same process. It answers the AT
+ *        commands the daemon uses, switches to the 27.010 multiplexer on
+ *        AT+CMUX and then answers each DLCI on its own, and hands the HTTP
+ *        requests of the modem's HTTP service to a callback that stands in
+ *        for the server. Every command it receives is logged, so tests can
+ *        check what was sent and on which channel.
+ * @author Aramayis Orkusyan
+ * @date December 9, 2019
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef SITE_MON_GSM_FAKE_MODEM_H
+#define SITE_MON_GSM_FAKE_MODEM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct fake_modem fake_modem_t;
+
+// Answers one request of the HTTP service, as the server would. method is
+// 0 for GET and 1 for POST, body is NULL for a GET. The response text goes
+// in response.
+//
+// Returns the HTTP status, or a 6xx status for a request that got lost on
+// the way, as the modem reports it.
+typedef int (*fake_http_t)(void *arg, int method, const char *url, const uint8_t *body,
+                           size_t length, char *response, size_t size);
+
+typedef struct fake_modem_config
+{
+    int         multiplex;     // accept AT+CMUX, otherwise answer ERROR
+    uint32_t    cmgs_delay_ms; // time the network takes to take an SMS
+    fake_http_t http;          // NULL answers every HTTPACTION with 404
+    void       *http_arg;
+    uint32_t    flood_dlci;    // DLCI sent flood_bytes of unsolicited data
+    uint32_t    flood_bytes;   // as soon as it is opened, 0 for none
+} fake_modem_config_t;
+
+/**
+ * Create the pseudo-terminal and start answering on it.
+ *
+ * @param config How to answer. It is copied.
+ * @return The modem, or NULL on failure.
+ */
+fake_modem_t *fake_modem_start(const fake_modem_config_t *config);
+
+/**
+ * Get the device to pass to gsm_open().
+ *
+ * @param modem The modem.
+ * @return The path of the pseudo-terminal.
+ */
+const char *fake_modem_path(const fake_modem_t *modem);
+
+/**
+ * Find the first command received that starts with a prefix. The text of an
+ * SMS is logged as a command of its own.
+ *
+ * @param modem The modem.
+ * @param prefix The start of the command, e.g. "AT+CMGS".
+ * @return The DLCI it came on, 0 before the multiplexer was started, or -1
+ *         if no such command was received.
+ */
+int fake_modem_received(fake_modem_t *modem, const char *prefix);
+
+/**
+ * Stop answering and remove the pseudo-terminal.
+ *
+ * @param modem The modem. NULL is ignored.
+ */
+void fake_modem_stop(fake_modem_t *modem);
+
+#endif // SITE_MON_GSM_FAKE_MODEM_H
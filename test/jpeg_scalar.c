@@ -0,0 +1,9 @@
+// Builds the encoder once more without SIMD, under other names, so that
+// jpeg_test can compare the two paths byte for byte in one process.
+#undef __SSE2__
+#undef __ARM_NEON
+
+#define jpeg_max_size jpeg_scalar_max_size
+#define jpeg_encode   jpeg_scalar_encode
+
+#include "../src/jpeg.c"
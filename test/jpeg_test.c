@@ -0,0 +1,163 @@
+/**
+ * @file jpeg_test.c
+ *
+ * @brief Encodes extreme patterns with the SIMD path of the encoder and with
+ *        the scalar one and checks that the JPEGs are the same bytes. Besides
+ *        a few plain patterns, every block is filled with the black and white
+ *        pattern that drives one multiply of the second DCT pass as far as
+ *        it goes, past what fits in a 16-bit lane times four.
+ * @author Aramayis Orkusyan
+ * @date December 9, 2019
+ * @copyright GNU General Public License v3.0
+ */
+
+#include "jpeg.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_WIDTH  64
+#define TEST_HEIGHT 64
+
+typedef uint8_t (*test_pattern_t)(uint32_t x, uint32_t y);
+
+// Encoder of jpeg_scalar.c.
+size_t  jpeg_scalar_max_size(uint32_t width, uint32_t height);
+ssize_t jpeg_scalar_encode(const uint8_t *luma, size_t stride, uint32_t width, uint32_t height,
+                           int quality, uint8_t *out, size_t size);
+
+// Blocks that push the input of each multiply of the second DCT pass to its
+// largest value, found from the sign of every pixel's weight in it. Bit
+// y * 8 + x is set where the pixel is white.
+static const uint64_t test_worst_blocks[] =
+{
+    0xffff00000000ffffull, 0xffff0000ffff0000ull, 0x00000000ffff0000ull, 0x000000000000ffffull,
+    0x0000000000ffff00ull, 0x0f0ff0f0f0f00f0full, 0x0f0ff0f00f0ff0f0ull, 0x0000f0f00f0f0000ull,
+    0xf0f0000000000f0full, 0x00f0f000000f0f00ull, 0xc3c33c3c3c3cc3c3ull, 0xc3c33c3cc3c33c3cull,
+    0x00003c3cc3c30000ull, 0x3c3c00000000c3c3ull, 0x003c3c0000c3c300ull, 0x71718e8e8e8e7171ull,
+    0x71718e8e71718e8eull, 0x00008e8e71710000ull, 0x8e8e000000007171ull, 0x008e8e0000717100ull,
+    0x9999666666669999ull, 0x9999666699996666ull, 0x0000666699990000ull, 0x6666000000009999ull,
+    0x0066660000999900ull, 0x4d4db2b2b2b24d4dull, 0x4d4db2b24d4db2b2ull, 0x0000b2b24d4d0000ull,
+    0xb2b2000000004d4dull, 0x00b2b200004d4d00ull, 0xa5a55a5a5a5aa5a5ull, 0xa5a55a5aa5a55a5aull,
+    0x00005a5aa5a50000ull, 0x5a5a00000000a5a5ull, 0x005a5a0000a5a500ull, 0x5555aaaaaaaa5555ull,
+    0x5555aaaa5555aaaaull, 0x0000aaaa55550000ull, 0xaaaa000000005555ull, 0x00aaaa0000555500ull
+};
+
+static uint8_t test_squares_4(uint32_t x, uint32_t y)   { return ((x / 4 + y / 4) & 1) ? 255 : 0; }
+static uint8_t test_checker(uint32_t x, uint32_t y)     { return ((x + y) & 1) ? 255 : 0; }
+static uint8_t test_columns(uint32_t x, uint32_t y)     { (void)y; return (x & 1) ? 255 : 0; }
+static uint8_t test_rows(uint32_t x, uint32_t y)        { (void)x; return (y & 1) ? 0 : 255; }
+static uint8_t test_halves(uint32_t x, uint32_t y)      { (void)y; return ((x & 7) < 4) ? 255 : 0; }
+static uint8_t test_corner(uint32_t x, uint32_t y)      { return ((x & 7) < 4 && (y & 7) < 4) ? 255 : 0; }
+static uint8_t test_black(uint32_t x, uint32_t y)       { (void)x; (void)y; return 0; }
+static uint8_t test_white(uint32_t x, uint32_t y)       { (void)x; (void)y; return 255; }
+static uint8_t test_dot(uint32_t x, uint32_t y)         { return ((x & 7) == 3 && (y & 7) == 4) ? 255 : 0; }
+static uint8_t test_ramp(uint32_t x, uint32_t y)        { return (uint8_t)(x * 4 + y); }
+static uint8_t test_noise(uint32_t x, uint32_t y)       { return (uint8_t)((x * 7919u + y * 104729u) * 2654435761u >> 24); }
+
+/*******************************************************************************
+ *
+ * Function:    test_compare()
+ *
+ * Description: Encodes a frame with both paths at several qualities, over
+ *              whole blocks and with partial blocks at the edges, and reports
+ *              every JPEG that differs.
+ *
+ * Returns:     Number of JPEGs that differ.
+ *
+ ******************************************************************************/
+static int test_compare(const char *name, const uint8_t *luma, uint8_t *simd, uint8_t *scalar,
+                        size_t size)
+{
+    static const int      qualities[] = { 1, 25, 50, 75, 90, 100 };
+    static const uint32_t sizes[][2]  = { { TEST_WIDTH, TEST_HEIGHT }, { TEST_WIDTH - 3, TEST_HEIGHT - 5 } };
+    int                   failed      = 0;
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+    {
+        for (size_t q = 0; q < sizeof(qualities) / sizeof(qualities[0]); ++q)
+        {
+            ssize_t a = jpeg_encode(luma, TEST_WIDTH, sizes[s][0], sizes[s][1],
+                                    qualities[q], simd, size);
+            ssize_t b = jpeg_scalar_encode(luma, TEST_WIDTH, sizes[s][0], sizes[s][1],
+                                           qualities[q], scalar, size);
+
+            if (a <= 0 || a != b || memcmp(simd, scalar, (size_t)a) != 0)
+            {
+                fprintf(stderr, "%s %ux%u quality %d: SIMD and scalar JPEGs differ (%zd and %zd bytes)\n",
+                        name, sizes[s][0], sizes[s][1], qualities[q], a, b);
+                ++failed;
+            }
+        }
+    }
+
+    return failed;
+}
+
+int main(void)
+{
+    static const struct { const char *name; test_pattern_t pattern; } patterns[] =
+    {
+        { "4x4 squares", test_squares_4 }, { "checker", test_checker },
+        { "columns", test_columns },       { "rows", test_rows },
+        { "halves", test_halves },         { "corner", test_corner },
+        { "black", test_black },           { "white", test_white },
+        { "dot", test_dot },               { "ramp", test_ramp },
+        { "noise", test_noise }
+    };
+
+    size_t   size   = jpeg_max_size(TEST_WIDTH, TEST_HEIGHT);
+    uint8_t *luma   = malloc(TEST_WIDTH * TEST_HEIGHT);
+    uint8_t *simd   = malloc(size);
+    uint8_t *scalar = malloc(size);
+    int      failed = 0;
+
+    if (!luma || !simd || !scalar || size != jpeg_scalar_max_size(TEST_WIDTH, TEST_HEIGHT))
+    {
+        fprintf(stderr, "setup failed\n");
+        return 1;
+    }
+
+    for (size_t p = 0; p < sizeof(patterns) / sizeof(patterns[0]); ++p)
+    {
+        for (uint32_t y = 0; y < TEST_HEIGHT; ++y)
+        {
+            for (uint32_t x = 0; x < TEST_WIDTH; ++x)
+            {
+                luma[y * TEST_WIDTH + x] = patterns[p].pattern(x, y);
+            }
+        }
+        failed += test_compare(patterns[p].name, luma, simd, scalar, size);
+    }
+
+    for (size_t b = 0; b < sizeof(test_worst_blocks) / sizeof(test_worst_blocks[0]); ++b)
+    {
+        // The block and its negative, which is as far the other way.
+        for (int negative = 0; negative < 2; ++negative)
+        {
+            char name[32];
+
+            for (uint32_t y = 0; y < TEST_HEIGHT; ++y)
+            {
+                for (uint32_t x = 0; x < TEST_WIDTH; ++x)
+                {
+                    int white = (test_worst_blocks[b] >> ((y & 7) * 8 + (x & 7))) & 1;
+                    luma[y * TEST_WIDTH + x] = (white ^ negative) ? 255 : 0;
+                }
+            }
+            snprintf(name, sizeof(name), "worst block %zu%s", b, negative ? " negative" : "");
+            failed += test_compare(name, luma, simd, scalar, size);
+        }
+    }
+
+    free(luma);
+    free(simd);
+    free(scalar);
+
+    if (failed)
+    {
+        fprintf(stderr, "%d JPEGs differ\n", failed);
+    }
+
+    return failed ? 1 : 0;
+}
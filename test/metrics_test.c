@@ -0,0 +1,83 @@
+/**
+ * @file metrics_test.c
+ *
+ * @brief Registers the series of two families interleaved, as one per modem
+ *        does, and checks that metrics_print() writes each family once: its
+ *        HELP and TYPE, then all of its samples together.
+ * @author Aramayis Orkusyan
+ * @date December 9, 2019
+ * @copyright GNU General Public License v3.0
+ */
+
+#include "metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_OUTPUT_SIZE 65536
+#define TEST_MAX_FAMILIES 8
+
+int main(void)
+{
+    static char output[TEST_OUTPUT_SIZE];
+    const char *families[TEST_MAX_FAMILIES];
+    uint32_t    num_families = 0;
+    FILE       *stream       = fmemopen(output, sizeof(output) - 1, "w");
+    int         failed       = 0;
+
+    metrics_add(metrics_counter("test_sms_total", "{modem=\"a\"}", "SMS sent."), 1);
+    metrics_set(metrics_gauge("test_rssi_dbm", "{modem=\"a\"}", "Signal."), -70);
+    metrics_add(metrics_counter("test_sms_total", "{modem=\"b\"}", "SMS sent."), 2);
+    metrics_set(metrics_gauge("test_rssi_dbm", "{modem=\"b\"}", "Signal."), -80);
+    metrics_observe(metrics_histogram("test_send_seconds", "{modem=\"a\"}", "Send."), 1000000);
+    metrics_add(metrics_counter("test_sms_total", "{modem=\"c\"}", "SMS sent."), 3);
+    metrics_observe(metrics_histogram("test_send_seconds", "{modem=\"b\"}", "Send."), 2000000);
+
+    if (stream == NULL)
+    {
+        fprintf(stderr, "setup failed\n");
+        return 1;
+    }
+    metrics_print(stream);
+    fclose(stream);
+
+    // Each sample must belong to the family of the TYPE line last seen, and
+    // no family may be opened twice.
+    const char *family = NULL;
+    for (char *line = strtok(output, "\n"); line != NULL; line = strtok(NULL, "\n"))
+    {
+        if (strncmp(line, "# TYPE ", 7) == 0)
+        {
+            family = line + 7;
+            *strchr(line + 7, ' ') = '\0';
+            for (uint32_t n = 0; n < num_families; ++n)
+            {
+                if (strcmp(families[n], family) == 0)
+                {
+                    fprintf(stderr, "FAIL family %s opened twice\n", family);
+                    failed += 1;
+                }
+            }
+            if (num_families < TEST_MAX_FAMILIES)
+            {
+                families[num_families++] = family;
+            }
+        }
+        else if (line[0] != '#')
+        {
+            if ((family == NULL) || (strncmp(line, family, strlen(family)) != 0))
+            {
+                fprintf(stderr, "FAIL sample outside its family: %s\n", line);
+                failed += 1;
+            }
+        }
+    }
+
+    if (num_families != 3)
+    {
+        fprintf(stderr, "FAIL expected 3 families, got %u\n", num_families);
+        failed += 1;
+    }
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,186 @@
+/**
+ * @file upload_test.c
+ *
+ * @brief Uploads a snapshot through the fake modem to a server kept in
+ *        memory that drops chunks, commits half of some before the link
+ *        fails and loses the answer to others, and checks that the server
+ *        ends up with exactly the bytes of the snapshot.
+ * @author Aramayis Orkusyan
+ * @date December 9, 2019
+ * @copyright GNU General Public License v3.0
+ */
+
+#include "fake_modem.h"
+#include "gsm.h"
+#include "upload.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_SNAPSHOT_SIZE 20000
+#define TEST_SEED          0x5EED1234u
+
+// What the server does with a chunk, one in four each.
+typedef enum test_fault
+{
+    TEST_FAULT_NONE,
+    TEST_FAULT_DROP,      // lost on the way, nothing stored
+    TEST_FAULT_HALF,      // half stored, then the link fails
+    TEST_FAULT_LOST_REPLY // all stored, the answer is lost
+} test_fault_t;
+
+typedef struct test_server
+{
+    uint8_t  data[TEST_SNAPSHOT_SIZE];
+    size_t   committed;
+    uint32_t state; // xorshift32
+    uint32_t faults[4];
+    uint32_t posts;
+} test_server_t;
+
+/*******************************************************************************
+ *
+ * Function:    test_random()
+ *
+ * Description: Steps a xorshift32 generator, so every run sees the same
+ *              faults.
+ *
+ * Returns:     The next number.
+ *
+ ******************************************************************************/
+static uint32_t test_random(uint32_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+/*******************************************************************************
+ *
+ * Function:    test_http()
+ *
+ * Description: The upload server. A GET answers the committed offset, a POST
+ *              at that offset appends its chunk unless a fault gets in the
+ *              way and answers the new offset.
+ *
+ * Returns:     The HTTP status, 601 for a request lost on the way.
+ *
+ ******************************************************************************/
+static int test_http(void *arg, int method, const char *url, const uint8_t *body,
+                     size_t length, char *response, size_t size)
+{
+    test_server_t     *server = arg;
+    const char        *query  = strstr(url, "&offset=");
+    unsigned long long offset, total;
+
+    if (method == 0)
+    {
+        snprintf(response, size, "%zu", server->committed);
+        return 200;
+    }
+
+    if ((query == NULL) || (sscanf(query, "&offset=%llu&total=%llu", &offset, &total) != 2) ||
+        (total != TEST_SNAPSHOT_SIZE) || (body == NULL))
+    {
+        return 400;
+    }
+
+    // A chunk from an offset the server has moved past is not stored again.
+    if ((offset != server->committed) || (offset + length > TEST_SNAPSHOT_SIZE))
+    {
+        snprintf(response, size, "%zu", server->committed);
+        return 200;
+    }
+
+    test_fault_t fault = (test_fault_t)(test_random(&server->state) % 4);
+
+    server->posts += 1;
+    server->faults[fault] += 1;
+    switch (fault)
+    {
+    case TEST_FAULT_DROP:
+        return 601;
+    case TEST_FAULT_HALF:
+        memcpy(server->data + offset, body, length / 2);
+        server->committed += length / 2;
+        return 601;
+    case TEST_FAULT_LOST_REPLY:
+        memcpy(server->data + offset, body, length);
+        server->committed += length;
+        return 601;
+    default:
+        memcpy(server->data + offset, body, length);
+        server->committed += length;
+        snprintf(response, size, "%zu", server->committed);
+        return 200;
+    }
+}
+
+int main(void)
+{
+    static test_server_t server = { .state = TEST_SEED };
+    static uint8_t       snapshot[TEST_SNAPSHOT_SIZE];
+
+    const fake_modem_config_t config = { .http = test_http, .http_arg = &server };
+    const upload_config_t     upload = { .url = "http://example.com/upload", .apn = "fake",
+                                         .min_chunk = 512, .max_chunk = 4096,
+                                         .target_chunk_ms = 1000, .max_attempts = 64 };
+    fake_modem_t *fake = fake_modem_start(&config);
+    gsm_t        *modem;
+    uint32_t      state = TEST_SEED;
+    int           failed = 0;
+
+    // Random bytes, with the ones the modem or the multiplexer might take
+    // for something else.
+    for (size_t n = 0; n < TEST_SNAPSHOT_SIZE; ++n)
+    {
+        snapshot[n] = (uint8_t)test_random(&state);
+    }
+    snapshot[0] = '\r';
+    snapshot[1] = 0x1A;
+    snapshot[2] = 0xF9;
+
+    if ((fake == NULL) || (upload_init(&upload) == -1))
+    {
+        fprintf(stderr, "setup failed\n");
+        return 1;
+    }
+
+    if ((modem = gsm_open(fake_modem_path(fake), "fake", NULL)) == NULL)
+    {
+        fprintf(stderr, "FAIL gsm_open\n");
+        fake_modem_stop(fake);
+        return 1;
+    }
+
+    if (upload_snapshot(modem, "test-1", snapshot, sizeof(snapshot)) == -1)
+    {
+        fprintf(stderr, "FAIL upload_snapshot stopped at %zu bytes\n", server.committed);
+        failed += 1;
+    }
+    else if ((server.committed != sizeof(snapshot)) ||
+             (memcmp(server.data, snapshot, sizeof(snapshot)) != 0))
+    {
+        fprintf(stderr, "FAIL server has %zu bytes that differ from the snapshot\n",
+                server.committed);
+        failed += 1;
+    }
+
+    for (int fault = TEST_FAULT_DROP; fault <= TEST_FAULT_LOST_REPLY; ++fault)
+    {
+        if (server.faults[fault] == 0)
+        {
+            fprintf(stderr, "FAIL fault %d never happened, try another seed\n", fault);
+            failed += 1;
+        }
+    }
+
+    printf("%u chunks posted, %u dropped, %u half stored, %u answers lost, %d failures\n",
+           server.posts, server.faults[TEST_FAULT_DROP], server.faults[TEST_FAULT_HALF],
+           server.faults[TEST_FAULT_LOST_REPLY], failed);
+
+    fake_modem_stop(fake);
+
+    return failed ? 1 : 0;
+}